@@ -8,7 +8,7 @@
  * Syntax
  * ------
  * 
- *   nmfgraph ([gamma])
+ *   nmfgraph ([gamma]) (options)
  * 
  * [gamma] is an optional gamma value used for scaling dynamics to
  * intensity levels.  It must be an integer greater than zero that
@@ -18,7 +18,12 @@
  * 
  * An NMF file is read from standard input, and a sequence of Retro
  * layers are written as text to standard output.  See the operation
- * section for further information.
+ * section for further information.  The --input option described in
+ * the options section reads and merges NMF files instead of standard
+ * input.
+ * 
+ * Any number of options may follow, beginning with "--".  The gamma
+ * value, if given, must come before the options.
  * 
  * Operation
  * ---------
@@ -40,7 +45,9 @@
  * When an NMF note is encountered with a particular layer ID, nmfgraph
  * will create a graph builder for that layer ID if one has not yet been
  * constructed.  All note events will be routed to the graph builder of
- * their particular layer, sorted in chronological order.
+ * their particular layer, sorted in chronological order.  Notes are
+ * partitioned by layer and only sorted within each layer, with grace
+ * notes before other notes at the same time.
  * 
  * The articulation of a note indicates the particular function:
  * 
@@ -92,14 +99,151 @@
  * attached grace note, the grace note pitch gives the starting
  * intensity and the non-grace pitch gives the ending intensity.
  * 
- * The LAYER_MAX and LAYER_MAXDYN constants impose limits on how many
- * layers there may be and how many dynamics may be in each layer.
+ * Layer IDs may be anything in the NMF layer range, and layers are
+ * registered as they are encountered, so sparse layer IDs cost nothing
+ * for the IDs that are unused.  Layers are written in ascending order
+ * of layer ID.  There is no fixed limit on how many dynamics may be in
+ * each layer.
+ * 
+ * Options
+ * -------
+ * 
+ * The following option builds layers on multiple threads:
+ * 
+ *   --threads=[n]  use up to [n] threads to build the layers
+ * 
+ * Each layer is validated, built, and formatted on its own, so layers
+ * are divided among the threads and formatted into memory buffers,
+ * which are then written in ascending order of layer ID.  The output
+ * and any error messages are the same as when running on a single
+ * thread.  [n] may be from 1 to 64, with 1 being the default.
+ * 
+ * The following options also render the layers to a binary envelope
+ * file, which the synthesizer can read without interpreting the
+ * layer commands:
+ * 
+ *   --envelope=[path]  write the envelope file to [path]
+ *   --hop=[n]          samples between envelope values, default 64
+ * 
+ * Each layer is sampled every [n] samples, from time zero through the
+ * time of the last dynamic in any layer, so every layer has the same
+ * number of values.  Each value is the output intensity in range
+ * [0, 1024] with the gamma correction applied, and ramps are
+ * interpolated linearly and rounded to the nearest integer.  All
+ * integers in the file are unsigned and big-endian.  The file has a
+ * header of three 32-bit integers: the number of layers, the number of
+ * values per layer, and the hop size [n].  Each layer follows in
+ * ascending order of layer ID, as a 32-bit layer number (the same
+ * one-based number used in the text output) followed by the 16-bit
+ * values.  The text output is still written to standard output.  --hop
+ * may only be given together with --envelope.
+ * 
+ * The following option reads the graph from NMF files instead of
+ * standard input:
+ * 
+ *   --input=[path]           read the NMF file at [path]
+ *   --input=[path]:[offset]  also add [offset] to each layer ID
+ * 
+ * --input may be given any number of times up to 256, so that graphs
+ * kept in separate files, such as one for each instrument section, are
+ * combined into one set of layers.  [offset] is added to the layer ID
+ * of each note in the file, so that the layers of different files can
+ * be kept apart, and the result must be in the NMF layer range.  All
+ * the files must have the same quantum basis.  The notes of the files
+ * are merged in one pass, with notes at the same time taken in the
+ * order the files were given, which is the same result as sorting the
+ * concatenated files.  The merge is fastest when each file is already
+ * sorted in chronological order.
+ * 
+ * The following option writes each layer as soon as it is complete:
+ * 
+ *   --stream  build and write the layers one group of notes at a time
+ * 
+ * With --stream, the notes of each layer must be contiguous in the
+ * input, as they are when the input is grouped by layer, and the notes
+ * within each group may be in any order.  A layer is complete when a
+ * note of another layer is reached, so it is checked, written, and
+ * freed at that point, and only one layer is held at a time beyond the
+ * parsed input.  Layers are written in the order their groups appear,
+ * which is ascending order of layer ID when the groups are in that
+ * order.  It is an error for a layer to appear in two separate groups.
+ * Errors are reported when their group is reached, after the layers
+ * before it have been written.  --stream can't be combined with
+ * --threads, --input, --cache, --envelope, --index, --at, or --load,
+ * which all need every layer at once.
+ * 
+ * The following option reuses the text of layers that have not changed
+ * since an earlier run:
+ * 
+ *   --cache=[path]  keep a cache of formatted layers in [path]
+ * 
+ * Each layer is identified by a 64-bit FNV-1a hash of its dynamics,
+ * its layer ID, the gamma value, and whether --simplify is given.  The
+ * text of each layer whose hash is in the cache file is copied from the
+ * cache instead of being formatted again, and the cache file is then
+ * replaced with the layers of this run.  When one layer of a large
+ * score is edited, only that layer is formatted again.  The output is
+ * the same as without the cache.  Each entry also stores a 64-bit
+ * FNV-1a digest of its text, which is checked when the cache file is
+ * read.  A missing cache file is the same as an empty cache, and an
+ * unreadable or corrupt cache file is ignored with a warning.  --cache
+ * can't be combined with --at or --load.
+ * 
+ * The following options build an index of the breakpoints of each
+ * layer, which gives the intensity of a layer at any time without
+ * replaying its dynamics:
+ * 
+ *   --index=[path]  write the index file to [path]
+ *   --at=[t,...]    write the intensities at the given times
+ *   --load=[path]   read the index file at [path] instead of the input
+ * 
+ * Each breakpoint is one dynamic, with its starting and ending output
+ * intensities, so the intensity at a time is found with a binary search
+ * for the breakpoint in effect.  Intensities are the same as in an
+ * envelope file:  gamma correction is applied, and ramps are
+ * interpolated linearly and rounded to the nearest integer.
+ * 
+ * All integers in the index file are unsigned and big-endian.  The file
+ * has a header of two 32-bit integers: the signature 0x4e474958 and the
+ * number of layers.  Each layer follows in ascending order of layer ID,
+ * as a 32-bit layer number and a 32-bit breakpoint count, followed by
+ * the breakpoints.  Each breakpoint is a 32-bit time followed by 16-bit
+ * starting and ending intensities, which are equal for constant
+ * dynamics.
+ * 
+ * --at takes a comma-separated list of times, each zero or greater.
+ * Instead of the layer text, one line is written to standard output for
+ * each layer, with the layer number followed by the intensity at each
+ * time in the order given.  Times in ascending order are evaluated in
+ * one forward pass through each layer, so sorting a large batch of
+ * times makes it faster.
+ * 
+ * With --load, standard input is not read and the gamma value is
+ * ignored, since the intensities are stored in the index.  --load must
+ * be combined with --at or --index, and can't be combined with
+ * --envelope or --simplify.
+ * 
+ * The following option removes redundant breakpoints from the layers
+ * before they are written or indexed:
+ * 
+ *   --simplify  merge breakpoints that lie on one line
+ * 
+ * After the levels are converted to output intensities, consecutive
+ * constants of the same intensity are merged, ramps that start and end
+ * at the same intensity become constants, and chains of ramps are
+ * merged where the curve is continuous and the slope is exactly the
+ * same on both sides of a breakpoint.  The intensity at every time is
+ * unchanged, so the layers sound the same while giving Retro fewer
+ * commands to parse and interpolate.  The number of breakpoints removed
+ * is reported on standard error.  The envelope file is not affected.
  * 
  * Compilation
  * -----------
  * 
  * Compile with libnmf.
  * 
+ * Requires POSIX threads, which may require -lpthread
+ * 
  * The math library may also be required with -lm
  */
 
@@ -110,6 +254,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+
 #include "nmf.h"
 
 /*
@@ -130,14 +276,92 @@
 #define DYNL_MAX  (9)
 
 /*
- * The maximum number of dynamics that may be within a layer.
+ * The initial capacity of the dynamic array of a layer.  The capacity
+ * is doubled each time the array fills.
+ */
+#define LAYER_INITDYN (16)
+
+/*
+ * The maximum capacity of the dynamic array of a layer.
  */
-#define LAYER_MAXDYN (4000)
+#define LAYER_MAXCAP (INT32_MAX / 2)
 
 /*
- * The maximum zero-based layer index.
+ * The maximum zero-based layer index, which is the full range of the
+ * NMF layer field.
+ */
+#define LAYER_MAX (65535)
+
+/*
+ * The initial number of slots in the layer hash table.  Must be a power
+ * of two.  The table is doubled whenever it would become more than half
+ * full.
+ */
+#define LAYER_INITHASH (64)
+
+/*
+ * The maximum number of input files that may be merged.
+ */
+#define MAX_INPUTS (256)
+
+/*
+ * The maximum number of threads that may be used to build layers.
+ */
+#define MAX_THREADS (64)
+
+/*
+ * The default number of samples between values of a rendered envelope.
+ */
+#define ENV_DEFHOP (64)
+
+/*
+ * The maximum number of values in each layer of a rendered envelope.
+ */
+#define ENV_MAXFRAMES (INT32_C(268435456))
+
+/*
+ * The signature at the start of a breakpoint index file, which is the
+ * ASCII string "NGIX".
+ */
+#define INDEX_SIGNATURE (UINT32_C(0x4e474958))
+
+/*
+ * The signature at the start of a layer cache file, which is the ASCII
+ * string "NGCH".
+ */
+#define CACHE_SIGNATURE (UINT32_C(0x4e474348))
+
+/*
+ * The parameters of the 64-bit FNV-1a hash used to identify layers in
+ * the layer cache.
+ */
+#define FNV_OFFSET (UINT64_C(14695981039346656037))
+#define FNV_PRIME (UINT64_C(1099511628211))
+
+/*
+ * The most breakpoints a batched index lookup steps forward before it
+ * falls back to a binary search.
+ */
+#define INDEX_MAXSTEP (8)
+
+/*
+ * Error codes
+ * ===========
+ * 
+ * Remember to update error_string!
  */
-#define LAYER_MAX (255)
+
+#define ERR_OK          (0)   /* No error */
+#define ERR_PITCH       (1)   /* Invalid pitch */
+#define ERR_GRACEART    (2)   /* Grace note not part of ramp */
+#define ERR_GRACEOFF    (3)   /* Grace note offset other than -1 */
+#define ERR_NOZERO      (4)   /* Missing t=0 dynamic */
+#define ERR_SIMUL       (5)   /* Simultaneous dynamics */
+#define ERR_GRACECONST  (6)   /* Grace note before constant dynamic */
+#define ERR_TOOLONG     (7)   /* Layer is too long */
+#define ERR_MULTIGRACE  (8)   /* Multiple grace notes */
+#define ERR_GRACEBEAT   (9)   /* Grace note missing beat */
+#define ERR_ARTKEY      (10)  /* Unrecognized articulation key */
 
 /*
  * Type definitions
@@ -147,18 +371,10 @@
 /*
  * DYNREC, a dynamic record.
  * 
- * A structure prototype proceeds the definition so that the structure
- * can be referred to within the definition.
+ * The dynamic records of each layer are stored in order in a contiguous
+ * array.
  */
-struct DYNREC_TAG;
-typedef struct DYNREC_TAG DYNREC;
-struct DYNREC_TAG {
-  
-  /*
-   * Pointer to the next dynamic record in the layer, or NULL if this
-   * is the last dynamic record.
-   */
-  DYNREC *pNext;
+typedef struct {
   
   /*
    * The time offset of this dynamic.
@@ -181,13 +397,19 @@ struct DYNREC_TAG {
    * the next dynamic.
    */
   uint8_t b;
-};
+  
+} DYNREC;
 
 /*
  * A layer register, used for building layer information.
  */
 typedef struct {
   
+  /*
+   * The layer index of this register, in range [0, LAYER_MAX].
+   */
+  int32_t id;
+  
   /*
    * The total number of dynamics in this layer.
    */
@@ -206,21 +428,180 @@ typedef struct {
   uint8_t gval;
   
   /*
-   * Pointer to the first dynamic record in this layer.
-   * 
-   * Only valid if dcount is greater than zero.
+   * The capacity of the dynamic array, in records.
    */
-  DYNREC *pFirst;
+  int32_t dcap;
   
   /*
-   * Pointer to the last dynamic record in this layer.
+   * The dynamic array, holding dcount records in chronological order.
    * 
-   * Only valid if dcount is greater than zero.
+   * NULL if dcap is zero.
    */
-  DYNREC *pLast;
+  DYNREC *pDyn;
   
 } LAYERREG;
 
+/*
+ * A layer job for multi-threaded building.
+ */
+typedef struct {
+  
+  /*
+   * The layer index of this job.
+   */
+  int32_t layer_i;
+  
+  /*
+   * The routing error of the layer, or ERR_OK, and the index in m_note
+   * of the note that caused it.
+   */
+  int err;
+  int32_t err_i;
+  
+  /*
+   * Non-zero if the layer is dangling.  Only valid if err is ERR_OK.
+   */
+  int dangling;
+  
+  /*
+   * The formatted layer, or NULL if it was not formatted.
+   * 
+   * Allocated with open_memstream().
+   */
+  char *pBuf;
+  size_t buf_len;
+  
+} LAYERJOB;
+
+/*
+ * The argument of a thread that builds layers.
+ */
+typedef struct {
+  
+  /*
+   * The index of the first job this thread runs, and the distance
+   * between the jobs it runs, which is the number of threads.
+   */
+  int32_t first;
+  int32_t stride;
+  
+} LAYERWORKER;
+
+/*
+ * An input file to merge.
+ */
+typedef struct {
+  
+  /*
+   * The path of the input file.
+   */
+  const char *pPath;
+  
+  /*
+   * The offset added to the layer index of each note in the file.
+   */
+  int32_t offset;
+  
+  /*
+   * The parsed file, or NULL if it has not been parsed or has been fully
+   * merged and freed.
+   */
+  NMF_DATA *pd;
+  
+  /*
+   * The number of notes in the file, and the index of the next note to
+   * merge after the current one.
+   */
+  int32_t count;
+  int32_t next;
+  
+  /*
+   * The current note of the file, which is the next one to be merged.
+   * Only valid while the file is in the merge heap.
+   */
+  NMF_NOTE cur;
+  
+} INPUTSRC;
+
+/*
+ * An entry of the layer cache, holding the formatted text of a layer.
+ */
+typedef struct {
+  
+  /*
+   * The digest of everything that determines the text of the layer, as
+   * computed by layerDigest().
+   */
+  uint64_t hash;
+  
+  /*
+   * The formatted text of the layer and its length in bytes.  pText is
+   * NULL if the entry is unused.
+   */
+  char *pText;
+  size_t len;
+  
+  /*
+   * Non-zero if pText was allocated for this entry, zero if it points to
+   * the text of a loaded cache entry.
+   */
+  int owned;
+  
+} CACHEENT;
+
+/*
+ * BREAKPT, a breakpoint of the intensity curve of a layer.
+ * 
+ * Each breakpoint corresponds to one dynamic, with its levels already
+ * converted to output intensities.
+ */
+typedef struct {
+  
+  /*
+   * The time offset of this breakpoint.
+   */
+  int32_t t;
+  
+  /*
+   * The intensity at the breakpoint, and the intensity the curve reaches
+   * at the next breakpoint, both in range [0, 1024].  They are equal for
+   * constant dynamics.
+   */
+  uint16_t start;
+  uint16_t end;
+  
+  /*
+   * Non-zero if this breakpoint is written as a ramp, zero if it is
+   * written as a constant.  A ramp may have equal start and end
+   * intensities unless the breakpoints have been simplified.
+   */
+  uint8_t ramp;
+  
+} BREAKPT;
+
+/*
+ * The breakpoint index of a layer.
+ */
+typedef struct {
+  
+  /*
+   * The layer index, in range [0, LAYER_MAX].
+   */
+  int32_t layer_i;
+  
+  /*
+   * The number of breakpoints, which is at least one.
+   */
+  int32_t count;
+  
+  /*
+   * The breakpoints in ascending order of time.  The first is at time
+   * zero and the last is constant.
+   */
+  BREAKPT *pb;
+  
+} INDEXLAYER;
+
 /*
  * Static data
  * ===========
@@ -234,11 +615,35 @@ typedef struct {
 static int m_tinit = 0;
 
 /*
- * The table of layer registers.
+ * The registers of the layers that have been encountered, in the order
+ * they were registered.
+ * 
+ * m_t_count is the number of registers and m_t_cap is the capacity of
+ * the array.  Only valid if m_tinit.  Registers may move when the array
+ * grows, so pointers to them are only valid until the next layer is
+ * registered.
+ */
+static LAYERREG *m_t = NULL;
+static int32_t m_t_count = 0;
+static int32_t m_t_cap = 0;
+
+/*
+ * The hash table that maps layer indices to registers.
  * 
- * Only valid if m_tinit.
+ * Each of the m_hash_cap slots holds an index into m_t, or -1 if the
+ * slot is empty.  Collisions are resolved by linear probing.  Only valid
+ * if m_tinit.
  */
-static LAYERREG m_t[LAYER_MAX + 1];
+static int32_t *m_hash = NULL;
+static int32_t m_hash_cap = 0;
+
+/*
+ * Indices into m_t of all registers, sorted by ascending layer index.
+ * 
+ * Only valid if m_order_valid.  Use sortLayers() to rebuild it.
+ */
+static int32_t *m_order = NULL;
+static int m_order_valid = 0;
 
 /*
  * Flag indicating whether the level table has been initialized.
@@ -258,6 +663,121 @@ static int m_level_init = 0;
  */
 static int m_level[DYNL_MAX + 1];
 
+/*
+ * The notes of the input, in input order.  When several input files
+ * are merged, this is the merged order.
+ * 
+ * m_note_count is the number of notes.  NULL until copyNotes() or
+ * mergeInputs() is called.
+ */
+static NMF_NOTE *m_note = NULL;
+static int32_t m_note_count = 0;
+
+/*
+ * The note indices partitioned by layer.
+ * 
+ * The indices of the notes in the layer layerAt(i) are in m_part from
+ * m_bucket[i] up to but excluding m_bucket[i + 1], in processing order.
+ * m_bucket_count is the number of layers, and m_bucket has one more
+ * entry than that.  NULL until partitionNotes() is called.
+ */
+static int32_t *m_part = NULL;
+static int32_t *m_bucket = NULL;
+static int32_t m_bucket_count = 0;
+
+/*
+ * The input files to merge, in the order given.
+ * 
+ * m_input_count is the number of input files.  If it is zero, the input
+ * is read from standard input instead.
+ */
+static INPUTSRC m_input[MAX_INPUTS];
+static int32_t m_input_count = 0;
+
+/*
+ * The maximum number of threads used to build layers.
+ */
+static int32_t m_threads = 1;
+
+/*
+ * The layer jobs for multi-threaded building.
+ * 
+ * m_job_count is the number of jobs.  Only used within buildThreaded().
+ */
+static LAYERJOB *m_job = NULL;
+static int32_t m_job_count = 0;
+
+/*
+ * The path of the envelope file to write, or NULL if no envelope file
+ * is written, and the number of samples between envelope values.
+ */
+static const char *m_env_path = NULL;
+static int32_t m_env_hop = 0;
+
+/*
+ * The breakpoint index, with an entry for each non-empty layer in
+ * ascending order of layer index.
+ * 
+ * m_index_count is the number of entries.  NULL until buildIndex() or
+ * loadIndex() is called.
+ */
+static INDEXLAYER *m_index = NULL;
+static int32_t m_index_count = 0;
+
+/*
+ * The path of the index file to write, or NULL if no index file is
+ * written, and the path of the index file to read instead of building
+ * the layers, or NULL if the layers are built from the input.
+ */
+static const char *m_index_path = NULL;
+static const char *m_load_path = NULL;
+
+/*
+ * The path of the layer cache file, or NULL if no layer cache is used.
+ */
+static const char *m_cache_path = NULL;
+
+/*
+ * The entries loaded from the layer cache file, sorted by hash.
+ * 
+ * m_cache_count is the number of entries.  NULL if no entries are
+ * loaded.
+ */
+static CACHEENT *m_cache = NULL;
+static int32_t m_cache_count = 0;
+
+/*
+ * The entries of the layers written in this run, which become the new
+ * layer cache.
+ * 
+ * m_fresh_count is the number of entries.  NULL until layers are
+ * written with the layer cache.
+ */
+static CACHEENT *m_fresh = NULL;
+static int32_t m_fresh_count = 0;
+
+/*
+ * Flag indicating whether breakpoints are simplified before the layers
+ * are written or indexed.
+ */
+static int m_simplify = 0;
+
+/*
+ * Flag indicating whether layers are streamed, each one written and
+ * released as soon as its group of notes ends.
+ */
+static int m_stream = 0;
+
+/*
+ * The times at which to query the intensities of the layers, in the
+ * order given.
+ * 
+ * m_at_count is the number of times.  NULL if there is no query, in
+ * which case the layers are written as text.
+ */
+static int32_t *m_at = NULL;
+static int32_t m_at_count = 0;
+
 /*
  * Local functions
  * ===============
@@ -268,18 +788,109 @@ static int32_t pitchToLevel(int32_t p);
 
 static void init_level(double g);
 static void init_table(void);
+static void free_table(void);
+
+static uint32_t hashLayer(int32_t layer_i, int32_t cap);
+static LAYERREG *findLayer(int32_t layer_i);
+static LAYERREG *getLayer(int32_t layer_i);
+static int cmpLayer(const void *pA, const void *pB);
+static void sortLayers(void);
+static int32_t layerCount(void);
+static int32_t layerAt(int32_t i);
 
 static int layerHasGrace(int32_t layer_i);
 static int32_t layerGraceTime(int32_t layer_i);
 static int layerIsEmpty(int32_t layer_i);
 static int32_t layerLastTime(int32_t layer_i);
+static DYNREC *layerAppend(int32_t layer_i);
 static int layerDynC(int32_t layer_i, int32_t t, int32_t val);
 static void layerGrace(int32_t layer_i, int32_t t, int32_t val);
 static int layerDynR(int32_t layer_i, int32_t t, int32_t val);
 static int layerDangling(int32_t layer_i);
+static void layerRelease(int32_t layer_i);
 
+static int dynLevels(
+    const LAYERREG * plr,
+          int32_t    i,
+          int      * pStart,
+          int      * pEnd);
+static int32_t simplifyBreakpoints(BREAKPT *pb, int32_t count);
+static int32_t layerBreakpoints(
+    int32_t   layer_i,
+    BREAKPT * pb,
+    int       simplify);
 static void writeLayer(FILE *pf, int32_t layer_i);
+static void countSimplify(
+    int32_t   layer_i,
+    int64_t * pTotal,
+    int64_t * pKept);
+static void reportSimplify(
+    const char    * pModule,
+          int64_t   total,
+          int64_t   kept);
+
+static char *formatLayer(int32_t layer_i, size_t *pLen);
+static uint64_t fnvUint32(uint64_t h, uint32_t v);
+static uint64_t layerDigest(int32_t layer_i);
+static uint64_t textDigest(const char *pText, size_t len);
+static int cmpCache(const void *pA, const void *pB);
+static void loadCache(const char *pPath, const char *pModule);
+static const CACHEENT *findCache(uint64_t hash);
+static void cacheLayer(int32_t layer_i, CACHEENT *pe);
+static void allocFresh(int32_t count);
+static int saveCache(const char *pPath, const char *pModule);
+static void free_cache(void);
 
+static int noteCompare(int32_t i, int32_t j);
+static int cmpNote(const void *pA, const void *pB);
+static void copyNotes(NMF_DATA *pd);
+static int parseInput(const char *pstr);
+static int loadInputs(const char *pModule);
+static void free_inputs(void);
+static int mergeLess(int32_t a, int32_t b);
+static void mergeSift(int32_t *ph, int32_t n, int32_t i);
+static int mergeInputs(void);
+static void partitionNotes(void);
+static void free_part(void);
+static int routeNote(const NMF_NOTE *pn);
+static const char *error_string(int code);
+
+static void *buildWorker(void *pArg);
+static int buildThreaded(const char *pModule);
+
+static int streamLayers(
+          NMF_DATA * pd,
+          int64_t  * pTotal,
+          int64_t  * pKept,
+    const char     * pModule);
+
+static void putUint32(unsigned char *pb, uint32_t v);
+static void renderLayer(
+    int32_t    layer_i,
+    uint16_t * pv,
+    int32_t    frames,
+    int32_t    hop);
+static int writeEnvelope(
+    const char    * pPath,
+          int32_t   hop,
+    const char    * pModule);
+
+static void buildIndex(void);
+static void free_index(void);
+static int32_t indexFind(const INDEXLAYER *pil, int32_t t);
+static int32_t indexLevel(const INDEXLAYER *pil, int32_t j, int32_t t);
+static int32_t indexEval(const INDEXLAYER *pil, int32_t t);
+static void indexEvalBatch(
+    const INDEXLAYER * pil,
+    const int32_t    * pt,
+          int32_t    * pr,
+          int32_t      count);
+static int readUint32(FILE *pf, uint32_t *pv);
+static int saveIndex(const char *pPath, const char *pModule);
+static int loadIndex(const char *pPath, const char *pModule);
+static void writeQuery(FILE *pf);
+
+static int parseTimes(const char *pstr);
 static int parseInt(const char *pstr, int32_t *pv);
 
 /*
@@ -408,16 +1019,24 @@ static void init_table(void) {
   /* Only proceed if not initialized */
   if (!m_tinit) {
     
-    /* Clear the table */
-    memset(&m_t, 0, (LAYER_MAX + 1) * sizeof(LAYERREG));
+    /* Start with no registers */
+    m_t = NULL;
+    m_t_count = 0;
+    m_t_cap = 0;
     
-    /* Set each dcount field to zero, and clear each gtime and gval
-     * field */
-    for(i = 0; i <= LAYER_MAX; i++) {
-      (m_t[i]).dcount = 0;
-      (m_t[i]).gtime = -1;
-      (m_t[i]).gval = 0;
+    /* Allocate an empty hash table */
+    m_hash_cap = LAYER_INITHASH;
+    m_hash = (int32_t *) malloc(((size_t) m_hash_cap) * sizeof(int32_t));
+    if (m_hash == NULL) {
+      abort();
     }
+    for(i = 0; i < m_hash_cap; i++) {
+      m_hash[i] = -1;
+    }
+    
+    /* No sorted order yet */
+    m_order = NULL;
+    m_order_valid = 0;
     
     /* Set initialization flag */
     m_tinit = 1;
@@ -425,23 +1044,316 @@ static void init_table(void) {
 }
 
 /*
- * Check whether a given layer index has a buffered grace note.
+ * Free the dynamic arrays of all layers and clear the layer table.
  * 
- * layer_i must be in range [0, LAYER_MAX].
+ * The table is left uninitialized.  Does nothing if the table is not
+ * initialized.
+ */
+static void free_table(void) {
+  
+  int32_t i = 0;
+  
+  if (m_tinit) {
+    for(i = 0; i < m_t_count; i++) {
+      free((m_t[i]).pDyn);
+      (m_t[i]).pDyn = NULL;
+    }
+    free(m_t);
+    m_t = NULL;
+    m_t_count = 0;
+    m_t_cap = 0;
+    
+    free(m_hash);
+    m_hash = NULL;
+    m_hash_cap = 0;
+    
+    free(m_order);
+    m_order = NULL;
+    m_order_valid = 0;
+    
+    m_tinit = 0;
+  }
+}
+
+/*
+ * Compute the home slot of a layer index in a hash table.
+ * 
+ * cap must be a power of two.
  * 
  * Parameters:
  * 
- *   layer_i - the layer to check
+ *   layer_i - the layer index
+ * 
+ *   cap - the number of slots in the hash table
  * 
  * Return:
  * 
- *   non-zero if buffered grace note, zero if not
+ *   the home slot of the layer index
  */
-static int layerHasGrace(int32_t layer_i) {
-  
-  int result = 0;
-  
-  /* Check parameter */
+static uint32_t hashLayer(int32_t layer_i, int32_t cap) {
+  return (((uint32_t) layer_i) * UINT32_C(2654435761)) &
+            ((uint32_t) (cap - 1));
+}
+
+/*
+ * Find the register of a given layer index.
+ * 
+ * layer_i must be in range [0, LAYER_MAX].
+ * 
+ * The returned pointer is only valid until the next layer is registered
+ * with getLayer().
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to find
+ * 
+ * Return:
+ * 
+ *   the layer register, or NULL if the layer has not been registered
+ */
+static LAYERREG *findLayer(int32_t layer_i) {
+  
+  uint32_t h = 0;
+  
+  /* Check parameter */
+  if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
+    abort();
+  }
+  
+  /* Initialize table if necessary */
+  init_table();
+  
+  /* Probe the hash table */
+  for(h = hashLayer(layer_i, m_hash_cap);
+      m_hash[h] >= 0;
+      h = (h + 1) & ((uint32_t) (m_hash_cap - 1))) {
+    if ((m_t[m_hash[h]]).id == layer_i) {
+      return &(m_t[m_hash[h]]);
+    }
+  }
+  
+  /* Layer not registered */
+  return NULL;
+}
+
+/*
+ * Get the register of a given layer index, registering the layer if it
+ * has not been encountered yet.
+ * 
+ * layer_i must be in range [0, LAYER_MAX].
+ * 
+ * New layers start empty with no buffered grace note.  The returned
+ * pointer is only valid until the next layer is registered.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to get
+ * 
+ * Return:
+ * 
+ *   the layer register
+ */
+static LAYERREG *getLayer(int32_t layer_i) {
+  
+  LAYERREG *plr = NULL;
+  int32_t *pNewHash = NULL;
+  int32_t newcap = 0;
+  int32_t i = 0;
+  uint32_t h = 0;
+  
+  /* Return the register if it already exists */
+  plr = findLayer(layer_i);
+  if (plr != NULL) {
+    return plr;
+  }
+  
+  /* Grow the register array if necessary */
+  if (m_t_count >= m_t_cap) {
+    if (m_t_cap < 1) {
+      newcap = LAYER_INITHASH / 2;
+    } else {
+      newcap = m_t_cap * 2;
+    }
+    m_t = (LAYERREG *) realloc(m_t, ((size_t) newcap) * sizeof(LAYERREG));
+    if (m_t == NULL) {
+      abort();
+    }
+    m_t_cap = newcap;
+  }
+  
+  /* Double the hash table if it would become more than half full */
+  if ((m_t_count + 1) * 2 > m_hash_cap) {
+    newcap = m_hash_cap * 2;
+    pNewHash = (int32_t *) malloc(((size_t) newcap) * sizeof(int32_t));
+    if (pNewHash == NULL) {
+      abort();
+    }
+    for(i = 0; i < newcap; i++) {
+      pNewHash[i] = -1;
+    }
+    for(i = 0; i < m_t_count; i++) {
+      h = hashLayer((m_t[i]).id, newcap);
+      while (pNewHash[h] >= 0) {
+        h = (h + 1) & ((uint32_t) (newcap - 1));
+      }
+      pNewHash[h] = i;
+    }
+    free(m_hash);
+    m_hash = pNewHash;
+    m_hash_cap = newcap;
+  }
+  
+  /* Add the new register */
+  plr = &(m_t[m_t_count]);
+  memset(plr, 0, sizeof(LAYERREG));
+  plr->id = layer_i;
+  plr->dcount = 0;
+  plr->gtime = -1;
+  plr->gval = 0;
+  plr->dcap = 0;
+  plr->pDyn = NULL;
+  
+  h = hashLayer(layer_i, m_hash_cap);
+  while (m_hash[h] >= 0) {
+    h = (h + 1) & ((uint32_t) (m_hash_cap - 1));
+  }
+  m_hash[h] = m_t_count;
+  
+  m_t_count++;
+  m_order_valid = 0;
+  
+  /* Return the new register */
+  return plr;
+}
+
+/*
+ * Comparison function for sorting register indices by layer index.
+ * 
+ * Parameters:
+ * 
+ *   pA - pointer to the first register index
+ * 
+ *   pB - pointer to the second register index
+ * 
+ * Return:
+ * 
+ *   less than, equal to, or greater than zero as the first layer index
+ *   is less than, equal to, or greater than the second
+ */
+static int cmpLayer(const void *pA, const void *pB) {
+  
+  int32_t a = 0;
+  int32_t b = 0;
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+  
+  /* Get the layer indices */
+  a = (m_t[*((const int32_t *) pA)]).id;
+  b = (m_t[*((const int32_t *) pB)]).id;
+  
+  /* Compare */
+  if (a < b) {
+    return -1;
+  } else if (a > b) {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Rebuild the sorted order of the registered layers, if it is not
+ * already valid.
+ */
+static void sortLayers(void) {
+  
+  int32_t i = 0;
+  
+  /* Initialize table if necessary */
+  init_table();
+  
+  /* Only proceed if order not valid */
+  if (!m_order_valid) {
+    
+    free(m_order);
+    m_order = NULL;
+    
+    if (m_t_count > 0) {
+      m_order = (int32_t *) malloc(((size_t) m_t_count) * sizeof(int32_t));
+      if (m_order == NULL) {
+        abort();
+      }
+      for(i = 0; i < m_t_count; i++) {
+        m_order[i] = i;
+      }
+      qsort(m_order, (size_t) m_t_count, sizeof(int32_t), &cmpLayer);
+    }
+    
+    m_order_valid = 1;
+  }
+}
+
+/*
+ * Return the number of layers that have been registered.
+ * 
+ * Return:
+ * 
+ *   the number of registered layers
+ */
+static int32_t layerCount(void) {
+  init_table();
+  return m_t_count;
+}
+
+/*
+ * Return the layer index of a registered layer, in ascending order of
+ * layer index.
+ * 
+ * i must be in range [0, layerCount() - 1].
+ * 
+ * Parameters:
+ * 
+ *   i - the position of the layer in ascending order
+ * 
+ * Return:
+ * 
+ *   the layer index
+ */
+static int32_t layerAt(int32_t i) {
+  
+  /* Check parameter */
+  if ((i < 0) || (i >= layerCount())) {
+    abort();
+  }
+  
+  /* Make sure the order is valid */
+  sortLayers();
+  
+  /* Return the layer index */
+  return (m_t[m_order[i]]).id;
+}
+
+/*
+ * Check whether a given layer index has a buffered grace note.
+ * 
+ * layer_i must be in range [0, LAYER_MAX].
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to check
+ * 
+ * Return:
+ * 
+ *   non-zero if buffered grace note, zero if not
+ */
+static int layerHasGrace(int32_t layer_i) {
+  
+  int result = 0;
+  const LAYERREG *plr = NULL;
+  
+  /* Check parameter */
   if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
     abort();
   }
@@ -450,8 +1362,11 @@ static int layerHasGrace(int32_t layer_i) {
   init_table();
   
   /* See if layer has grace note */
-  if ((m_t[layer_i]).gval != 0) {
-    result = 1;
+  plr = findLayer(layer_i);
+  if (plr != NULL) {
+    if (plr->gval != 0) {
+      result = 1;
+    }
   }
   
   /* Return result */
@@ -476,6 +1391,7 @@ static int layerHasGrace(int32_t layer_i) {
 static int32_t layerGraceTime(int32_t layer_i) {
   
   int32_t result = 0;
+  const LAYERREG *plr = NULL;
   
   /* Check parameter */
   if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
@@ -486,7 +1402,11 @@ static int32_t layerGraceTime(int32_t layer_i) {
   init_table();
   
   /* Get time value */
-  result = (m_t[layer_i]).gtime;
+  plr = findLayer(layer_i);
+  if (plr == NULL) {
+    abort();  /* no buffered grace note */
+  }
+  result = plr->gtime;
   if (result < 0) {
     abort();  /* no buffered grace note */
   }
@@ -514,6 +1434,7 @@ static int32_t layerGraceTime(int32_t layer_i) {
 static int layerIsEmpty(int32_t layer_i) {
   
   int result = 0;
+  const LAYERREG *plr = NULL;
   
   /* Check parameter */
   if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
@@ -524,7 +1445,10 @@ static int layerIsEmpty(int32_t layer_i) {
   init_table();
   
   /* See if layer is empty */
-  if ((m_t[layer_i]).dcount < 1) {
+  plr = findLayer(layer_i);
+  if (plr == NULL) {
+    result = 1;
+  } else if (plr->dcount < 1) {
     result = 1;
   }
   
@@ -550,6 +1474,8 @@ static int layerIsEmpty(int32_t layer_i) {
  */
 static int32_t layerLastTime(int32_t layer_i) {
   
+  const LAYERREG *plr = NULL;
+  
   /* Check parameter */
   if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
     abort();
@@ -559,12 +1485,83 @@ static int32_t layerLastTime(int32_t layer_i) {
   init_table();
   
   /* Make sure requested layer is not empty */
-  if ((m_t[layer_i]).dcount < 1) {
+  plr = findLayer(layer_i);
+  if (plr == NULL) {
+    abort();  /* layer is empty */
+  }
+  if (plr->dcount < 1) {
     abort();  /* layer is empty */
   }
   
   /* Return result */
-  return ((m_t[layer_i]).pLast)->t;
+  return (plr->pDyn)[plr->dcount - 1].t;
+}
+
+/*
+ * Append a blank dynamic record to the given layer.
+ * 
+ * layer_i must be in range [0, LAYER_MAX].  The layer is registered if
+ * it has not been encountered yet.
+ * 
+ * The dynamic array of the layer is grown if necessary by doubling its
+ * capacity.  The new record is cleared to zero and the dynamic count of
+ * the layer is increased.  The returned pointer is only valid until the
+ * next record is appended to the layer.
+ * 
+ * If the layer can't hold any more dynamics, the function fails.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to append a record to
+ * 
+ * Return:
+ * 
+ *   pointer to the new record, or NULL if too many dynamics in layer
+ */
+static DYNREC *layerAppend(int32_t layer_i) {
+  
+  LAYERREG *plr = NULL;
+  DYNREC *dr = NULL;
+  int32_t newcap = 0;
+  
+  /* Check parameter */
+  if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
+    abort();
+  }
+  
+  /* Initialize table if necessary */
+  init_table();
+  
+  /* Get pointer to layer register */
+  plr = getLayer(layer_i);
+  
+  /* Grow the array if it is full */
+  if (plr->dcount >= plr->dcap) {
+    if (plr->dcap < 1) {
+      newcap = LAYER_INITDYN;
+    } else if (plr->dcap <= LAYER_MAXCAP / 2) {
+      newcap = plr->dcap * 2;
+    } else if (plr->dcap < LAYER_MAXCAP) {
+      newcap = LAYER_MAXCAP;
+    } else {
+      return NULL;  /* layer is full */
+    }
+    
+    dr = (DYNREC *) realloc(plr->pDyn, ((size_t) newcap) * sizeof(DYNREC));
+    if (dr == NULL) {
+      abort();
+    }
+    plr->pDyn = dr;
+    plr->dcap = newcap;
+  }
+  
+  /* Clear the new record and increase the count */
+  dr = &((plr->pDyn)[plr->dcount]);
+  memset(dr, 0, sizeof(DYNREC));
+  (plr->dcount)++;
+  
+  /* Return the new record */
+  return dr;
 }
 
 /*
@@ -630,37 +1627,14 @@ static int layerDynC(int32_t layer_i, int32_t t, int32_t val) {
     abort();
   }
   
-  /* Only proceed if room for another dynamic */
-  if ((m_t[layer_i]).dcount < LAYER_MAXDYN) {
-    
-    /* Allocate new dynamic record */
-    dr = (DYNREC *) malloc(sizeof(DYNREC));
-    if (dr == NULL) {
-      abort();
-    }
-    memset(dr, 0, sizeof(DYNREC));
-    
+  /* Append a new dynamic record, if there is room */
+  dr = layerAppend(layer_i);
+  if (dr != NULL) {
     /* Set variables */
-    dr->pNext = NULL;
     dr->t = t;
     dr->a = 0;
     dr->b = (uint8_t) val;
     
-    /* Check whether this is the first record */
-    if ((m_t[layer_i]).dcount < 1) {
-      /* First record -- set both pFirst and pLast */
-      (m_t[layer_i]).pFirst = dr;
-      (m_t[layer_i]).pLast = dr;
-      
-    } else {
-      /* Not the first record -- link new record into layer */
-      ((m_t[layer_i]).pLast)->pNext = dr;
-      (m_t[layer_i]).pLast = dr;
-    }
-    
-    /* Increase count */
-    ((m_t[layer_i]).dcount)++;
-    
   } else {
     /* Layer is full */
     status = 0;
@@ -695,6 +1669,8 @@ static int layerDynC(int32_t layer_i, int32_t t, int32_t val) {
  */
 static void layerGrace(int32_t layer_i, int32_t t, int32_t val) {
   
+  LAYERREG *plr = NULL;
+  
   /* Initialize table if necessary */
   init_table();
   
@@ -724,8 +1700,9 @@ static void layerGrace(int32_t layer_i, int32_t t, int32_t val) {
   }
   
   /* Buffer the grace note */
-  (m_t[layer_i]).gtime = t;
-  (m_t[layer_i]).gval = (uint8_t) val;
+  plr = getLayer(layer_i);
+  plr->gtime = t;
+  plr->gval = (uint8_t) val;
 }
 
 /*
@@ -767,6 +1744,7 @@ static int layerDynR(int32_t layer_i, int32_t t, int32_t val) {
   
   int status = 1;
   DYNREC *dr = NULL;
+  LAYERREG *plr = NULL;
   
   /* Initialize table if necessary */
   init_table();
@@ -796,51 +1774,29 @@ static int layerDynR(int32_t layer_i, int32_t t, int32_t val) {
     abort();
   }
   
-  /* Only proceed if room for another dynamic */
-  if ((m_t[layer_i]).dcount < LAYER_MAXDYN) {
-    
-    /* Allocate new dynamic record */
-    dr = (DYNREC *) malloc(sizeof(DYNREC));
-    if (dr == NULL) {
-      abort();
-    }
-    memset(dr, 0, sizeof(DYNREC));
+  /* Append a new dynamic record, if there is room */
+  dr = layerAppend(layer_i);
+  if (dr != NULL) {
     
     /* Set variables, depending on whether buffered grace note */
     if (layerHasGrace(layer_i)) {
       /* Buffered grace note */
-      dr->pNext = NULL;
+      plr = getLayer(layer_i);
       dr->t = t;
-      dr->a = (m_t[layer_i]).gval;
+      dr->a = plr->gval;
       dr->b = (uint8_t) val;
       
       /* Clear buffered grace note */
-      (m_t[layer_i]).gtime = -1;
-      (m_t[layer_i]).gval = 0;
+      plr->gtime = -1;
+      plr->gval = 0;
       
     } else {
       /* No buffered grace note */
-      dr->pNext = NULL;
       dr->t = t;
       dr->a = (uint8_t) val;
       dr->b = 0;
     }
     
-    /* Check whether this is the first record */
-    if ((m_t[layer_i]).dcount < 1) {
-      /* First record -- set both pFirst and pLast */
-      (m_t[layer_i]).pFirst = dr;
-      (m_t[layer_i]).pLast = dr;
-      
-    } else {
-      /* Not the first record -- link new record into layer */
-      ((m_t[layer_i]).pLast)->pNext = dr;
-      (m_t[layer_i]).pLast = dr;
-    }
-    
-    /* Increase count */
-    ((m_t[layer_i]).dcount)++;
-    
   } else {
     /* Layer is full */
     status = 0;
@@ -870,6 +1826,7 @@ static int layerDynR(int32_t layer_i, int32_t t, int32_t val) {
 static int layerDangling(int32_t layer_i) {
   
   int result = 0;
+  const LAYERREG *plr = NULL;
   
   /* Check parameter */
   if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
@@ -883,7 +1840,8 @@ static int layerDangling(int32_t layer_i) {
   if (layerHasGrace(layer_i)) {
     result = 1;
   } else if (!layerIsEmpty(layer_i)) {
-    if (((m_t[layer_i]).pLast)->a != 0) {
+    plr = findLayer(layer_i);
+    if ((plr->pDyn)[plr->dcount - 1].a != 0) {
       result = 1;
     }
   }
@@ -893,97 +1851,3054 @@ static int layerDangling(int32_t layer_i) {
 }
 
 /*
- * Write a layer in textual Retro format to the given file.
+ * Release the dynamics of a layer.
  * 
- * pf must be open for writing or undefined behavior occurs.  Writing is
- * fully sequential.
+ * The dynamic array of the layer is freed and the layer becomes empty,
+ * but it stays registered, so findLayer() still finds it.  This is used
+ * to free each layer as soon as it is written when streaming.
  * 
- * layer_i must be in range [0, LAYER_MAX].
+ * Parameters:
  * 
- * A fault occurs if the given layer is dangling or if it is empty.  Use
- * layerDangling() and layerIsEmpty() to check for these conditions.
+ *   layer_i - the layer to release
+ */
+static void layerRelease(int32_t layer_i) {
+  
+  LAYERREG *plr = NULL;
+  
+  /* Check parameter */
+  if ((layer_i < 0) || (layer_i > LAYER_MAX)) {
+    abort();
+  }
+  
+  /* Free the dynamics if the layer is registered */
+  plr = findLayer(layer_i);
+  if (plr != NULL) {
+    free(plr->pDyn);
+    plr->pDyn = NULL;
+    plr->dcap = 0;
+    plr->dcount = 0;
+    plr->gtime = -1;
+    plr->gval = 0;
+  }
+}
+
+/*
+ * Get the output levels of a dynamic in a layer.
  * 
- * m_level_init must be non-zero, indicating that the level table has
- * been initialized.  A fault occurs if the level table is not yet
- * initialized.
+ * plr is a layer that is not dangling, and i is the index of one of its
+ * dynamics.  The level table must be initialized.
  * 
- * Layers are always written with a layer multiplier of 1024.  If a
- * different multiplier is desired, you can derive a new layer from the
- * layer that is output.
+ * For a constant dynamic, the level is returned in *pStart, and *pEnd
+ * is set to the same level.  For a ramp dynamic, the starting and
+ * ending levels are returned.  The ending level of a ramp without a
+ * grace note is the starting level of the next dynamic.
  * 
  * Parameters:
  * 
- *   pf - the output file
+ *   plr - the layer register
  * 
- *   layer_i - the layer to write
+ *   i - the index of the dynamic
+ * 
+ *   pStart - pointer to variable to receive the starting level
+ * 
+ *   pEnd - pointer to variable to receive the ending level
+ * 
+ * Return:
+ * 
+ *   non-zero if the dynamic is a ramp, zero if it is constant
  */
-static void writeLayer(FILE *pf, int32_t layer_i) {
+static int dynLevels(
+    const LAYERREG * plr,
+          int32_t    i,
+          int      * pStart,
+          int      * pEnd) {
   
-  LAYERREG *plr = NULL;
-  DYNREC *pdr = NULL;
-  DYNREC *pdn = NULL;
-  int start = 0;
-  int end = 0;
+  int result = 0;
+  const DYNREC *pdr = NULL;
+  const DYNREC *pdn = NULL;
   
   /* Check parameters */
-  if ((pf == NULL) || (layer_i < 0) || (layer_i > LAYER_MAX)) {
+  if ((plr == NULL) || (pStart == NULL) || (pEnd == NULL)) {
     abort();
   }
-  if (layerIsEmpty(layer_i) || layerDangling(layer_i)) {
+  if ((i < 0) || (i >= plr->dcount)) {
     abort();
   }
   if (!m_level_init) {
     abort();
   }
   
-  /* Get pointer to layer register */
-  plr = &(m_t[layer_i]);
-  
-  /* Write the opening line */
-  fprintf(pf, "[\n");
+  /* Get the dynamic */
+  pdr = &((plr->pDyn)[i]);
   
-  /* Go through all dynamics */
-  for(pdr = plr->pFirst; pdr != NULL; pdr = pdr->pNext) {
-  
-    /* If not first, write comma and line break */
-    if (pdr != plr->pFirst) {
+  /* Determine kind of dynamic */
+  if (pdr->a == 0) {
+    /* Constant dynamic -- get level */
+    *pStart = m_level[pdr->b];
+    *pEnd = *pStart;
+    result = 0;
+    
+  } else if (pdr->b == 0) {
+    /* Ramp with end value same as next start value -- get levels */
+    if (i >= plr->dcount - 1) {
+      abort();  /* dangling layer */
+    }
+    *pStart = m_level[pdr->a];
+    
+    pdn = &((plr->pDyn)[i + 1]);
+    if (pdn->a == 0) {
+      *pEnd = m_level[pdn->b];
+    } else {
+      *pEnd = m_level[pdn->a];
+    }
+    result = 1;
+    
+  } else {
+    /* Ramp fully specified -- get levels */
+    *pStart = m_level[pdr->a];
+    *pEnd = m_level[pdr->b];
+    result = 1;
+  }
+  
+  return result;
+}
+
+/*
+ * Simplify an array of breakpoints in place.
+ * 
+ * Ramps with equal start and end intensities become constants.  Then
+ * each breakpoint is merged into the one before it when both lie on one
+ * straight line in the output intensity domain: the curve is continuous
+ * at the breakpoint, and the slopes before and after it are exactly
+ * equal.  This merges consecutive constants of the same level and
+ * chains of collinear ramps.  The slopes are compared with integer
+ * arithmetic, so the simplified curve has exactly the same value as the
+ * original at every time, and nothing changes at integer output
+ * resolution.
+ * 
+ * The breakpoints must be in ascending order of time and the last one
+ * must be constant, as produced by layerBreakpoints().
+ * 
+ * Parameters:
+ * 
+ *   pb - the breakpoints
+ * 
+ *   count - the number of breakpoints, at least one
+ * 
+ * Return:
+ * 
+ *   the number of breakpoints that remain
+ */
+static int32_t simplifyBreakpoints(BREAKPT *pb, int32_t count) {
+  
+  int32_t i = 0;
+  int32_t w = 0;
+  int merge = 0;
+  BREAKPT *pc = NULL;
+  const BREAKPT *pn = NULL;
+  int64_t rise_c = 0;
+  int64_t rise_n = 0;
+  
+  /* Check parameters */
+  if ((pb == NULL) || (count < 1)) {
+    abort();
+  }
+  
+  /* Flat ramps are constants */
+  for(i = 0; i < count; i++) {
+    if ((pb[i]).start == (pb[i]).end) {
+      (pb[i]).ramp = 0;
+    }
+  }
+  
+  /* Merge each breakpoint into the current kept breakpoint w if they
+   * are collinear; the current breakpoint reaches its end intensity at
+   * the time of breakpoint i */
+  w = 0;
+  for(i = 1; i < count; i++) {
+    pc = &(pb[w]);
+    pn = &(pb[i]);
+    
+    merge = 0;
+    if (pc->end == pn->start) {
+      if (i >= count - 1) {
+        /* The last breakpoint is constant forever, so only a constant of
+         * the same level can absorb it */
+        if (pc->start == pc->end) {
+          merge = 1;
+        }
+        
+      } else {
+        /* Compare the slopes by cross-multiplying */
+        rise_c = ((int64_t) pc->end) - ((int64_t) pc->start);
+        rise_n = ((int64_t) pn->end) - ((int64_t) pn->start);
+        if (rise_c * (((int64_t) (pb[i + 1]).t) - pn->t) ==
+              rise_n * (((int64_t) pn->t) - pc->t)) {
+          merge = 1;
+        }
+      }
+    }
+    
+    if (merge) {
+      pc->end = pn->end;
+      if (pc->start != pc->end) {
+        pc->ramp = 1;
+      }
+    } else {
+      w++;
+      pb[w] = *pn;
+    }
+  }
+  
+  return w + 1;
+}
+
+/*
+ * Get the breakpoints of a layer.
+ * 
+ * layer_i must be a non-empty layer that is not dangling.  The level
+ * table must be initialized.
+ * 
+ * pb must have room for as many breakpoints as the layer has dynamics.
+ * One breakpoint is stored for each dynamic, with the output levels
+ * returned by dynLevels().  If simplify is non-zero, the breakpoints
+ * are then simplified with simplifyBreakpoints().
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer
+ * 
+ *   pb - the array to receive the breakpoints
+ * 
+ *   simplify - non-zero to simplify the breakpoints
+ * 
+ * Return:
+ * 
+ *   the number of breakpoints stored
+ */
+static int32_t layerBreakpoints(
+    int32_t   layer_i,
+    BREAKPT * pb,
+    int       simplify) {
+  
+  const LAYERREG *plr = NULL;
+  int32_t i = 0;
+  int32_t count = 0;
+  int start = 0;
+  int end = 0;
+  
+  /* Check parameters */
+  if (pb == NULL) {
+    abort();
+  }
+  if (layerIsEmpty(layer_i) || layerDangling(layer_i)) {
+    abort();
+  }
+  
+  /* Get pointer to layer register */
+  plr = findLayer(layer_i);
+  
+  /* Store a breakpoint for each dynamic */
+  for(i = 0; i < plr->dcount; i++) {
+    if (dynLevels(plr, i, &start, &end)) {
+      (pb[i]).ramp = 1;
+    } else {
+      (pb[i]).ramp = 0;
+    }
+    (pb[i]).t = ((plr->pDyn)[i]).t;
+    (pb[i]).start = (uint16_t) start;
+    (pb[i]).end = (uint16_t) end;
+  }
+  count = plr->dcount;
+  
+  /* Simplify if requested */
+  if (simplify) {
+    count = simplifyBreakpoints(pb, count);
+  }
+  
+  return count;
+}
+
+/*
+ * Write a layer in textual Retro format to the given file.
+ * 
+ * pf must be open for writing or undefined behavior occurs.  Writing is
+ * fully sequential.
+ * 
+ * layer_i must be in range [0, LAYER_MAX].
+ * 
+ * A fault occurs if the given layer is dangling or if it is empty.  Use
+ * layerDangling() and layerIsEmpty() to check for these conditions.
+ * 
+ * m_level_init must be non-zero, indicating that the level table has
+ * been initialized.  A fault occurs if the level table is not yet
+ * initialized.
+ * 
+ * If m_simplify is set, the breakpoints of the layer are simplified
+ * before they are written.
+ * 
+ * Layers are always written with a layer multiplier of 1024.  If a
+ * different multiplier is desired, you can derive a new layer from the
+ * layer that is output.
+ * 
+ * Parameters:
+ * 
+ *   pf - the output file
+ * 
+ *   layer_i - the layer to write
+ */
+static void writeLayer(FILE *pf, int32_t layer_i) {
+  
+  BREAKPT *pb = NULL;
+  int32_t i = 0;
+  int32_t count = 0;
+  
+  /* Check parameters */
+  if ((pf == NULL) || (layer_i < 0) || (layer_i > LAYER_MAX)) {
+    abort();
+  }
+  if (layerIsEmpty(layer_i) || layerDangling(layer_i)) {
+    abort();
+  }
+  if (!m_level_init) {
+    abort();
+  }
+  
+  /* Get the breakpoints of the layer */
+  pb = (BREAKPT *) calloc(
+          (size_t) (findLayer(layer_i))->dcount, sizeof(BREAKPT));
+  if (pb == NULL) {
+    abort();
+  }
+  count = layerBreakpoints(layer_i, pb, m_simplify);
+  
+  /* Write the opening line */
+  fprintf(pf, "[\n");
+  
+  /* Go through all breakpoints */
+  for(i = 0; i < count; i++) {
+    
+    /* If not first, write comma and line break */
+    if (i > 0) {
       fprintf(pf, ",\n");
     }
   
-    /* Determine kind of dynamic */
-    if (pdr->a == 0) {
-      /* Constant dynamic -- get level */
-      start = m_level[pdr->b];
-      
-      /* Write command */
-      fprintf(pf, "  %ld %d lc", (long) (pdr->t), start);
-      
-    } else if (pdr->b == 0) {
-      /* Ramp with end value same as next start value -- get levels */
-      start = m_level[pdr->a];
-      
-      pdn = pdr->pNext;
-      if (pdn->a == 0) {
-        end = m_level[pdn->b];
-      } else {
-        end = m_level[pdn->a];
+    /* Write the command for the kind of breakpoint */
+    if (!((pb[i]).ramp)) {
+      fprintf(pf, "  %ld %d lc", (long) ((pb[i]).t), (int) (pb[i]).start);
+    } else {
+      fprintf(pf, "  %ld %d %d lr", (long) ((pb[i]).t),
+              (int) (pb[i]).start, (int) (pb[i]).end);
+    }
+  }
+  
+  /* Write the closing line */
+  fprintf(pf, "\n] 1024 %ld layer\n", (long) (layer_i + 1));
+  
+  /* Free the breakpoints */
+  free(pb);
+  pb = NULL;
+}
+
+/*
+ * Count the breakpoints of a layer before and after simplification.
+ * 
+ * layer_i must be a non-empty layer that is not dangling, and the level
+ * table must be initialized.  The counts are added to the totals.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer
+ * 
+ *   pTotal - the total number of breakpoints
+ * 
+ *   pKept - the total number of breakpoints kept by simplification
+ */
+static void countSimplify(
+    int32_t   layer_i,
+    int64_t * pTotal,
+    int64_t * pKept) {
+  
+  const LAYERREG *plr = NULL;
+  BREAKPT *pb = NULL;
+  
+  /* Check parameters */
+  if ((pTotal == NULL) || (pKept == NULL)) {
+    abort();
+  }
+  if (layerIsEmpty(layer_i)) {
+    abort();
+  }
+  
+  /* Simplify into a scratch buffer */
+  plr = findLayer(layer_i);
+  pb = (BREAKPT *) calloc((size_t) plr->dcount, sizeof(BREAKPT));
+  if (pb == NULL) {
+    abort();
+  }
+  *pTotal += (int64_t) plr->dcount;
+  *pKept += (int64_t) layerBreakpoints(layer_i, pb, 1);
+  free(pb);
+  pb = NULL;
+}
+
+/*
+ * Report how many breakpoints simplification removed.
+ * 
+ * The report is written to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for the report
+ * 
+ *   total - the total number of breakpoints
+ * 
+ *   kept - the number of breakpoints kept by simplification
+ */
+static void reportSimplify(
+    const char    * pModule,
+          int64_t   total,
+          int64_t   kept) {
+  
+  /* Check parameters */
+  if ((pModule == NULL) || (total < 0) || (kept < 0) || (kept > total)) {
+    abort();
+  }
+  
+  fprintf(stderr, "%s: Simplification removed %lld of %lld breakpoints\n",
+          pModule, (long long) (total - kept), (long long) total);
+}
+
+/*
+ * Format a layer in textual Retro format into a new memory buffer.
+ * 
+ * The layer is formatted with writeLayer(), with the same requirements.
+ * The buffer is null-terminated and must be freed with free().
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to format
+ * 
+ *   pLen - pointer to variable to receive the length in bytes, not
+ *   including the terminating null
+ * 
+ * Return:
+ * 
+ *   the formatted text
+ */
+static char *formatLayer(int32_t layer_i, size_t *pLen) {
+  
+  FILE *pf = NULL;
+  char *pBuf = NULL;
+  
+  /* Check parameter */
+  if (pLen == NULL) {
+    abort();
+  }
+  
+  /* Write the layer to a memory stream */
+  pf = open_memstream(&pBuf, pLen);
+  if (pf == NULL) {
+    abort();
+  }
+  writeLayer(pf, layer_i);
+  if (fclose(pf)) {
+    abort();
+  }
+  pf = NULL;
+  
+  return pBuf;
+}
+
+/*
+ * Add a 32-bit integer to a 64-bit FNV-1a hash.
+ * 
+ * The integer is hashed as four bytes in big-endian order, so that
+ * digests are the same on every platform.
+ * 
+ * Parameters:
+ * 
+ *   h - the hash so far
+ * 
+ *   v - the integer to add
+ * 
+ * Return:
+ * 
+ *   the updated hash
+ */
+static uint64_t fnvUint32(uint64_t h, uint32_t v) {
+  
+  int i = 0;
+  
+  for(i = 24; i >= 0; i -= 8) {
+    h = h ^ ((uint64_t) ((v >> i) & 0xff));
+    h = h * FNV_PRIME;
+  }
+  
+  return h;
+}
+
+/*
+ * Compute the digest of a layer for the layer cache.
+ * 
+ * layer_i must be a non-empty layer that is not dangling, and the level
+ * table must be initialized.  The digest covers everything that
+ * determines the text writeLayer() produces: the layer index, the
+ * simplify flag, the level table, which encodes the gamma value, and
+ * the time and levels of every dynamic in the layer.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer
+ * 
+ * Return:
+ * 
+ *   the 64-bit FNV-1a digest
+ */
+static uint64_t layerDigest(int32_t layer_i) {
+  
+  const LAYERREG *plr = NULL;
+  const DYNREC *pdr = NULL;
+  uint64_t h = FNV_OFFSET;
+  int32_t i = 0;
+  
+  /* Check state */
+  if (layerIsEmpty(layer_i) || layerDangling(layer_i)) {
+    abort();
+  }
+  if (!m_level_init) {
+    abort();
+  }
+  
+  /* Get pointer to layer register */
+  plr = findLayer(layer_i);
+  
+  /* Hash the settings */
+  h = fnvUint32(h, (uint32_t) layer_i);
+  h = fnvUint32(h, (uint32_t) m_simplify);
+  for(i = DYNL_MIN; i <= DYNL_MAX; i++) {
+    h = fnvUint32(h, (uint32_t) m_level[i]);
+  }
+  
+  /* Hash the dynamics */
+  h = fnvUint32(h, (uint32_t) plr->dcount);
+  for(i = 0; i < plr->dcount; i++) {
+    pdr = &((plr->pDyn)[i]);
+    h = fnvUint32(h, (uint32_t) pdr->t);
+    h = fnvUint32(h, (((uint32_t) pdr->a) << 8) | ((uint32_t) pdr->b));
+  }
+  
+  return h;
+}
+
+/*
+ * Compute the digest of the formatted text of a layer, which is stored
+ * with each entry of the layer cache file to detect corruption.
+ * 
+ * Parameters:
+ * 
+ *   pText - the text
+ * 
+ *   len - the length of the text in bytes
+ * 
+ * Return:
+ * 
+ *   the 64-bit FNV-1a digest
+ */
+static uint64_t textDigest(const char *pText, size_t len) {
+  
+  uint64_t h = FNV_OFFSET;
+  size_t i = 0;
+  
+  /* Check parameter */
+  if (pText == NULL) {
+    abort();
+  }
+  
+  for(i = 0; i < len; i++) {
+    h = h ^ ((uint64_t) ((unsigned char) pText[i]));
+    h = h * FNV_PRIME;
+  }
+  
+  return h;
+}
+
+/*
+ * Comparison function for sorting cache entries by hash with qsort()
+ * and searching them with bsearch().
+ * 
+ * Parameters:
+ * 
+ *   pA - pointer to the first entry
+ * 
+ *   pB - pointer to the second entry
+ * 
+ * Return:
+ * 
+ *   less than, equal to, or greater than zero as the first hash is less
+ *   than, equal to, or greater than the second
+ */
+static int cmpCache(const void *pA, const void *pB) {
+  
+  const CACHEENT *pa = NULL;
+  const CACHEENT *pb = NULL;
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+  pa = (const CACHEENT *) pA;
+  pb = (const CACHEENT *) pB;
+  
+  if (pa->hash < pb->hash) {
+    return -1;
+  } else if (pa->hash > pb->hash) {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Load the layer cache file into m_cache.
+ * 
+ * A missing cache file is the same as an empty cache.  Since the cache
+ * only saves work, a cache file that can't be read is reported on
+ * standard error and then ignored.  This includes a file with an entry
+ * whose length runs past the end of the file, or whose text doesn't
+ * match its stored digest.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the cache file
+ * 
+ *   pModule - the module name for warnings
+ */
+static void loadCache(const char *pPath, const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t count = 0;
+  uint32_t v = 0;
+  uint32_t w = 0;
+  uint64_t check = 0;
+  long remain = 0;
+  FILE *pf = NULL;
+  CACHEENT *pe = NULL;
+  
+  /* Check parameters and state */
+  if ((pPath == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  if (m_cache != NULL) {
+    abort();
+  }
+  
+  /* Open the file, stopping if there is none */
+  pf = fopen(pPath, "rb");
+  if (pf == NULL) {
+    return;
+  }
+  
+  /* Get the size of the file */
+  if (fseek(pf, 0, SEEK_END)) {
+    status = 0;
+  } else {
+    remain = ftell(pf);
+    if (remain < 0) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (fseek(pf, 0, SEEK_SET)) {
+      status = 0;
+    }
+  }
+  
+  /* Read the header */
+  if (status) {
+    if (!readUint32(pf, &v)) {
+      status = 0;
+    } else if (v != CACHE_SIGNATURE) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (!readUint32(pf, &v)) {
+      status = 0;
+    } else if (v > LAYER_MAX + 1) {
+      status = 0;
+    } else {
+      count = (int32_t) v;
+    }
+  }
+  if (status) {
+    remain -= 8;
+    m_cache = (CACHEENT *) calloc((size_t) (count + 1), sizeof(CACHEENT));
+    if (m_cache == NULL) {
+      abort();
+    }
+  }
+  
+  /* Read each entry */
+  for(i = 0; status && (i < count); i++) {
+    pe = &(m_cache[i]);
+    
+    /* Read the hash and the text digest */
+    if ((!readUint32(pf, &v)) || (!readUint32(pf, &w))) {
+      status = 0;
+    } else {
+      pe->hash = (((uint64_t) v) << 32) | ((uint64_t) w);
+    }
+    if (status) {
+      if ((!readUint32(pf, &v)) || (!readUint32(pf, &w))) {
+        status = 0;
+      } else {
+        check = (((uint64_t) v) << 32) | ((uint64_t) w);
+      }
+    }
+    
+    /* Read the length, which must fit in the rest of the file */
+    if (status) {
+      remain -= 20;
+      if (!readUint32(pf, &v)) {
+        status = 0;
+      } else if ((v > INT32_MAX) || (remain < 0) ||
+                  (((long) v) > remain)) {
+        status = 0;
+      } else {
+        remain -= (long) v;
+      }
+    }
+    
+    /* Read the text and check it against the digest */
+    if (status) {
+      pe->len = (size_t) v;
+      pe->pText = (char *) malloc(pe->len + 1);
+      if (pe->pText == NULL) {
+        abort();
+      }
+      pe->owned = 1;
+      m_cache_count++;
+      
+      if (fread(pe->pText, 1, pe->len, pf) != pe->len) {
+        status = 0;
+      } else {
+        (pe->pText)[pe->len] = 0;
+      }
+    }
+    if (status) {
+      if (textDigest(pe->pText, pe->len) != check) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Make sure there is nothing after the last entry */
+  if (status) {
+    if (fgetc(pf) != EOF) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file */
+  fclose(pf);
+  pf = NULL;
+  
+  /* Sort the entries for searching, or drop them if the file is
+   * invalid */
+  if (status) {
+    if (m_cache_count > 1) {
+      qsort(m_cache, (size_t) m_cache_count, sizeof(CACHEENT), &cmpCache);
+    }
+  } else {
+    fprintf(stderr, "%s: Ignoring invalid cache file!\n", pModule);
+    free_cache();
+  }
+}
+
+/*
+ * Find a loaded cache entry by hash.
+ * 
+ * Parameters:
+ * 
+ *   hash - the hash to look for
+ * 
+ * Return:
+ * 
+ *   the entry, or NULL if there is none
+ */
+static const CACHEENT *findCache(uint64_t hash) {
+  
+  CACHEENT key;
+  
+  /* Initialize structures */
+  memset(&key, 0, sizeof(CACHEENT));
+  
+  if (m_cache_count < 1) {
+    return NULL;
+  }
+  
+  key.hash = hash;
+  return (const CACHEENT *) bsearch(
+            &key, m_cache, (size_t) m_cache_count, sizeof(CACHEENT),
+            &cmpCache);
+}
+
+/*
+ * Get the text of a layer from the layer cache, or format it if it is
+ * not cached.
+ * 
+ * layer_i must be a non-empty layer that is not dangling, and the level
+ * table must be initialized.  The loaded cache is only read, so this
+ * may be called from several threads at once for different entries.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer
+ * 
+ *   pe - the entry to receive the hash and text of the layer
+ */
+static void cacheLayer(int32_t layer_i, CACHEENT *pe) {
+  
+  const CACHEENT *pc = NULL;
+  
+  /* Check parameter */
+  if (pe == NULL) {
+    abort();
+  }
+  
+  /* Splice cached text if possible, otherwise format the layer */
+  pe->hash = layerDigest(layer_i);
+  pc = findCache(pe->hash);
+  if (pc != NULL) {
+    pe->pText = pc->pText;
+    pe->len = pc->len;
+    pe->owned = 0;
+  } else {
+    pe->pText = formatLayer(layer_i, &(pe->len));
+    pe->owned = 1;
+  }
+}
+
+/*
+ * Allocate the entries of the new layer cache.
+ * 
+ * All the entries start unused.
+ * 
+ * Parameters:
+ * 
+ *   count - the number of entries
+ */
+static void allocFresh(int32_t count) {
+  
+  /* Check parameter and state */
+  if (count < 0) {
+    abort();
+  }
+  if (m_fresh != NULL) {
+    abort();
+  }
+  
+  m_fresh = (CACHEENT *) calloc((size_t) (count + 1), sizeof(CACHEENT));
+  if (m_fresh == NULL) {
+    abort();
+  }
+  m_fresh_count = count;
+}
+
+/*
+ * Write the new layer cache from m_fresh to a file.
+ * 
+ * The cache is written to a temporary file beside the cache file, which
+ * then replaces the cache file, so an interrupted run never leaves a
+ * partial cache.  Errors are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the cache file
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int saveCache(const char *pPath, const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t count = 0;
+  char *pTemp = NULL;
+  FILE *pf = NULL;
+  uint64_t check = 0;
+  const CACHEENT *pe = NULL;
+  unsigned char buf[20];
+  
+  /* Initialize structures */
+  memset(buf, 0, sizeof(buf));
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Count the entries in use */
+  for(i = 0; i < m_fresh_count; i++) {
+    if ((m_fresh[i]).pText != NULL) {
+      count++;
+    }
+  }
+  
+  /* Open the temporary file */
+  pTemp = (char *) malloc(strlen(pPath) + 5);
+  if (pTemp == NULL) {
+    abort();
+  }
+  strcpy(pTemp, pPath);
+  strcat(pTemp, ".tmp");
+  
+  pf = fopen(pTemp, "wb");
+  if (pf == NULL) {
+    status = 0;
+    fprintf(stderr, "%s: Can't open cache file!\n", pModule);
+  }
+  
+  /* Write the header */
+  if (status) {
+    putUint32(&(buf[0]), CACHE_SIGNATURE);
+    putUint32(&(buf[4]), (uint32_t) count);
+    if (fwrite(buf, 1, 8, pf) != 8) {
+      status = 0;
+    }
+  }
+  
+  /* Write each entry in use */
+  for(i = 0; status && (i < m_fresh_count); i++) {
+    pe = &(m_fresh[i]);
+    if (pe->pText == NULL) {
+      continue;
+    }
+    
+    check = textDigest(pe->pText, pe->len);
+    putUint32(&(buf[0]), (uint32_t) (pe->hash >> 32));
+    putUint32(&(buf[4]), (uint32_t) (pe->hash & UINT32_C(0xffffffff)));
+    putUint32(&(buf[8]), (uint32_t) (check >> 32));
+    putUint32(&(buf[12]), (uint32_t) (check & UINT32_C(0xffffffff)));
+    putUint32(&(buf[16]), (uint32_t) pe->len);
+    if (fwrite(buf, 1, 20, pf) != 20) {
+      status = 0;
+    } else if (fwrite(pe->pText, 1, pe->len, pf) != pe->len) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file and replace the cache file with it */
+  if (pf != NULL) {
+    if (fclose(pf)) {
+      status = 0;
+    }
+    pf = NULL;
+    if (status) {
+      if (rename(pTemp, pPath)) {
+        status = 0;
+      }
+    }
+    if (!status) {
+      remove(pTemp);
+      fprintf(stderr, "%s: Can't write cache file!\n", pModule);
+    }
+  }
+  
+  /* Free the temporary path */
+  free(pTemp);
+  pTemp = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Free the loaded and new layer caches.
+ */
+static void free_cache(void) {
+  
+  int32_t i = 0;
+  
+  if (m_fresh != NULL) {
+    for(i = 0; i < m_fresh_count; i++) {
+      if ((m_fresh[i]).owned) {
+        free((m_fresh[i]).pText);
+      }
+      (m_fresh[i]).pText = NULL;
+    }
+    free(m_fresh);
+    m_fresh = NULL;
+  }
+  m_fresh_count = 0;
+  
+  if (m_cache != NULL) {
+    for(i = 0; i < m_cache_count; i++) {
+      free((m_cache[i]).pText);
+      (m_cache[i]).pText = NULL;
+    }
+    free(m_cache);
+    m_cache = NULL;
+  }
+  m_cache_count = 0;
+}
+
+/*
+ * Compare two notes by their order of processing.
+ * 
+ * Notes are ordered by t, then grace notes before other notes, then by
+ * their index in the input.  i and j must be valid indices into m_note.
+ * 
+ * Parameters:
+ * 
+ *   i - the index of the first note
+ * 
+ *   j - the index of the second note
+ * 
+ * Return:
+ * 
+ *   less than, equal to, or greater than zero as the first note comes
+ *   before, is the same as, or comes after the second note
+ */
+static int noteCompare(int32_t i, int32_t j) {
+  
+  const NMF_NOTE *pa = NULL;
+  const NMF_NOTE *pb = NULL;
+  int ga = 0;
+  int gb = 0;
+  
+  /* Check parameters */
+  if ((i < 0) || (i >= m_note_count) || (j < 0) || (j >= m_note_count)) {
+    abort();
+  }
+  
+  /* Get the notes */
+  pa = &(m_note[i]);
+  pb = &(m_note[j]);
+  
+  /* Compare t */
+  if (pa->t < pb->t) {
+    return -1;
+  } else if (pa->t > pb->t) {
+    return 1;
+  }
+  
+  /* Grace notes come first */
+  if (pa->dur < 0) {
+    ga = 1;
+  }
+  if (pb->dur < 0) {
+    gb = 1;
+  }
+  if (ga && (!gb)) {
+    return -1;
+  } else if (gb && (!ga)) {
+    return 1;
+  }
+  
+  /* Compare input index */
+  if (i < j) {
+    return -1;
+  } else if (i > j) {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Comparison function for sorting note indices with qsort().
+ * 
+ * Parameters:
+ * 
+ *   pA - pointer to the first note index
+ * 
+ *   pB - pointer to the second note index
+ * 
+ * Return:
+ * 
+ *   the result of noteCompare() on the two indices
+ */
+static int cmpNote(const void *pA, const void *pB) {
+  
+  /* Check parameters */
+  if ((pA == NULL) || (pB == NULL)) {
+    abort();
+  }
+  
+  return noteCompare(*((const int32_t *) pA), *((const int32_t *) pB));
+}
+
+/*
+ * Copy the notes of an NMF object into m_note, in the order they appear
+ * in the object.
+ * 
+ * m_note must not have been filled yet.
+ * 
+ * Parameters:
+ * 
+ *   pd - the NMF object
+ */
+static void copyNotes(NMF_DATA *pd) {
+  
+  int32_t i = 0;
+  
+  /* Check parameter and state */
+  if (pd == NULL) {
+    abort();
+  }
+  if (m_note != NULL) {
+    abort();
+  }
+  
+  /* Allocate and fill the array */
+  m_note_count = nmf_notes(pd);
+  m_note = (NMF_NOTE *) calloc(
+              (size_t) (m_note_count + 1), sizeof(NMF_NOTE));
+  if (m_note == NULL) {
+    abort();
+  }
+  for(i = 0; i < m_note_count; i++) {
+    nmf_get(pd, i, &(m_note[i]));
+  }
+}
+
+/*
+ * Add an input file from the argument of an --input option.
+ * 
+ * The argument is a path, optionally followed by a colon and a layer
+ * offset.  A colon is only taken as the start of a layer offset if
+ * everything after the last colon is an unsigned decimal integer, so
+ * paths containing colons can still be given.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the argument
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the argument is invalid or there
+ *   are too many input files
+ */
+static int parseInput(const char *pstr) {
+  
+  int status = 1;
+  const char *pc = NULL;
+  const char *pd = NULL;
+  char *pPath = NULL;
+  int32_t offset = 0;
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Check room */
+  if (m_input_count >= MAX_INPUTS) {
+    status = 0;
+  }
+  
+  /* Look for a layer offset after the last colon */
+  if (status) {
+    pc = strrchr(pstr, ':');
+    if (pc != NULL) {
+      for(pd = pc + 1; *pd != 0; pd++) {
+        if ((*pd < '0') || (*pd > '9')) {
+          break;
+        }
+      }
+      if ((pd == pc + 1) || (*pd != 0)) {
+        pc = NULL;
+      }
+    }
+    if (pc != NULL) {
+      if (!parseInt(pc + 1, &offset)) {
+        status = 0;
+      } else if (offset > LAYER_MAX) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Get the path */
+  if (status) {
+    if (pc == NULL) {
+      pc = pstr + strlen(pstr);
+    }
+    if (pc == pstr) {
+      status = 0;
+    }
+  }
+  if (status) {
+    pPath = (char *) malloc((size_t) (pc - pstr) + 1);
+    if (pPath == NULL) {
+      abort();
+    }
+    memcpy(pPath, pstr, (size_t) (pc - pstr));
+    pPath[pc - pstr] = 0;
+  }
+  
+  /* Add the input */
+  if (status) {
+    memset(&(m_input[m_input_count]), 0, sizeof(INPUTSRC));
+    (m_input[m_input_count]).pPath = pPath;
+    (m_input[m_input_count]).offset = offset;
+    (m_input[m_input_count]).pd = NULL;
+    m_input_count++;
+    pPath = NULL;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse all the input files.
+ * 
+ * Each input file must have a quantum basis of 48,000 or 44,100 quanta
+ * per second, and all input files must have the same basis.  Errors are
+ * reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int loadInputs(const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int basis = 0;
+  FILE *pf = NULL;
+  INPUTSRC *ps = NULL;
+  
+  /* Check parameter */
+  if (pModule == NULL) {
+    abort();
+  }
+  
+  /* Parse each file */
+  for(i = 0; i < m_input_count; i++) {
+    ps = &(m_input[i]);
+    
+    pf = fopen(ps->pPath, "rb");
+    if (pf == NULL) {
+      status = 0;
+      fprintf(stderr, "%s: Can't open input file %s!\n",
+              pModule, ps->pPath);
+    }
+    
+    if (status) {
+      ps->pd = nmf_parse(pf);
+      if (ps->pd == NULL) {
+        status = 0;
+        fprintf(stderr, "%s: Can't parse %s as NMF!\n",
+                pModule, ps->pPath);
+      }
+    }
+    
+    if (pf != NULL) {
+      fclose(pf);
+      pf = NULL;
+    }
+    
+    /* Make sure basis is correct and matches the other files */
+    if (status) {
+      if ((nmf_basis(ps->pd) != NMF_BASIS_44100) &&
+          (nmf_basis(ps->pd) != NMF_BASIS_48000)) {
+        status = 0;
+        fprintf(stderr, "%s: NMF file has wrong basis!\n", pModule);
+        
+      } else if (i == 0) {
+        basis = nmf_basis(ps->pd);
+        
+      } else if (nmf_basis(ps->pd) != basis) {
+        status = 0;
+        fprintf(stderr, "%s: Input files have different bases!\n",
+                pModule);
+      }
+    }
+    
+    if (status) {
+      ps->count = nmf_notes(ps->pd);
+      ps->next = 0;
+    }
+    
+    if (!status) {
+      break;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Free all the input files.
+ */
+static void free_inputs(void) {
+  
+  int32_t i = 0;
+  
+  for(i = 0; i < m_input_count; i++) {
+    nmf_free((m_input[i]).pd);
+    (m_input[i]).pd = NULL;
+    free((char *) (m_input[i]).pPath);
+    (m_input[i]).pPath = NULL;
+  }
+  m_input_count = 0;
+}
+
+/*
+ * Compare the current notes of two input files in the merge.
+ * 
+ * Notes are ordered by t, then grace notes before other notes, then by
+ * the order of the input files, which is the order that sorting the
+ * concatenated files would give.
+ * 
+ * Parameters:
+ * 
+ *   a - the index of the first input file
+ * 
+ *   b - the index of the second input file
+ * 
+ * Return:
+ * 
+ *   non-zero if the current note of a comes before that of b
+ */
+static int mergeLess(int32_t a, int32_t b) {
+  
+  const NMF_NOTE *pa = NULL;
+  const NMF_NOTE *pb = NULL;
+  int ga = 0;
+  int gb = 0;
+  
+  /* Check parameters */
+  if ((a < 0) || (a >= m_input_count) || (b < 0) || (b >= m_input_count)) {
+    abort();
+  }
+  
+  pa = &((m_input[a]).cur);
+  pb = &((m_input[b]).cur);
+  
+  if (pa->t != pb->t) {
+    return (pa->t < pb->t);
+  }
+  
+  ga = (pa->dur < 0);
+  gb = (pb->dur < 0);
+  if (ga != gb) {
+    return ga;
+  }
+  
+  return (a < b);
+}
+
+/*
+ * Restore the heap property of a merge heap below a given node.
+ * 
+ * Parameters:
+ * 
+ *   ph - the heap of input file indices
+ * 
+ *   n - the number of entries in the heap
+ * 
+ *   i - the node to sift down
+ */
+static void mergeSift(int32_t *ph, int32_t n, int32_t i) {
+  
+  int32_t c = 0;
+  int32_t x = 0;
+  
+  /* Check parameters */
+  if ((ph == NULL) || (n < 0) || (i < 0)) {
+    abort();
+  }
+  
+  x = ph[i];
+  while (2 * i + 1 < n) {
+    c = 2 * i + 1;
+    if (c + 1 < n) {
+      if (mergeLess(ph[c + 1], ph[c])) {
+        c++;
+      }
+    }
+    if (!mergeLess(ph[c], x)) {
+      break;
+    }
+    ph[i] = ph[c];
+    i = c;
+  }
+  ph[i] = x;
+}
+
+/*
+ * Merge the notes of all input files into m_note.
+ * 
+ * loadInputs() must have been called successfully, and m_note must not
+ * have been filled yet.  The layer offset of each file is added to its
+ * notes.  A binary heap holds the current note of each file, so the
+ * merge is a single pass over the notes.  If every file is sorted, the
+ * merged notes are in the same order as sorting the concatenated files,
+ * and partitionNotes() finds every layer already in order.  Each file is
+ * freed as soon as all of its notes are merged.
+ * 
+ * The function fails if a layer index plus its offset is beyond
+ * LAYER_MAX.
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if a layer index is out of range
+ */
+static int mergeInputs(void) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t n = 0;
+  int64_t total = 0;
+  int32_t *ph = NULL;
+  INPUTSRC *ps = NULL;
+  NMF_NOTE *pn = NULL;
+  
+  /* Check state */
+  if (m_note != NULL) {
+    abort();
+  }
+  
+  /* Count the notes */
+  for(i = 0; i < m_input_count; i++) {
+    total += (int64_t) (m_input[i]).count;
+  }
+  if (total > INT32_MAX / 2) {
+    abort();
+  }
+  
+  /* Allocate the arrays */
+  m_note = (NMF_NOTE *) calloc((size_t) (total + 1), sizeof(NMF_NOTE));
+  ph = (int32_t *) calloc((size_t) (m_input_count + 1), sizeof(int32_t));
+  if ((m_note == NULL) || (ph == NULL)) {
+    abort();
+  }
+  
+  /* Build the heap from the first note of each non-empty file */
+  for(i = 0; i < m_input_count; i++) {
+    ps = &(m_input[i]);
+    if (ps->count > 0) {
+      nmf_get(ps->pd, 0, &(ps->cur));
+      ps->next = 1;
+      ph[n] = i;
+      n++;
+    }
+  }
+  for(i = (n / 2) - 1; i >= 0; i--) {
+    mergeSift(ph, n, i);
+  }
+  
+  /* Take the least note until all files are merged */
+  while (n > 0) {
+    ps = &(m_input[ph[0]]);
+    
+    /* Copy the note with the layer offset applied */
+    pn = &(m_note[m_note_count]);
+    *pn = ps->cur;
+    if (((int32_t) pn->layer_i) + ps->offset > LAYER_MAX) {
+      status = 0;
+      break;
+    }
+    pn->layer_i = (uint16_t) (((int32_t) pn->layer_i) + ps->offset);
+    m_note_count++;
+    
+    /* Advance the file, removing it from the heap when done */
+    if (ps->next < ps->count) {
+      nmf_get(ps->pd, ps->next, &(ps->cur));
+      (ps->next)++;
+    } else {
+      nmf_free(ps->pd);
+      ps->pd = NULL;
+      n--;
+      ph[0] = ph[n];
+    }
+    if (n > 0) {
+      mergeSift(ph, n, 0);
+    }
+  }
+  
+  /* Free the heap */
+  free(ph);
+  ph = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Partition the notes in m_note by layer.
+ * 
+ * m_note must have been filled by copyNotes() or mergeInputs().  Every
+ * layer that has notes is registered with getLayer(), so that the
+ * buckets can follow the sorted order of layerAt().  A counting pass
+ * over the registered layers computes the start of each bucket in
+ * m_bucket, and the note indices are scattered into m_part so that the
+ * indices of each layer are contiguous and in input order.  Each bucket
+ * is then sorted into processing order with noteCompare(), which is
+ * skipped when the bucket is already in order.
+ * 
+ * This gives each layer its notes in chronological order without
+ * sorting the whole note stream, and the cost only depends on the
+ * number of notes and the number of layers that have notes, not on the
+ * range of layer indices.  Must only be called once, before any other
+ * layer is registered.
+ */
+static void partitionNotes(void) {
+  
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t *pSlot = NULL;
+  int32_t *pPos = NULL;
+  int32_t *pFill = NULL;
+  
+  /* Check state */
+  if ((m_note == NULL) || (m_part != NULL)) {
+    abort();
+  }
+  if (layerCount() > 0) {
+    abort();
+  }
+  
+  /* Register every layer that has notes, recording the register index
+   * of each note, and put the layers in order */
+  pSlot = (int32_t *) calloc(
+              (size_t) (m_note_count + 1), sizeof(int32_t));
+  if (pSlot == NULL) {
+    abort();
+  }
+  for(i = 0; i < m_note_count; i++) {
+    pSlot[i] = (int32_t) (getLayer((int32_t) (m_note[i]).layer_i) - m_t);
+  }
+  sortLayers();
+  m_bucket_count = layerCount();
+  
+  /* Convert register indices to positions in layer order */
+  pPos = (int32_t *) calloc(
+              (size_t) (m_bucket_count + 1), sizeof(int32_t));
+  if (pPos == NULL) {
+    abort();
+  }
+  for(i = 0; i < m_bucket_count; i++) {
+    pPos[m_order[i]] = i;
+  }
+  for(i = 0; i < m_note_count; i++) {
+    pSlot[i] = pPos[pSlot[i]];
+  }
+  free(pPos);
+  pPos = NULL;
+  
+  /* Allocate the arrays */
+  m_part = (int32_t *) calloc(
+              (size_t) (m_note_count + 1), sizeof(int32_t));
+  m_bucket = (int32_t *) calloc(
+              (size_t) (m_bucket_count + 1), sizeof(int32_t));
+  pFill = (int32_t *) calloc(
+              (size_t) (m_bucket_count + 1), sizeof(int32_t));
+  if ((m_part == NULL) || (m_bucket == NULL) || (pFill == NULL)) {
+    abort();
+  }
+  
+  /* Count the notes in each layer */
+  for(i = 0; i < m_note_count; i++) {
+    (m_bucket[pSlot[i] + 1])++;
+  }
+  
+  /* Convert the counts to bucket starts */
+  for(i = 1; i <= m_bucket_count; i++) {
+    m_bucket[i] += m_bucket[i - 1];
+  }
+  
+  /* Scatter the note indices into their buckets in input order */
+  memcpy(pFill, m_bucket, ((size_t) m_bucket_count) * sizeof(int32_t));
+  for(i = 0; i < m_note_count; i++) {
+    m_part[(pFill[pSlot[i]])++] = i;
+  }
+  
+  free(pFill);
+  pFill = NULL;
+  free(pSlot);
+  pSlot = NULL;
+  
+  /* Sort each bucket that is not already in order */
+  for(i = 0; i < m_bucket_count; i++) {
+    lo = m_bucket[i];
+    hi = m_bucket[i + 1];
+    for(j = lo + 1; j < hi; j++) {
+      if (noteCompare(m_part[j - 1], m_part[j]) > 0) {
+        break;
+      }
+    }
+    if (j < hi) {
+      qsort(&(m_part[lo]), (size_t) (hi - lo), sizeof(int32_t), &cmpNote);
+    }
+  }
+}
+
+/*
+ * Free the partitioned notes.
+ */
+static void free_part(void) {
+  free(m_note);
+  m_note = NULL;
+  free(m_part);
+  m_part = NULL;
+  free(m_bucket);
+  m_bucket = NULL;
+  m_bucket_count = 0;
+  m_note_count = 0;
+}
+
+/*
+ * Route a note to the graph builder of its layer.
+ * 
+ * The note must come after all notes previously routed to the same
+ * layer in the order of noteCompare().  Notes of different layers may
+ * be routed in any order relative to each other.
+ * 
+ * Parameters:
+ * 
+ *   pn - the note to route
+ * 
+ * Return:
+ * 
+ *   ERR_OK if successful, or else an error code
+ */
+static int routeNote(const NMF_NOTE *pn) {
+  
+  int err = ERR_OK;
+  int32_t lvl = 0;
+  
+  /* Check parameter */
+  if (pn == NULL) {
+    abort();
+  }
+  
+  /* Determine level from pitch */
+  lvl = pitchToLevel(pn->pitch);
+  if (lvl < 0) {
+    err = ERR_PITCH;
+  }
+  
+  /* If note is a grace note, make sure articulation indicates a ramp,
+   * and also that grace note offset is -1 */
+  if ((err == ERR_OK) && (pn->dur < 0)) {
+    if (pn->art != ARTKEY_RAMP) {
+      err = ERR_GRACEART;
+    } else if (pn->dur != -1) {
+      err = ERR_GRACEOFF;
+    }
+  }
+  
+  /* If this is first note, make sure it has t=0; otherwise, make sure t
+   * value of this note is greater than last time value */
+  if (err == ERR_OK) {
+    if (layerIsEmpty(pn->layer_i)) {
+      if (pn->t != 0) {
+        err = ERR_NOZERO;
+      }
+    } else {
+      if (pn->t <= layerLastTime(pn->layer_i)) {
+        err = ERR_SIMUL;
+      }
+    }
+  }
+  
+  /* Determine what to do based on articulation and duration */
+  if ((err == ERR_OK) && (pn->art == ARTKEY_CONSTANT)) {
+    /* Constant dynamic -- make sure no grace note is buffered */
+    if (layerHasGrace(pn->layer_i)) {
+      err = ERR_GRACECONST;
+    }
+    
+    /* Report constant dynamic */
+    if (err == ERR_OK) {
+      if (!layerDynC(pn->layer_i, pn->t, lvl)) {
+        err = ERR_TOOLONG;
+      }
+    }
+    
+  } else if ((err == ERR_OK) && (pn->dur < 0)) {
+    /* Grace note -- verify no grace note buffered */
+    if (layerHasGrace(pn->layer_i)) {
+      err = ERR_MULTIGRACE;
+    }
+    
+    /* Buffer grace note */
+    if (err == ERR_OK) {
+      layerGrace(pn->layer_i, pn->t, lvl);
+    }
+    
+  } else if ((err == ERR_OK) && (pn->art == ARTKEY_RAMP)) {
+    /* Ramp dynamic -- if a grace note is buffered, make sure its t
+     * value matches that of this note */
+    if (layerHasGrace(pn->layer_i)) {
+      if (layerGraceTime(pn->layer_i) != pn->t) {
+        err = ERR_GRACEBEAT;
+      }
+    }
+    
+    /* Report ramp dynamic */
+    if (err == ERR_OK) {
+      if (!layerDynR(pn->layer_i, pn->t, lvl)) {
+        err = ERR_TOOLONG;
+      }
+    }
+    
+  } else if (err == ERR_OK) {
+    /* Unrecognized articulation key */
+    err = ERR_ARTKEY;
+  }
+  
+  /* Return error code */
+  return err;
+}
+
+/*
+ * Convert an error code into a string.
+ * 
+ * The string has the first letter capitalized, but no punctuation or
+ * line break at the end.
+ * 
+ * If the code is ERR_OK, then "No error" is returned.  If the code is
+ * unrecognized, then "Unknown error" is returned.
+ * 
+ * Parameters:
+ * 
+ *   code - the error code
+ * 
+ * Return:
+ * 
+ *   an error message
+ */
+static const char *error_string(int code) {
+  
+  const char *pResult = NULL;
+  
+  switch (code) {
+    
+    case ERR_OK:
+      pResult = "No error";
+      break;
+    
+    case ERR_PITCH:
+      pResult = "Invalid pitch encountered";
+      break;
+    
+    case ERR_GRACEART:
+      pResult = "Grace note must be part of ramp";
+      break;
+    
+    case ERR_GRACEOFF:
+      pResult = "Only grace note offset -1 is allowed";
+      break;
+    
+    case ERR_NOZERO:
+      pResult = "Missing t=0 dynamic";
+      break;
+    
+    case ERR_SIMUL:
+      pResult = "Simultaneous dynamics";
+      break;
+    
+    case ERR_GRACECONST:
+      pResult = "Grace note before constant dynamic";
+      break;
+    
+    case ERR_TOOLONG:
+      pResult = "Layer is too long";
+      break;
+    
+    case ERR_MULTIGRACE:
+      pResult = "Multiple grace notes";
+      break;
+    
+    case ERR_GRACEBEAT:
+      pResult = "Grace note missing beat";
+      break;
+    
+    case ERR_ARTKEY:
+      pResult = "Unrecognized articulation key";
+      break;
+    
+    default:
+      pResult = "Unknown error";
+  }
+  
+  return pResult;
+}
+
+/*
+ * Thread function that builds and formats a share of the layers.
+ * 
+ * The argument is a LAYERWORKER.  The worker handles every job in
+ * m_job whose index is its first index plus a multiple of its stride.
+ * For each job, the notes of the layer are routed to its graph builder.
+ * If that succeeds and the layer is not dangling, the layer is written
+ * to a memory buffer in the job, or to the entry of the job in m_fresh
+ * if the layer cache is used.  Errors are recorded in the job rather
+ * than reported.
+ * 
+ * Each layer must already be registered, so that the layer registry is
+ * only read while the workers run.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the LAYERWORKER
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *buildWorker(void *pArg) {
+  
+  const LAYERWORKER *pw = NULL;
+  LAYERJOB *pj = NULL;
+  int32_t i = 0;
+  int32_t j = 0;
+  
+  /* Check parameter */
+  if (pArg == NULL) {
+    abort();
+  }
+  pw = (const LAYERWORKER *) pArg;
+  
+  /* Run the jobs */
+  for(i = pw->first; i < m_job_count; i += pw->stride) {
+    pj = &(m_job[i]);
+    
+    /* Route the notes of the layer, stopping on error */
+    for(j = m_bucket[i]; j < m_bucket[i + 1]; j++) {
+      pj->err = routeNote(&(m_note[m_part[j]]));
+      if (pj->err != ERR_OK) {
+        pj->err_i = m_part[j];
+        break;
+      }
+    }
+    
+    /* Check for dangling layer and format the layer if all is well */
+    if (pj->err == ERR_OK) {
+      pj->dangling = layerDangling(pj->layer_i);
+    }
+    if ((pj->err == ERR_OK) && (!(pj->dangling)) &&
+        (!layerIsEmpty(pj->layer_i)) && (m_at == NULL)) {
+      if (m_cache_path != NULL) {
+        cacheLayer(pj->layer_i, &(m_fresh[i]));
+      } else {
+        pj->pBuf = formatLayer(pj->layer_i, &(pj->buf_len));
+      }
+    }
+  }
+  
+  return NULL;
+}
+
+/*
+ * Build and write all layers using multiple threads.
+ * 
+ * partitionNotes() must already have been called, and m_threads should
+ * be greater than one.  The layers are built and formatted in parallel
+ * into memory buffers, and then the buffers are written to standard
+ * output in ascending order of layer index.
+ * 
+ * Output and error messages are the same as the single-threaded scan.
+ * If any layer has a routing error, the error that comes first in
+ * processing order is reported.  Otherwise, each dangling layer is
+ * reported in layer order.  Nothing is written if there is any error,
+ * and nothing is formatted or written when the layers are queried.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int buildThreaded(const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t worker_count = 0;
+  int err = ERR_OK;
+  int32_t err_i = -1;
+  LAYERWORKER *pw = NULL;
+  pthread_t *pth = NULL;
+  
+  /* Check parameter and state */
+  if (pModule == NULL) {
+    abort();
+  }
+  if ((m_note == NULL) || (m_job != NULL)) {
+    abort();
+  }
+  
+  /* Set up a job for each layer, which partitionNotes() registered in
+   * the order of the buckets */
+  m_job_count = m_bucket_count;
+  m_job = (LAYERJOB *) calloc((size_t) (m_job_count + 1), sizeof(LAYERJOB));
+  if (m_job == NULL) {
+    abort();
+  }
+  for(i = 0; i < m_job_count; i++) {
+    (m_job[i]).layer_i = layerAt(i);
+    (m_job[i]).err = ERR_OK;
+    (m_job[i]).err_i = -1;
+    (m_job[i]).dangling = 0;
+    (m_job[i]).pBuf = NULL;
+    (m_job[i]).buf_len = 0;
+  }
+  if (m_cache_path != NULL) {
+    allocFresh(m_job_count);
+  }
+  
+  /* Run the jobs on the worker threads */
+  worker_count = m_threads;
+  if (worker_count > m_job_count) {
+    worker_count = m_job_count;
+  }
+  if (worker_count > 0) {
+    pw = (LAYERWORKER *) calloc((size_t) worker_count, sizeof(LAYERWORKER));
+    pth = (pthread_t *) calloc((size_t) worker_count, sizeof(pthread_t));
+    if ((pw == NULL) || (pth == NULL)) {
+      abort();
+    }
+    
+    for(i = 0; i < worker_count; i++) {
+      pw[i].first = i;
+      pw[i].stride = worker_count;
+      if (pthread_create(&(pth[i]), NULL, &buildWorker, &(pw[i]))) {
+        abort();
+      }
+    }
+    for(i = 0; i < worker_count; i++) {
+      if (pthread_join(pth[i], NULL)) {
+        abort();
+      }
+    }
+    
+    free(pw);
+    pw = NULL;
+    free(pth);
+    pth = NULL;
+  }
+  
+  /* Report the routing error that comes first in processing order */
+  for(i = 0; i < m_job_count; i++) {
+    if ((m_job[i]).err != ERR_OK) {
+      if (err_i < 0) {
+        err = (m_job[i]).err;
+        err_i = (m_job[i]).err_i;
+      } else if (noteCompare((m_job[i]).err_i, err_i) < 0) {
+        err = (m_job[i]).err;
+        err_i = (m_job[i]).err_i;
+      }
+    }
+  }
+  if (err != ERR_OK) {
+    status = 0;
+    fprintf(stderr, "%s: %s!\n", pModule, error_string(err));
+  }
+  
+  /* Make sure no dangling layers */
+  if (status) {
+    for(i = 0; i < m_job_count; i++) {
+      if ((m_job[i]).dangling) {
+        status = 0;
+        fprintf(stderr, "%s: Dangling layer!\n", pModule);
+      }
+    }
+  }
+  
+  /* Write the formatted layers in order */
+  if (status && (m_at == NULL) && (m_cache_path != NULL)) {
+    for(i = 0; i < m_fresh_count; i++) {
+      if ((m_fresh[i]).len > 0) {
+        if (fwrite((m_fresh[i]).pText, 1, (m_fresh[i]).len, stdout) !=
+              (m_fresh[i]).len) {
+          abort();
+        }
+      }
+    }
+    
+  } else if (status && (m_at == NULL)) {
+    for(i = 0; i < m_job_count; i++) {
+      if ((m_job[i]).pBuf != NULL) {
+        if ((m_job[i]).buf_len > 0) {
+          if (fwrite((m_job[i]).pBuf, 1, (m_job[i]).buf_len, stdout) !=
+                (m_job[i]).buf_len) {
+            abort();
+          }
+        }
+      }
+    }
+  }
+  
+  /* Free the jobs */
+  for(i = 0; i < m_job_count; i++) {
+    free((m_job[i]).pBuf);
+    (m_job[i]).pBuf = NULL;
+  }
+  free(m_job);
+  m_job = NULL;
+  m_job_count = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Build and write the layers of an NMF object one group at a time.
+ * 
+ * The notes of each layer must be contiguous in the NMF object, so that
+ * a layer is complete as soon as a note of another layer is reached.
+ * Each group of notes is copied into m_note and sorted into processing
+ * order if it is not already in order.  The notes are then routed, and
+ * the layer is checked, written to standard output, and released
+ * before the next group is read.  Only one layer is held at a time.
+ * 
+ * Layers are written in the order their groups appear.  Errors are
+ * reported to standard error, and the layers before the group with the
+ * error have already been written.  If m_simplify is set, the
+ * breakpoints of each layer are counted into the totals before the
+ * layer is released.
+ * 
+ * Parameters:
+ * 
+ *   pd - the NMF object
+ * 
+ *   pTotal - the total number of breakpoints, for simplification
+ * 
+ *   pKept - the number of breakpoints kept by simplification
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int streamLayers(
+          NMF_DATA * pd,
+          int64_t  * pTotal,
+          int64_t  * pKept,
+    const char     * pModule) {
+  
+  int status = 1;
+  int err = ERR_OK;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t count = 0;
+  int32_t cap = 0;
+  int32_t layer_i = 0;
+  NMF_NOTE n;
+  
+  /* Initialize structures */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameters and state */
+  if ((pd == NULL) || (pTotal == NULL) || (pKept == NULL) ||
+      (pModule == NULL)) {
+    abort();
+  }
+  if ((m_note != NULL) || (m_part != NULL)) {
+    abort();
+  }
+  
+  /* Process each group of notes */
+  count = nmf_notes(pd);
+  i = 0;
+  while (status && (i < count)) {
+    
+    /* Make sure the layer has not been seen in an earlier group */
+    nmf_get(pd, i, &n);
+    layer_i = (int32_t) n.layer_i;
+    if (findLayer(layer_i) != NULL) {
+      status = 0;
+      fprintf(stderr, "%s: Layer %ld is not contiguous!\n",
+              pModule, (long) (layer_i + 1));
+    }
+    
+    /* Copy the group into m_note, growing the buffers as needed */
+    m_note_count = 0;
+    while (status && (i < count)) {
+      nmf_get(pd, i, &n);
+      if ((int32_t) n.layer_i != layer_i) {
+        break;
+      }
+      
+      if (m_note_count >= cap) {
+        if (cap < 1) {
+          cap = LAYER_INITDYN;
+        } else {
+          cap = cap * 2;
+        }
+        m_note = (NMF_NOTE *) realloc(
+                    m_note, ((size_t) cap) * sizeof(NMF_NOTE));
+        m_part = (int32_t *) realloc(
+                    m_part, ((size_t) cap) * sizeof(int32_t));
+        if ((m_note == NULL) || (m_part == NULL)) {
+          abort();
+        }
+      }
+      
+      m_note[m_note_count] = n;
+      m_part[m_note_count] = m_note_count;
+      m_note_count++;
+      i++;
+    }
+    
+    /* Sort the group into processing order if necessary */
+    if (status) {
+      for(j = 1; j < m_note_count; j++) {
+        if (noteCompare(m_part[j - 1], m_part[j]) > 0) {
+          break;
+        }
+      }
+      if (j < m_note_count) {
+        qsort(m_part, (size_t) m_note_count, sizeof(int32_t), &cmpNote);
+      }
+    }
+    
+    /* Route the notes of the group */
+    for(j = 0; status && (j < m_note_count); j++) {
+      err = routeNote(&(m_note[m_part[j]]));
+      if (err != ERR_OK) {
+        status = 0;
+        fprintf(stderr, "%s: %s!\n", pModule, error_string(err));
+      }
+    }
+    
+    /* Make sure the layer is not dangling */
+    if (status) {
+      if (layerDangling(layer_i)) {
+        status = 0;
+        fprintf(stderr, "%s: Dangling layer!\n", pModule);
+      }
+    }
+    
+    /* Write the layer and release it */
+    if (status) {
+      writeLayer(stdout, layer_i);
+      if (m_simplify) {
+        countSimplify(layer_i, pTotal, pKept);
+      }
+      layerRelease(layer_i);
+    }
+  }
+  
+  /* Free the group buffers */
+  free(m_note);
+  m_note = NULL;
+  free(m_part);
+  m_part = NULL;
+  m_note_count = 0;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Store a 32-bit unsigned integer in big-endian order.
+ * 
+ * Parameters:
+ * 
+ *   pb - pointer to the four bytes to receive the integer
+ * 
+ *   v - the value to store
+ */
+static void putUint32(unsigned char *pb, uint32_t v) {
+  
+  /* Check parameter */
+  if (pb == NULL) {
+    abort();
+  }
+  
+  pb[0] = (unsigned char) (v >> 24);
+  pb[1] = (unsigned char) ((v >> 16) & 0xff);
+  pb[2] = (unsigned char) ((v >> 8) & 0xff);
+  pb[3] = (unsigned char) (v & 0xff);
+}
+
+/*
+ * Render the intensity curve of a layer at a fixed control rate.
+ * 
+ * layer_i must be a non-empty layer that is not dangling.  The level
+ * table must be initialized.
+ * 
+ * pv receives frames values, where value k is the output intensity of
+ * the layer at sample time k * hop.  Constant dynamics hold their level
+ * up to the next dynamic, and the last dynamic holds its level to the
+ * end.  Ramp dynamics are interpolated linearly from their start level
+ * at their own time to their end level at the time of the next dynamic,
+ * and rounded to the nearest integer.  The interpolation loop has no
+ * branches, so that the compiler can vectorize it.
+ * 
+ * Parameters:
+ * 
+ *   layer_i - the layer to render
+ * 
+ *   pv - the array to receive the intensities
+ * 
+ *   frames - the number of values to render
+ * 
+ *   hop - the number of samples between values
+ */
+static void renderLayer(
+    int32_t    layer_i,
+    uint16_t * pv,
+    int32_t    frames,
+    int32_t    hop) {
+  
+  const LAYERREG *plr = NULL;
+  int32_t i = 0;
+  int32_t k = 0;
+  int64_t t0 = 0;
+  int64_t t1 = 0;
+  int64_t k0 = 0;
+  int64_t k1 = 0;
+  int start = 0;
+  int end = 0;
+  double base = 0.0;
+  double step = 0.0;
+  
+  /* Check parameters */
+  if ((pv == NULL) || (frames < 1) || (hop < 1)) {
+    abort();
+  }
+  if (layerIsEmpty(layer_i) || layerDangling(layer_i)) {
+    abort();
+  }
+  if (!m_level_init) {
+    abort();
+  }
+  
+  /* Get pointer to layer register */
+  plr = findLayer(layer_i);
+  
+  /* Render each dynamic over the frames up to the next dynamic */
+  for(i = 0; i < plr->dcount; i++) {
+    
+    /* Get the time range of the dynamic */
+    t0 = (int64_t) ((plr->pDyn)[i]).t;
+    if (i < plr->dcount - 1) {
+      t1 = (int64_t) ((plr->pDyn)[i + 1]).t;
+    } else {
+      t1 = ((int64_t) frames) * ((int64_t) hop);
+    }
+    
+    /* Get the range of frames from the first at or after t0 up to but
+     * excluding the first at or after t1 */
+    k0 = (t0 + hop - 1) / hop;
+    k1 = (t1 + hop - 1) / hop;
+    if (k1 > frames) {
+      k1 = frames;
+    }
+    if (k0 >= k1) {
+      continue;
+    }
+    
+    /* Render the dynamic */
+    if (!dynLevels(plr, i, &start, &end)) {
+      for(k = (int32_t) k0; k < (int32_t) k1; k++) {
+        pv[k] = (uint16_t) start;
+      }
+      
+    } else {
+      step = ((double) (end - start)) / ((double) (t1 - t0));
+      base = ((double) start) + step * ((double) (k0 * hop - t0)) + 0.5;
+      step = step * ((double) hop);
+      for(k = 0; k < (int32_t) (k1 - k0); k++) {
+        pv[k0 + k] = (uint16_t) (base + step * ((double) k));
+      }
+    }
+  }
+}
+
+/*
+ * Write the intensity curves of all layers to a binary envelope file.
+ * 
+ * All layers must have been built successfully, with none dangling.
+ * The file format is described in the program documentation.  Errors
+ * are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the envelope file
+ * 
+ *   hop - the number of samples between values
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int writeEnvelope(
+    const char    * pPath,
+          int32_t   hop,
+    const char    * pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t k = 0;
+  int32_t layer_i = 0;
+  int32_t layers = 0;
+  int32_t t_end = 0;
+  int64_t frames = 0;
+  FILE *pf = NULL;
+  uint16_t *pv = NULL;
+  unsigned char *pb = NULL;
+  unsigned char hdr[12];
+  
+  /* Initialize structures */
+  memset(hdr, 0, sizeof(hdr));
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (hop < 1) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Count the layers and find the time of the last dynamic */
+  for(i = 0; i < layerCount(); i++) {
+    layer_i = layerAt(i);
+    if (!layerIsEmpty(layer_i)) {
+      layers++;
+      if (layerLastTime(layer_i) > t_end) {
+        t_end = layerLastTime(layer_i);
+      }
+    }
+  }
+  
+  /* The envelope runs from time zero through the last dynamic */
+  frames = (((int64_t) t_end) / hop) + 1;
+  if (frames > ENV_MAXFRAMES) {
+    status = 0;
+    fprintf(stderr, "%s: Envelope is too long!\n", pModule);
+  }
+  
+  /* Allocate buffers */
+  if (status) {
+    pv = (uint16_t *) calloc((size_t) frames, sizeof(uint16_t));
+    pb = (unsigned char *) calloc((size_t) frames, 2);
+    if ((pv == NULL) || (pb == NULL)) {
+      abort();
+    }
+  }
+  
+  /* Open the file and write the header */
+  if (status) {
+    pf = fopen(pPath, "wb");
+    if (pf == NULL) {
+      status = 0;
+      fprintf(stderr, "%s: Can't open envelope file!\n", pModule);
+    }
+  }
+  if (status) {
+    putUint32(&(hdr[0]), (uint32_t) layers);
+    putUint32(&(hdr[4]), (uint32_t) frames);
+    putUint32(&(hdr[8]), (uint32_t) hop);
+    if (fwrite(hdr, 1, 12, pf) != 12) {
+      status = 0;
+    }
+  }
+  
+  /* Render and write each layer */
+  if (status) {
+    for(i = 0; i < layerCount(); i++) {
+      layer_i = layerAt(i);
+      if (layerIsEmpty(layer_i)) {
+        continue;
+      }
+      
+      renderLayer(layer_i, pv, (int32_t) frames, hop);
+      for(k = 0; k < (int32_t) frames; k++) {
+        pb[2 * k] = (unsigned char) (pv[k] >> 8);
+        pb[2 * k + 1] = (unsigned char) (pv[k] & 0xff);
+      }
+      
+      putUint32(&(hdr[0]), (uint32_t) (layer_i + 1));
+      if (fwrite(hdr, 1, 4, pf) != 4) {
+        status = 0;
+      } else if (fwrite(pb, 2, (size_t) frames, pf) != (size_t) frames) {
+        status = 0;
+      }
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Close the file */
+  if (pf != NULL) {
+    if (fclose(pf)) {
+      status = 0;
+    }
+    pf = NULL;
+    if (!status) {
+      fprintf(stderr, "%s: Can't write envelope file!\n", pModule);
+    }
+  }
+  
+  /* Free buffers */
+  free(pv);
+  pv = NULL;
+  free(pb);
+  pb = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Build the breakpoint index from the layer registry.
+ * 
+ * All layers must have been built successfully, with none dangling.
+ * The level table must be initialized.  Each non-empty layer gets an
+ * entry in m_index, in ascending order of layer index, holding the
+ * breakpoints from layerBreakpoints(), simplified if m_simplify is
+ * set.  Any existing index is freed first.
+ */
+static void buildIndex(void) {
+  
+  int32_t i = 0;
+  int32_t layer_i = 0;
+  const LAYERREG *plr = NULL;
+  INDEXLAYER *pil = NULL;
+  
+  /* Free any existing index */
+  free_index();
+  
+  /* Allocate an entry for each layer */
+  m_index = (INDEXLAYER *) calloc(
+              (size_t) (layerCount() + 1), sizeof(INDEXLAYER));
+  if (m_index == NULL) {
+    abort();
+  }
+  
+  /* Fill in the non-empty layers */
+  for(i = 0; i < layerCount(); i++) {
+    layer_i = layerAt(i);
+    if (layerIsEmpty(layer_i)) {
+      continue;
+    }
+    if (layerDangling(layer_i)) {
+      abort();
+    }
+    plr = findLayer(layer_i);
+    
+    pil = &(m_index[m_index_count]);
+    pil->layer_i = layer_i;
+    pil->pb = (BREAKPT *) calloc((size_t) plr->dcount, sizeof(BREAKPT));
+    if (pil->pb == NULL) {
+      abort();
+    }
+    pil->count = layerBreakpoints(layer_i, pil->pb, m_simplify);
+    
+    m_index_count++;
+  }
+}
+
+/*
+ * Free the breakpoint index.
+ */
+static void free_index(void) {
+  
+  int32_t i = 0;
+  
+  if (m_index != NULL) {
+    for(i = 0; i < m_index_count; i++) {
+      free((m_index[i]).pb);
+      (m_index[i]).pb = NULL;
+    }
+    free(m_index);
+    m_index = NULL;
+  }
+  m_index_count = 0;
+}
+
+/*
+ * Find the breakpoint in effect at a given time.
+ * 
+ * The breakpoint in effect is the last one at or before t.  Since the
+ * first breakpoint of every layer is at time zero, there is always one
+ * for t zero or greater.  The search is a binary search.
+ * 
+ * Parameters:
+ * 
+ *   pil - the index layer
+ * 
+ *   t - the time, zero or greater
+ * 
+ * Return:
+ * 
+ *   the index of the breakpoint in effect
+ */
+static int32_t indexFind(const INDEXLAYER *pil, int32_t t) {
+  
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  
+  /* Check parameters */
+  if ((pil == NULL) || (t < 0)) {
+    abort();
+  }
+  if (pil->count < 1) {
+    abort();
+  }
+  
+  /* Find the last breakpoint with time at or before t, keeping the
+   * invariant that the breakpoint at lo is at or before t and every
+   * breakpoint at or after hi is after t */
+  lo = 0;
+  hi = pil->count;
+  while (hi - lo > 1) {
+    mid = lo + ((hi - lo) / 2);
+    if (((pil->pb)[mid]).t <= t) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  
+  return lo;
+}
+
+/*
+ * Compute the intensity of a layer at a time, given the breakpoint in
+ * effect.
+ * 
+ * Ramps are interpolated linearly between their start level at their
+ * own time and their end level at the time of the next breakpoint, and
+ * rounded to the nearest integer.
+ * 
+ * Parameters:
+ * 
+ *   pil - the index layer
+ * 
+ *   j - the index of the breakpoint in effect at t
+ * 
+ *   t - the time
+ * 
+ * Return:
+ * 
+ *   the intensity in range [0, 1024]
+ */
+static int32_t indexLevel(const INDEXLAYER *pil, int32_t j, int32_t t) {
+  
+  const BREAKPT *pb = NULL;
+  double f = 0.0;
+  
+  /* Check parameters */
+  if (pil == NULL) {
+    abort();
+  }
+  if ((j < 0) || (j >= pil->count)) {
+    abort();
+  }
+  
+  pb = &((pil->pb)[j]);
+  if ((pb->start == pb->end) || (j >= pil->count - 1)) {
+    return (int32_t) pb->start;
+  }
+  
+  f = ((double) (pb->end - pb->start)) *
+        ((double) (((int64_t) t) - pb->t)) /
+        ((double) (((int64_t) (pb + 1)->t) - pb->t));
+  return (int32_t) floor(((double) pb->start) + f + 0.5);
+}
+
+/*
+ * Evaluate the intensity of a layer at a time.
+ * 
+ * Parameters:
+ * 
+ *   pil - the index layer
+ * 
+ *   t - the time, zero or greater
+ * 
+ * Return:
+ * 
+ *   the intensity in range [0, 1024]
+ */
+static int32_t indexEval(const INDEXLAYER *pil, int32_t t) {
+  return indexLevel(pil, indexFind(pil, t), t);
+}
+
+/*
+ * Evaluate the intensity of a layer at many times.
+ * 
+ * pt is an array of count times, each zero or greater, and pr receives
+ * count intensities.  While the times are in ascending order, the
+ * breakpoint in effect is found by stepping forward from the previous
+ * one, so a sorted batch costs time in proportion to the number of
+ * times plus the number of breakpoints passed.  Whenever a time goes
+ * backwards, or the step would pass more than a few breakpoints, a
+ * binary search is used instead.
+ * 
+ * Parameters:
+ * 
+ *   pil - the index layer
+ * 
+ *   pt - the times
+ * 
+ *   pr - the array to receive the intensities
+ * 
+ *   count - the number of times
+ */
+static void indexEvalBatch(
+    const INDEXLAYER * pil,
+    const int32_t    * pt,
+          int32_t    * pr,
+          int32_t      count) {
+  
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t step = 0;
+  int32_t t_prev = 0;
+  
+  /* Check parameters */
+  if ((pil == NULL) || (pt == NULL) || (pr == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  for(i = 0; i < count; i++) {
+    if (pt[i] < 0) {
+      abort();
+    }
+    
+    /* Step forward while the times ascend, up to a limit */
+    if ((i > 0) && (pt[i] >= t_prev)) {
+      for(step = 0; step < INDEX_MAXSTEP; step++) {
+        if (j >= pil->count - 1) {
+          break;
+        }
+        if (((pil->pb)[j + 1]).t > pt[i]) {
+          break;
+        }
+        j++;
+      }
+      if (step >= INDEX_MAXSTEP) {
+        j = indexFind(pil, pt[i]);
+      }
+      
+    } else {
+      j = indexFind(pil, pt[i]);
+    }
+    
+    pr[i] = indexLevel(pil, j, pt[i]);
+    t_prev = pt[i];
+  }
+}
+
+/*
+ * Write the breakpoint index to a file.
+ * 
+ * The file format is described in the program documentation.  Errors
+ * are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the index file
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int saveIndex(const char *pPath, const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t j = 0;
+  FILE *pf = NULL;
+  const INDEXLAYER *pil = NULL;
+  unsigned char buf[12];
+  
+  /* Initialize structures */
+  memset(buf, 0, sizeof(buf));
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  pf = fopen(pPath, "wb");
+  if (pf == NULL) {
+    status = 0;
+    fprintf(stderr, "%s: Can't open index file!\n", pModule);
+  }
+  
+  /* Write the header */
+  if (status) {
+    putUint32(&(buf[0]), INDEX_SIGNATURE);
+    putUint32(&(buf[4]), (uint32_t) m_index_count);
+    if (fwrite(buf, 1, 8, pf) != 8) {
+      status = 0;
+    }
+  }
+  
+  /* Write each layer */
+  for(i = 0; status && (i < m_index_count); i++) {
+    pil = &(m_index[i]);
+    putUint32(&(buf[0]), (uint32_t) (pil->layer_i + 1));
+    putUint32(&(buf[4]), (uint32_t) pil->count);
+    if (fwrite(buf, 1, 8, pf) != 8) {
+      status = 0;
+    }
+    for(j = 0; status && (j < pil->count); j++) {
+      putUint32(&(buf[0]), (uint32_t) ((pil->pb)[j]).t);
+      putUint32(&(buf[4]),
+          (((uint32_t) ((pil->pb)[j]).start) << 16) |
+          ((uint32_t) ((pil->pb)[j]).end));
+      if (fwrite(buf, 1, 8, pf) != 8) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Close the file */
+  if (pf != NULL) {
+    if (fclose(pf)) {
+      status = 0;
+    }
+    pf = NULL;
+    if (!status) {
+      fprintf(stderr, "%s: Can't write index file!\n", pModule);
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Read a 32-bit unsigned big-endian integer from a file.
+ * 
+ * Parameters:
+ * 
+ *   pf - the file
+ * 
+ *   pv - pointer to variable to receive the integer
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the integer could not be read
+ */
+static int readUint32(FILE *pf, uint32_t *pv) {
+  
+  unsigned char buf[4];
+  
+  /* Check parameters */
+  if ((pf == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  if (fread(buf, 1, 4, pf) != 4) {
+    return 0;
+  }
+  *pv = (((uint32_t) buf[0]) << 24) | (((uint32_t) buf[1]) << 16) |
+        (((uint32_t) buf[2]) << 8) | ((uint32_t) buf[3]);
+  return 1;
+}
+
+/*
+ * Load the breakpoint index from a file written by saveIndex().
+ * 
+ * The index is checked as it is read: layer numbers must ascend and be
+ * in range, each layer must have at least one breakpoint, the first at
+ * time zero, times must strictly ascend, levels must be in range
+ * [0, 1024], and the last breakpoint of each layer must be constant.
+ * Errors are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pPath - the path of the index file
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int loadIndex(const char *pPath, const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t layers = 0;
+  int opened = 0;
+  uint32_t v = 0;
+  uint32_t w = 0;
+  FILE *pf = NULL;
+  INDEXLAYER *pil = NULL;
+  BREAKPT *pb = NULL;
+  
+  /* Check parameters */
+  if ((pPath == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Free any existing index */
+  free_index();
+  
+  /* Open the file */
+  pf = fopen(pPath, "rb");
+  if (pf == NULL) {
+    status = 0;
+    fprintf(stderr, "%s: Can't open index file!\n", pModule);
+  } else {
+    opened = 1;
+  }
+  
+  /* Read the header */
+  if (status) {
+    if (!readUint32(pf, &v)) {
+      status = 0;
+    } else if (v != INDEX_SIGNATURE) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (!readUint32(pf, &v)) {
+      status = 0;
+    } else if (v > LAYER_MAX + 1) {
+      status = 0;
+    } else {
+      layers = (int32_t) v;
+    }
+  }
+  if (status) {
+    m_index = (INDEXLAYER *) calloc(
+                (size_t) (layers + 1), sizeof(INDEXLAYER));
+    if (m_index == NULL) {
+      abort();
+    }
+  }
+  
+  /* Read each layer */
+  for(i = 0; status && (i < layers); i++) {
+    pil = &(m_index[i]);
+    
+    /* Read the layer number and breakpoint count */
+    if ((!readUint32(pf, &v)) || (!readUint32(pf, &w))) {
+      status = 0;
+    } else if ((v < 1) || (v > LAYER_MAX + 1) ||
+                (w < 1) || (w > LAYER_MAXCAP)) {
+      status = 0;
+    } else if (i > 0) {
+      if (((int32_t) v) - 1 <= (m_index[i - 1]).layer_i) {
+        status = 0;
+      }
+    }
+    if (status) {
+      pil->layer_i = ((int32_t) v) - 1;
+      pil->count = (int32_t) w;
+      pil->pb = (BREAKPT *) calloc((size_t) w, sizeof(BREAKPT));
+      if (pil->pb == NULL) {
+        abort();
+      }
+      m_index_count++;
+    }
+    
+    /* Read and check the breakpoints */
+    for(j = 0; status && (j < pil->count); j++) {
+      pb = &((pil->pb)[j]);
+      if ((!readUint32(pf, &v)) || (!readUint32(pf, &w))) {
+        status = 0;
+      } else if (v > INT32_MAX) {
+        status = 0;
+      } else if ((j == 0) && (v != 0)) {
+        status = 0;
+      } else if ((j > 0) && (((int32_t) v) <= (pb - 1)->t)) {
+        status = 0;
+      } else if (((w >> 16) > 1024) || ((w & 0xffff) > 1024)) {
+        status = 0;
+      }
+      if (status) {
+        pb->t = (int32_t) v;
+        pb->start = (uint16_t) (w >> 16);
+        pb->end = (uint16_t) (w & 0xffff);
+        if (pb->start != pb->end) {
+          pb->ramp = 1;
+        } else {
+          pb->ramp = 0;
+        }
+      }
+    }
+    if (status) {
+      pb = &((pil->pb)[pil->count - 1]);
+      if (pb->start != pb->end) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Make sure there is nothing after the last layer */
+  if (status) {
+    if (fgetc(pf) != EOF) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file */
+  if (pf != NULL) {
+    fclose(pf);
+    pf = NULL;
+  }
+  
+  /* Report errors in the file */
+  if ((!status) && opened) {
+    fprintf(stderr, "%s: Invalid index file!\n", pModule);
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Write the intensities of all indexed layers at the query times.
+ * 
+ * One line is written for each layer in the index, in ascending order
+ * of layer index.  Each line has the one-based layer number, followed
+ * by the intensity at each time in m_at, in the order given.
+ * 
+ * Parameters:
+ * 
+ *   pf - the output file
+ */
+static void writeQuery(FILE *pf) {
+  
+  int32_t i = 0;
+  int32_t k = 0;
+  int32_t *pr = NULL;
+  
+  /* Check parameter and state */
+  if ((pf == NULL) || (m_at == NULL) || (m_at_count < 1)) {
+    abort();
+  }
+  
+  /* Allocate the results */
+  pr = (int32_t *) calloc((size_t) m_at_count, sizeof(int32_t));
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Evaluate and write each layer */
+  for(i = 0; i < m_index_count; i++) {
+    if (m_at_count > 1) {
+      indexEvalBatch(&(m_index[i]), m_at, pr, m_at_count);
+    } else {
+      pr[0] = indexEval(&(m_index[i]), m_at[0]);
+    }
+    
+    fprintf(pf, "%ld", (long) ((m_index[i]).layer_i + 1));
+    for(k = 0; k < m_at_count; k++) {
+      fprintf(pf, " %ld", (long) pr[k]);
+    }
+    fprintf(pf, "\n");
+  }
+  
+  /* Free the results */
+  free(pr);
+  pr = NULL;
+}
+
+/*
+ * Parse a comma-separated list of query times into m_at.
+ * 
+ * Each time must be an integer zero or greater.  m_at must not have
+ * been set yet.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the list is invalid
+ */
+static int parseTimes(const char *pstr) {
+  
+  int status = 1;
+  size_t len = 0;
+  int32_t count = 0;
+  char *pCopy = NULL;
+  char *pItem = NULL;
+  char *pNext = NULL;
+  
+  /* Check parameter and state */
+  if (pstr == NULL) {
+    abort();
+  }
+  if (m_at != NULL) {
+    abort();
+  }
+  
+  /* Make a copy that can be split, and count the times */
+  len = strlen(pstr);
+  pCopy = (char *) malloc(len + 1);
+  if (pCopy == NULL) {
+    abort();
+  }
+  memcpy(pCopy, pstr, len + 1);
+  
+  count = 1;
+  for(pItem = pCopy; *pItem != 0; pItem++) {
+    if (*pItem == ',') {
+      if (count >= INT32_MAX / 2) {
+        abort();
       }
-      
-      /* Write command */
-      fprintf(pf, "  %ld %d %d lr", (long) (pdr->t), start, end);
+      count++;
+    }
+  }
+  
+  m_at = (int32_t *) calloc((size_t) count, sizeof(int32_t));
+  if (m_at == NULL) {
+    abort();
+  }
+  
+  /* Parse each time */
+  pItem = pCopy;
+  while (status && (pItem != NULL)) {
+    pNext = strchr(pItem, ',');
+    if (pNext != NULL) {
+      *pNext = 0;
+      pNext++;
+    }
     
+    if (!parseInt(pItem, &(m_at[m_at_count]))) {
+      status = 0;
+    } else if (m_at[m_at_count] < 0) {
+      status = 0;
     } else {
-      /* Ramp fully specified -- get levels */
-      start = m_level[pdr->a];
-      end = m_level[pdr->b];
-      
-      /* Write command */
-      fprintf(pf, "  %ld %d %d lr", (long) (pdr->t), start, end);
+      m_at_count++;
     }
+    
+    pItem = pNext;
   }
   
-  /* Write the closing line */
-  fprintf(pf, "\n] 1024 %ld layer\n", (long) (layer_i + 1));
+  /* Free the copy */
+  free(pCopy);
+  pCopy = NULL;
+  
+  /* Return status */
+  return status;
 }
 
 /*
@@ -1103,12 +5018,13 @@ int main(int argc, char *argv[]) {
   NMF_DATA *pd = NULL;
   int basis = 0;
   int32_t i = 0;
-  int32_t notes = 0;
-  int32_t lvl = 0;
-  NMF_NOTE n;
-  
-  /* Initialize structures */
-  memset(&n, 0, sizeof(NMF_NOTE));
+  int32_t j = 0;
+  int err = ERR_OK;
+  int retval = 0;
+  int32_t err_i = -1;
+  int32_t x = 0;
+  int64_t simp_total = 0;
+  int64_t simp_kept = 0;
   
   /* Get module name */
   if (argc > 0) {
@@ -1122,58 +5038,223 @@ int main(int argc, char *argv[]) {
     pModule = "nmfgraph";
   }
   
-  /* We can have at most one additional argument */
-  if ((argc > 1) && (argc != 2)) {
-    status = 0;
-    fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
-  }
-  
-  /* Check if we got the optional argument */
-  if (status && (argc > 1)) {
-    
-    /* Make sure argument is present */
+  /* Make sure arguments are present */
+  if (argc > 1) {
     if (argv == NULL) {
       abort();
     }
-    if (argv[0] == NULL) {
-      abort();
+    for(x = 0; x < argc; x++) {
+      if (argv[x] == NULL) {
+        abort();
+      }
     }
-    if (argv[1] == NULL) {
-      abort();
+  }
+  
+  /* Check if we got the optional gamma argument, which is the first
+   * argument if it is not an option */
+  x = 1;
+  if (argc > 1) {
+    if (strncmp(argv[1], "--", 2) != 0) {
+      x = 2;
+      
+      /* Parse the gamma integer value */
+      if (!parseInt(argv[1], &g_i)) {
+        status = 0;
+        fprintf(stderr, "%s: Can't parse argument as integer!\n",
+          pModule);
+      }
+      
+      /* Range-check gamma value */
+      if (status && (g_i < 1)) {
+        status = 0;
+        fprintf(stderr, "%s: Gamma value out of range!\n", pModule);
+      }
+      
+      /* Compute gamma value */
+      if (status && (g_i == 1000)) {
+        g = 1.0;
+        
+      } else if (status) {
+        g = ((double) g_i) / 1000.0;
+        if (!isfinite(g)) {
+          abort();  /* shouldn't happen */
+        }
+      }
     }
-    
-    /* Parse the gamma integer value */
-    if (!parseInt(argv[1], &g_i)) {
+  }
+  
+  /* Parse any options */
+  if (status) {
+    for( ; x < argc; x++) {
+      if (strncmp(argv[x], "--threads=", strlen("--threads=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--threads="), &m_threads)) {
+          status = 0;
+        } else if ((m_threads < 1) || (m_threads > MAX_THREADS)) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid thread count!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--envelope=",
+                    strlen("--envelope=")) == 0) {
+        m_env_path = argv[x] + strlen("--envelope=");
+        if (*m_env_path == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid envelope path!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--hop=", strlen("--hop=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--hop="), &m_env_hop)) {
+          status = 0;
+        } else if (m_env_hop < 1) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid hop size!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--index=", strlen("--index=")) == 0) {
+        m_index_path = argv[x] + strlen("--index=");
+        if (*m_index_path == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid index path!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--load=", strlen("--load=")) == 0) {
+        m_load_path = argv[x] + strlen("--load=");
+        if (*m_load_path == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid index path!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--at=", strlen("--at=")) == 0) {
+        if (m_at != NULL) {
+          status = 0;
+        } else if (!parseTimes(argv[x] + strlen("--at="))) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid query times!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--input=", strlen("--input=")) == 0) {
+        if (!parseInput(argv[x] + strlen("--input="))) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid input file %s!\n",
+                  pModule, argv[x]);
+        }
+        
+      } else if (strncmp(argv[x], "--cache=", strlen("--cache=")) == 0) {
+        m_cache_path = argv[x] + strlen("--cache=");
+        if (*m_cache_path == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid cache path!\n", pModule);
+        }
+        
+      } else if (strcmp(argv[x], "--simplify") == 0) {
+        m_simplify = 1;
+        
+      } else if (strcmp(argv[x], "--stream") == 0) {
+        m_stream = 1;
+        
+      } else if (strncmp(argv[x], "--", 2) == 0) {
+        status = 0;
+        fprintf(stderr, "%s: Unrecognized option %s!\n",
+                pModule, argv[x]);
+        
+      } else {
+        status = 0;
+        fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
+      }
+      
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* The hop size only applies to an envelope */
+  if (status && (m_env_hop > 0) && (m_env_path == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: --hop requires --envelope!\n", pModule);
+  }
+  if (status && (m_env_hop < 1)) {
+    m_env_hop = ENV_DEFHOP;
+  }
+  
+  /* The layer cache only applies when the layer text is written */
+  if (status && (m_cache_path != NULL) &&
+      ((m_at != NULL) || (m_load_path != NULL))) {
+    status = 0;
+    fprintf(stderr, "%s: --cache can't be used with --at or --load!\n",
+            pModule);
+  }
+  
+  /* Streaming writes the layer text one layer at a time, so it can't be
+   * combined with anything that needs all layers at once */
+  if (status && m_stream) {
+    if ((m_threads > 1) || (m_input_count > 0) || (m_load_path != NULL) ||
+        (m_env_path != NULL) || (m_index_path != NULL) || (m_at != NULL) ||
+        (m_cache_path != NULL)) {
       status = 0;
-      fprintf(stderr, "%s: Can't parse argument as integer!\n",
-        pModule);
+      fprintf(stderr, "%s: --stream can't be used with that option!\n",
+              pModule);
     }
-    
-    /* Range-check gamma value */
-    if (status && (g_i < 1)) {
+  }
+  
+  /* A loaded index can only be queried or written again */
+  if (status && (m_load_path != NULL)) {
+    if (m_env_path != NULL) {
       status = 0;
-      fprintf(stderr, "%s: Gamma value out of range!\n", pModule);
+      fprintf(stderr, "%s: --load can't be used with --envelope!\n",
+              pModule);
+    } else if (m_simplify) {
+      status = 0;
+      fprintf(stderr, "%s: --load can't be used with --simplify!\n",
+              pModule);
+    } else if (m_input_count > 0) {
+      status = 0;
+      fprintf(stderr, "%s: --load can't be used with --input!\n",
+              pModule);
+    } else if ((m_at == NULL) && (m_index_path == NULL)) {
+      status = 0;
+      fprintf(stderr, "%s: --load requires --at or --index!\n", pModule);
     }
-    
-    /* Compute gamma value */
-    if (status && (g_i == 1000)) {
-      g = 1.0;
-      
-    } else if (status) {
-      g = ((double) g_i) / 1000.0;
-      if (!isfinite(g)) {
-        abort();  /* shouldn't happen */
-      }
+  }
+  
+  /* If an index is loaded, read it instead of building the layers */
+  if (status && (m_load_path != NULL)) {
+    if (!loadIndex(m_load_path, pModule)) {
+      status = 0;
     }
   }
   
   /* Initialize level table */
-  if (status) {
+  if (status && (m_load_path == NULL)) {
     init_level(g);
   }
   
-  /* Parse input */
-  if (status) {
+  /* Load the layer cache if requested */
+  if (status && (m_cache_path != NULL)) {
+    loadCache(m_cache_path, pModule);
+  }
+  
+  /* If input files were given, parse them and merge their notes */
+  if (status && (m_load_path == NULL) && (m_input_count > 0)) {
+    if (!loadInputs(pModule)) {
+      status = 0;
+    }
+    if (status) {
+      if (!mergeInputs()) {
+        status = 0;
+        fprintf(stderr, "%s: Maximum layer index exceeded!\n", pModule);
+      }
+    }
+  }
+  
+  /* Otherwise, parse input */
+  if (status && (m_load_path == NULL) && (m_input_count < 1)) {
     pd = nmf_parse(stdin);
     if (pd == NULL) {
       status = 0;
@@ -1182,7 +5263,7 @@ int main(int argc, char *argv[]) {
   }
   
   /* Make sure basis is correct */
-  if (status) {
+  if (status && (m_load_path == NULL) && (m_input_count < 1)) {
     basis = nmf_basis(pd);
     if ((basis != NMF_BASIS_44100) && (basis != NMF_BASIS_48000)) {
       status = 0;
@@ -1190,152 +5271,166 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Sort all the events */
-  if (status) {
-    nmf_sort(pd);
+  /* In streaming mode, build and write each layer as its group of notes
+   * ends */
+  if (status && m_stream) {
+    if (!streamLayers(pd, &simp_total, &simp_kept, pModule)) {
+      status = 0;
+    }
   }
   
-  /* Process all the notes */
-  if (status) {
-    notes = nmf_notes(pd);
-    for(i = 0; i < notes; i++) {
-      
-      /* Get the current note */
-      nmf_get(pd, i, &n);
-      
-      /* Determine level from pitch */
-      lvl = pitchToLevel(n.pitch);
-      if (lvl < 0) {
-        status = 0;
-        fprintf(stderr, "%s: Invalid pitch encountered!\n", pModule);
-      }
-      
-      /* Check layer index */
-      if (status) {
-        if (n.layer_i > LAYER_MAX) {
-          status = 0;
-          fprintf(stderr, "%s: Maximum layer index exceeded!\n",
-                  pModule);
-        }
-      }
-      
-      /* If note is a grace note, make sure articulation indicates a
-       * ramp, and also that grace note offset is -1 */
-      if (status && (n.dur < 0)) {
-        if (n.art != ARTKEY_RAMP) {
-          status = 0;
-          fprintf(stderr, "%s: Grace note must be part of ramp!\n",
-                  pModule);
-        }
-        if (status && (n.dur != -1)) {
-          status = 0;
-          fprintf(stderr, "%s: Only grace note offset -1 is allowed!\n",
-                  pModule);
-        }
-      }
-      
-      /* If this is first note, make sure it has t=0; otherwise, make
-       * sure t value of this note is greater than last time value */
-      if (status) {
-        if (layerIsEmpty(n.layer_i)) {
-          if (n.t != 0) {
-            status = 0;
-            fprintf(stderr, "%s: Missing t=0 dynamic!\n", pModule);
-          }
-        } else {
-          if (n.t <= layerLastTime(n.layer_i)) {
-            status = 0;
-            fprintf(stderr, "%s: Simultaneous dynamics!\n", pModule);
-          }
-        }
-      }
-      
-      /* Determine what to do based on articulation and duration */
-      if (status && (n.art == ARTKEY_CONSTANT)) {
-        /* Constant dynamic -- make sure no grace note is buffered */
-        if (status) {
-          if (layerHasGrace(n.layer_i)) {
-            status = 0;
-            fprintf(stderr, "%s: Grace note before constant dynamic!\n",
-                    pModule);
-          }
-        }
+  /* Get the notes */
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_input_count < 1)) {
+    copyNotes(pd);
+    nmf_free(pd);
+    pd = NULL;
+  }
+  
+  /* Partition the notes by layer, with each layer in chronological
+   * order */
+  if (status && (m_load_path == NULL) && (!m_stream)) {
+    partitionNotes();
+  }
+  
+  /* Build and write the layers on multiple threads if requested */
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_threads > 1)) {
+    if (!buildThreaded(pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Otherwise, route the notes of each layer to its graph builder; when
+   * there are errors, report the one that comes first in processing
+   * order, which is the one a single chronological pass over all layers
+   * would find */
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_threads <= 1)) {
+    for(i = 0; i < m_bucket_count; i++) {
+      for(j = m_bucket[i]; j < m_bucket[i + 1]; j++) {
         
-        /* Report constant dynamic */
-        if (status) {
-          if (!layerDynC(n.layer_i, n.t, lvl)) {
-            status = 0;
-            fprintf(stderr, "%s: Layer is too long!\n");
+        /* Later notes can't give an earlier error */
+        if (err_i >= 0) {
+          if (noteCompare(m_part[j], err_i) > 0) {
+            break;
           }
         }
-      
-      } else if (status && (n.dur < 0)) {
-        /* Grace note -- verify no grace note buffered */
-        if (layerHasGrace(n.layer_i)) {
-          status = 0;
-          fprintf(stderr, "%s: Multiple grace notes!\n", pModule);
-        }
-          
-        /* Buffer grace note */
-        if (status) {
-          layerGrace(n.layer_i, n.t, lvl);
-        }
         
-      } else if (status && (n.art == ARTKEY_RAMP)) {
-        /* Ramp dynamic -- if a grace note is buffered, make sure its t
-         * value matches that of this note */
-        if (layerHasGrace(n.layer_i)) {
-          if (layerGraceTime(n.layer_i) != n.t) {
-            status = 0;
-            fprintf(stderr, "%s: Grace note missing beat!\n",
-                    pModule);
-          }
+        /* Route the note and stop this layer on error */
+        retval = routeNote(&(m_note[m_part[j]]));
+        if (retval != ERR_OK) {
+          err = retval;
+          err_i = m_part[j];
+          break;
         }
-          
-        /* Report ramp dynamic */
-        if (status) {
-          if (!layerDynR(n.layer_i, n.t, lvl)) {
-            status = 0;
-            fprintf(stderr, "%s: Layer is too long!\n", pModule);
-          }
-        }
-        
-      } else if (status) {
-        /* Unrecognized articulation key */
-        status = 0;
-        fprintf(stderr, "%s: Unrecognized articulation key!\n",
-                pModule);
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
       }
     }
+    
+    if (err != ERR_OK) {
+      status = 0;
+      fprintf(stderr, "%s: %s!\n", pModule, error_string(err));
+    }
   }
   
   /* Make sure no dangling layers */
-  if (status) {
-    for(i = 0; i <= LAYER_MAX; i++) {
-      if (layerDangling(i)) {
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_threads <= 1)) {
+    for(i = 0; i < layerCount(); i++) {
+      if (layerDangling(layerAt(i))) {
         status = 0;
         fprintf(stderr, "%s: Dangling layer!\n", pModule);
       }
     }
   }
   
-  /* Write non-empty layers to output */
-  if (status) {
-    for(i = 0; i <= LAYER_MAX; i++) {
-      if (!layerIsEmpty(i)) {
-        writeLayer(stdout, i);
+  /* Write non-empty layers to output, in ascending order of layer
+   * index, unless the layers are being queried */
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_threads <= 1) && (m_at == NULL) && (m_cache_path == NULL)) {
+    for(i = 0; i < layerCount(); i++) {
+      if (!layerIsEmpty(layerAt(i))) {
+        writeLayer(stdout, layerAt(i));
+      }
+    }
+  }
+  
+  /* When the layer cache is used, splice the text of each unchanged
+   * layer from the cache and only format the others */
+  if (status && (m_load_path == NULL) && (!m_stream) &&
+      (m_threads <= 1) && (m_at == NULL) && (m_cache_path != NULL)) {
+    allocFresh(layerCount());
+    for(i = 0; i < layerCount(); i++) {
+      if (!layerIsEmpty(layerAt(i))) {
+        cacheLayer(layerAt(i), &(m_fresh[i]));
+        if ((m_fresh[i]).len > 0) {
+          if (fwrite((m_fresh[i]).pText, 1, (m_fresh[i]).len, stdout) !=
+                (m_fresh[i]).len) {
+            abort();
+          }
+        }
+      }
+    }
+  }
+  
+  /* Write the new layer cache */
+  if (status && (m_cache_path != NULL)) {
+    if (!saveCache(m_cache_path, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Write the envelope file if requested */
+  if (status && (m_env_path != NULL)) {
+    if (!writeEnvelope(m_env_path, m_env_hop, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Count the breakpoints removed by simplification, unless they were
+   * counted while streaming */
+  if (status && m_simplify && (!m_stream)) {
+    for(i = 0; i < layerCount(); i++) {
+      if (!layerIsEmpty(layerAt(i))) {
+        countSimplify(layerAt(i), &simp_total, &simp_kept);
       }
     }
   }
   
+  /* Report simplification if requested */
+  if (status && m_simplify) {
+    reportSimplify(pModule, simp_total, simp_kept);
+  }
+  
+  /* Build the breakpoint index if it is needed */
+  if (status && (m_load_path == NULL) &&
+      ((m_index_path != NULL) || (m_at != NULL))) {
+    buildIndex();
+  }
+  
+  /* Write the index file if requested */
+  if (status && (m_index_path != NULL)) {
+    if (!saveIndex(m_index_path, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Write the query results if requested */
+  if (status && (m_at != NULL)) {
+    writeQuery(stdout);
+  }
+  
   /* Free data if allocated */
   nmf_free(pd);
   pd = NULL;
+  free_part();
+  free_table();
+  free_index();
+  free_inputs();
+  free_cache();
+  free(m_at);
+  m_at = NULL;
+  m_at_count = 0;
   
   /* Invert status and return */
   if (status) {
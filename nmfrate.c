@@ -8,7 +8,7 @@
  * Syntax
  * ------
  * 
- *   nmfrate [srate] [tempo] [qbeat]
+ *   nmfrate [srate] [tempo] [qbeat] (options)
  * 
  * [srate] is the fixed rate to use, which must be either 48000 or
  * 44100.
@@ -30,29 +30,1740 @@
  * 
  * Grace note durations are left as-is without modification.
  * 
+ * Options
+ * -------
+ * 
+ * Any number of options may follow the [qbeat] parameter.  The
+ * following options snap the converted output to a grid of fixed-size
+ * sample blocks:
+ * 
+ *   --block=[n]    snap output times to multiples of [n] samples
+ *   --round=[r]    rounding policy, either floor, nearest, or ceil
+ * 
+ * When --block is given, section offsets and note t values are snapped
+ * to the block grid, and so are the ends of notes with durations
+ * greater than zero.  Durations are then recomputed from the snapped
+ * ends, and notes are lengthened if necessary so that they are at
+ * least one block long.  Grace note offsets are left alone.  The
+ * default rounding policy is nearest, with ties rounded up.  The
+ * timing error added by snapping is reported on standard error.
+ * 
+ * The following option changes how times are converted:
+ * 
+ *   --exact        convert with exact integer arithmetic
+ * 
+ * Normally, the duration of each quantum is computed in double
+ * precision and multiplied by each time.  With --exact, the duration is
+ * kept as a reduced ratio of 64-bit integers, and each time is
+ * converted with an integer multiply and divide, so that every result
+ * is exactly the floor of the rational product.  This can differ by one
+ * sample from the default conversion when the product is very close to
+ * a whole number of samples.
+ * 
+ * The following options write additional tempo variants:
+ * 
+ *   --variant=[tempo]:[qbeat]:[path]
+ *                  also convert with [tempo] and [qbeat] to [path]
+ *   --threads=[n]  use up to [n] threads to write the variants
+ * 
+ * --variant may be given any number of times, up to 255.  The input is
+ * parsed once, and each variant is converted from the same parsed notes
+ * with its own quantum duration and written to its own file, in
+ * addition to the conversion with the [tempo] and [qbeat] parameters
+ * that is written to standard output.  The path is everything after
+ * the second colon.  Variants are converted in parallel when --threads
+ * is greater than one.  [n] may be from 1 to 64, with 1 being the
+ * default.  Errors and block snapping statistics are reported in the
+ * order the variants were given, and each variant that converts
+ * successfully is written even if another variant fails.
+ * 
+ * The following options convert an NMF file in place instead of
+ * reading standard input and writing standard output:
+ * 
+ *   --mmap=[path]  memory-map the NMF file at [path] and convert it
+ *   --out=[path]   copy the file to [path] first and convert the copy
+ * 
+ * Only the basis, the section offsets, and the t and dur fields of the
+ * notes change during conversion, so with --mmap the file is mapped
+ * into memory and those fields are rewritten where they are, without
+ * parsing or serializing an NMF object.  With --out, the output file is
+ * created at the same size as the input, the input is copied into it,
+ * and the output is converted, leaving the input unchanged.  The output
+ * file is not changed until the input has been mapped and checked, and
+ * if --out names the same file as --mmap, including through a link, the
+ * file is converted in place.  --out may only be given together with
+ * --mmap.
+ * 
+ * The file is read and written using the fixed NMF binary layout, and
+ * its header is checked before anything is converted.  Every value is
+ * converted once before anything is written, so the file is left
+ * unchanged if there is a computation error.  Other options work the
+ * same way in this mode, except --variant, which can't be used with
+ * --mmap.
+ * 
  * Compilation
  * -----------
  * 
- * Compile with libnmf.
+ * Compile with libnmf.
+ * 
+ * Notes are converted in batches.  If the compiler targets AVX2 (for
+ * example, with -mavx2 or -march=native), the conversion uses an AVX2
+ * kernel that gives the same results as the portable code.
+ * 
+ * Requires a C11 compiler for thread-local storage and POSIX threads,
+ * which may require -lpthread.  The --mmap option uses POSIX file
+ * mapping, so this program requires a POSIX platform.
+ * 
+ * May also need to be compiled with the math library -lm
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "nmf.h"
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * Rounding policies for snapping output times to blocks.
+ */
+#define ROUND_FLOOR   (0)   /* Round down to the block at or before */
+#define ROUND_NEAREST (1)   /* Round to the nearest block, ties up */
+#define ROUND_CEIL    (2)   /* Round up to the block at or after */
+
+/*
+ * The number of notes converted at a time.
+ */
+#define RATE_BATCH (4096)
+
+/*
+ * The binary layout of NMF files.
+ * 
+ * All integers are big-endian.  The file starts with a header of
+ * NMF_HEAD_SIZE bytes holding the primary and secondary signatures
+ * (32-bit), the basis (16-bit, one of the NMF_BASIS_ constants), the
+ * section count (16-bit), and the note count (32-bit).  The section
+ * table follows, with a 32-bit offset for each section, the first of
+ * which is zero.  The note table comes last, with a record of
+ * NMF_NOTE_SIZE bytes for each note holding t (32-bit), dur (32-bit),
+ * pitch, articulation, section, and layer (16-bit each).
+ */
+#define NMF_SIG_PRIMARY   UINT32_C(0x72edf078)
+#define NMF_SIG_SECONDARY UINT32_C(0x4e4f492e)
+
+#define NMF_POS_PRIMARY   (0)
+#define NMF_POS_SECONDARY (4)
+#define NMF_POS_BASIS     (8)
+#define NMF_POS_SCOUNT    (10)
+#define NMF_POS_NCOUNT    (12)
+#define NMF_HEAD_SIZE     (16)
+
+#define NMF_SECT_SIZE (4)
+
+#define NMF_NOTE_T    (0)
+#define NMF_NOTE_DUR  (4)
+#define NMF_NOTE_SIZE (16)
+
+/*
+ * The maximum number of tempo variants, including the variant given by
+ * the [tempo] and [qbeat] parameters.
+ */
+#define MAX_VARIANTS (256)
+
+/*
+ * The maximum number of threads that may be used to write tempo
+ * variants.
+ */
+#define MAX_THREADS (64)
+
+/*
+ * Outcomes of running a tempo variant.
+ */
+#define VAR_OK      (0)   /* Variant written successfully */
+#define VAR_COMPUTE (1)   /* Computation error */
+#define VAR_OPEN    (2)   /* Can't open the output file */
+#define VAR_WRITE   (3)   /* Can't write the output file */
+
+/*
+ * Type declarations
+ * =================
+ */
+
+/*
+ * A tempo variant to convert and write.
+ */
+typedef struct {
+  
+  /*
+   * The tempo in beats per ten minutes and the number of quanta per
+   * beat for this variant.
+   */
+  int32_t tempo;
+  int32_t qbeat;
+  
+  /*
+   * The path of the output file, or NULL to write to standard output.
+   */
+  const char *pPath;
+  
+  /*
+   * The outcome of running the variant, one of the VAR_ constants.
+   */
+  int err;
+  
+  /*
+   * The formatted block snapping report, or NULL if there is none.
+   * 
+   * Allocated with open_memstream() and freed by the caller.
+   */
+  char *pReport;
+  size_t report_len;
+  
+} VARIANT;
+
+/*
+ * The argument of a thread that runs tempo variants.
+ */
+typedef struct {
+  
+  /*
+   * The input NMF object, shared by all threads.
+   */
+  NMF_DATA *pd;
+  
+  /*
+   * The output sampling rate.
+   */
+  int32_t srate;
+  
+  /*
+   * The index of the first variant this thread runs.
+   */
+  int32_t first;
+  
+  /*
+   * The module name for reports.
+   */
+  const char *pModule;
+  
+} VARWORKER;
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * The block size in samples that output times are snapped to, or zero
+ * if output times are not snapped.
+ */
+static int32_t m_block = 0;
+
+/*
+ * The rounding policy used to snap output times to blocks.
+ * 
+ * One of the ROUND_ constants.
+ */
+static int m_round = ROUND_NEAREST;
+
+/*
+ * Block snapping statistics.
+ * 
+ * The counts are the number of note starts and note ends that were
+ * snapped.  The sums and maximums are of the absolute difference in
+ * samples between the snapped and unsnapped times.  The extended count
+ * is the number of notes that were lengthened to one block.
+ * 
+ * These are per thread, so that tempo variants can be converted on
+ * separate threads.
+ */
+static _Thread_local int32_t m_snap_start_count = 0;
+static _Thread_local int32_t m_snap_end_count = 0;
+static _Thread_local int64_t m_snap_start_sum = 0;
+static _Thread_local int64_t m_snap_end_sum = 0;
+static _Thread_local int64_t m_snap_start_max = 0;
+static _Thread_local int64_t m_snap_end_max = 0;
+static _Thread_local int32_t m_snap_extended = 0;
+
+/*
+ * Flag indicating whether the exact integer conversion path is used.
+ */
+static int m_exact = 0;
+
+/*
+ * The duration of each quantum in output samples as a reduced ratio,
+ * for the exact integer conversion path.
+ * 
+ * Only valid if m_exact.  The numerator is 600 * srate and the
+ * denominator is tempo * qbeat, both divided by their greatest common
+ * divisor.
+ */
+static _Thread_local int64_t m_exact_num = 0;
+static _Thread_local int64_t m_exact_den = 0;
+
+/*
+ * The batch of notes being converted, and their t and dur values as
+ * separate arrays so that they can be converted in bulk.
+ */
+static _Thread_local NMF_NOTE m_batch_n[RATE_BATCH];
+static _Thread_local int32_t m_batch_t[RATE_BATCH];
+static _Thread_local int32_t m_batch_d[RATE_BATCH];
+
+/*
+ * The tempo variants to convert.
+ * 
+ * Variant zero is given by the [tempo] and [qbeat] parameters and is
+ * written to standard output.  The rest are given by --variant options.
+ */
+static VARIANT m_var[MAX_VARIANTS];
+static int32_t m_var_count = 0;
+
+/*
+ * The maximum number of threads used to write tempo variants.
+ */
+static int32_t m_threads = 1;
+
+/*
+ * The number of sections and notes in the memory-mapped NMF file.
+ */
+static int32_t m_map_sections = 0;
+static int32_t m_map_notes = 0;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static int snapTime(int32_t t, int is_end, int32_t *pr);
+static int snapNote(NMF_NOTE *pn);
+static void reportSnap(FILE *pf, const char *pModule);
+static void resetSnap(void);
+
+static void setExact(int32_t srate, int32_t tempo, int32_t qbeat);
+static int32_t scaleExact(int32_t v, int32_t lo, int *povf);
+static double setRate(int32_t srate, int32_t tempo, int32_t qbeat);
+
+static int convertScalar(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur);
+#ifdef __AVX2__
+static int convertAVX2(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur);
+#endif
+static int convertBatch(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur);
+static int convertOffset(int32_t v, double qdur, int32_t *pr);
+static int convertData(NMF_DATA *pd, NMF_DATA *pdo, double qdur);
+
+static uint32_t getUint(const unsigned char *p, int width);
+static void putUint(unsigned char *p, uint32_t v, int width);
+static size_t sectPos(int32_t k);
+static size_t notePos(int32_t j, size_t field);
+static int checkHeader(const unsigned char *pm, size_t len);
+static int mapPass(unsigned char *pm, double qdur, int write);
+static int mmapConvert(
+    const char    * pInPath,
+    const char    * pOutPath,
+          int32_t   srate,
+          double    qdur,
+    const char    * pModule);
+
+static void runVariant(
+          NMF_DATA  * pd,
+          int32_t     srate,
+          VARIANT   * pv,
+    const char      * pModule);
+static void *runWorker(void *pArg);
+
+static int parseInt(const char *pstr, int32_t *pv);
+static int parseVariant(const char *pstr, VARIANT *pv);
+
+/*
+ * Snap an output time to the block grid.
+ * 
+ * t is the output time, which must be zero or greater.  It is rounded
+ * to a multiple of m_block according to m_round.  The absolute
+ * difference between the snapped and original times is accumulated in
+ * the note end statistics if is_end is greater than zero, the note
+ * start statistics if is_end is zero, or not at all if is_end is less
+ * than zero.
+ * 
+ * pr points to the variable that receives the snapped time.  The
+ * function fails if the snapped time is out of range.
+ * 
+ * m_block must be greater than zero or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   t - the output time to snap
+ * 
+ *   is_end - which statistics to accumulate (see above)
+ * 
+ *   pr - pointer to variable to receive the snapped time
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if out of range
+ */
+static int snapTime(int32_t t, int is_end, int32_t *pr) {
+  
+  int64_t r = 0;
+  int64_t e = 0;
+  
+  /* Check parameters */
+  if ((t < 0) || (pr == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_block < 1) {
+    abort();
+  }
+  
+  /* Round according to the rounding policy */
+  if (m_round == ROUND_FLOOR) {
+    r = (int64_t) t;
+  } else if (m_round == ROUND_CEIL) {
+    r = ((int64_t) t) + ((int64_t) (m_block - 1));
+  } else if (m_round == ROUND_NEAREST) {
+    r = ((int64_t) t) + ((int64_t) (m_block / 2));
+  } else {
+    abort();  /* shouldn't happen */
+  }
+  r = (r / ((int64_t) m_block)) * ((int64_t) m_block);
+  
+  /* Check range */
+  if (r > INT32_MAX) {
+    return 0;
+  }
+  
+  /* Accumulate error statistics */
+  e = r - ((int64_t) t);
+  if (e < 0) {
+    e = -e;
+  }
+  if (is_end > 0) {
+    m_snap_end_sum += e;
+    if (e > m_snap_end_max) {
+      m_snap_end_max = e;
+    }
+  } else if (is_end == 0) {
+    m_snap_start_sum += e;
+    if (e > m_snap_start_max) {
+      m_snap_start_max = e;
+    }
+  }
+  
+  /* Return snapped time */
+  *pr = (int32_t) r;
+  return 1;
+}
+
+/*
+ * Snap a converted note to the block grid.
+ * 
+ * pn is the converted note.  Its t value is snapped with snapTime().
+ * If its duration is greater than zero, the end of the note is also
+ * snapped, and the duration is adjusted so that the note remains at
+ * least one block long.  Zero and negative durations are left alone.
+ * 
+ * m_block must be greater than zero or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pn - the note to snap
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if out of range
+ */
+static int snapNote(NMF_NOTE *pn) {
+  
+  int status = 1;
+  int32_t t = 0;
+  int32_t y = 0;
+  
+  /* Check parameter */
+  if (pn == NULL) {
+    abort();
+  }
+  
+  /* Snap the start of the note */
+  if (!snapTime(pn->t, 0, &t)) {
+    status = 0;
+  }
+  
+  /* Snap the end of the note if it has a duration */
+  if (status && (pn->dur > 0)) {
+    if (pn->dur <= INT32_MAX - pn->t) {
+      if (!snapTime(pn->t + pn->dur, 1, &y)) {
+        status = 0;
+      }
+    } else {
+      status = 0;
+    }
+    
+    if (status && (y - t < m_block)) {
+      if (t <= INT32_MAX - m_block) {
+        y = t + m_block;
+        m_snap_extended++;
+      } else {
+        status = 0;
+      }
+    }
+    
+    if (status) {
+      pn->dur = y - t;
+      m_snap_end_count++;
+    }
+  }
+  
+  /* Store snapped start */
+  if (status) {
+    pn->t = t;
+    m_snap_start_count++;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Report the timing error statistics of block snapping.
+ * 
+ * Parameters:
+ * 
+ *   pf - the file to report to
+ * 
+ *   pModule - the module name to prefix the report with
+ */
+static void reportSnap(FILE *pf, const char *pModule) {
+  
+  double start_mean = 0.0;
+  double end_mean = 0.0;
+  
+  /* Check parameters */
+  if ((pf == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Compute mean errors */
+  if (m_snap_start_count > 0) {
+    start_mean = ((double) m_snap_start_sum) /
+                    ((double) m_snap_start_count);
+  }
+  if (m_snap_end_count > 0) {
+    end_mean = ((double) m_snap_end_sum) /
+                  ((double) m_snap_end_count);
+  }
+  
+  /* Report */
+  fprintf(pf, "%s: Snapped %ld note starts to %ld-sample blocks, "
+              "error mean %.2f max %ld\n",
+          pModule, (long) m_snap_start_count, (long) m_block,
+          start_mean, (long) m_snap_start_max);
+  fprintf(pf, "%s: Snapped %ld note ends, error mean %.2f max %ld\n",
+          pModule, (long) m_snap_end_count,
+          end_mean, (long) m_snap_end_max);
+  fprintf(pf, "%s: Extended %ld notes to one block\n",
+          pModule, (long) m_snap_extended);
+}
+
+/*
+ * Set up the exact integer conversion path.
+ * 
+ * The ratio of output samples per input quantum is 600 * srate divided
+ * by tempo * qbeat.  It is reduced by the greatest common divisor and
+ * stored in m_exact_num and m_exact_den.  All parameters must be
+ * greater than zero, and srate must be 48000 or 44100.
+ * 
+ * Parameters:
+ * 
+ *   srate - the output sampling rate
+ * 
+ *   tempo - the tempo in beats per ten minutes
+ * 
+ *   qbeat - the number of quanta per beat
+ */
+static void setExact(int32_t srate, int32_t tempo, int32_t qbeat) {
+  
+  int64_t a = 0;
+  int64_t b = 0;
+  int64_t r = 0;
+  
+  /* Check parameters */
+  if (((srate != 48000) && (srate != 44100)) ||
+      (tempo < 1) || (qbeat < 1)) {
+    abort();
+  }
+  
+  /* Compute the ratio */
+  m_exact_num = 600 * ((int64_t) srate);
+  m_exact_den = ((int64_t) tempo) * ((int64_t) qbeat);
+  
+  /* Reduce by the greatest common divisor */
+  a = m_exact_num;
+  b = m_exact_den;
+  while (b != 0) {
+    r = a % b;
+    a = b;
+    b = r;
+  }
+  m_exact_num /= a;
+  m_exact_den /= a;
+}
+
+/*
+ * Convert a value with the exact integer conversion path.
+ * 
+ * v is the value in input quanta.  The result is v scaled by the ratio
+ * set with setExact(), floored, and raised to lo if it is less than lo.
+ * Since the numerator is at most 600 * 48000, the product with any
+ * 32-bit value fits in 64 bits, and the result is exactly the floor of
+ * the rational product for non-negative v.
+ * 
+ * If the result does not fit in 32 bits, the variable pointed to by
+ * povf is set to one and the result is saturated; otherwise, the
+ * variable is left alone, so one check after several conversions is
+ * enough.  The function contains no branches that depend on the value,
+ * apart from what the compiler makes of the clamps.
+ * 
+ * Parameters:
+ * 
+ *   v - the value to convert
+ * 
+ *   lo - the least result
+ * 
+ *   povf - pointer to the overflow flag
+ * 
+ * Return:
+ * 
+ *   the converted value
+ */
+static int32_t scaleExact(int32_t v, int32_t lo, int *povf) {
+  
+  int64_t r = 0;
+  
+  /* Check parameter */
+  if (povf == NULL) {
+    abort();
+  }
+  
+  /* Convert, flag overflow, and clamp */
+  r = (m_exact_num * ((int64_t) v)) / m_exact_den;
+  *povf |= (r > INT32_MAX);
+  r = (r < lo) ? lo : r;
+  r = (r > INT32_MAX) ? INT32_MAX : r;
+  
+  /* Return result */
+  return (int32_t) r;
+}
+
+/*
+ * Convert note times and durations one at a time in double precision.
+ * 
+ * pt and pd point to count note t and dur values, which are converted
+ * in place.  Each t value is multiplied by qdur, truncated, and raised
+ * to zero if negative.  Each dur value that is greater than zero is
+ * multiplied by qdur, truncated, and raised to one if less than one;
+ * other dur values are grace note offsets and are left alone.
+ * 
+ * The function fails if any product is not finite or does not fit in
+ * 32 bits.  The values are undefined in that case.
+ * 
+ * Parameters:
+ * 
+ *   pt - the t values
+ * 
+ *   pd - the dur values
+ * 
+ *   count - the number of values in each array
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int convertScalar(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur) {
+  
+  int status = 1;
+  int32_t x = 0;
+  int32_t newval = 0;
+  double f = 0.0;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pd == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  for(x = 0; x < count; x++) {
+    
+    /* Compute the new offset of the note */
+    f = qdur * ((double) pt[x]);
+    if (!isfinite(f)) {
+      status = 0;
+    }
+    if (status) {
+      if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
+        status = 0;
+      }
+    }
+    if (status) {
+      newval = (int32_t) f;
+      if (newval < 0) {
+        newval = 0;
+      }
+      pt[x] = newval;
+    }
+    
+    /* If duration of note is greater than zero, recompute it */
+    if (status && (pd[x] > 0)) {
+      f = qdur * ((double) pd[x]);
+      if (!isfinite(f)) {
+        status = 0;
+      }
+      if (status) {
+        if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
+          status = 0;
+        }
+      }
+      if (status) {
+        newval = (int32_t) f;
+        if (newval < 1) {
+          newval = 1;
+        }
+        pd[x] = newval;
+      }
+    }
+    
+    /* Leave loop if error */
+    if (!status) {
+      break;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+#ifdef __AVX2__
+/*
+ * Convert note times and durations four at a time with AVX2.
+ * 
+ * The interface and results are the same as convertScalar().  Each
+ * group of four values is widened to double precision, multiplied,
+ * range-checked, truncated back to 32 bits, and clamped, with the dur
+ * values blended so that only those greater than zero are changed.
+ * Values left over at the end are converted with convertScalar().
+ * 
+ * Parameters:
+ * 
+ *   pt - the t values
+ * 
+ *   pd - the dur values
+ * 
+ *   count - the number of values in each array
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int convertAVX2(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur) {
+  
+  int32_t x = 0;
+  int bad = 0;
+  __m256d q;
+  __m256d lo;
+  __m256d hi;
+  __m256d f;
+  __m128i zero;
+  __m128i one;
+  __m128i v;
+  __m128i d;
+  __m128i m;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pd == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  q = _mm256_set1_pd(qdur);
+  lo = _mm256_set1_pd((double) INT32_MIN);
+  hi = _mm256_set1_pd((double) INT32_MAX);
+  zero = _mm_setzero_si128();
+  one = _mm_set1_epi32(1);
+  
+  for(x = 0; x + 4 <= count; x += 4) {
+    
+    /* Convert t values */
+    v = _mm_loadu_si128((const __m128i *) (pt + x));
+    f = _mm256_mul_pd(_mm256_cvtepi32_pd(v), q);
+    bad |= _mm256_movemask_pd(_mm256_or_pd(
+              _mm256_cmp_pd(f, lo, _CMP_NGE_UQ),
+              _mm256_cmp_pd(f, hi, _CMP_NLE_UQ)));
+    v = _mm_max_epi32(_mm256_cvttpd_epi32(f), zero);
+    _mm_storeu_si128((__m128i *) (pt + x), v);
+    
+    /* Convert dur values, only where they are greater than zero */
+    d = _mm_loadu_si128((const __m128i *) (pd + x));
+    m = _mm_cmpgt_epi32(d, zero);
+    f = _mm256_mul_pd(_mm256_cvtepi32_pd(d), q);
+    bad |= _mm256_movemask_pd(_mm256_or_pd(
+              _mm256_cmp_pd(f, lo, _CMP_NGE_UQ),
+              _mm256_cmp_pd(f, hi, _CMP_NLE_UQ))) &
+            _mm_movemask_ps(_mm_castsi128_ps(m));
+    v = _mm_max_epi32(_mm256_cvttpd_epi32(f), one);
+    d = _mm_blendv_epi8(d, v, m);
+    _mm_storeu_si128((__m128i *) (pd + x), d);
+  }
+  
+  /* Fail if any value was out of range */
+  if (bad) {
+    return 0;
+  }
+  
+  /* Convert remaining values */
+  return convertScalar(pt + x, pd + x, count - x, qdur);
+}
+#endif
+
+/*
+ * Convert note times and durations in bulk.
+ * 
+ * The interface and results are the same as convertScalar(), except
+ * that if m_exact is set, the exact integer path of scaleExact() is used
+ * instead of qdur.  Otherwise, the AVX2 kernel is used if the program
+ * was compiled with AVX2 enabled.
+ * 
+ * Parameters:
+ * 
+ *   pt - the t values
+ * 
+ *   pd - the dur values
+ * 
+ *   count - the number of values in each array
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int convertBatch(
+    int32_t * pt,
+    int32_t * pd,
+    int32_t   count,
+    double    qdur) {
+  
+  int32_t x = 0;
+  int ovf = 0;
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pd == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  /* Exact integer path */
+  if (m_exact) {
+    for(x = 0; x < count; x++) {
+      pt[x] = scaleExact(pt[x], 0, &ovf);
+      if (pd[x] > 0) {
+        pd[x] = scaleExact(pd[x], 1, &ovf);
+      }
+    }
+    return (!ovf);
+  }
+  
+  /* Double-precision path */
+#ifdef __AVX2__
+  return convertAVX2(pt, pd, count, qdur);
+#else
+  return convertScalar(pt, pd, count, qdur);
+#endif
+}
+
+/*
+ * Convert a section offset.
+ * 
+ * v is the section offset in input quanta.  It is converted with the
+ * exact integer path if m_exact is set, or else in double precision with
+ * qdur, raised to zero if negative, and snapped to the block grid if
+ * m_block is set.
+ * 
+ * Parameters:
+ * 
+ *   v - the section offset to convert
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ *   pr - pointer to variable to receive the converted offset
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int convertOffset(int32_t v, double qdur, int32_t *pr) {
+  
+  int status = 1;
+  int ovf = 0;
+  int32_t newval = 0;
+  double f = 0.0;
+  
+  /* Check parameter */
+  if (pr == NULL) {
+    abort();
+  }
+  
+  /* Compute new section offset, with the exact integer path if
+   * requested */
+  if (m_exact) {
+    newval = scaleExact(v, 0, &ovf);
+    if (ovf) {
+      status = 0;
+    }
+    
+  } else {
+    f = qdur * ((double) v);
+    if (!isfinite(f)) {
+      status = 0;
+    }
+    if (status) {
+      if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
+        status = 0;
+      }
+    }
+    if (status) {
+      newval = (int32_t) f;
+      if (newval < 0) {
+        newval = 0;
+      }
+    }
+  }
+  
+  /* Snap to the block grid if requested */
+  if (status && (m_block > 0)) {
+    if (!snapTime(newval, -1, &newval)) {
+      status = 0;
+    }
+  }
+  
+  /* Return result */
+  if (status) {
+    *pr = newval;
+  }
+  return status;
+}
+
+/*
+ * Read an unsigned big-endian integer from a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the first byte of the integer
+ * 
+ *   width - the number of bytes, from one to four
+ * 
+ * Return:
+ * 
+ *   the integer value
+ */
+static uint32_t getUint(const unsigned char *p, int width) {
+  
+  uint32_t v = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (width < 1) || (width > 4)) {
+    abort();
+  }
+  
+  for(i = 0; i < width; i++) {
+    v = (v << 8) | ((uint32_t) p[i]);
+  }
+  
+  return v;
+}
+
+/*
+ * Write an unsigned big-endian integer to a byte buffer.
+ * 
+ * Parameters:
+ * 
+ *   p - pointer to the first byte of the integer
+ * 
+ *   v - the value to write, which must fit in width bytes
+ * 
+ *   width - the number of bytes, from one to four
+ */
+static void putUint(unsigned char *p, uint32_t v, int width) {
+  
+  int i = 0;
+  
+  /* Check parameters */
+  if ((p == NULL) || (width < 1) || (width > 4)) {
+    abort();
+  }
+  
+  for(i = width - 1; i >= 0; i--) {
+    p[i] = (unsigned char) (v & 0xff);
+    v >>= 8;
+  }
+}
+
+/*
+ * Get the position of a section offset in a mapped NMF file.
+ * 
+ * The file has m_map_sections sections.
+ * 
+ * Parameters:
+ * 
+ *   k - the section index
+ * 
+ * Return:
+ * 
+ *   the byte position of the section offset
+ */
+static size_t sectPos(int32_t k) {
+  
+  /* Check parameters */
+  if ((k < 0) || (k >= m_map_sections)) {
+    abort();
+  }
+  
+  return NMF_HEAD_SIZE + ((size_t) k) * NMF_SECT_SIZE;
+}
+
+/*
+ * Get the position of a note field in a mapped NMF file.
+ * 
+ * The file has m_map_sections sections and m_map_notes notes.
+ * 
+ * Parameters:
+ * 
+ *   j - the note index
+ * 
+ *   field - the position of the field within the note record, either
+ *   NMF_NOTE_T or NMF_NOTE_DUR
+ * 
+ * Return:
+ * 
+ *   the byte position of the note field
+ */
+static size_t notePos(int32_t j, size_t field) {
+  
+  /* Check parameters */
+  if ((j < 0) || (j >= m_map_notes) || (field + 4 > NMF_NOTE_SIZE)) {
+    abort();
+  }
+  
+  return NMF_HEAD_SIZE +
+          ((size_t) m_map_sections) * NMF_SECT_SIZE +
+          ((size_t) j) * NMF_NOTE_SIZE +
+          field;
+}
+
+/*
+ * Check the header of a mapped NMF file and get its counts.
+ * 
+ * The signatures must match, the basis must be one of the NMF_BASIS_
+ * constants, the counts must be within the limits of libnmf, the length
+ * must be exactly what the counts give, and the first section must
+ * start at offset zero.  If the check passes, m_map_sections and
+ * m_map_notes are set.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mapped file
+ * 
+ *   len - the length of the mapped file in bytes
+ * 
+ * Return:
+ * 
+ *   non-zero if the file is valid, zero if not
+ */
+static int checkHeader(const unsigned char *pm, size_t len) {
+  
+  int status = 1;
+  uint32_t basis = 0;
+  uint32_t scount = 0;
+  uint32_t ncount = 0;
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  /* Check the length of the header and the signatures */
+  if (len < NMF_HEAD_SIZE) {
+    status = 0;
+  }
+  if (status) {
+    if ((getUint(pm + NMF_POS_PRIMARY, 4) != NMF_SIG_PRIMARY) ||
+        (getUint(pm + NMF_POS_SECONDARY, 4) != NMF_SIG_SECONDARY)) {
+      status = 0;
+    }
+  }
+  
+  /* Check the basis and the counts */
+  if (status) {
+    basis = getUint(pm + NMF_POS_BASIS, 2);
+    scount = getUint(pm + NMF_POS_SCOUNT, 2);
+    ncount = getUint(pm + NMF_POS_NCOUNT, 4);
+    if ((basis != NMF_BASIS_Q96) && (basis != NMF_BASIS_44100) &&
+        (basis != NMF_BASIS_48000)) {
+      status = 0;
+    }
+    if ((scount < 1) || (ncount > (uint32_t) NMF_MAXNOTES)) {
+      status = 0;
+    }
+  }
+  
+  /* Check the length of the file */
+  if (status) {
+    if (len != NMF_HEAD_SIZE +
+                ((size_t) scount) * NMF_SECT_SIZE +
+                ((size_t) ncount) * NMF_NOTE_SIZE) {
+      status = 0;
+    }
+  }
+  
+  /* Check the offset of the first section */
+  if (status) {
+    if (getUint(pm + NMF_HEAD_SIZE, 4) != 0) {
+      status = 0;
+    }
+  }
+  
+  /* Store the counts */
+  if (status) {
+    m_map_sections = (int32_t) scount;
+    m_map_notes = (int32_t) ncount;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Convert the sections and notes of a mapped NMF file.
+ * 
+ * pm points to the mapped file, whose header has been checked and whose
+ * counts are in m_map_sections and m_map_notes.  If write is zero, the
+ * values are only converted to check that there is no computation
+ * error.  If write is non-zero, the converted values are written back.
+ * 
+ * Parameters:
+ * 
+ *   pm - the mapped file
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ *   write - non-zero to write the converted values
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int mapPass(unsigned char *pm, double qdur, int write) {
+  
+  int status = 1;
+  int32_t k = 0;
+  int32_t x = 0;
+  int32_t i = 0;
+  int32_t batch = 0;
+  int32_t v = 0;
+  size_t p = 0;
+  NMF_NOTE n;
+  
+  /* Initialize structures */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameter */
+  if (pm == NULL) {
+    abort();
+  }
+  
+  /* Convert the section offsets */
+  for(k = 1; k < m_map_sections; k++) {
+    p = sectPos(k);
+    if (!convertOffset((int32_t) getUint(pm + p, 4), qdur, &v)) {
+      status = 0;
+      break;
+    }
+    if (write) {
+      putUint(pm + p, (uint32_t) v, 4);
+    }
+  }
+  
+  /* Convert the notes in batches */
+  if (status) {
+    for(x = 0; x < m_map_notes; x += batch) {
+      
+      batch = m_map_notes - x;
+      if (batch > RATE_BATCH) {
+        batch = RATE_BATCH;
+      }
+      
+      for(i = 0; i < batch; i++) {
+        m_batch_t[i] = (int32_t) getUint(
+                          pm + notePos(x + i, NMF_NOTE_T), 4);
+        m_batch_d[i] = (int32_t) getUint(
+                          pm + notePos(x + i, NMF_NOTE_DUR), 4);
+      }
+      
+      if (!convertBatch(m_batch_t, m_batch_d, batch, qdur)) {
+        status = 0;
+        break;
+      }
+      
+      for(i = 0; i < batch; i++) {
+        if (m_block > 0) {
+          n.t = m_batch_t[i];
+          n.dur = m_batch_d[i];
+          if (!snapNote(&n)) {
+            status = 0;
+            break;
+          }
+          m_batch_t[i] = n.t;
+          m_batch_d[i] = n.dur;
+        }
+        if (write) {
+          putUint(pm + notePos(x + i, NMF_NOTE_T),
+                    (uint32_t) m_batch_t[i], 4);
+          putUint(pm + notePos(x + i, NMF_NOTE_DUR),
+                    (uint32_t) m_batch_d[i], 4);
+        }
+      }
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Convert a memory-mapped NMF file.
+ * 
+ * pInPath is the NMF file to convert.  If pOutPath is NULL, the file is
+ * converted in place.  Otherwise, the output file is sized to match the
+ * input, filled with a copy of the input, and converted in place.  Only
+ * the basis, section offsets, and note t and dur fields are rewritten,
+ * and no NMF object is built.
+ * 
+ * The input is mapped, its header is checked, and all values are
+ * converted once to check for computation errors before any file is
+ * changed, so nothing is written unless the whole conversion succeeds.
+ * The output file is opened without truncating it and compared with the
+ * input by device and inode, so that if both paths name the same file,
+ * it is converted in place instead of being truncated before it is
+ * read.  Errors are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   pInPath - path to the input NMF file
+ * 
+ *   pOutPath - path to the output NMF file, or NULL
+ * 
+ *   srate - the output sampling rate
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int mmapConvert(
+    const char    * pInPath,
+    const char    * pOutPath,
+          int32_t   srate,
+          double    qdur,
+    const char    * pModule) {
+  
+  int status = 1;
+  int fd_in = -1;
+  int fd_out = -1;
+  size_t len = 0;
+  struct stat st;
+  struct stat st_out;
+  unsigned char *pIn = NULL;
+  unsigned char *pm = NULL;
+  
+  /* Initialize structures */
+  memset(&st, 0, sizeof(struct stat));
+  memset(&st_out, 0, sizeof(struct stat));
+  
+  /* Check parameters */
+  if ((pInPath == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  if ((srate != 48000) && (srate != 44100)) {
+    abort();
+  }
+  
+  /* Open and size the input file */
+  if (status) {
+    fd_in = open(pInPath, (pOutPath == NULL) ? O_RDWR : O_RDONLY);
+    if (fd_in < 0) {
+      status = 0;
+    } else if (fstat(fd_in, &st) != 0) {
+      status = 0;
+    } else if (st.st_size < (off_t) NMF_HEAD_SIZE) {
+      status = 0;
+    }
+    if (!status) {
+      fprintf(stderr, "%s: Can't open NMF file!\n", pModule);
+    }
+  }
+  
+  /* Map the input file, read-only if there is a separate output */
+  if (status) {
+    len = (size_t) st.st_size;
+    if (pOutPath == NULL) {
+      pIn = (unsigned char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd_in, 0);
+    } else {
+      pIn = (unsigned char *) mmap(NULL, len, PROT_READ,
+                                    MAP_SHARED, fd_in, 0);
+    }
+    if (pIn == (unsigned char *) MAP_FAILED) {
+      pIn = NULL;
+      status = 0;
+      fprintf(stderr, "%s: Can't map NMF file!\n", pModule);
+    }
+  }
+  
+  /* Check the header and get the counts */
+  if (status) {
+    if (!checkHeader(pIn, len)) {
+      status = 0;
+      fprintf(stderr, "%s: Invalid NMF file!\n", pModule);
+    }
+  }
+  
+  /* Check the conversion against the input before changing any file */
+  if (status) {
+    if (!mapPass(pIn, qdur, 0)) {
+      status = 0;
+      fprintf(stderr, "%s: Computation error!\n", pModule);
+    }
+  }
+  
+  /* Get the mapping to convert, which is the input itself if there is
+   * no separate output */
+  if (status && (pOutPath == NULL)) {
+    pm = pIn;
+    pIn = NULL;
+  }
+  
+  /* If there is a separate output, open it without truncating, and
+   * check whether it is the same file as the input */
+  if (status && (pOutPath != NULL)) {
+    fd_out = open(pOutPath, O_RDWR | O_CREAT, 0666);
+    if (fd_out < 0) {
+      status = 0;
+    } else if (fstat(fd_out, &st_out) != 0) {
+      status = 0;
+    }
+    if (!status) {
+      fprintf(stderr, "%s: Can't open output file!\n", pModule);
+    }
+  }
+  
+  /* Map the output; if it is the input file, convert it in place,
+   * otherwise size it to match the input and copy the input into it */
+  if (status && (pOutPath != NULL)) {
+    if ((st_out.st_dev == st.st_dev) && (st_out.st_ino == st.st_ino)) {
+      pm = (unsigned char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd_out, 0);
+      if (pm == (unsigned char *) MAP_FAILED) {
+        pm = NULL;
+      }
+      
+    } else {
+      if ((ftruncate(fd_out, 0) == 0) &&
+          (ftruncate(fd_out, (off_t) len) == 0)) {
+        pm = (unsigned char *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd_out, 0);
+        if (pm == (unsigned char *) MAP_FAILED) {
+          pm = NULL;
+        }
+      }
+      if (pm != NULL) {
+        memcpy(pm, pIn, len);
+      }
+    }
+    if (pm == NULL) {
+      status = 0;
+      fprintf(stderr, "%s: Can't map output file!\n", pModule);
+    }
+  }
+  
+  /* Unmap the input if it is separate */
+  if (pIn != NULL) {
+    munmap(pIn, len);
+    pIn = NULL;
+  }
+  
+  /* Reset the snapping statistics from the check and convert for
+   * real */
+  if (status) {
+    resetSnap();
+    if (!mapPass(pm, qdur, 1)) {
+      abort();  /* shouldn't happen after the check */
+    }
+    if (srate == 48000) {
+      putUint(pm + NMF_POS_BASIS, NMF_BASIS_48000, 2);
+    } else {
+      putUint(pm + NMF_POS_BASIS, NMF_BASIS_44100, 2);
+    }
+  }
+  
+  /* Flush and unmap */
+  if (pm != NULL) {
+    if (status) {
+      if (msync(pm, len, MS_SYNC) != 0) {
+        status = 0;
+        fprintf(stderr, "%s: Can't write NMF file!\n", pModule);
+      }
+    }
+    munmap(pm, len);
+    pm = NULL;
+  }
+  
+  /* Close files */
+  if (fd_in >= 0) {
+    close(fd_in);
+    fd_in = -1;
+  }
+  if (fd_out >= 0) {
+    close(fd_out);
+    fd_out = -1;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Reset the block snapping statistics.
+ */
+static void resetSnap(void) {
+  m_snap_start_count = 0;
+  m_snap_end_count = 0;
+  m_snap_start_sum = 0;
+  m_snap_end_sum = 0;
+  m_snap_start_max = 0;
+  m_snap_end_max = 0;
+  m_snap_extended = 0;
+}
+
+/*
+ * Compute the duration of each quantum in output samples.
+ * 
+ * If m_exact is set, the duration is also set up as a reduced ratio for
+ * the exact integer path with setExact().  All parameters must be
+ * greater than zero, and srate must be 48000 or 44100.
+ * 
+ * Parameters:
+ * 
+ *   srate - the output sampling rate
+ * 
+ *   tempo - the tempo in beats per ten minutes
+ * 
+ *   qbeat - the number of quanta per beat
+ * 
+ * Return:
+ * 
+ *   the duration of each quantum in output samples
+ */
+static double setRate(int32_t srate, int32_t tempo, int32_t qbeat) {
+  
+  /* Check parameters */
+  if (((srate != 48000) && (srate != 44100)) ||
+      (tempo < 1) || (qbeat < 1)) {
+    abort();
+  }
+  
+  /* Set up the exact integer path if requested */
+  if (m_exact) {
+    setExact(srate, tempo, qbeat);
+  }
+  
+  return ((600.0 / ((double) tempo)) * ((double) srate)) /
+            ((double) qbeat);
+}
+
+/*
+ * Convert the sections and notes of an NMF object into another.
+ * 
+ * pdo must be a rebased object with no sections beyond the first and no
+ * notes.  Sections and notes of pd are converted and added to pdo,
+ * snapped to the block grid if m_block is set.  pd is only read, so
+ * several threads may convert the same pd at once.
+ * 
+ * Parameters:
+ * 
+ *   pd - the input NMF object
+ * 
+ *   pdo - the output NMF object
+ * 
+ *   qdur - the duration of each quantum in output samples
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if computation error
+ */
+static int convertData(NMF_DATA *pd, NMF_DATA *pdo, double qdur) {
+  
+  int status = 1;
+  int32_t x = 0;
+  int32_t i = 0;
+  int32_t sections = 0;
+  int32_t notes = 0;
+  int32_t batch = 0;
+  int32_t newval = 0;
+  
+  /* Check parameters */
+  if ((pd == NULL) || (pdo == NULL)) {
+    abort();
+  }
+  
+  /* Transfer sections, adjusting their offsets */
+  sections = nmf_sections(pd);
+  for(x = 1; x < sections; x++) {
+    if (!convertOffset(nmf_offset(pd, x), qdur, &newval)) {
+      status = 0;
+      break;
+    }
+    if (!nmf_sect(pdo, newval)) {
+      abort();  /* shouldn't happen */
+    }
+  }
+  
+  /* Transfer notes in batches, converting t and dur in bulk */
+  if (status) {
+    notes = nmf_notes(pd);
+    for(x = 0; x < notes; x += batch) {
+      
+      /* Determine the size of this batch */
+      batch = notes - x;
+      if (batch > RATE_BATCH) {
+        batch = RATE_BATCH;
+      }
+      
+      /* Get the notes of the batch, and their t and dur values */
+      for(i = 0; i < batch; i++) {
+        nmf_get(pd, x + i, &(m_batch_n[i]));
+        m_batch_t[i] = (m_batch_n[i]).t;
+        m_batch_d[i] = (m_batch_n[i]).dur;
+      }
+      
+      /* Convert t and dur */
+      if (!convertBatch(m_batch_t, m_batch_d, batch, qdur)) {
+        status = 0;
+        break;
+      }
+      
+      /* Write the converted values back, snap to the block grid if
+       * requested, and transfer the notes to the new file */
+      for(i = 0; i < batch; i++) {
+        (m_batch_n[i]).t = m_batch_t[i];
+        (m_batch_n[i]).dur = m_batch_d[i];
+        
+        if (m_block > 0) {
+          if (!snapNote(&(m_batch_n[i]))) {
+            status = 0;
+            break;
+          }
+        }
+        
+        if (!nmf_append(pdo, &(m_batch_n[i]))) {
+          abort();  /* shouldn't happen */
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Convert an NMF object for one tempo variant and write the result.
+ * 
+ * The variant's qdur is computed, the notes of pd are converted into a
+ * new object, and the object is serialized to the variant's output
+ * file, or to standard output if the variant has no path.  If block
+ * snapping is on, the snapping statistics are formatted into a report
+ * buffer in the variant.  The outcome is stored in the err field of the
+ * variant rather than being reported, so that variants can be run on
+ * separate threads and reported in order afterwards.
  * 
- * May also need to be compiled with the math library -lm
+ * Parameters:
+ * 
+ *   pd - the input NMF object
+ * 
+ *   srate - the output sampling rate
+ * 
+ *   pv - the variant to run
+ * 
+ *   pModule - the module name for the report
  */
-
-#include <math.h>
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "nmf.h"
+static void runVariant(
+          NMF_DATA  * pd,
+          int32_t     srate,
+          VARIANT   * pv,
+    const char      * pModule) {
+  
+  NMF_DATA *pdo = NULL;
+  FILE *pOut = NULL;
+  double qdur = 0.0;
+  
+  /* Check parameters */
+  if ((pd == NULL) || (pv == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Set up the conversion */
+  pv->err = VAR_OK;
+  qdur = setRate(srate, pv->tempo, pv->qbeat);
+  resetSnap();
+  
+  /* Allocate blank object for transformed data and rebase it */
+  pdo = nmf_alloc();
+  if (srate == 48000) {
+    nmf_rebase(pdo, NMF_BASIS_48000);
+  } else {
+    nmf_rebase(pdo, NMF_BASIS_44100);
+  }
+  
+  /* Convert the data */
+  if (!convertData(pd, pdo, qdur)) {
+    pv->err = VAR_COMPUTE;
+  }
+  
+  /* Serialize the data to output */
+  if (pv->err == VAR_OK) {
+    if (pv->pPath == NULL) {
+      if (!nmf_serialize(pdo, stdout)) {
+        abort();  /* shouldn't happen */
+      }
+      
+    } else {
+      pOut = fopen(pv->pPath, "wb");
+      if (pOut == NULL) {
+        pv->err = VAR_OPEN;
+      }
+      if (pv->err == VAR_OK) {
+        if (!nmf_serialize(pdo, pOut)) {
+          pv->err = VAR_WRITE;
+        }
+      }
+      if (pOut != NULL) {
+        if (fclose(pOut)) {
+          pv->err = VAR_WRITE;
+        }
+        pOut = NULL;
+      }
+    }
+  }
+  
+  /* Format the block snapping statistics if requested */
+  if ((pv->err == VAR_OK) && (m_block > 0)) {
+    pOut = open_memstream(&(pv->pReport), &(pv->report_len));
+    if (pOut == NULL) {
+      abort();
+    }
+    reportSnap(pOut, pModule);
+    if (fclose(pOut)) {
+      abort();
+    }
+    pOut = NULL;
+  }
+  
+  /* Free the converted data */
+  nmf_free(pdo);
+  pdo = NULL;
+}
 
 /*
- * Local functions
- * ===============
+ * Thread function that runs a share of the tempo variants.
+ * 
+ * The argument is a VARWORKER.  The worker runs every variant in
+ * m_var whose index is its first index plus a multiple of m_threads.
+ * 
+ * Parameters:
+ * 
+ *   pArg - the VARWORKER
+ * 
+ * Return:
+ * 
+ *   NULL
  */
-
-/* Prototypes */
-static int parseInt(const char *pstr, int32_t *pv);
+static void *runWorker(void *pArg) {
+  
+  const VARWORKER *pw = NULL;
+  int32_t i = 0;
+  
+  /* Check parameter */
+  if (pArg == NULL) {
+    abort();
+  }
+  pw = (const VARWORKER *) pArg;
+  
+  /* Run the variants */
+  for(i = pw->first; i < m_var_count; i += m_threads) {
+    runVariant(pw->pd, pw->srate, &(m_var[i]), pw->pModule);
+  }
+  
+  return NULL;
+}
 
 /*
  * Parse the given string as a signed integer.
@@ -157,6 +1868,76 @@ static int parseInt(const char *pstr, int32_t *pv) {
   return status;
 }
 
+/*
+ * Parse a tempo variant option value.
+ * 
+ * The value has the form [tempo]:[qbeat]:[path].  The path is
+ * everything after the second colon and may itself contain colons.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the option value to parse
+ * 
+ *   pv - the variant to receive the parsed values
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseVariant(const char *pstr, VARIANT *pv) {
+  
+  int status = 1;
+  int32_t v[2];
+  int32_t i = 0;
+  size_t len = 0;
+  char buf[32];
+  
+  /* Initialize structures */
+  memset(v, 0, sizeof(v));
+  memset(buf, 0, sizeof(buf));
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* Parse the tempo and qbeat fields */
+  for(i = 0; i < 2; i++) {
+    len = strcspn(pstr, ":");
+    if ((pstr[len] != ':') || (len >= sizeof(buf))) {
+      status = 0;
+      break;
+    }
+    memcpy(buf, pstr, len);
+    buf[len] = 0;
+    if (!parseInt(buf, &(v[i]))) {
+      status = 0;
+      break;
+    }
+    if (v[i] < 1) {
+      status = 0;
+      break;
+    }
+    pstr += len + 1;
+  }
+  
+  /* The rest is the path */
+  if (status && (*pstr == 0)) {
+    status = 0;
+  }
+  
+  /* Store the variant */
+  if (status) {
+    memset(pv, 0, sizeof(VARIANT));
+    pv->tempo = v[0];
+    pv->qbeat = v[1];
+    pv->pPath = pstr;
+    pv->err = VAR_OK;
+  }
+  
+  return status;
+}
+
 /*
  * Program entrypoint
  * ==================
@@ -173,17 +1954,13 @@ int main(int argc, char *argv[]) {
   int32_t qbeat = 0;
   
   NMF_DATA *pd = NULL;
-  NMF_DATA *pdo = NULL;
-  NMF_NOTE n;
-  
   double qdur = 0.0;
-  double f = 0.0;
-  int32_t notes = 0;
-  int32_t sections = 0;
-  int32_t newval = 0;
-  
-  /* Initialize structures */
-  memset(&n, 0, sizeof(NMF_NOTE));
+  int32_t i = 0;
+  int32_t worker_count = 0;
+  const char *pMapPath = NULL;
+  const char *pOutPath = NULL;
+  VARWORKER *pw = NULL;
+  pthread_t *pth = NULL;
   
   /* Get module name */
   if (argc > 0) {
@@ -197,8 +1974,8 @@ int main(int argc, char *argv[]) {
     pModule = "nmfrate";
   }
   
-  /* We need exactly three parameters past module name */
-  if (argc != 4) {
+  /* We need at least three parameters past module name */
+  if (argc < 4) {
     status = 0;
     fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
   }
@@ -237,6 +2014,83 @@ int main(int argc, char *argv[]) {
     }
   }
   
+  /* Parse any options, with variant zero reserved for the [tempo] and
+   * [qbeat] parameters */
+  m_var_count = 1;
+  if (status) {
+    for(x = 4; x < argc; x++) {
+      if (strncmp(argv[x], "--block=", strlen("--block=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--block="), &m_block)) {
+          status = 0;
+        } else if (m_block < 1) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid block size!\n", pModule);
+        }
+        
+      } else if (strcmp(argv[x], "--round=floor") == 0) {
+        m_round = ROUND_FLOOR;
+        
+      } else if (strcmp(argv[x], "--round=nearest") == 0) {
+        m_round = ROUND_NEAREST;
+        
+      } else if (strcmp(argv[x], "--round=ceil") == 0) {
+        m_round = ROUND_CEIL;
+        
+      } else if (strcmp(argv[x], "--exact") == 0) {
+        m_exact = 1;
+        
+      } else if (strncmp(argv[x], "--variant=",
+                    strlen("--variant=")) == 0) {
+        if (m_var_count >= MAX_VARIANTS) {
+          status = 0;
+          fprintf(stderr, "%s: Too many variants!\n", pModule);
+        } else if (!parseVariant(argv[x] + strlen("--variant="),
+                                  &(m_var[m_var_count]))) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid variant %s!\n", pModule, argv[x]);
+        } else {
+          m_var_count++;
+        }
+        
+      } else if (strncmp(argv[x], "--threads=",
+                    strlen("--threads=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--threads="), &m_threads)) {
+          status = 0;
+        } else if ((m_threads < 1) || (m_threads > MAX_THREADS)) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid thread count!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--mmap=", strlen("--mmap=")) == 0) {
+        pMapPath = argv[x] + strlen("--mmap=");
+        if (*pMapPath == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid mapped file path!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--out=", strlen("--out=")) == 0) {
+        pOutPath = argv[x] + strlen("--out=");
+        if (*pOutPath == 0) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid output file path!\n", pModule);
+        }
+        
+      } else {
+        status = 0;
+        fprintf(stderr, "%s: Unrecognized option %s!\n",
+                pModule, argv[x]);
+      }
+      
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
   /* Range-check parameters */
   if (status && (srate != 48000) && (srate != 44100)) {
     status = 0;
@@ -253,8 +2107,30 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "%s: Invalid beat!\n", pModule);
   }
   
+  if (status && (pOutPath != NULL) && (pMapPath == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: --out requires --mmap!\n", pModule);
+  }
+  
+  /* Variants can't be combined with conversion of a mapped file */
+  if (status && (pMapPath != NULL) && (m_var_count > 1)) {
+    status = 0;
+    fprintf(stderr, "%s: --variant can't be used with --mmap!\n", pModule);
+  }
+  
+  /* Convert a memory-mapped file if requested */
+  if (status && (pMapPath != NULL)) {
+    qdur = setRate(srate, tempo, qbeat);
+    if (!mmapConvert(pMapPath, pOutPath, srate, qdur, pModule)) {
+      status = 0;
+    }
+    if (status && (m_block > 0)) {
+      reportSnap(stderr, pModule);
+    }
+  }
+  
   /* Parse input as NMF */
-  if (status) {
+  if (status && (pMapPath == NULL)) {
     pd = nmf_parse(stdin);
     if (pd == NULL) {
       status = 0;
@@ -262,138 +2138,95 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Allocate blank object for transformed data and rebase it */
-  if (status) {
-    pdo = nmf_alloc();
-    if (srate == 48000) {
-      nmf_rebase(pdo, NMF_BASIS_48000);
+  /* Convert and write each tempo variant, on multiple threads if
+   * requested and there is more than one variant */
+  if (status && (pMapPath == NULL)) {
+    m_var[0].tempo = tempo;
+    m_var[0].qbeat = qbeat;
+    m_var[0].pPath = NULL;
     
-    } else if (srate == 44100) {
-      nmf_rebase(pdo, NMF_BASIS_44100);
-      
-    } else {
-      abort();  /* shouldn't happen */
+    worker_count = m_threads;
+    if (worker_count > m_var_count) {
+      worker_count = m_var_count;
     }
-  }
-  
-  /* Compute the duration of each quanta in the target sample rate */
-  if (status) {
-    qdur = ((600.0 / ((double) tempo)) * ((double) srate)) /
-              ((double) qbeat);
-  }
-  
-  /* Transfer sections, adjusting their offsets */
-  if (status) {
-    sections = nmf_sections(pd);
-    for(x = 1; x < sections; x++) {
-      
-      /* Compute new section offset */
-      f = qdur * ((double) nmf_offset(pd, x));
-      if (!isfinite(f)) {
-        status = 0;
-        fprintf(stderr, "%s: Computation error!\n", pModule);
+    
+    if (worker_count > 1) {
+      pw = (VARWORKER *) calloc((size_t) worker_count, sizeof(VARWORKER));
+      pth = (pthread_t *) calloc((size_t) worker_count, sizeof(pthread_t));
+      if ((pw == NULL) || (pth == NULL)) {
+        abort();
       }
-      if (status) {
-        if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
-          status = 0;
-          fprintf(stderr, "%s: Computation error!\n", pModule);
+      
+      m_threads = worker_count;
+      for(i = 0; i < worker_count; i++) {
+        pw[i].pd = pd;
+        pw[i].srate = srate;
+        pw[i].first = i;
+        pw[i].pModule = pModule;
+        if (pthread_create(&(pth[i]), NULL, &runWorker, &(pw[i]))) {
+          abort();
         }
       }
-      if (status) {
-        newval = (int32_t) f;
-        if (newval < 0) {
-          newval = 0;
+      for(i = 0; i < worker_count; i++) {
+        if (pthread_join(pth[i], NULL)) {
+          abort();
         }
       }
       
-      /* Output new section */
-      if (!nmf_sect(pdo, newval)) {
-        abort();  /* shouldn't happen */
+      free(pw);
+      pw = NULL;
+      free(pth);
+      pth = NULL;
+      
+    } else {
+      for(i = 0; i < m_var_count; i++) {
+        runVariant(pd, srate, &(m_var[i]), pModule);
       }
     }
   }
   
-  
-  /* Transfer notes, adjusting t and dur */
-  if (status) {
-    notes = nmf_notes(pd);
-    for(x = 0; x < notes; x++) {
-      
-      /* Get the current note */
-      nmf_get(pd, x, &n);
-      
-      /* Compute the new offset of the note */
-      f = qdur * ((double) n.t);
-      if (!isfinite(f)) {
+  /* Report the outcome of each variant in order */
+  if (status && (pMapPath == NULL)) {
+    for(i = 0; i < m_var_count; i++) {
+      if (m_var[i].err == VAR_COMPUTE) {
         status = 0;
-        fprintf(stderr, "%s: Computation error!\n", pModule);
-      }
-      if (status) {
-        if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
-          status = 0;
-          fprintf(stderr, "%s: Computation error!\n", pModule);
-        }
-      }
-      if (status) {
-        newval = (int32_t) f;
-        if (newval < 0) {
-          newval = 0;
-        }
-      }
-      if (status) {
-        n.t = newval;
-      }
-      
-      /* If duration of note is greater than zero, recompute it */
-      if (n.dur > 0) {
-        f = qdur * ((double) n.dur);
-        if (!isfinite(f)) {
-          status = 0;
+        if (m_var[i].pPath == NULL) {
           fprintf(stderr, "%s: Computation error!\n", pModule);
+        } else {
+          fprintf(stderr, "%s: Computation error for %s!\n",
+                  pModule, m_var[i].pPath);
         }
-        if (status) {
-          if ((f < (double) INT32_MIN) || (f > (double) INT32_MAX)) {
-            status = 0;
-            fprintf(stderr, "%s: Computation error!\n", pModule);
-          }
-        }
-        if (status) {
-          newval = (int32_t) f;
-          if (newval < 1) {
-            newval = 1;
-          }
-        }
-        if (status) {
-          n.dur = newval;
-        }
+        
+      } else if (m_var[i].err == VAR_OPEN) {
+        status = 0;
+        fprintf(stderr, "%s: Can't open %s!\n",
+                pModule, m_var[i].pPath);
+        
+      } else if (m_var[i].err == VAR_WRITE) {
+        status = 0;
+        fprintf(stderr, "%s: Can't write %s!\n",
+                pModule, m_var[i].pPath);
+        
+      } else if (m_var[i].err != VAR_OK) {
+        abort();  /* unrecognized outcome */
       }
       
-      /* Transfer note to new file */
-      if (status) {
-        if (!nmf_append(pdo, &n)) {
-          abort();  /* shouldn't happen */
+      if (m_var[i].pReport != NULL) {
+        if (m_var_count > 1) {
+          fprintf(stderr, "%s: Variant %s\n", pModule,
+                  (m_var[i].pPath != NULL) ?
+                    m_var[i].pPath : "standard output");
         }
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
+        fwrite(m_var[i].pReport, 1, m_var[i].report_len, stderr);
+        free(m_var[i].pReport);
+        m_var[i].pReport = NULL;
       }
     }
   }
   
-  /* Serialize the data to output */
-  if (status) {
-    if (!nmf_serialize(pdo, stdout)) {
-      abort();  /* shouldn't happen */
-    }
-  }
-  
   /* Free data if allocated */
   nmf_free(pd);
   pd = NULL;
-  nmf_free(pdo);
-  pdo = NULL;
   
   /* Invert status and return */
   if (status) {
@@ -3,89 +3,2068 @@
  * ===========
  * 
  * Open a fixed-rate NMF file, sort its notes, and output a series of
- * note events in the Retro synthesizer format, always using instrument
- * one and layer one for everything.
+ * note events in the Retro synthesizer format, using instrument one and
+ * layer one for everything unless other instruments and layers are
+ * selected with the --route option.
  * 
  * Grace notes and notes of duration zero are ignored.
  * 
  * Syntax
  * ------
  * 
- *   nmfsimple
+ *   nmfsimple (options)
  * 
  * The input fixed-rate NMF file is read from standard input.  The note
- * events are written to standard output.
+ * events are written to standard output, unless they are split into
+ * separate files with the --split or --chunk option.
+ * 
+ * Options
+ * -------
+ * 
+ * The following options only output the notes within a time window:
+ * 
+ *   --from=[t]  start of the window, in samples (default zero)
+ *   --to=[t]    end of the window, in samples (default end of piece)
+ *   --clip      clip notes to the window
+ *   --rebase    make times relative to the start of the window
+ * 
+ * The window includes [from] but not [to], and [to] must be greater
+ * than [from].  A note is output if any part of it is within the
+ * window, including notes that start before the window and are still
+ * sounding when it begins.  With --clip, the parts of notes outside the
+ * window are cut off.  With --rebase, [from] is subtracted from the
+ * time of each note, so the window starts at time zero; --rebase
+ * requires --clip, so that no note has a negative time.
+ * 
+ * The end of the window is located within the sorted notes by binary
+ * search on note start times.  Notes still sounding from before the
+ * window are found with the latest end time of each block of 64 notes,
+ * and the output loop skips every block that has ended by the start of
+ * the window, so a long note early in the piece, such as a held pedal,
+ * only keeps its own block in the loop.  Finding these end times reads
+ * every note once, so a windowed run still has a light pass over the
+ * whole piece, but formatting and output only depend on the notes near
+ * the window.
+ * 
+ * The following options write the notes to separate files:
+ * 
+ *   --split=layer  one file for each NMF layer
+ *   --split=sect   one file for each NMF section
+ *   --split=both   one file for each layer within each section
+ *   --prefix=[p]   start each file name with [p]
+ * 
+ * The notes are split in a single pass over the sorted notes, so each
+ * file has its notes in the same order as they would appear in the
+ * standard output.  Layers and sections are numbered from one in the
+ * file names.  With --prefix=part_, layer 3 is written to part_L3,
+ * section 2 is written to part_S2, and layer 3 within section 2 is
+ * written to part_S2L3.  Files are only written for layers and
+ * sections that have notes to output, and existing files are replaced.
+ * Each file has its own memory buffer, which is appended to the file
+ * whenever it fills, so any number of files may be written without
+ * keeping them all open.  --prefix is required with --split.
+ * 
+ * The following options write the notes to separate files by time, so
+ * that the chunks can be synthesized in parallel and concatenated:
+ * 
+ *   --chunk=[n]   one file for each [n] samples
+ *   --prefix=[p]  start each file name with [p]
+ * 
+ * Chunks are numbered from one, so with --prefix=part_, the first chunk
+ * is written to part_C1.  Chunk [k] covers the samples from ([k] - 1) *
+ * [n] up to but excluding [k] * [n], and each chunk file starts with a
+ * "# chunk [k] start [s]" comment giving its start time [s].  Times in
+ * a chunk file are relative to the start of the chunk.
+ * 
+ * Each chunk file first lists the carry notes, which started in an
+ * earlier chunk and are still sounding.  Each carry note starts at time
+ * zero with its remaining duration, and ends with a "# carry [o]"
+ * comment, where [o] is the number of samples of the note that sounded
+ * in earlier chunks.  The carry notes are followed by the notes that
+ * start in the chunk.  Every note is cut off at the end of its chunk,
+ * with the rest carried into the following chunks.  A chunk file is
+ * written for every chunk up to the end of the last note, including
+ * empty chunks, so that the chunks can be concatenated without gaps.
+ * At most 65536 chunk files may be written, and if the chunk length
+ * would need more than that to reach the end of the last note, nothing
+ * is written and an error is reported.  Times are counted from time
+ * zero, so use --rebase to chunk a window from its start.  --chunk
+ * can't be used with --split, and --prefix is required with --chunk.
+ * 
+ * The following option selects the instrument and layer of notes:
+ * 
+ *   --route=[l]:[i]:[r]  use instrument [i] and Retro layer [r] for the
+ *                        notes of NMF layer [l]
+ * 
+ * NMF layers are numbered from one, and [i] and [r] must be one or
+ * greater.  --route may be given any number of times.  Notes of NMF
+ * layers that are not routed use instrument one and layer one.
+ * 
+ * The following option assigns a synthesizer voice to each note:
+ * 
+ *   --voices  add a voice to each note, and a voice count header
+ * 
+ * Voices are assigned to the notes that are output, in order of start
+ * time, with each note given the lowest-numbered voice that is free when
+ * it starts.  A voice becomes free when its note ends, which is tracked
+ * with a min-heap of the end times of the sounding notes, so the number
+ * of voices is the greatest number of notes that sound at once and no
+ * voice ever has to be stolen.  Voices are numbered from one.  The voice
+ * of each note is written in a trailing comment on its line, as
+ * "# voice [v]", or as "# carry [o] voice [v]" for carry notes, so the
+ * lines remain valid note events.  A "# voices [c]" line giving the
+ * voice count [c] comes before the notes.  Voices are assigned across
+ * the whole output, so with --split or --chunk, each file has the
+ * header with the overall voice count, and each note keeps the same
+ * voice in every chunk it sounds in.
  * 
  * Compation
  * ---------
  * 
- * Compile with libnmf.
+ * Compile with libnmf.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nmf.h"
+
+/*
+ * Constants
+ * =========
+ */
+
+/*
+ * The number of NMF layers and sections.
+ */
+#define LAYER_COUNT (65536)
+
+/*
+ * Split modes.
+ */
+#define SPLIT_NONE  (0)   /* Write everything to standard output */
+#define SPLIT_LAYER (1)   /* One file for each layer */
+#define SPLIT_SECT  (2)   /* One file for each section */
+#define SPLIT_BOTH  (3)   /* One file for each layer in each section */
+
+/*
+ * The initial and maximum size in bytes of the buffer of each output
+ * file.  The buffer doubles in size each time it fills until it reaches
+ * the maximum, after which it is appended to the file each time it
+ * fills.
+ */
+#define SINK_INITBUF (4096)
+#define SINK_MAXBUF (65536)
+
+/*
+ * The initial number of slots in the output file hash table.  Must be a
+ * power of two.  The table is doubled whenever it would become more
+ * than half full.
+ */
+#define SINK_INITHASH (64)
+
+/*
+ * The longest line that is written for a note, including the line
+ * break.
+ */
+#define LINE_MAX_LEN (128)
+
+/*
+ * The initial capacity of the carry list when chunking.
+ */
+#define CARRY_INIT (64)
+
+/*
+ * The most chunk files that --chunk may write.
+ */
+#define CHUNK_MAX (65536)
+
+/*
+ * The number of notes in each block of the reach array.
+ */
+#define REACH_BLOCK (64)
+
+/*
+ * Type definitions
+ * ================
+ */
+
+/*
+ * An output file when splitting.
+ */
+typedef struct {
+  
+  /*
+   * The key of the file, which combines the section and layer that are
+   * written to it as (sect << 16) | layer, with the part that is not
+   * split on set to zero.
+   */
+  uint32_t key;
+  
+  /*
+   * Non-zero once the file has been created, after which the buffer is
+   * appended to it.
+   */
+  int started;
+  
+  /*
+   * The buffer of text not yet written, holding len bytes, with a
+   * capacity of cap bytes.
+   */
+  char *pBuf;
+  size_t len;
+  size_t cap;
+  
+} SINK;
+
+/*
+ * A note in the carry list when chunking, which started in an earlier
+ * chunk and is still sounding.
+ */
+typedef struct {
+  
+  /*
+   * The start and end time of the whole note.
+   */
+  int64_t t;
+  int64_t end;
+  
+  /*
+   * The pitch, instrument, and Retro layer of the note.
+   */
+  int pitch;
+  long inst;
+  long layer;
+  
+  /*
+   * The voice of the note, or zero if voices are not assigned.
+   */
+  int32_t voice;
+  
+} CARRY;
+
+/*
+ * A sounding note in the heap used for voice assignment.
+ */
+typedef struct {
+  
+  /*
+   * The end time of the note.
+   */
+  int64_t end;
+  
+  /*
+   * The voice of the note.
+   */
+  int32_t voice;
+  
+} BUSY;
+
+/*
+ * Static data
+ * ===========
+ */
+
+/*
+ * Flag indicating whether only the notes in a time window are output.
+ */
+static int m_window = 0;
+
+/*
+ * The start of the time window, inclusive, and the end of the time
+ * window, exclusive.
+ * 
+ * Only used if m_window.
+ */
+static int64_t m_from = 0;
+static int64_t m_to = INT64_MAX;
+
+/*
+ * The block reach array built by buildReach(), or NULL if it has not
+ * been built.
+ */
+static int64_t *m_reach = NULL;
+
+/*
+ * Flags indicating whether notes are clipped to the window, and whether
+ * times are made relative to the start of the window.
+ */
+static int m_clip = 0;
+static int m_rebase = 0;
+
+/*
+ * The split mode, one of the SPLIT_ constants, and the prefix of the
+ * output file names, or NULL if not given.
+ */
+static int m_split = SPLIT_NONE;
+static const char *m_prefix = NULL;
+
+/*
+ * The output files, in the order they were created.
+ * 
+ * m_sink_count is the number of files and m_sink_cap is the capacity of
+ * the array.
+ */
+static SINK *m_sink = NULL;
+static int32_t m_sink_count = 0;
+static int32_t m_sink_cap = 0;
+
+/*
+ * The hash table that maps keys to output files.
+ * 
+ * Each of the m_hash_cap slots holds an index into m_sink, or -1 if the
+ * slot is empty.  Collisions are resolved by linear probing.  NULL until
+ * the first output file is created.
+ */
+static int32_t *m_hash = NULL;
+static int32_t m_hash_cap = 0;
+
+/*
+ * The instrument and Retro layer of the notes of each NMF layer, or NULL
+ * if no layers are routed.
+ * 
+ * The entries for layer_i are at 2 * layer_i and 2 * layer_i + 1.  Zero
+ * entries mean instrument one and layer one.
+ */
+static int32_t *m_route = NULL;
+
+/*
+ * The chunk length in samples, or zero if the output is not chunked.
+ */
+static int64_t m_chunk = 0;
+
+/*
+ * The index of the chunk currently being written, and its output file,
+ * which is reused for each chunk and keyed by chunk index.
+ */
+static int64_t m_chunk_i = 0;
+static SINK m_chunk_sink;
+
+/*
+ * The carry list of notes still sounding from earlier chunks.
+ * 
+ * m_carry_count is the number of notes and m_carry_cap is the capacity
+ * of the array.
+ */
+static CARRY *m_carry = NULL;
+static int32_t m_carry_count = 0;
+static int32_t m_carry_cap = 0;
+
+/*
+ * Flag indicating whether voices are assigned, and the number of voices
+ * once they have been.
+ */
+static int m_voices = 0;
+static int32_t m_voice_count = 0;
+
+/*
+ * Local functions
+ * ===============
+ */
+
+/* Prototypes */
+static int32_t findStart(NMF_DATA *pd, int64_t t);
+static void buildReach(NMF_DATA *pd);
+static int32_t nextNote(int32_t x, int32_t ncount);
+static void free_reach(void);
+static int noteSpan(const NMF_NOTE *pn, int64_t *pt, int64_t *pEnd);
+static void busyPush(BUSY *pHeap, int32_t *pCount, int64_t end, int32_t v);
+static int32_t busyPop(BUSY *pHeap, int32_t *pCount);
+static void freePush(int32_t *pHeap, int32_t *pCount, int32_t v);
+static int32_t freePop(int32_t *pHeap, int32_t *pCount);
+static int32_t *assignVoices(NMF_DATA *pd, int32_t first, int32_t ncount);
+static size_t formatNote(
+    char    * pLine,
+    int64_t   t,
+    int64_t   dur,
+    int       pitch,
+    long      inst,
+    long      layer,
+    int64_t   carry,
+    int32_t   voice);
+static size_t formatVoices(char *pLine);
+static uint32_t hashKey(uint32_t key, int32_t cap);
+static SINK *getSink(uint32_t key);
+static char *sinkPath(uint32_t key);
+static int sinkFlush(SINK *ps, const char *pModule);
+static int sinkAppend(
+          SINK     * ps,
+    const char     * pLine,
+          size_t     len,
+    const char     * pModule);
+static int sinkWrite(
+          uint32_t   key,
+    const char     * pLine,
+          size_t     len,
+    const char     * pModule);
+static int flushSinks(const char *pModule);
+static void free_sinks(void);
+static int chunkBegin(const char *pModule);
+static int chunkNote(
+          int64_t   t,
+          int64_t   end,
+          int       pitch,
+          long      inst,
+          long      layer,
+          int32_t   voice,
+    const char    * pModule);
+static int chunkClose(const char *pModule);
+static int parseRoute(const char *pstr);
+static int report(NMF_DATA *pd, FILE *po, const char *pModule);
+static int parseInt(const char *pstr, int32_t *pv);
+
+/*
+ * Find the first note that starts at or after a given time.
+ * 
+ * The notes must be sorted.  The search is a binary search.
+ * 
+ * Parameters:
+ * 
+ *   pd - the parsed data object
+ * 
+ *   t - the time
+ * 
+ * Return:
+ * 
+ *   the index of the first note with a time at or after t, or the note
+ *   count if there is none
+ */
+static int32_t findStart(NMF_DATA *pd, int64_t t) {
+  
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  NMF_NOTE n;
+  
+  /* Initialize structure */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameter */
+  if (pd == NULL) {
+    abort();
+  }
+  
+  /* Every note before lo starts before t, and every note at or after hi
+   * starts at or after t */
+  lo = 0;
+  hi = nmf_notes(pd);
+  while (lo < hi) {
+    mid = lo + ((hi - lo) / 2);
+    nmf_get(pd, mid, &n);
+    if (((int64_t) n.t) < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  
+  return lo;
+}
+
+/*
+ * Build the block reach array of the sorted notes into m_reach.
+ * 
+ * The notes are split into blocks of REACH_BLOCK notes.  Element b of
+ * the array is the latest end time of any note in block b, ignoring
+ * grace notes and notes of duration zero, or -1 if the block has no
+ * such notes.  nextNote() uses it to skip whole blocks of notes that
+ * have all ended by the start of the window.
+ * 
+ * Building the array reads every note once.  The array is freed with
+ * free_reach().
+ * 
+ * Parameters:
+ * 
+ *   pd - the parsed data object
+ */
+static void buildReach(NMF_DATA *pd) {
+  
+  int32_t x = 0;
+  int32_t ncount = 0;
+  int64_t end = 0;
+  NMF_NOTE n;
+  
+  /* Initialize structure */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameter and state */
+  if (pd == NULL) {
+    abort();
+  }
+  if (m_reach != NULL) {
+    abort();
+  }
+  
+  /* Allocate the array */
+  ncount = nmf_notes(pd);
+  m_reach = (int64_t *) calloc(
+              (size_t) ((ncount / REACH_BLOCK) + 1), sizeof(int64_t));
+  if (m_reach == NULL) {
+    abort();
+  }
+  for(x = 0; x <= ncount / REACH_BLOCK; x++) {
+    m_reach[x] = -1;
+  }
+  
+  /* Fill the array */
+  for(x = 0; x < ncount; x++) {
+    nmf_get(pd, x, &n);
+    if (n.dur >= 1) {
+      end = ((int64_t) n.t) + ((int64_t) n.dur);
+      if (end > m_reach[x / REACH_BLOCK]) {
+        m_reach[x / REACH_BLOCK] = end;
+      }
+    }
+  }
+}
+
+/*
+ * Find the next note that might overlap the window.
+ * 
+ * If m_reach has been built, blocks of notes that have all ended by the
+ * start of the window are skipped.  Otherwise, x is returned unchanged.
+ * 
+ * Parameters:
+ * 
+ *   x - the index of the note to start from
+ * 
+ *   ncount - one past the index of the last note that might be output
+ * 
+ * Return:
+ * 
+ *   the index of the next note at or after x that might be output, or
+ *   ncount if there is none
+ */
+static int32_t nextNote(int32_t x, int32_t ncount) {
+  
+  /* Check parameters */
+  if ((x < 0) || (ncount < 0)) {
+    abort();
+  }
+  
+  /* Skip the blocks that end before the window */
+  if (m_reach != NULL) {
+    while (x < ncount) {
+      if (m_reach[x / REACH_BLOCK] > m_from) {
+        break;
+      }
+      x = ((x / REACH_BLOCK) + 1) * REACH_BLOCK;
+    }
+  }
+  
+  if (x > ncount) {
+    x = ncount;
+  }
+  return x;
+}
+
+/*
+ * Free the block reach array.
+ */
+static void free_reach(void) {
+  free(m_reach);
+  m_reach = NULL;
+}
+
+/*
+ * Get the output span of a note.
+ * 
+ * Notes of duration less than one are not output.  If m_window is set,
+ * notes that don't overlap the window are not output, and the span is
+ * clipped and rebased as selected by m_clip and m_rebase.
+ * 
+ * Parameters:
+ * 
+ *   pn - the note
+ * 
+ *   pt - receives the start time of the note
+ * 
+ *   pEnd - receives the end time of the note
+ * 
+ * Return:
+ * 
+ *   non-zero if the note is output, zero if it is skipped
+ */
+static int noteSpan(const NMF_NOTE *pn, int64_t *pt, int64_t *pEnd) {
+  
+  int64_t t = 0;
+  int64_t end = 0;
+  
+  /* Check parameters */
+  if ((pn == NULL) || (pt == NULL) || (pEnd == NULL)) {
+    abort();
+  }
+  
+  /* Ignore notes of duration less than one */
+  if (pn->dur < 1) {
+    return 0;
+  }
+  
+  /* Apply the window */
+  t = (int64_t) pn->t;
+  end = t + ((int64_t) pn->dur);
+  if (m_window) {
+    if ((end <= m_from) || (t >= m_to)) {
+      return 0;
+    }
+    if (m_clip) {
+      if (t < m_from) {
+        t = m_from;
+      }
+      if (end > m_to) {
+        end = m_to;
+      }
+    }
+    if (m_rebase) {
+      t = t - m_from;
+      end = end - m_from;
+    }
+  }
+  
+  *pt = t;
+  *pEnd = end;
+  return 1;
+}
+
+/*
+ * Add a sounding note to the heap of sounding notes, which is ordered
+ * by end time with the earliest at the root.
+ * 
+ * Parameters:
+ * 
+ *   pHeap - the heap, with room for the new note
+ * 
+ *   pCount - the number of notes in the heap, which is incremented
+ * 
+ *   end - the end time of the note
+ * 
+ *   v - the voice of the note
+ */
+static void busyPush(BUSY *pHeap, int32_t *pCount, int64_t end, int32_t v) {
+  
+  int32_t i = 0;
+  int32_t parent = 0;
+  
+  /* Check parameters */
+  if ((pHeap == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  
+  /* Sift up from the new leaf */
+  i = *pCount;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if ((pHeap[parent]).end <= end) {
+      break;
+    }
+    memcpy(&(pHeap[i]), &(pHeap[parent]), sizeof(BUSY));
+    i = parent;
+  }
+  (pHeap[i]).end = end;
+  (pHeap[i]).voice = v;
+  (*pCount)++;
+}
+
+/*
+ * Remove the sounding note with the earliest end time from the heap of
+ * sounding notes.
+ * 
+ * Parameters:
+ * 
+ *   pHeap - the heap, which must not be empty
+ * 
+ *   pCount - the number of notes in the heap, which is decremented
+ * 
+ * Return:
+ * 
+ *   the voice of the removed note
+ */
+static int32_t busyPop(BUSY *pHeap, int32_t *pCount) {
+  
+  int32_t result = 0;
+  int32_t i = 0;
+  int32_t c = 0;
+  int32_t count = 0;
+  BUSY last;
+  
+  /* Initialize structure */
+  memset(&last, 0, sizeof(BUSY));
+  
+  /* Check parameters */
+  if ((pHeap == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  if (*pCount < 1) {
+    abort();
+  }
+  
+  /* Take the root, and sift the last leaf down from the root */
+  result = (pHeap[0]).voice;
+  count = *pCount - 1;
+  memcpy(&last, &(pHeap[count]), sizeof(BUSY));
+  i = 0;
+  for(c = 1; c < count; c = 2 * i + 1) {
+    if ((c + 1 < count) && ((pHeap[c + 1]).end < (pHeap[c]).end)) {
+      c++;
+    }
+    if (last.end <= (pHeap[c]).end) {
+      break;
+    }
+    memcpy(&(pHeap[i]), &(pHeap[c]), sizeof(BUSY));
+    i = c;
+  }
+  if (count > 0) {
+    memcpy(&(pHeap[i]), &last, sizeof(BUSY));
+  }
+  *pCount = count;
+  
+  return result;
+}
+
+/*
+ * Add a voice to the heap of free voices, which is ordered by voice
+ * number with the lowest at the root.
+ * 
+ * Parameters:
+ * 
+ *   pHeap - the heap, with room for the new voice
+ * 
+ *   pCount - the number of voices in the heap, which is incremented
+ * 
+ *   v - the voice
+ */
+static void freePush(int32_t *pHeap, int32_t *pCount, int32_t v) {
+  
+  int32_t i = 0;
+  int32_t parent = 0;
+  
+  /* Check parameters */
+  if ((pHeap == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  
+  /* Sift up from the new leaf */
+  i = *pCount;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (pHeap[parent] <= v) {
+      break;
+    }
+    pHeap[i] = pHeap[parent];
+    i = parent;
+  }
+  pHeap[i] = v;
+  (*pCount)++;
+}
+
+/*
+ * Remove the lowest voice from the heap of free voices.
+ * 
+ * Parameters:
+ * 
+ *   pHeap - the heap, which must not be empty
+ * 
+ *   pCount - the number of voices in the heap, which is decremented
+ * 
+ * Return:
+ * 
+ *   the lowest free voice
+ */
+static int32_t freePop(int32_t *pHeap, int32_t *pCount) {
+  
+  int32_t result = 0;
+  int32_t i = 0;
+  int32_t c = 0;
+  int32_t count = 0;
+  int32_t last = 0;
+  
+  /* Check parameters */
+  if ((pHeap == NULL) || (pCount == NULL)) {
+    abort();
+  }
+  if (*pCount < 1) {
+    abort();
+  }
+  
+  /* Take the root, and sift the last leaf down from the root */
+  result = pHeap[0];
+  count = *pCount - 1;
+  last = pHeap[count];
+  i = 0;
+  for(c = 1; c < count; c = 2 * i + 1) {
+    if ((c + 1 < count) && (pHeap[c + 1] < pHeap[c])) {
+      c++;
+    }
+    if (last <= pHeap[c]) {
+      break;
+    }
+    pHeap[i] = pHeap[c];
+    i = c;
+  }
+  if (count > 0) {
+    pHeap[i] = last;
+  }
+  *pCount = count;
+  
+  return result;
+}
+
+/*
+ * Assign a voice to each note that is output.
+ * 
+ * The notes must be sorted.  Notes are visited in order of start time,
+ * which is not changed by clipping or rebasing.  Before each note, every
+ * sounding note that has ended by its start time frees its voice, and
+ * the note then takes the lowest free voice, or a new voice if none are
+ * free.  This uses the fewest voices possible, which is the greatest
+ * number of notes sounding at once.
+ * 
+ * m_voice_count is set to the number of voices.
+ * 
+ * Parameters:
+ * 
+ *   pd - the parsed data object
+ * 
+ *   first - the index of the first note that might be output
+ * 
+ *   ncount - one past the index of the last note that might be output
+ * 
+ * Return:
+ * 
+ *   a newly allocated array of (ncount - first) voices, numbered from
+ *   one, with zero for notes that are not output, to be freed with
+ *   free()
+ */
+static int32_t *assignVoices(NMF_DATA *pd, int32_t first, int32_t ncount) {
+  
+  int32_t x = 0;
+  int32_t count = 0;
+  int32_t busy_count = 0;
+  int32_t free_count = 0;
+  int64_t t = 0;
+  int64_t end = 0;
+  int32_t *pVoice = NULL;
+  int32_t *pFree = NULL;
+  BUSY *pBusy = NULL;
+  NMF_NOTE n;
+  
+  /* Initialize structure */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameters */
+  if ((pd == NULL) || (first < 0) || (ncount < first)) {
+    abort();
+  }
+  
+  /* Allocate the voices and the heaps, with room for every note */
+  count = ncount - first;
+  pVoice = (int32_t *) calloc((size_t) (count + 1), sizeof(int32_t));
+  pFree = (int32_t *) calloc((size_t) (count + 1), sizeof(int32_t));
+  pBusy = (BUSY *) calloc((size_t) (count + 1), sizeof(BUSY));
+  if ((pVoice == NULL) || (pFree == NULL) || (pBusy == NULL)) {
+    abort();
+  }
+  
+  /* Assign each note a voice */
+  m_voice_count = 0;
+  for(x = nextNote(first, ncount); x < ncount; x = nextNote(x + 1, ncount)) {
+    
+    /* Get the note, skipping notes that aren't output */
+    nmf_get(pd, x, &n);
+    if (!noteSpan(&n, &t, &end)) {
+      continue;
+    }
+    
+    /* Free the voices of the notes that have ended */
+    while (busy_count > 0) {
+      if ((pBusy[0]).end > t) {
+        break;
+      }
+      freePush(pFree, &free_count, busyPop(pBusy, &busy_count));
+    }
+    
+    /* Take the lowest free voice, or a new voice */
+    if (free_count > 0) {
+      pVoice[x - first] = freePop(pFree, &free_count);
+    } else {
+      m_voice_count++;
+      pVoice[x - first] = m_voice_count;
+    }
+    busyPush(pBusy, &busy_count, end, pVoice[x - first]);
+  }
+  
+  /* Free the heaps */
+  free(pFree);
+  pFree = NULL;
+  free(pBusy);
+  pBusy = NULL;
+  
+  return pVoice;
+}
+
+/*
+ * Format a note event line.
+ * 
+ * The line is in the Retro note command format, followed by a trailing
+ * comment with the carry offset if the note is carried from an earlier
+ * chunk, and the voice if voices are assigned.
+ * 
+ * Parameters:
+ * 
+ *   pLine - the buffer, with room for LINE_MAX_LEN + 1 bytes
+ * 
+ *   t - the start time of the note
+ * 
+ *   dur - the duration of the note
+ * 
+ *   pitch - the pitch of the note
+ * 
+ *   inst - the instrument of the note
+ * 
+ *   layer - the Retro layer of the note
+ * 
+ *   carry - the number of samples of the note in earlier chunks, or -1
+ *   if the note is not carried
+ * 
+ *   voice - the voice of the note, or zero if voices are not assigned
+ * 
+ * Return:
+ * 
+ *   the length of the line, including the line break
+ */
+static size_t formatNote(
+    char    * pLine,
+    int64_t   t,
+    int64_t   dur,
+    int       pitch,
+    long      inst,
+    long      layer,
+    int64_t   carry,
+    int32_t   voice) {
+  
+  int len = 0;
+  
+  /* Check parameter */
+  if (pLine == NULL) {
+    abort();
+  }
+  
+  /* Format the line */
+  if ((carry >= 0) && (voice > 0)) {
+    len = snprintf(pLine, LINE_MAX_LEN + 1,
+                    "%ld %ld %d %ld %ld n # carry %ld voice %ld\n",
+                    (long) t, (long) dur, pitch, inst, layer,
+                    (long) carry, (long) voice);
+  } else if (carry >= 0) {
+    len = snprintf(pLine, LINE_MAX_LEN + 1,
+                    "%ld %ld %d %ld %ld n # carry %ld\n",
+                    (long) t, (long) dur, pitch, inst, layer,
+                    (long) carry);
+  } else if (voice > 0) {
+    len = snprintf(pLine, LINE_MAX_LEN + 1,
+                    "%ld %ld %d %ld %ld n # voice %ld\n",
+                    (long) t, (long) dur, pitch, inst, layer,
+                    (long) voice);
+  } else {
+    len = snprintf(pLine, LINE_MAX_LEN + 1,
+                    "%ld %ld %d %ld %ld n\n",
+                    (long) t, (long) dur, pitch, inst, layer);
+  }
+  if ((len < 1) || (len > LINE_MAX_LEN)) {
+    abort();
+  }
+  
+  return (size_t) len;
+}
+
+/*
+ * Format the voice count header line.
+ * 
+ * Parameters:
+ * 
+ *   pLine - the buffer, with room for LINE_MAX_LEN + 1 bytes
+ * 
+ * Return:
+ * 
+ *   the length of the line, including the line break
+ */
+static size_t formatVoices(char *pLine) {
+  
+  int len = 0;
+  
+  /* Check parameter */
+  if (pLine == NULL) {
+    abort();
+  }
+  
+  len = snprintf(pLine, LINE_MAX_LEN + 1, "# voices %ld\n",
+                  (long) m_voice_count);
+  if ((len < 1) || (len > LINE_MAX_LEN)) {
+    abort();
+  }
+  
+  return (size_t) len;
+}
+
+/*
+ * Compute the starting slot of a key in a hash table.
+ * 
+ * Parameters:
+ * 
+ *   key - the output file key
+ * 
+ *   cap - the number of slots, a power of two
+ * 
+ * Return:
+ * 
+ *   the starting slot
+ */
+static uint32_t hashKey(uint32_t key, int32_t cap) {
+  return (key * UINT32_C(2654435761)) & ((uint32_t) (cap - 1));
+}
+
+/*
+ * Get the output file with a given key, creating it if necessary.
+ * 
+ * A new output file has an empty buffer and is not created on disk
+ * until it is first flushed.  Pointers to output files are only valid
+ * until the next one is created.
+ * 
+ * Parameters:
+ * 
+ *   key - the output file key
+ * 
+ * Return:
+ * 
+ *   the output file
+ */
+static SINK *getSink(uint32_t key) {
+  
+  uint32_t h = 0;
+  int32_t i = 0;
+  int32_t newcap = 0;
+  int32_t *pNew = NULL;
+  SINK *pns = NULL;
+  
+  /* Allocate the hash table if necessary */
+  if (m_hash == NULL) {
+    m_hash_cap = SINK_INITHASH;
+    m_hash = (int32_t *) malloc(((size_t) m_hash_cap) * sizeof(int32_t));
+    if (m_hash == NULL) {
+      abort();
+    }
+    for(i = 0; i < m_hash_cap; i++) {
+      m_hash[i] = -1;
+    }
+  }
+  
+  /* Look for the key */
+  for(h = hashKey(key, m_hash_cap);
+      m_hash[h] >= 0;
+      h = (h + 1) & ((uint32_t) (m_hash_cap - 1))) {
+    if ((m_sink[m_hash[h]]).key == key) {
+      return &(m_sink[m_hash[h]]);
+    }
+  }
+  
+  /* Grow the array of output files if it is full */
+  if (m_sink_count >= m_sink_cap) {
+    if (m_sink_cap < 1) {
+      newcap = SINK_INITHASH / 2;
+    } else {
+      newcap = m_sink_cap * 2;
+    }
+    pns = (SINK *) realloc(m_sink, ((size_t) newcap) * sizeof(SINK));
+    if (pns == NULL) {
+      abort();
+    }
+    m_sink = pns;
+    m_sink_cap = newcap;
+  }
+  
+  /* Add the output file */
+  memset(&(m_sink[m_sink_count]), 0, sizeof(SINK));
+  (m_sink[m_sink_count]).key = key;
+  (m_sink[m_sink_count]).started = 0;
+  (m_sink[m_sink_count]).pBuf = NULL;
+  m_hash[h] = m_sink_count;
+  m_sink_count++;
+  
+  /* Double the hash table if it is more than half full */
+  if (m_sink_count > m_hash_cap / 2) {
+    newcap = m_hash_cap * 2;
+    pNew = (int32_t *) malloc(((size_t) newcap) * sizeof(int32_t));
+    if (pNew == NULL) {
+      abort();
+    }
+    for(i = 0; i < newcap; i++) {
+      pNew[i] = -1;
+    }
+    for(i = 0; i < m_sink_count; i++) {
+      for(h = hashKey((m_sink[i]).key, newcap);
+          pNew[h] >= 0;
+          h = (h + 1) & ((uint32_t) (newcap - 1)));
+      pNew[h] = i;
+    }
+    free(m_hash);
+    m_hash = pNew;
+    m_hash_cap = newcap;
+  }
+  
+  return &(m_sink[m_sink_count - 1]);
+}
+
+/*
+ * Build the path of an output file.
+ * 
+ * m_prefix must be set.  The path must be freed with free().
+ * 
+ * Parameters:
+ * 
+ *   key - the output file key
+ * 
+ * Return:
+ * 
+ *   the path
+ */
+static char *sinkPath(uint32_t key) {
+  
+  char *pPath = NULL;
+  size_t cap = 0;
+  long sect = 0;
+  long layer = 0;
+  
+  /* Check state */
+  if (m_prefix == NULL) {
+    abort();
+  }
+  
+  /* Allocate the path */
+  cap = strlen(m_prefix) + 32;
+  pPath = (char *) malloc(cap);
+  if (pPath == NULL) {
+    abort();
+  }
+  
+  /* Format the path, numbering from one */
+  sect = ((long) (key >> 16)) + 1;
+  layer = ((long) (key & UINT32_C(0xffff))) + 1;
+  if (m_chunk > 0) {
+    snprintf(pPath, cap, "%sC%ld", m_prefix, ((long) key) + 1);
+  } else if (m_split == SPLIT_LAYER) {
+    snprintf(pPath, cap, "%sL%ld", m_prefix, layer);
+  } else if (m_split == SPLIT_SECT) {
+    snprintf(pPath, cap, "%sS%ld", m_prefix, sect);
+  } else if (m_split == SPLIT_BOTH) {
+    snprintf(pPath, cap, "%sS%ldL%ld", m_prefix, sect, layer);
+  } else {
+    abort();
+  }
+  
+  return pPath;
+}
+
+/*
+ * Write the buffer of an output file to disk and empty it.
+ * 
+ * The file is created the first time, replacing any existing file, and
+ * appended to after that.  The file is only kept open while it is being
+ * written.  Errors are reported to standard error.
+ * 
+ * Parameters:
+ * 
+ *   ps - the output file
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sinkFlush(SINK *ps, const char *pModule) {
+  
+  int status = 1;
+  char *pPath = NULL;
+  FILE *pf = NULL;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Open the file */
+  pPath = sinkPath(ps->key);
+  if (ps->started) {
+    pf = fopen(pPath, "ab");
+  } else {
+    pf = fopen(pPath, "wb");
+  }
+  if (pf == NULL) {
+    status = 0;
+  }
+  
+  /* Write the buffer */
+  if (status && (ps->len > 0)) {
+    if (fwrite(ps->pBuf, 1, ps->len, pf) != ps->len) {
+      status = 0;
+    }
+  }
+  
+  /* Close the file */
+  if (pf != NULL) {
+    if (fclose(pf)) {
+      status = 0;
+    }
+    pf = NULL;
+  }
+  
+  /* Report errors, or empty the buffer */
+  if (status) {
+    ps->started = 1;
+    ps->len = 0;
+  } else {
+    fprintf(stderr, "%s: Can't write output file %s!\n", pModule, pPath);
+  }
+  
+  /* Free the path */
+  free(pPath);
+  pPath = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Add a line of text to the buffer of an output file.
+ * 
+ * The buffer grows up to SINK_MAXBUF bytes, and is then written to disk
+ * whenever it would overflow.
+ * 
+ * Parameters:
+ * 
+ *   ps - the output file
+ * 
+ *   pLine - the text to write
+ * 
+ *   len - the length of the text, at most LINE_MAX_LEN
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sinkAppend(
+          SINK     * ps,
+    const char     * pLine,
+          size_t     len,
+    const char     * pModule) {
+  
+  int status = 1;
+  char *pb = NULL;
+  size_t newcap = 0;
+  
+  /* Check parameters */
+  if ((ps == NULL) || (pLine == NULL) || (len > LINE_MAX_LEN) ||
+      (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Make room in the buffer, growing it if it is still small and
+   * flushing it otherwise */
+  if (ps->len + len > ps->cap) {
+    if (ps->cap < SINK_MAXBUF) {
+      if (ps->cap < 1) {
+        newcap = SINK_INITBUF;
+      } else {
+        newcap = ps->cap * 2;
+      }
+      pb = (char *) realloc(ps->pBuf, newcap);
+      if (pb == NULL) {
+        abort();
+      }
+      ps->pBuf = pb;
+      ps->cap = newcap;
+      
+    } else {
+      if (!sinkFlush(ps, pModule)) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Add the line */
+  if (status) {
+    memcpy(ps->pBuf + ps->len, pLine, len);
+    ps->len += len;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Write a line of text to an output file.
+ * 
+ * The line is added to the buffer of the output file with the given
+ * key, which is created if necessary.  If m_voices is set, a new output
+ * file starts with the voice count header.
+ * 
+ * Parameters:
+ * 
+ *   key - the output file key
+ * 
+ *   pLine - the text to write
+ * 
+ *   len - the length of the text, at most LINE_MAX_LEN
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int sinkWrite(
+          uint32_t   key,
+    const char     * pLine,
+          size_t     len,
+    const char     * pModule) {
+  
+  int status = 1;
+  SINK *ps = NULL;
+  size_t hlen = 0;
+  char head[LINE_MAX_LEN + 1];
+  
+  /* Initialize structures */
+  memset(head, 0, sizeof(head));
+  
+  /* Check parameters */
+  if ((pLine == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Get the output file */
+  ps = getSink(key);
+  
+  /* Start a new file with the voice count header if voices are
+   * assigned */
+  if (m_voices && (!(ps->started)) && (ps->len < 1)) {
+    hlen = formatVoices(head);
+    if (!sinkAppend(ps, head, hlen, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Add the line */
+  if (status) {
+    if (!sinkAppend(ps, pLine, len, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Write the remaining buffer of every output file to disk.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int flushSinks(const char *pModule) {
+  
+  int status = 1;
+  int32_t i = 0;
+  
+  /* Check parameter */
+  if (pModule == NULL) {
+    abort();
+  }
+  
+  for(i = 0; i < m_sink_count; i++) {
+    if (((m_sink[i]).len > 0) || (!((m_sink[i]).started))) {
+      if (!sinkFlush(&(m_sink[i]), pModule)) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  return status;
+}
+
+/*
+ * Free all output files and the carry list.
+ */
+static void free_sinks(void) {
+  
+  int32_t i = 0;
+  
+  for(i = 0; i < m_sink_count; i++) {
+    free((m_sink[i]).pBuf);
+    (m_sink[i]).pBuf = NULL;
+  }
+  free(m_sink);
+  m_sink = NULL;
+  m_sink_count = 0;
+  m_sink_cap = 0;
+  
+  free(m_hash);
+  m_hash = NULL;
+  m_hash_cap = 0;
+  
+  free(m_chunk_sink.pBuf);
+  memset(&m_chunk_sink, 0, sizeof(SINK));
+  
+  free(m_carry);
+  m_carry = NULL;
+  m_carry_count = 0;
+  m_carry_cap = 0;
+}
+
+/*
+ * Begin writing the chunk file m_chunk_i.
+ * 
+ * The chunk file starts with a comment giving its number and start
+ * time, and the voice count header if m_voices is set, followed by a
+ * note event for each note in the carry list.  The carry notes start at
+ * time zero of the chunk, with the remaining part of their duration that
+ * falls within the chunk, and a trailing comment giving the number of
+ * samples of the note that were already sounded in earlier chunks.
+ * Notes that end within the chunk are dropped from the carry list.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int chunkBegin(const char *pModule) {
+  
+  int status = 1;
+  int len = 0;
+  size_t nlen = 0;
+  int32_t i = 0;
+  int32_t keep = 0;
+  int64_t start = 0;
+  int64_t stop = 0;
+  char line[LINE_MAX_LEN + 1];
+  
+  /* Initialize structures */
+  memset(line, 0, sizeof(line));
+  
+  /* Check parameter */
+  if (pModule == NULL) {
+    abort();
+  }
+  
+  /* Reset the chunk file */
+  m_chunk_sink.key = (uint32_t) m_chunk_i;
+  m_chunk_sink.started = 0;
+  m_chunk_sink.len = 0;
+  
+  /* Write the header comment */
+  start = m_chunk_i * m_chunk;
+  len = snprintf(line, sizeof(line), "# chunk %ld start %ld\n",
+                  (long) (m_chunk_i + 1),
+                  (long) start);
+  if ((len < 1) || (len > LINE_MAX_LEN)) {
+    abort();
+  }
+  if (!sinkAppend(&m_chunk_sink, line, (size_t) len, pModule)) {
+    status = 0;
+  }
+  
+  /* Write the voice count header */
+  if (status && m_voices) {
+    nlen = formatVoices(line);
+    if (!sinkAppend(&m_chunk_sink, line, nlen, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Write the carry notes, keeping those that extend past the chunk */
+  if (status) {
+    keep = 0;
+    for(i = 0; i < m_carry_count; i++) {
+      stop = (m_carry[i]).end;
+      if (stop > start + m_chunk) {
+        stop = start + m_chunk;
+      }
+      
+      nlen = formatNote(line, 0, stop - start,
+                  (m_carry[i]).pitch,
+                  (m_carry[i]).inst,
+                  (m_carry[i]).layer,
+                  start - (m_carry[i]).t,
+                  (m_carry[i]).voice);
+      if (!sinkAppend(&m_chunk_sink, line, nlen, pModule)) {
+        status = 0;
+        break;
+      }
+      
+      if ((m_carry[i]).end > start + m_chunk) {
+        if (keep < i) {
+          memcpy(&(m_carry[keep]), &(m_carry[i]), sizeof(CARRY));
+        }
+        keep++;
+      }
+    }
+    if (status) {
+      m_carry_count = keep;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Write a note to the chunk that it starts in.
+ * 
+ * The notes must be given in order of start time.  Chunk files are
+ * completed and begun as necessary to reach the chunk of the note,
+ * including empty chunks, so that the chunk files are numbered without
+ * gaps.  If the note extends past the end of its chunk, it is cut off at
+ * the end of the chunk and the rest is added to the carry list.
+ * 
+ * Parameters:
+ * 
+ *   t - the start time of the note
+ * 
+ *   end - the end time of the note, after t
+ * 
+ *   pitch - the pitch of the note
+ * 
+ *   inst - the instrument of the note
+ * 
+ *   layer - the Retro layer of the note
+ * 
+ *   voice - the voice of the note, or zero if voices are not assigned
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
  */
-
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "nmf.h"
+static int chunkNote(
+          int64_t   t,
+          int64_t   end,
+          int       pitch,
+          long      inst,
+          long      layer,
+          int32_t   voice,
+    const char    * pModule) {
+  
+  int status = 1;
+  size_t len = 0;
+  int64_t start = 0;
+  int64_t stop = 0;
+  int32_t newcap = 0;
+  CARRY *pc = NULL;
+  char line[LINE_MAX_LEN + 1];
+  
+  /* Initialize structures */
+  memset(line, 0, sizeof(line));
+  
+  /* Check parameters */
+  if ((t < m_chunk_i * m_chunk) || (end <= t) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Advance to the chunk of the note */
+  while (m_chunk_i < t / m_chunk) {
+    if (!sinkFlush(&m_chunk_sink, pModule)) {
+      status = 0;
+      break;
+    }
+    m_chunk_i++;
+    if (!chunkBegin(pModule)) {
+      status = 0;
+      break;
+    }
+  }
+  
+  /* Write the part of the note within the chunk */
+  if (status) {
+    start = m_chunk_i * m_chunk;
+    stop = end;
+    if (stop > start + m_chunk) {
+      stop = start + m_chunk;
+    }
+    
+    len = formatNote(line, t - start, stop - t, pitch, inst, layer,
+                      -1, voice);
+    if (!sinkAppend(&m_chunk_sink, line, len, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Carry the rest of the note to later chunks */
+  if (status && (end > start + m_chunk)) {
+    if (m_carry_count >= m_carry_cap) {
+      if (m_carry_cap < 1) {
+        newcap = CARRY_INIT;
+      } else {
+        newcap = m_carry_cap * 2;
+      }
+      pc = (CARRY *) realloc(m_carry, ((size_t) newcap) * sizeof(CARRY));
+      if (pc == NULL) {
+        abort();
+      }
+      m_carry = pc;
+      m_carry_cap = newcap;
+    }
+    
+    (m_carry[m_carry_count]).t = t;
+    (m_carry[m_carry_count]).end = end;
+    (m_carry[m_carry_count]).pitch = pitch;
+    (m_carry[m_carry_count]).inst = inst;
+    (m_carry[m_carry_count]).layer = layer;
+    (m_carry[m_carry_count]).voice = voice;
+    m_carry_count++;
+  }
+  
+  /* Return status */
+  return status;
+}
 
 /*
- * Local functions
- * ===============
+ * Complete the current chunk file, and write further chunk files until
+ * the carry list is empty.
+ * 
+ * Parameters:
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
  */
+static int chunkClose(const char *pModule) {
+  
+  int status = 1;
+  
+  /* Check parameter */
+  if (pModule == NULL) {
+    abort();
+  }
+  
+  /* Complete the current chunk */
+  if (!sinkFlush(&m_chunk_sink, pModule)) {
+    status = 0;
+  }
+  
+  /* Write the chunks that the carry list still sounds in */
+  while (status && (m_carry_count > 0)) {
+    m_chunk_i++;
+    if (!chunkBegin(pModule)) {
+      status = 0;
+    }
+    if (status) {
+      if (!sinkFlush(&m_chunk_sink, pModule)) {
+        status = 0;
+      }
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
 
-/* Prototypes */
-static void report(NMF_DATA *pd, FILE *po);
+/*
+ * Add a layer route from the argument of a --route option.
+ * 
+ * The argument is the NMF layer number, instrument, and Retro layer,
+ * separated by colons.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the argument
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if the argument is invalid
+ */
+static int parseRoute(const char *pstr) {
+  
+  int status = 1;
+  int i = 0;
+  size_t len = 0;
+  char *pCopy = NULL;
+  char *pItem = NULL;
+  char *pNext = NULL;
+  int32_t v[3];
+  
+  /* Initialize structures */
+  memset(v, 0, sizeof(v));
+  
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
+  }
+  
+  /* Make a copy that can be split */
+  len = strlen(pstr);
+  pCopy = (char *) malloc(len + 1);
+  if (pCopy == NULL) {
+    abort();
+  }
+  memcpy(pCopy, pstr, len + 1);
+  
+  /* Parse the three fields */
+  pItem = pCopy;
+  for(i = 0; i < 3; i++) {
+    if (pItem == NULL) {
+      status = 0;
+      break;
+    }
+    pNext = strchr(pItem, ':');
+    if (pNext != NULL) {
+      *pNext = 0;
+      pNext++;
+    }
+    if (!parseInt(pItem, &(v[i]))) {
+      status = 0;
+      break;
+    }
+    pItem = pNext;
+  }
+  if (status && (pItem != NULL)) {
+    status = 0;
+  }
+  
+  /* Free the copy */
+  free(pCopy);
+  pCopy = NULL;
+  
+  /* Range-check the fields */
+  if (status) {
+    if ((v[0] < 1) || (v[0] > LAYER_COUNT) || (v[1] < 1) || (v[2] < 1)) {
+      status = 0;
+    }
+  }
+  
+  /* Store the route */
+  if (status) {
+    if (m_route == NULL) {
+      m_route = (int32_t *) calloc(
+                  (size_t) (2 * LAYER_COUNT), sizeof(int32_t));
+      if (m_route == NULL) {
+        abort();
+      }
+    }
+    m_route[2 * (v[0] - 1)] = v[1];
+    m_route[2 * (v[0] - 1) + 1] = v[2];
+  }
+  
+  /* Return status */
+  return status;
+}
 
 /*
  * Print a textual representation of each note in the given parsed data
  * object to the given file.
  * 
  * The textual representation follows the Retro synthesizer note command
- * format, with instrument one and layer one always used.
+ * format, with the instrument and layer selected by m_route, or
+ * instrument one and layer one if the layer of the note is not routed.
  * 
  * Grace notes and notes of duration zero are ignored.
  * 
+ * If m_split is set, each note is written to the buffer of its output
+ * file instead of po, and the output files are written to disk as their
+ * buffers fill.  Call flushSinks() afterwards to write the rest.
+ * 
+ * If m_chunk is set, the notes must be sorted, and each note is written
+ * to the chunk file it starts in instead of po, with every chunk file
+ * completed before this function returns.
+ * 
+ * If m_voices is set, the notes must be sorted, and each note is
+ * written with its voice, after a header giving the voice count.
+ * 
+ * If m_window is set, the notes must be sorted, and only the notes that
+ * overlap the time window are printed, clipped and rebased as selected
+ * by m_clip and m_rebase.  Only the notes from the first one that might
+ * still be sounding at the start of the window up to the end of the
+ * window are visited, skipping blocks of notes that have all ended
+ * before the window with nextNote().
+ * 
  * Parameters:
  * 
  *   pd - the parsed data object
  * 
  *   po - the output file
+ * 
+ *   pModule - the module name for error messages
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
  */
-static void report(NMF_DATA *pd, FILE *po) {
+static int report(NMF_DATA *pd, FILE *po, const char *pModule) {
   
+  int status = 1;
   int32_t x = 0;
+  size_t len = 0;
+  long inst = 1;
+  long layer = 1;
+  uint32_t key = 0;
+  char line[LINE_MAX_LEN + 1];
+  int32_t first = 0;
   int32_t ncount = 0;
+  int32_t voice = 0;
+  int64_t t = 0;
+  int64_t end = 0;
+  int64_t last = 0;
+  int32_t *pVoice = NULL;
   NMF_NOTE n;
   
-  /* Initialize structure */
+  /* Initialize structures */
   memset(&n, 0, sizeof(NMF_NOTE));
+  memset(line, 0, sizeof(line));
   
-  /* Check parameter */
-  if ((pd == NULL) || (po == NULL)) {
+  /* Check parameters */
+  if ((pd == NULL) || (po == NULL) || (pModule == NULL)) {
     abort();
   }
   
   /* Get note count */
   ncount = nmf_notes(pd);
   
+  /* If there is a window, find the notes that might overlap it */
+  first = 0;
+  if (m_window) {
+    buildReach(pd);
+    ncount = findStart(pd, m_to);
+    first = nextNote(0, ncount);
+  }
+  
+  /* If assigning voices, assign them to all the notes first, so that
+   * the voice count is known for the headers */
+  if (m_voices) {
+    pVoice = assignVoices(pd, first, ncount);
+    if ((m_chunk < 1) && (m_split == SPLIT_NONE)) {
+      len = formatVoices(line);
+      fwrite(line, 1, len, po);
+    }
+  }
+  
+  /* If chunking, make sure the notes fit in CHUNK_MAX chunk files, and
+   * begin the first chunk */
+  if (m_chunk > 0) {
+    last = 0;
+    for(x = first; x < ncount; x = nextNote(x + 1, ncount)) {
+      nmf_get(pd, x, &n);
+      if (noteSpan(&n, &t, &end)) {
+        if (end > last) {
+          last = end;
+        }
+      }
+    }
+    if ((last - 1) / m_chunk >= CHUNK_MAX) {
+      status = 0;
+      fprintf(stderr, "%s: Chunk length gives too many chunk files!\n",
+                pModule);
+      ncount = first;
+    }
+  }
+  if (status && (m_chunk > 0)) {
+    m_chunk_i = 0;
+    if (!chunkBegin(pModule)) {
+      status = 0;
+      ncount = first;
+    }
+  }
+  
   /* Print each note */
-  for(x = 0; x < ncount; x++) {
+  for(x = first; x < ncount; x = nextNote(x + 1, ncount)) {
     
     /* Get the note */
     nmf_get(pd, x, &n);
     
-    /* Ignore notes of duration less than one */
-    if (n.dur < 1) {
+    /* Get the span of the note, skipping notes that aren't output */
+    if (!noteSpan(&n, &t, &end)) {
       continue;
     }
     
+    /* Get the voice */
+    voice = 0;
+    if (pVoice != NULL) {
+      voice = pVoice[x - first];
+    }
+    
+    /* Select the instrument and layer */
+    inst = 1;
+    layer = 1;
+    if (m_route != NULL) {
+      if (m_route[2 * n.layer_i] > 0) {
+        inst = (long) m_route[2 * n.layer_i];
+        layer = (long) m_route[2 * n.layer_i + 1];
+      }
+    }
+    
     /* Print the information */
-    fprintf(po, "%ld %ld %d 1 1 n\n",
-            (long) n.t,
-            (long) n.dur,
-            (int) n.pitch);
+    if (m_chunk > 0) {
+      if (!chunkNote(t, end, (int) n.pitch, inst, layer, voice,
+                      pModule)) {
+        status = 0;
+        break;
+      }
+      
+    } else if (m_split == SPLIT_NONE) {
+      len = formatNote(line, t, end - t, (int) n.pitch, inst, layer,
+                        -1, voice);
+      fwrite(line, 1, len, po);
+      
+    } else {
+      len = formatNote(line, t, end - t, (int) n.pitch, inst, layer,
+                        -1, voice);
+      
+      key = 0;
+      if ((m_split == SPLIT_SECT) || (m_split == SPLIT_BOTH)) {
+        key |= ((uint32_t) n.sect) << 16;
+      }
+      if ((m_split == SPLIT_LAYER) || (m_split == SPLIT_BOTH)) {
+        key |= (uint32_t) n.layer_i;
+      }
+      
+      if (!sinkWrite(key, line, len, pModule)) {
+        status = 0;
+        break;
+      }
+    }
+  }
+  
+  /* If chunking, complete the chunk files */
+  if (status && (m_chunk > 0)) {
+    if (!chunkClose(pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Free the voices and the reach array */
+  free(pVoice);
+  pVoice = NULL;
+  free_reach();
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse the given string as a signed integer.
+ * 
+ * pstr is the string to parse.
+ * 
+ * pv points to the integer value to use to return the parsed numeric
+ * value if the function is successful.
+ * 
+ * In two's complement, this function will not successfully parse the
+ * least negative value.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ *   pv - pointer to the return numeric value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseInt(const char *pstr, int32_t *pv) {
+  
+  int negflag = 0;
+  int32_t result = 0;
+  int status = 1;
+  int32_t d = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* If first character is a sign character, set negflag appropriately
+   * and skip it */
+  if (*pstr == '+') {
+    negflag = 0;
+    pstr++;
+  } else if (*pstr == '-') {
+    negflag = 1;
+    pstr++;
+  } else {
+    negflag = 0;
+  }
+  
+  /* Make sure we have at least one digit */
+  if (*pstr == 0) {
+    status = 0;
+  }
+  
+  /* Parse all digits */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+    
+      /* Make sure in range of digits */
+      if ((*pstr < '0') || (*pstr > '9')) {
+        status = 0;
+      }
+    
+      /* Get numeric value of digit */
+      if (status) {
+        d = (int32_t) (*pstr - '0');
+      }
+      
+      /* Multiply result by 10, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX / 10) {
+          result = result * 10;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Add in digit value, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX - d) {
+          result = result + d;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+    
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
   }
+  
+  /* Invert result if negative mode */
+  if (status && negflag) {
+    result = -(result);
+  }
+  
+  /* Write result if successful */
+  if (status) {
+    *pv = result;
+  }
+  
+  /* Return status */
+  return status;
 }
 
 /*
@@ -97,6 +2076,8 @@ int main(int argc, char *argv[]) {
   
   int status = 1;
   int basis = 0;
+  int x = 0;
+  int32_t v = 0;
   const char *pModule = NULL;
   NMF_DATA *pd = NULL;
   
@@ -112,10 +2093,136 @@ int main(int argc, char *argv[]) {
     pModule = "nmfsimple";
   }
   
-  /* There may be no arguments beyond the module name */
+  /* Make sure arguments are present */
   if (argc > 1) {
-    fprintf(stderr, "%s: Not expecting arguments!\n", pModule);
+    if (argv == NULL) {
+      abort();
+    }
+    for(x = 0; x < argc; x++) {
+      if (argv[x] == NULL) {
+        abort();
+      }
+    }
+  }
+  
+  /* Parse any options */
+  for(x = 1; x < argc; x++) {
+    if (strncmp(argv[x], "--from=", strlen("--from=")) == 0) {
+      if (!parseInt(argv[x] + strlen("--from="), &v)) {
+        status = 0;
+      } else if (v < 0) {
+        status = 0;
+      } else {
+        m_from = (int64_t) v;
+        m_window = 1;
+      }
+      if (!status) {
+        fprintf(stderr, "%s: Invalid window start!\n", pModule);
+      }
+      
+    } else if (strncmp(argv[x], "--to=", strlen("--to=")) == 0) {
+      if (!parseInt(argv[x] + strlen("--to="), &v)) {
+        status = 0;
+      } else if (v < 1) {
+        status = 0;
+      } else {
+        m_to = (int64_t) v;
+        m_window = 1;
+      }
+      if (!status) {
+        fprintf(stderr, "%s: Invalid window end!\n", pModule);
+      }
+      
+    } else if (strcmp(argv[x], "--clip") == 0) {
+      m_clip = 1;
+      
+    } else if (strcmp(argv[x], "--rebase") == 0) {
+      m_rebase = 1;
+      
+    } else if (strcmp(argv[x], "--voices") == 0) {
+      m_voices = 1;
+      
+    } else if (strncmp(argv[x], "--split=", strlen("--split=")) == 0) {
+      if (strcmp(argv[x] + strlen("--split="), "layer") == 0) {
+        m_split = SPLIT_LAYER;
+      } else if (strcmp(argv[x] + strlen("--split="), "sect") == 0) {
+        m_split = SPLIT_SECT;
+      } else if (strcmp(argv[x] + strlen("--split="), "both") == 0) {
+        m_split = SPLIT_BOTH;
+      } else {
+        status = 0;
+        fprintf(stderr, "%s: Invalid split mode!\n", pModule);
+      }
+      
+    } else if (strncmp(argv[x], "--prefix=", strlen("--prefix=")) == 0) {
+      m_prefix = argv[x] + strlen("--prefix=");
+      if (*m_prefix == 0) {
+        status = 0;
+        fprintf(stderr, "%s: Invalid file prefix!\n", pModule);
+      }
+      
+    } else if (strncmp(argv[x], "--chunk=", strlen("--chunk=")) == 0) {
+      if (!parseInt(argv[x] + strlen("--chunk="), &v)) {
+        status = 0;
+      } else if (v < 1) {
+        status = 0;
+      } else {
+        m_chunk = (int64_t) v;
+      }
+      if (!status) {
+        fprintf(stderr, "%s: Invalid chunk length!\n", pModule);
+      }
+  
+    } else if (strncmp(argv[x], "--route=", strlen("--route=")) == 0) {
+      if (!parseRoute(argv[x] + strlen("--route="))) {
+        status = 0;
+        fprintf(stderr, "%s: Invalid route %s!\n", pModule, argv[x]);
+      }
+      
+    } else {
+      status = 0;
+      fprintf(stderr, "%s: Unrecognized option %s!\n", pModule, argv[x]);
+    }
+    
+    if (!status) {
+      break;
+    }
+  }
+  
+  /* Check the window options */
+  if (status && m_window && (m_to <= m_from)) {
+    status = 0;
+    fprintf(stderr, "%s: Window end must be after window start!\n",
+            pModule);
+  }
+  if (status && (m_clip || m_rebase) && (!m_window)) {
+    status = 0;
+    fprintf(stderr, "%s: --clip and --rebase require a window!\n",
+            pModule);
+  }
+  if (status && m_rebase && (!m_clip)) {
     status = 0;
+    fprintf(stderr, "%s: --rebase requires --clip!\n", pModule);
+  }
+  
+  /* Check the split and chunk options */
+  if (status && (m_split != SPLIT_NONE) && (m_chunk > 0)) {
+    status = 0;
+    fprintf(stderr, "%s: --split can't be used with --chunk!\n", pModule);
+  }
+  if (status && (m_split != SPLIT_NONE) && (m_prefix == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: --split requires --prefix!\n", pModule);
+  }
+  if (status && (m_chunk > 0) && (m_prefix == NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: --chunk requires --prefix!\n", pModule);
+  }
+  if (status && (m_split == SPLIT_NONE) && (m_chunk < 1) &&
+      (m_prefix != NULL)) {
+    status = 0;
+    fprintf(stderr, "%s: --prefix requires --split or --chunk!\n",
+              pModule);
   }
   
   /* Parse standard input as an NMF file */
@@ -145,13 +2252,27 @@ int main(int argc, char *argv[]) {
   
   /* Report the contents as note events */
   if (status) {
-    report(pd, stdout);
+    if (!report(pd, stdout, pModule)) {
+      status = 0;
+    }
+  }
+  
+  /* Write the rest of the split output files */
+  if (status && (m_split != SPLIT_NONE)) {
+    if (!flushSinks(pModule)) {
+      status = 0;
+    }
   }
   
   /* Free parsed data object if allocated */
   nmf_free(pd);
   pd = NULL;
   
+  /* Free split output files and routes */
+  free_sinks();
+  free(m_route);
+  m_route = NULL;
+  
   /* Invert status and return */
   if (status) {
     status = 0;
@@ -13,7 +13,7 @@
  * Syntax
  * ------
  * 
- *   nmftempo [map] [srate]
+ *   nmftempo [map] [srate] (options)
  * 
  * [map] is the path to a Shastina file in "%noir-tempo;" format that
  * will be read to build the tempo map.  See an example of the tempo map
@@ -27,16 +27,145 @@
  * output it will have a basis of either 44,100 or 48,000 quanta per
  * second, depending on the [srate] parameter.
  * 
+ * Options
+ * -------
+ * 
+ * Any number of options may follow the [srate] parameter.  The
+ * following warp options add a warp layer that is applied to output
+ * times after tempo conversion:
+ * 
+ *   --stretch=[r]  scale output times by [r] / 1000
+ *   --offset=[s]   add [s] samples to output times
+ *   --warp=[list]  piecewise-linear warp of output times
+ * 
+ * The [list] of a --warp option is a comma-separated list of one or
+ * more x:y pairs, each mapping output sample time x to warped sample
+ * time y.  The x values must be strictly ascending, and the y values
+ * must also be strictly ascending.  Between the points, the warp is
+ * linear.  Beyond the first and last points, the warp continues with
+ * the slope of the first and last segments.  A list with only a single
+ * point shifts all output times by y - x.
+ * 
+ * Warp layers are applied in the order they are given on the command
+ * line.  They are composed into a single warp and folded into the
+ * compiled tempo map before any notes are converted, so the number of
+ * warp layers does not affect conversion time.  Warp breakpoints are
+ * honored at the resolution of input quanta, and folding may shift
+ * output times by less than one sample.  The combined warp must not map
+ * any output time at or after zero below zero, so a negative --offset
+ * is only allowed if other layers make up for it.
+ * 
+ * The following options write a beat grid to standard output instead of
+ * an NMF file:
+ * 
+ *   --grid=[q]     write a grid with a beat every [q] input quanta
+ *   --beats=[n]    write exactly [n] beats
+ *   --meter=[list] number the beats within bars
+ * 
+ * The grid starts with a beat at t=0.  Without --beats, the grid has
+ * enough beats to cover the end of the last note and the last section
+ * of the input NMF.  With --beats, the input NMF is not needed and
+ * standard input is not read, so the tempo map can't use the "sect"
+ * command.  Each beat is written as a line with its sample offset and
+ * one-based beat number.  --beats and --meter may only be given
+ * together with --grid, and --grid can't be combined with --sections,
+ * --block, or --preview.
+ * 
+ * The [list] of a --meter option is a comma-separated list of one or
+ * more meters.  Each meter is a number of beats per bar, followed by @
+ * and the one-based bar number where the meter takes effect, except
+ * the first meter, which always starts at bar one.  For example,
+ * "4,3@17" is four beats per bar, changing to three beats per bar at
+ * bar 17.  When meters are given, each beat is written as a line with
+ * its sample offset, one-based bar number, and one-based beat number
+ * within the bar.
+ * 
+ * Grid beats are converted directly from the compiled tempo map in
+ * batches, without building an NMF file.
+ * 
+ * The following option converts an excerpt of the input:
+ * 
+ *   --sections=[a]-[b]  only convert sections [a] through [b]
+ * 
+ * Section numbers are the same as for the "sect" tempo map command.  A
+ * single section number may also be given.  Only notes in the range
+ * are converted, section numbers are renumbered so that section [a]
+ * becomes section zero, and output times are rebased so that the start
+ * of section [a] is at zero.  The tempo map is only interpreted up to
+ * the first tempo after the last input time needed by the range, and
+ * the rest of the tempo map file is not checked.
+ * 
+ * The following option optimizes the compiled tempo map:
+ * 
+ *   --optimize=[e] merge tempo nodes within a tolerance of [e] samples
+ * 
+ * The optimizer merges runs of redundant tempo nodes, such as repeated
+ * constant tempi with the same rate, into a single node, fits a single
+ * ramp or constant tempo to runs of short tempi where that stays within
+ * tolerance, and replaces ramps that are nearly constant with constant
+ * tempi.  Each change is only made if no output time in the affected
+ * range moves by more than [e] samples, and because output times are
+ * floored to whole samples, most merges need a tolerance of at least
+ * one.  The number of tempo nodes before and after is reported on
+ * standard error.  Optimization happens before any warp layers are
+ * folded in.
+ * 
+ * The following option converts notes approximately for previews:
+ * 
+ *   --preview      evaluate tempo nodes in single precision if possible
+ * 
+ * In preview mode, each tempo node is checked to see whether single
+ * precision evaluation is proven to stay within one sample of double
+ * precision across the input range of the node.  Note times in nodes
+ * that qualify are computed in single precision, and the rest fall back
+ * to double precision.  Output times may therefore differ by up to one
+ * sample from a normal conversion.  Section offsets and grids are always
+ * computed in double precision.  The number of qualifying nodes and the
+ * number of notes that needed the fallback are reported on standard
+ * error.
+ * 
+ * The following option compiles the tempo map on multiple threads:
+ * 
+ *   --threads=[n]  use up to [n] threads to compile the tempo map
+ * 
+ * The tempo map is read into memory and split into up to [n] chunks,
+ * each beginning with a "sect" command where the interpreter stack is
+ * empty.  The chunks are interpreted in parallel and then joined in
+ * order, with the output offsets at each seam and any ramp tempo that
+ * runs across a seam resolved during the join.  The compiled tempo map
+ * and any error messages are the same as when compiling on a single
+ * thread.  [n] may be from 1 to 64, with 1 being the default.  The
+ * option has no effect with --sections, since then only part of the
+ * tempo map is compiled.
+ * 
+ * The following options snap the converted output to a grid of
+ * fixed-size sample blocks:
+ * 
+ *   --block=[n]    snap output times to multiples of [n] samples
+ *   --round=[r]    rounding policy, either floor, nearest, or ceil
+ * 
+ * When --block is given, section offsets and note t values are snapped
+ * to the block grid, and so are the ends of notes with durations
+ * greater than zero.  Durations are then recomputed from the snapped
+ * ends, and notes are lengthened if necessary so that they are at
+ * least one block long.  Grace note offsets are left alone.  The
+ * default rounding policy is nearest, with ties rounded up.  The
+ * timing error added by snapping is reported on standard error.
+ * 
  * Compilation
  * -----------
  * 
  * Requires libnmf and libshastina beta 0.9.2 or compatible.
  * 
+ * Requires a C11 compiler for thread-local storage and POSIX threads,
+ * which may require -lpthread
+ * 
  * May also require the math library with -lm
  */
 
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -76,6 +205,9 @@
 #define ERR_BADRATE (21)  /* Invalid rate */
 #define ERR_BADQ    (22)  /* Invalid quanta count */
 #define ERR_BADMIL  (23)  /* Invalid millisecond count */
+#define ERR_BADWARP (24)  /* Invalid warp layer */
+#define ERR_NOSECIN (25)  /* Section operation without input NMF */
+#define ERR_WARPOUT (26)  /* Warp maps output below zero or backward */
  
 #define ERR_SN_MIN  (500) /* Mininum error code used for Shastina */
 #define ERR_SN_MAX  (600) /* Maximum error code used for Shastina */
@@ -100,6 +232,61 @@
  */
 #define MAX_STACK (32)
 
+/*
+ * The maximum number of points in the combined warp.
+ */
+#define MAX_WARP (4096)
+
+/*
+ * The maximum number of meters in a beat grid.
+ */
+#define MAX_METER (1024)
+
+/*
+ * The number of beats transformed at a time by the grid generator.
+ */
+#define GRID_BATCH (4096)
+
+/*
+ * The maximum number of tempo nodes the optimizer merges into one.
+ */
+#define OPT_MAX_RUN (64)
+
+/*
+ * The number of points per tempo node the optimizer uses to fit a
+ * merged node.
+ */
+#define OPT_FIT_POINTS (8)
+
+/*
+ * The maximum number of input quanta the optimizer checks exactly when
+ * deciding whether a merged node is within tolerance.
+ */
+#define OPT_MAX_CHECK (1048576)
+
+/*
+ * The number of values transformed at a time by the preview kernel.
+ */
+#define PREVIEW_BATCH (1024)
+
+/*
+ * The unit roundoff of single-precision floating-point, 2^-24.
+ */
+#define FLOAT_UNIT (5.9604644775390625e-8)
+
+/*
+ * Rounding policies for snapping output times to blocks.
+ */
+#define ROUND_FLOOR   (0)   /* Round down to the block at or before */
+#define ROUND_NEAREST (1)   /* Round to the nearest block, ties up */
+#define ROUND_CEIL    (2)   /* Round up to the block at or after */
+
+/*
+ * The maximum number of threads that may be used to compile the tempo
+ * map.
+ */
+#define MAX_THREADS (64)
+
 /*
  * Type declarations
  * =================
@@ -135,13 +322,119 @@ typedef struct {
    */
   int32_t offset_output;
   
+  /*
+   * Flag indicating whether this node may be evaluated in single
+   * precision in preview mode.
+   * 
+   * Set by markPreview() when single-precision evaluation is proven to
+   * stay within one output sample of double-precision evaluation across
+   * the input range of the node.
+   */
+  int preview;
+  
 } TEMPONODE;
 
+/*
+ * Structure representing an entity read from the tempo map, stored so
+ * that the map can be interpreted in chunks on separate threads.
+ */
+typedef struct {
+  
+  /*
+   * The Shastina entity type and string type.
+   */
+  int etype;
+  int str_type;
+  
+  /*
+   * The line number of the entity in the tempo map file.
+   */
+  long line;
+  
+  /*
+   * Offsets of the key and value strings in the token string arena.
+   * 
+   * The value offset is only valid for string entities.
+   */
+  size_t key;
+  size_t val;
+  
+} MAPTOKEN;
+
+/*
+ * Structure representing the result of interpreting one chunk of the
+ * tempo map.
+ */
+typedef struct {
+  
+  /*
+   * The tokens of the whole tempo map and the string arena they refer
+   * to.
+   */
+  const MAPTOKEN *pTok;
+  const char *pArena;
+  
+  /*
+   * The range of tokens in the chunk, from first to one past the last.
+   */
+  int32_t tok_lo;
+  int32_t tok_hi;
+  
+  /*
+   * The tempo nodes added by the chunk.
+   * 
+   * The offset_output values are relative to the start of the chunk and
+   * are recomputed when the chunks are joined.  pNodeTok holds the
+   * index of the token that added each node.
+   */
+  TEMPONODE *pNode;
+  int32_t *pNodeTok;
+  int32_t node_count;
+  
+  /*
+   * Flag indicating whether the chunk contains a tempo, and if so, the
+   * time of the first tempo and the index of the token that added it.
+   */
+  int has_first;
+  int32_t first_t;
+  int32_t first_tok;
+  
+  /*
+   * The state of the ramp buffer at the end of the chunk.
+   */
+  int tbuf_filled;
+  int32_t tbuf_t;
+  int32_t tbuf_q1;
+  int32_t tbuf_r1;
+  int32_t tbuf_q2;
+  int32_t tbuf_r2;
+  
+  /*
+   * The number of items on the interpreter stack at the end of the
+   * chunk.
+   */
+  int32_t st_count;
+  
+  /*
+   * The error code if the chunk failed, or ERR_OK, and the index of the
+   * token where the error occurred.
+   */
+  int err;
+  int32_t err_tok;
+  
+} MAPCHUNK;
+
 /*
  * Static data
  * ===========
  */
 
+/*
+ * The interpreter state below is thread-local so that sections of the
+ * tempo map can be interpreted on separate threads when --threads is
+ * given.  The main thread's copy holds the compiled tempo map.
+ */
+
 /*
  * Flag indicating whether the tempo map has been initialized.
  * 
@@ -150,7 +443,7 @@ typedef struct {
  * 
  * Zero means tempo map has not been initialized yet.
  */
-static int m_map_init = 0;
+static _Thread_local int m_map_init = 0;
 
 /*
  * The sampling rate of the tempo map.
@@ -166,26 +459,26 @@ static int32_t m_map_rate = 0;
  * 
  * Only valid if m_map_init.
  */
-static int32_t m_map_count = 0;
+static _Thread_local int32_t m_map_count = 0;
 
 /*
  * The capacity of the tempo map in nodes.
  * 
  * Only valid if m_map_init.
  */
-static int32_t m_map_cap = 0;
+static _Thread_local int32_t m_map_cap = 0;
 
 /*
  * Pointer to the tempo map.
  * 
  * Only valid if m_map_init.
  */
-static TEMPONODE *m_map_t = NULL;
+static _Thread_local TEMPONODE *m_map_t = NULL;
 
 /*
  * Flag indicating whether the tempo node buffer is filled.
  */
-static int m_tbuf_filled = 0;
+static _Thread_local int m_tbuf_filled = 0;
 
 /*
  * The tempo node buffer values.
@@ -198,30 +491,30 @@ static int m_tbuf_filled = 0;
  * The ramp node must be buffered because the next node must be read
  * before the length can be determined.
  */
-static int32_t m_tbuf_t = 0;
-static int32_t m_tbuf_q1 = 0;
-static int32_t m_tbuf_r1 = 0;
-static int32_t m_tbuf_q2 = 0;
-static int32_t m_tbuf_r2 = 0;
+static _Thread_local int32_t m_tbuf_t = 0;
+static _Thread_local int32_t m_tbuf_q1 = 0;
+static _Thread_local int32_t m_tbuf_r1 = 0;
+static _Thread_local int32_t m_tbuf_q2 = 0;
+static _Thread_local int32_t m_tbuf_r2 = 0;
 
 /*
  * Flag indicating whether the interpreter stack has been initialized.
  */
-static int m_st_init = 0;
+static _Thread_local int m_st_init = 0;
 
 /*
  * The total number of items on the interpreter stack.
  * 
  * Only valid if m_st_init.
  */
-static int32_t m_st_count = 0;
+static _Thread_local int32_t m_st_count = 0;
 
 /*
  * The interpreter stack.
  * 
  * Only valid if m_st_init.
  */
-static int32_t m_st_t[MAX_STACK];
+static _Thread_local int32_t m_st_t[MAX_STACK];
 
 /*
  * Pointer to the input NMF data.
@@ -233,7 +526,155 @@ static NMF_DATA *m_pdi = NULL;
 /*
  * The tempo map cursor.
  */
-static int32_t m_cursor = 0;
+static _Thread_local int32_t m_cursor = 0;
+
+/*
+ * The number of points in the combined warp.
+ * 
+ * Zero means there is no warp.  Otherwise, m_warp_x and m_warp_y hold
+ * the points of the combined warp.  See addWarp() for the meaning of
+ * the points.
+ */
+static int32_t m_warp_n = 0;
+
+/*
+ * The points of the combined warp.
+ * 
+ * Only valid if m_warp_n is greater than zero.
+ */
+static double m_warp_x[MAX_WARP];
+static double m_warp_y[MAX_WARP];
+
+/*
+ * The beat length of the grid in input quanta, or zero if the grid
+ * generator is not in use.
+ */
+static int32_t m_grid_beat = 0;
+
+/*
+ * The number of beats in the grid, or -1 if the grid should cover the
+ * input NMF.
+ */
+static int32_t m_grid_count = -1;
+
+/*
+ * The number of meters in the grid.
+ * 
+ * Zero means no meters were given.  Otherwise, m_meter_beats holds the
+ * beats per bar of each meter and m_meter_bar holds the one-based bar
+ * number at which each meter starts.
+ */
+static int32_t m_meter_n = 0;
+static int32_t m_meter_beats[MAX_METER];
+static int32_t m_meter_bar[MAX_METER];
+
+/*
+ * The block size in samples that output times are snapped to, or zero
+ * if output times are not snapped.
+ */
+static int32_t m_block = 0;
+
+/*
+ * The rounding policy used to snap output times to blocks.
+ * 
+ * One of the ROUND_ constants.
+ */
+static int m_round = ROUND_NEAREST;
+
+/*
+ * Block snapping statistics.
+ * 
+ * The counts are the number of note starts and note ends that were
+ * snapped.  The sums and maximums are of the absolute difference in
+ * samples between the snapped and unsnapped times.  The extended count
+ * is the number of notes that were lengthened to one block.
+ */
+static int32_t m_snap_start_count = 0;
+static int32_t m_snap_end_count = 0;
+static int64_t m_snap_start_sum = 0;
+static int64_t m_snap_end_sum = 0;
+static int64_t m_snap_start_max = 0;
+static int64_t m_snap_end_max = 0;
+static int32_t m_snap_extended = 0;
+
+/*
+ * The range of input sections to convert, or -1 for both if all
+ * sections are converted.
+ * 
+ * When a range is set, only notes in sections m_sect_lo through
+ * m_sect_hi inclusive are converted, and output times are rebased so
+ * that the start of section m_sect_lo is at zero.
+ */
+static int32_t m_sect_lo = -1;
+static int32_t m_sect_hi = -1;
+
+/*
+ * The last input time that the tempo map must cover, or -1 if the whole
+ * tempo map must be compiled.
+ * 
+ * When this is zero or greater, parseMap() stops interpreting the tempo
+ * map once a tempo begins after this time.
+ */
+static int32_t m_horizon = -1;
+
+/*
+ * The tolerance in output samples of the tempo map optimizer, or -1 if
+ * the tempo map is not optimized.
+ */
+static int32_t m_opt_tol = -1;
+
+/*
+ * The number of tempo nodes before and after optimization.
+ */
+static int32_t m_opt_before = 0;
+static int32_t m_opt_after = 0;
+
+/*
+ * Flag indicating whether notes are converted in preview mode.
+ * 
+ * In preview mode, tempo nodes that qualify are evaluated in single
+ * precision, which may change output times by up to one sample.
+ */
+static int m_preview = 0;
+
+/*
+ * Preview statistics.
+ * 
+ * The number of tempo nodes that qualified for single precision, and
+ * the number of converted notes that needed double precision for their
+ * start or end time.
+ */
+static int32_t m_preview_nodes = 0;
+static int32_t m_preview_fallback = 0;
+static int32_t m_preview_notes = 0;
+
+/*
+ * The maximum number of threads used to compile the tempo map.
+ * 
+ * One means the tempo map is compiled sequentially by parseMap().
+ * Otherwise, parseMapThreaded() is used.
+ */
+static int32_t m_threads = 1;
+
+/*
+ * Flag indicating whether the interpreter on this thread is compiling
+ * one chunk of a tempo map split at section boundaries.
+ * 
+ * In chunk mode, checkTime() does not require the first tempo to be at
+ * t=0, since the chunk may start in the middle of the map.  Instead,
+ * the time of the first tempo and the index of the token that added it
+ * are recorded so that the chunks can be checked when they are joined.
+ */
+static _Thread_local int m_chunk = 0;
+static _Thread_local int m_chunk_first = 0;
+static _Thread_local int32_t m_chunk_first_t = 0;
+static _Thread_local int32_t m_chunk_first_tok = 0;
+
+/*
+ * The index of the token that is currently being interpreted in chunk
+ * mode.
+ */
+static _Thread_local int32_t m_chunk_tok = 0;
 
 /*
  * Local functions
@@ -268,8 +709,60 @@ static int bufferRamp(
     int32_t   r2,
     int     * per);
 
+static double pwlEval(
+    const double * px,
+    const double * py,
+          int32_t  n,
+          double   x);
+static int addWarp(const double *px, const double *py, int32_t n);
+static int foldWarp(int *per);
+
+static double runError(int32_t i, int32_t j, double a, double b);
+static int runCheck(
+    int32_t i,
+    int32_t j,
+    double  a,
+    double  b,
+    int32_t tol,
+    int     open_end);
+static int runFit(
+    int32_t   i,
+    int32_t   j,
+    int       const_only,
+    double  * pa,
+    double  * pb);
+static int runAccept(
+    int32_t i,
+    int32_t j,
+    double  a,
+    double  b,
+    int32_t tol,
+    int     open_end);
+static void optimizeMap(int32_t tol);
+
+static int32_t mapFind(int32_t t);
+static int32_t nodeFinish(int32_t i, double f);
+static int32_t nodeTransform(int32_t i, int32_t t);
 static int32_t mapTransform(int32_t t);
+static void mapTransformVec(
+    const int32_t * pt,
+          int32_t * pr,
+          int32_t   count);
+static void markPreview(int32_t t_max);
+static void mapPreviewVec(
+    const int32_t * pt,
+          int32_t * pr,
+          uint8_t * pf,
+          int32_t   count);
+static void reportPreview(FILE *pf, const char *pModule);
+
+static int snapTime(int32_t t, int is_end, int32_t *pr);
+static int snapNote(NMF_NOTE *pn);
+static void reportSnap(FILE *pf, const char *pModule);
+static int32_t findHorizon(NMF_DATA *pdi, int32_t lo, int32_t hi);
 static int applyMap(NMF_DATA *pdi, FILE *pOut, int *per);
+static int fmtInt(char *pbuf, int32_t v);
+static int writeGrid(NMF_DATA *pdi, FILE *pOut, int *per);
 
 static int pushDur(const char *pstr, int *per);
 static int pushNum(const char *pstr, int *per);
@@ -279,9 +772,31 @@ static int opStep(int *per);
 static int opTempo(int *per);
 static int opRamp(int *per);
 static int opSpan(int *per);
+static int runEntity(
+          int    etype,
+          int    str_type,
+    const char * pKey,
+    const char * pValue,
+          int  * per);
 static int parseMap(FILE *pIn, int32_t srate, int *per, long *pln);
+static int32_t findChunks(
+    const MAPTOKEN * pTok,
+          int32_t    tok_count,
+    const char     * pArena,
+          MAPCHUNK * pc,
+          int32_t    max_chunk);
+static void *compileChunk(void *pArg);
+static int joinChunk(const MAPCHUNK *pc, int *per, long *pln);
+static int parseMapThreaded(
+    FILE    * pIn,
+    int32_t   srate,
+    int     * per,
+    long    * pln);
 
 static int parseInt(const char *pstr, int32_t *pv);
+static int parseWarp(const char *pstr);
+static int parseMeter(const char *pstr);
+static int parseRange(const char *pstr, int32_t *plo, int32_t *phi);
 static const char *error_string(int code);
 
 /*
@@ -393,8 +908,9 @@ static int stack_pop(int32_t *pv, int *per) {
  * The tempo map must be initialized or a fault occurs.
  * 
  * If the tempo map is empty and buffer is empty, t must be zero or
- * there is an error.  If the tempo map is not empty, t must be greater
- * than the last node that was added or an error occurs.
+ * there is an error, except in chunk mode (see m_chunk).  If the tempo
+ * map is not empty, t must be greater than the last node that was added
+ * or an error occurs.
  * 
  * If there is currently a node buffered in the tempo node buffer, t
  * must be greater than the t value in the buffer or an error occurs.
@@ -441,9 +957,17 @@ static int checkTime(int32_t t, int *per) {
   }
   
   /* If tempo map empty and tempo buffer node empty, make sure t is
-   * zero */
+   * zero, except in chunk mode, where the first tempo is recorded so it
+   * can be checked when the chunks are joined */
   if (status && (m_map_count < 1) && (!m_tbuf_filled)) {
-    if (t != 0) {
+    if (m_chunk) {
+      if (!m_chunk_first) {
+        m_chunk_first = 1;
+        m_chunk_first_t = t;
+        m_chunk_first_tok = m_chunk_tok;
+      }
+      
+    } else if (t != 0) {
       status = 0;
       *per = ERR_NOZEROT;
     }
@@ -1021,1253 +1545,4192 @@ static int bufferRamp(
 }
 
 /*
- * Transform an input t value to an output t value using the tempo map.
+ * Evaluate a piecewise-linear function.
  * 
- * t is the input quantum offset, which must be greater than or equal to
- * zero.  t is specified with a quantum basis of 96 quanta per quarter.
+ * px and py point to n points of the function, where n is at least
+ * one.  The px values must be strictly ascending.  Between the points,
+ * the function is linear.  Beyond the first and last points, the
+ * function continues with the slope of the first and last segments.  If
+ * there is only a single point, the function has a slope of one.
  * 
- * The return value is the offset using the fixed-length basis
- * established by parseMap().
+ * If the py values are also strictly ascending, the function can be
+ * inverted by calling this function with px and py swapped.
  * 
- * If the output t can not be computed due to overflow or other numeric
- * problems, -1 is returned.
+ * Parameters:
  * 
- * The tempo map must already be successfully initialized or a fault
- * occurs.
+ *   px - the x values of the points
  * 
- * Parameters:
+ *   py - the y values of the points
  * 
- *   t - the input t value
+ *   n - the number of points
+ * 
+ *   x - the value to evaluate the function at
  * 
  * Return:
  * 
- *   the output t value, or -1 if t could not be computed
+ *   the value of the function at x
  */
-static int32_t mapTransform(int32_t t) {
+static double pwlEval(
+    const double * px,
+    const double * py,
+          int32_t  n,
+          double   x) {
   
-  int status = 1;
-  TEMPONODE *pt = NULL;
-  TEMPONODE *pnx = NULL;
   int32_t lo = 0;
   int32_t hi = 0;
   int32_t mid = 0;
-  int32_t mid_val = 0;
-  double f = 0.0;
-  
-  /* Check parameter */
-  if (t < 0) {
-    abort();
-  }
+  double s = 0.0;
   
-  /* Check state */
-  if (m_map_init <= 0) {
+  /* Check parameters */
+  if ((px == NULL) || (py == NULL) || (n < 1)) {
     abort();
   }
   
-  /* Search for the tempo node with the greatest offset_input that is
-   * less than or equal to the input t value; also, get pointer to node
-   * after it, if there is one */
-  if ((m_map_t[m_map_count - 1]).offset_input <= t) {
-    /* t greater than or equal to last node, so use last node, and there
-     * is no next node */
-    pt = &(m_map_t[m_map_count - 1]);
-    pnx = NULL;
-    
-  } else {
-    /* t less than last node, so perform binary search to find desired
-     * node */
-    lo = 0;
-    hi = m_map_count - 1;
-    while (lo < hi) {
-      
-      /* Compute midpoint, which must be greater than low bound */
-      mid = lo + ((hi - lo) / 2);
-      if (mid <= lo) {
-        mid = lo + 1;
-      }
-      
-      /* Get midpoint value */
-      mid_val = (m_map_t[mid]).offset_input;
-      
-      /* Compare t to midpoint value */
-      if (t < mid_val) {
-        /* t less than midpoint value, so set hi bound to one lower than
-         * midpoint */
-        hi = mid - 1;
-        
-      } else if (t > mid_val) {
-        /* t greater than midpoint vlaue, so set lo bound to midpoint */
-        lo = mid;
-        
-      } else if (t == mid_val) {
-        /* t equals midpoint value, so zoom in on midpoint */
-        lo = mid;
-        hi = mid;
-        
-      } else {
-        abort();  /* shouldn't happen */
-      }
-    }
-    
-    /* Get pointer to desired node and next node */
-    pt = &(m_map_t[lo]);
-    pnx = &(m_map_t[lo + 1]);
-  }
-  
-  /* We found which node we are in, so change t to be an offset within
-   * this tempo node */
-  t = t - pt->offset_input;
-  
-  /* Compute the transformed offset in floating-point */
-  if (pt->a == 0.0) {
-    f = pt->b * ((double) t);
-  } else {
-    f = pt->a * (((double) t) * ((double) t)) + pt->b * ((double) t);
-  }
-  
-  /* Floor the offset */
-  f = floor(f);
-  
-  /* Check for numeric problems */
-  if (!isfinite(f)) {
-    status = 0;
-  }
-  if (status) {
-    if (!((f >= ((double) INT32_MIN)) && (f <= ((double) INT32_MAX)))) {
-      status = 0;
-    }
-  }
-  
-  /* Get transformed offset as integer */
-  if (status) {
-    t = (int32_t) f;
-  }
-  
-  /* If transformed offset less than zero, set to zero */
-  if (status && (t < 0)) {
-    t = 0;
+  /* Single point functions are a shift */
+  if (n < 2) {
+    return (x + (py[0] - px[0]));
   }
   
-  /* Add transformed offset to output offset, watching for overflow */
-  if (status) {
-    if (t <= INT32_MAX - pt->offset_output) {
-      t = t + pt->offset_output;
+  /* Binary search for the last segment starting at or before x, using
+   * the first segment if x is before all points */
+  lo = 0;
+  hi = n - 2;
+  while (lo < hi) {
+    mid = lo + ((hi - lo + 1) / 2);
+    if (px[mid] <= x) {
+      lo = mid;
     } else {
-      status = 0;
-    }
-  }
-  
-  /* If there is a next node, make sure transformed t is less than its
-   * output offset */
-  if (status && (pnx != NULL)) {
-    if (pnx->offset_output <= t) {
-      t = pnx->offset_output - 1;
+      hi = mid - 1;
     }
   }
   
-  /* If failure, set t to -1 */
-  if (!status) {
-    t = -1;
-  }
-  
-  /* Return result */
-  return t;
+  /* Evaluate on the segment */
+  s = (py[lo + 1] - py[lo]) / (px[lo + 1] - px[lo]);
+  return (py[lo] + s * (x - px[lo]));
 }
 
 /*
- * Apply a tempo map to the input NMF and write to the output NMF.
- * 
- * pdi is the input NMF data.
+ * Add a warp layer.
  * 
- * pOut is the output NMF file to write.  It must be open for writing or
- * undefined behavior occurs.  Writing is fully sequential.
+ * The warp layer is composed after the current combined warp, so that
+ * warp layers take effect in the order they are added.
  * 
- * per points to a variable to receive an error code in case of error.
- * The error code may be converted to an error message with the function
- * error_string().
+ * px and py point to n points, each mapping an output time px[i] to a
+ * warped time py[i].  n must be at least one.  The px values and the py
+ * values must both be strictly ascending and finite.  See pwlEval() for
+ * how the points define the warp.
  * 
- * The tempo map must be successfully initialized or a fault occurs.
+ * The function fails if the points are not valid or if the combined
+ * warp would have too many points.
  * 
  * Parameters:
  * 
- *   pdi - the input NMF data
+ *   px - the output times
  * 
- *   pOut - the output file to write
+ *   py - the warped times
  * 
- *   per - pointer to variable to receive an error code
+ *   n - the number of points
  * 
  * Return:
  * 
  *   non-zero if successful, zero if error
  */
-static int applyMap(NMF_DATA *pdi, FILE *pOut, int *per) {
+static int addWarp(const double *px, const double *py, int32_t n) {
   
   int status = 1;
-  NMF_DATA *pdo = NULL;
-  int32_t sections = 0;
-  int32_t notes = 0;
   int32_t i = 0;
-  int32_t x = 0;
-  int32_t y = 0;
-  NMF_NOTE n;
-  
-  /* Initialize structures */
-  memset(&n, 0, sizeof(NMF_NOTE));
+  int32_t j = 0;
+  int32_t cn = 0;
+  double x = 0.0;
+  double *pcx = NULL;
+  double *pcy = NULL;
   
   /* Check parameters */
-  if ((pdi == NULL) || (pOut == NULL) || (per == NULL)) {
+  if ((px == NULL) || (py == NULL) || (n < 1)) {
     abort();
   }
   
-  /* Check state */
-  if (m_map_init <= 0) {
-    abort();  /* tempo map not initialized */
+  /* Check that points are finite and ascending */
+  for(i = 0; i < n; i++) {
+    if ((!isfinite(px[i])) || (!isfinite(py[i]))) {
+      status = 0;
+      break;
+    }
+    if (i > 0) {
+      if ((px[i] <= px[i - 1]) || (py[i] <= py[i - 1])) {
+        status = 0;
+        break;
+      }
+    }
   }
   
-  /* Reset error */
-  *per = ERR_OK;
+  /* Allocate buffers for the composite warp */
+  if (status) {
+    pcx = (double *) calloc((size_t) (m_warp_n + n), sizeof(double));
+    pcy = (double *) calloc((size_t) (m_warp_n + n), sizeof(double));
+    if ((pcx == NULL) || (pcy == NULL)) {
+      abort();
+    }
+  }
   
-  /* Make sure input has proper quantum basis */
+  /* The points of the composite are the points of the current warp
+   * merged with the points of the new layer pulled back through the
+   * current warp; if there is no current warp, the points of the new
+   * layer are used as-is */
   if (status) {
-    if (nmf_basis(pdi) != NMF_BASIS_Q96) {
+    i = 0;
+    j = 0;
+    while ((i < m_warp_n) || (j < n)) {
+      
+      /* Pull back the next point of the new layer */
+      if (j < n) {
+        if (m_warp_n > 0) {
+          x = pwlEval(m_warp_y, m_warp_x, m_warp_n, px[j]);
+        } else {
+          x = px[j];
+        }
+      }
+      
+      /* Take the lesser of the two candidates, merging duplicates */
+      if ((j < n) && ((i >= m_warp_n) || (x < m_warp_x[i]))) {
+        j++;
+      } else {
+        if ((j < n) && (x == m_warp_x[i])) {
+          j++;
+        }
+        x = m_warp_x[i];
+        i++;
+      }
+      
+      pcx[cn] = x;
+      cn++;
+    }
+    
+    if (cn > MAX_WARP) {
       status = 0;
-      *per = ERR_BASISIN;
     }
   }
   
-  /* Allocate output object and set its basis */
+  /* Evaluate the composite at each of its points */
   if (status) {
-    pdo = nmf_alloc();
-    if (m_map_rate == 48000) {
-      nmf_rebase(pdo, NMF_BASIS_48000);
-    } else if (m_map_rate == 44100) {
-      nmf_rebase(pdo, NMF_BASIS_44100);
-    } else {
-      abort();  /* shouldn't happen */
+    for(i = 0; i < cn; i++) {
+      x = pcx[i];
+      if (m_warp_n > 0) {
+        x = pwlEval(m_warp_x, m_warp_y, m_warp_n, x);
+      }
+      pcy[i] = pwlEval(px, py, n, x);
     }
   }
   
-  /* Get the number of sections and notes in the input */
+  /* Store the composite as the new combined warp */
   if (status) {
-    sections = nmf_sections(pdi);
-    notes = nmf_notes(pdi);
+    memcpy(m_warp_x, pcx, ((size_t) cn) * sizeof(double));
+    memcpy(m_warp_y, pcy, ((size_t) cn) * sizeof(double));
+    m_warp_n = cn;
   }
   
-  /* Transfer all input sections to output, transforming their offsets
-   * according to the tempo map */
-  if (status) {
-    for(i = 1; i < sections; i++) {
-      x = mapTransform(nmf_offset(pdi, i));
-      if (x < 0) {
-        status = 0;
-        *per = ERR_XFORM;
-        break;
-      }
-      if (!nmf_sect(pdo, x)) {
-        abort();  /* shouldn't happen */
+  /* Free buffers if allocated */
+  free(pcx);
+  free(pcy);
+  pcx = NULL;
+  pcy = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Fold the combined warp into the compiled tempo map.
+ * 
+ * If there is no combined warp, this function does nothing.  Otherwise,
+ * tempo nodes are split at the input offsets where their output crosses
+ * a warp breakpoint, so that the warp is linear across each node.  The
+ * linear warp of each node is then applied to its A and B parameters
+ * and its output offset.
+ * 
+ * Splits happen at the first input quantum that reaches the breakpoint,
+ * so the warp is exact at all integer input offsets, except that output
+ * offsets are floored to integers.
+ * 
+ * The function fails with ERR_WARPOUT before changing the tempo map if
+ * the combined warp maps an output time of zero, or the start of any
+ * warp segment at or after zero, below zero, or if the warp is not
+ * strictly ascending.  Output times can then never become negative, so
+ * a bad warp is reported here instead of as a transform error on the
+ * first affected note.
+ * 
+ * The tempo map must be successfully initialized or a fault occurs.
+ * 
+ * per points to a variable to receive an error code in case of error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to a variable to receive an error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int foldWarp(int *per) {
+  
+  int status = 1;
+  int32_t i = 0;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  int32_t ncount = 0;
+  int32_t ncap = 0;
+  int32_t ofo = 0;
+  int32_t t = 0;
+  int32_t t_next = 0;
+  int has_next = 0;
+  double a = 0.0;
+  double b = 0.0;
+  double o = 0.0;
+  double s = 0.0;
+  double f = 0.0;
+  double p = 0.0;
+  double d = 0.0;
+  double xs = 0.0;
+  TEMPONODE *pn = NULL;
+  TEMPONODE *pt = NULL;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
+  }
+  
+  /* If no warp, nothing to do */
+  if (m_warp_n < 1) {
+    return 1;
+  }
+  
+  /* Check that the warp keeps output times at or above zero and in
+   * order */
+  if (!(pwlEval(m_warp_x, m_warp_y, m_warp_n, 0.0) >= 0.0)) {
+    *per = ERR_WARPOUT;
+    return 0;
+  }
+  for(i = 0; i < m_warp_n; i++) {
+    if ((m_warp_x[i] >= 0.0) && (!(m_warp_y[i] >= 0.0))) {
+      *per = ERR_WARPOUT;
+      return 0;
+    }
+    if (i > 0) {
+      if (!((m_warp_x[i] > m_warp_x[i - 1]) &&
+            (m_warp_y[i] > m_warp_y[i - 1]))) {
+        *per = ERR_WARPOUT;
+        return 0;
       }
     }
   }
   
-  /* Transfer all notes to output, transforming their t offsets and
-   * durations according to tempo map */
-  if (status) {
-    for(i = 0; i < notes; i++) {
+  /* Allocate new node array */
+  ncap = m_map_count;
+  if (ncap < INIT_ALLOC) {
+    ncap = INIT_ALLOC;
+  }
+  pn = (TEMPONODE *) calloc((size_t) ncap, sizeof(TEMPONODE));
+  if (pn == NULL) {
+    abort();
+  }
+  
+  /* Go through all nodes in the current map */
+  for(i = 0; i < m_map_count; i++) {
+    
+    /* Get the node parameters, and the input offset of the next node if
+     * there is one */
+    t = (m_map_t[i]).offset_input;
+    a = (m_map_t[i]).a;
+    b = (m_map_t[i]).b;
+    o = (double) (m_map_t[i]).offset_output;
+    if (i < m_map_count - 1) {
+      has_next = 1;
+      t_next = (m_map_t[i + 1]).offset_input;
+    } else {
+      has_next = 0;
+      t_next = 0;
+    }
+    
+    /* Emit this node, splitting it at each breakpoint it crosses */
+    while (status) {
       
-      /* Get current note */
-      nmf_get(pdi, i, &n);
+      /* Find the warp segment at the start of the node, and the next
+       * interior breakpoint after it, if any */
+      lo = 0;
+      if (m_warp_n > 1) {
+        hi = m_warp_n - 2;
+        while (lo < hi) {
+          mid = lo + ((hi - lo + 1) / 2);
+          if (m_warp_x[mid] <= o) {
+            lo = mid;
+          } else {
+            hi = mid - 1;
+          }
+        }
+        s = (m_warp_y[lo + 1] - m_warp_y[lo]) /
+              (m_warp_x[lo + 1] - m_warp_x[lo]);
+      } else {
+        s = 1.0;
+      }
       
-      /* Transform the t value, unless it is zero; zero is left as zero
-       * because that mapping should always hold */
-      if (n.t != 0) {
-        x = mapTransform(n.t);
-        if (x < 0) {
+      /* Compute the warped output offset, keeping the output offsets
+       * strictly ascending */
+      f = floor(pwlEval(m_warp_x, m_warp_y, m_warp_n, o));
+      if (!isfinite(f)) {
+        status = 0;
+        *per = ERR_NUMERIC;
+      }
+      if (status && (f < 0.0)) {
+        status = 0;
+        *per = ERR_WARPOUT;
+      }
+      if (status) {
+        if (!(f <= (double) INT32_MAX)) {
           status = 0;
-          *per = ERR_XFORM;
+          *per = ERR_NUMERIC;
         }
-      } else {
-        x = 0;
       }
-            
-      /* If the duration is greater than zero, transform it; leave alone
-       * durations of zero and negative durations (grace note
-       * offsets) */
-      if (status && (n.dur > 0)) {
-        /* Compute the t value at the end of the duration, watching for
-         * overflow */
-        if (n.dur <= INT32_MAX - n.t) {
-          y = n.dur + n.t;
-        } else {
+      if (status) {
+        ofo = (int32_t) f;
+        if (ncount > 0) {
+          if (ofo <= (pn[ncount - 1]).offset_output) {
+            if ((pn[ncount - 1]).offset_output < INT32_MAX) {
+              ofo = (pn[ncount - 1]).offset_output + 1;
+            } else {
+              status = 0;
+              *per = ERR_NUMERIC;
+            }
+          }
+        }
+      }
+      
+      /* Expand the new node array if necessary */
+      if (status && (ncount >= ncap)) {
+        if (ncap >= MAX_TEMPI) {
           status = 0;
-          *per = ERR_XFORM;
+          *per = ERR_TOOMANY;
         }
-        
-        /* Transform the endpoint t value */
         if (status) {
-          y = mapTransform(y);
-          if (y < 0) {
-            status = 0;
-            *per = ERR_XFORM;
+          ncap = ncap * 2;
+          if (ncap > MAX_TEMPI) {
+            ncap = MAX_TEMPI;
+          }
+          pn = (TEMPONODE *) realloc(
+                              pn, ((size_t) ncap) * sizeof(TEMPONODE));
+          if (pn == NULL) {
+            abort();
           }
         }
+      }
+      
+      /* Add the warped node */
+      if (status) {
+        pt = &(pn[ncount]);
+        pt->a = a * s;
+        pt->b = b * s;
+        pt->offset_input = t;
+        pt->offset_output = ofo;
+        ncount++;
         
-        /* Compute the transformed duration */
-        if (status) {
-          n.dur = y - x;
+        if ((!isfinite(pt->a)) || (!isfinite(pt->b))) {
+          status = 0;
+          *per = ERR_NUMERIC;
         }
       }
       
-      /* Now that duration is computed, store the transformed t */
-      if (status) {
-        n.t = x;
+      /* If there is no interior breakpoint after the start of the node,
+       * the node is finished */
+      if ((!status) || (lo + 1 > m_warp_n - 2)) {
+        break;
       }
+      p = m_warp_x[lo + 1];
       
-      /* Write transformed note to output */
-      if (status) {
-        if (!nmf_append(pdo, &n)) {
-          abort();  /* shouldn't happen */
-        }
+      /* Find the real input offset where the node output reaches the
+       * breakpoint, using a form of the quadratic formula that is stable
+       * for either sign of A; if the output never reaches it, the node
+       * is finished */
+      d = b * b + 4.0 * a * (p - o);
+      if (!(d >= 0.0)) {
+        break;
+      }
+      f = b + sqrt(d);
+      if (!(f > 0.0)) {
+        break;
+      }
+      xs = ceil((2.0 * (p - o)) / f);
+      if (xs < 1.0) {
+        xs = 1.0;
       }
       
-      /* Leave loop if error */
-      if (!status) {
+      /* If the split point is beyond the end of the node, the node is
+       * finished */
+      if (!(xs < ((double) INT32_MAX) - ((double) t))) {
+        break;
+      }
+      if (has_next && (!(((double) t) + xs < (double) t_next))) {
         break;
       }
+      
+      /* Move to the split point, re-expressing the quadratic relative to
+       * it */
+      o = o + a * xs * xs + b * xs;
+      b = 2.0 * a * xs + b;
+      t = t + ((int32_t) xs);
+    }
+    
+    /* Leave loop if error */
+    if (!status) {
+      break;
     }
   }
   
-  /* Serialize to output */
+  /* Replace the map with the warped map if successful */
   if (status) {
-    if (!nmf_serialize(pdo, pOut)) {
-      abort();  /* shouldn't happen */
-    }
+    free(m_map_t);
+    m_map_t = pn;
+    m_map_count = ncount;
+    m_map_cap = ncap;
+    pn = NULL;
   }
   
-  /* Free the data objects if allocated */
-  nmf_free(pdi);
-  nmf_free(pdo);
-  pdi = NULL;
-  pdo = NULL;
+  /* Free new node array if not used */
+  free(pn);
+  pn = NULL;
   
   /* Return status */
   return status;
 }
 
 /*
- * Push the number of quanta in a duration string onto the interpreter
- * stack.
+ * Compute the greatest difference between a candidate node and a run of
+ * tempo nodes, before flooring.
  * 
- * pstr is the duration string.  per points to a variable to receive an
- * error code in case of error.
+ * The run is nodes i through j of the tempo map, where j is less than
+ * the index of the last node.  The candidate node starts at the same
+ * input and output offsets as node i, with parameters a and b.  Within
+ * each node of the run, the difference between the candidate and the
+ * node is a quadratic, so its greatest magnitude is found at the ends of
+ * the node or at the vertex of the quadratic.
  * 
  * Parameters:
  * 
- *   pstr - the duration string
+ *   i - the first node of the run
  * 
- *   per - pointer to variable to receive error code
+ *   j - the last node of the run
+ * 
+ *   a - the A parameter of the candidate
+ * 
+ *   b - the B parameter of the candidate
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   the greatest difference, in output samples
  */
-static int pushDur(const char *pstr, int *per) {
+static double runError(int32_t i, int32_t j, double a, double b) {
+  
+  double result = 0.0;
+  double d = 0.0;
+  double c0 = 0.0;
+  double c1 = 0.0;
+  double c2 = 0.0;
+  double s = 0.0;
+  double xs[3];
+  int32_t k = 0;
+  int32_t m = 0;
+  int32_t xn = 0;
+  TEMPONODE *pk = NULL;
+  TEMPONODE *pi = NULL;
   
-  int status = 1;
-  int c = 0;
-  int32_t d = 0;
-  int32_t dur = 0;
+  /* Check parameters */
+  if ((i < 0) || (j < i) || (j >= m_map_count - 1)) {
+    abort();
+  }
+  
+  pi = &(m_map_t[i]);
+  for(k = i; k <= j; k++) {
+    pk = &(m_map_t[k]);
+    
+    /* Within node k, with x the offset from the start of node k and s
+     * the offset of node k from node i, the difference is
+     * a(x + s)^2 + b(x + s) + ofo_i - (a_k x^2 + b_k x + ofo_k), which
+     * is c2 x^2 + c1 x + c0 */
+    s = (double) (pk->offset_input - pi->offset_input);
+    c2 = a - pk->a;
+    c1 = 2.0 * a * s + b - pk->b;
+    c0 = a * s * s + b * s +
+          ((double) pi->offset_output) - ((double) pk->offset_output);
+    
+    /* Get the ends of the node and the vertex, if inside */
+    xn = 0;
+    xs[xn++] = 0.0;
+    xs[xn++] = (double) ((m_map_t[k + 1]).offset_input -
+                            pk->offset_input - 1);
+    if (c2 != 0.0) {
+      d = -c1 / (2.0 * c2);
+      if ((d > 0.0) && (d < xs[1])) {
+        xs[xn++] = d;
+      }
+    }
+    
+    /* Evaluate the difference at each point */
+    for(m = 0; m < xn; m++) {
+      d = fabs(c2 * xs[m] * xs[m] + c1 * xs[m] + c0);
+      if (!isfinite(d)) {
+        d = HUGE_VAL;
+      }
+      if (d > result) {
+        result = d;
+      }
+    }
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Check exactly whether a candidate node can replace a run of tempo
+ * nodes.
+ * 
+ * The run and candidate are as for runError().  Every input time in the
+ * run is transformed by the original nodes and by the candidate, and
+ * the check fails if the results differ by more than tol samples.
+ * Unless open_end is non-zero, the candidate output is clamped below the
+ * output offset of node j + 1, just as nodeTransform() would.  open_end
+ * is used when the candidate will also replace node j + 1 as the last
+ * node of the map, so there is no next node to clamp against.  Runs
+ * longer than OPT_MAX_CHECK input quanta are not checked and fail.
+ * 
+ * Parameters:
+ * 
+ *   i - the first node of the run
+ * 
+ *   j - the last node of the run
+ * 
+ *   a - the A parameter of the candidate
+ * 
+ *   b - the B parameter of the candidate
+ * 
+ *   tol - the tolerance in output samples
+ * 
+ *   open_end - non-zero if the candidate output is not clamped
+ * 
+ * Return:
+ * 
+ *   non-zero if the candidate is within tolerance, zero if not
+ */
+static int runCheck(
+    int32_t i,
+    int32_t j,
+    double  a,
+    double  b,
+    int32_t tol,
+    int     open_end) {
+  
+  int32_t k = 0;
+  int32_t t = 0;
+  int32_t t_end = 0;
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t limit = 0;
+  double f = 0.0;
+  TEMPONODE *pi = NULL;
   
   /* Check parameters */
-  if ((pstr == NULL) || (per == NULL)) {
+  if ((i < 0) || (j < i) || (j >= m_map_count - 1) || (tol < 0)) {
     abort();
   }
   
-  /* Duration string may not be empty */
-  if (*pstr == 0) {
-    status = 0;
-    *per = ERR_DURSTR;
+  pi = &(m_map_t[i]);
+  t_end = (m_map_t[j + 1]).offset_input;
+  limit = (m_map_t[j + 1]).offset_output - 1;
+  if (t_end - pi->offset_input > OPT_MAX_CHECK) {
+    return 0;
   }
   
-  /* Go through each character in the duration string */
-  if (status) {
-    for( ; *pstr != 0; pstr++) {
-      
-      /* Get current character */
-      c = *pstr;
-      
-      /* Get the number of quanta represented */
-      if (c == '1') {
-        d = 6;
-      } else if (c == '2') {
-        d = 12;
-      } else if (c == '3') {
-        d = 24;
-      } else if (c == '4') {
-        d = 48;
-      } else if (c == '5') {
-        d = 96;
-      } else if (c == '6') {
-        d = 192;
-      } else if (c == '7') {
-        d = 384;
-      } else if (c == '8') {
-        d = 32;
-      } else if (c == '9') {
-        d = 64;
-      } else {
-        /* Invalid character */
-        status = 0;
-        *per = ERR_DURSTR;
-      }
-      
-      /* Check if the next character is a modifier; if it is, apply it
-       * and skip the character */
-      if (status) {
-        if (pstr[1] == '\'') {
-          /* Doubling modifier */
-          d *= 2;
-          pstr++;
-          
-        } else if (pstr[1] == '.') {
-          /* Multiply by 1.5 */
-          d = d + (d / 2);
-          pstr++;
-          
-        } else if (pstr[1] == ',') {
-          /* Halving modifier */
-          d /= 2;
-          pstr++;
-        }
-      }
-      
-      /* Add duration to current duration, watching for overflow */
-      if (status) {
-        if (d <= INT32_MAX - dur) {
-          dur += d;
-        } else {
-          /* overflow */
-          status = 0;
-          *per = ERR_DURSTR;
-        }
-      }
-      
-      /* Leave loop if error */
-      if (!status) {
-        break;
-      }
+  k = i;
+  for(t = pi->offset_input; t < t_end; t++) {
+    
+    /* Transform with the original nodes */
+    while ((m_map_t[k + 1]).offset_input <= t) {
+      k++;
     }
-  }
-  
-  /* Push the duration */
-  if (status) {
-    if (!stack_push(dur, per)) {
-      status = 0;
+    x = nodeTransform(k, t);
+    
+    /* Transform with the candidate */
+    f = (double) (t - pi->offset_input);
+    f = floor(a * f * f + b * f);
+    if (!((f >= 0.0) && (f <= (double) (INT32_MAX - pi->offset_output)))) {
+      return 0;
+    }
+    y = ((int32_t) f) + pi->offset_output;
+    if ((!open_end) && (y > limit)) {
+      y = limit;
+    }
+    
+    /* Compare */
+    if ((x < 0) || (x - y > tol) || (y - x > tol)) {
+      return 0;
     }
   }
   
-  /* Return status */
+  return 1;
 }
 
 /*
- * Push an integer literal onto the interpreter stack.
+ * Fit a candidate node to a run of tempo nodes.
  * 
- * pstr is the numeric string.  per points to a variable to receive an
- * error code in case of error.
+ * The run is as for runError().  The candidate starts at the same input
+ * and output offsets as node i, and its A and B parameters are fit by
+ * least squares to OPT_FIT_POINTS evenly spaced points in each node of
+ * the run.  If const_only is non-zero, A is fixed at zero and only B is
+ * fit.
  * 
  * Parameters:
  * 
- *   pstr - the numeric string
+ *   i - the first node of the run
  * 
- *   per - pointer to variable to receive error code
+ *   j - the last node of the run
+ * 
+ *   const_only - non-zero to fit a constant tempo
+ * 
+ *   pa - pointer to variable to receive the A parameter
+ * 
+ *   pb - pointer to variable to receive the B parameter
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   non-zero if successful, zero if the fit is degenerate or does not
+ *   increase across the run
  */
-static int pushNum(const char *pstr, int *per) {
-  
-  int status = 1;
-  int32_t val = 0;
+static int runFit(
+    int32_t   i,
+    int32_t   j,
+    int       const_only,
+    double  * pa,
+    double  * pb) {
+  
+  int32_t k = 0;
+  int32_t m = 0;
+  double len = 0.0;
+  double s = 0.0;
+  double x = 0.0;
+  double u = 0.0;
+  double y = 0.0;
+  double s22 = 0.0;
+  double s21 = 0.0;
+  double s11 = 0.0;
+  double sy2 = 0.0;
+  double sy1 = 0.0;
+  double det = 0.0;
+  double a = 0.0;
+  double b = 0.0;
+  TEMPONODE *pk = NULL;
+  TEMPONODE *pi = NULL;
   
   /* Check parameters */
-  if ((pstr == NULL) || (per == NULL)) {
+  if ((i < 0) || (j < i) || (j >= m_map_count - 1) ||
+      (pa == NULL) || (pb == NULL)) {
     abort();
   }
   
-  /* Try to parse the number */
-  if (!parseInt(pstr, &val)) {
-    status = 0;
-    *per = ERR_NUMSTR;
+  /* Accumulate the normal equations, with offsets from the start of the
+   * run scaled by the length of the run for conditioning */
+  pi = &(m_map_t[i]);
+  len = (double) ((m_map_t[j + 1]).offset_input - pi->offset_input);
+  for(k = i; k <= j; k++) {
+    pk = &(m_map_t[k]);
+    s = (double) (pk->offset_input - pi->offset_input);
+    for(m = 0; m < OPT_FIT_POINTS; m++) {
+      x = ((double) ((m_map_t[k + 1]).offset_input - pk->offset_input)) *
+            ((double) m) / ((double) OPT_FIT_POINTS);
+      y = pk->a * x * x + pk->b * x +
+            ((double) (pk->offset_output - pi->offset_output));
+      u = (x + s) / len;
+      s22 += u * u * u * u;
+      s21 += u * u * u;
+      s11 += u * u;
+      sy2 += u * u * y;
+      sy1 += u * y;
+    }
   }
   
-  /* Push the number */
-  if (status) {
-    if (!stack_push(val, per)) {
-      status = 0;
+  /* Solve, and unscale */
+  if (const_only) {
+    if (!(s11 > 0.0)) {
+      return 0;
+    }
+    a = 0.0;
+    b = (sy1 / s11) / len;
+    
+  } else {
+    det = s22 * s11 - s21 * s21;
+    if (!(fabs(det) > 0.0)) {
+      return 0;
     }
+    a = ((sy2 * s11 - sy1 * s21) / det) / (len * len);
+    b = ((s22 * sy1 - s21 * sy2) / det) / len;
   }
   
-  /* Return status */
-  return status;
+  /* The candidate must be finite and increasing across the run */
+  if ((!isfinite(a)) || (!isfinite(b))) {
+    return 0;
+  }
+  if ((!(b > 0.0)) || (!(2.0 * a * len + b > 0.0))) {
+    return 0;
+  }
+  
+  *pa = a;
+  *pb = b;
+  return 1;
 }
 
 /*
- * Run a multiply operation.
- * 
- * This pops two integers off the stack, multiplies them, and pushes the
- * result back onto the stack.
+ * Check whether a candidate node within tolerance can replace a run of
+ * tempo nodes.
  * 
- * per points to a variable to receive to an error code if error.
+ * The run and candidate are as for runError().  The flooring of output
+ * times and the clamping at the ends of nodes can each add up to one
+ * sample to the continuous difference, so the candidate is accepted
+ * without further checks if the continuous difference is at least two
+ * samples within tolerance, rejected if it is beyond tolerance, and
+ * otherwise checked exactly with runCheck(), to which open_end is passed
+ * through.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
+ *   i - the first node of the run
+ * 
+ *   j - the last node of the run
+ * 
+ *   a - the A parameter of the candidate
+ * 
+ *   b - the B parameter of the candidate
+ * 
+ *   tol - the tolerance in output samples
+ * 
+ *   open_end - non-zero if the candidate output is not clamped
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   non-zero if the candidate is within tolerance, zero if not
  */
-static int opMul(int *per) {
+static int runAccept(
+    int32_t i,
+    int32_t j,
+    double  a,
+    double  b,
+    int32_t tol,
+    int     open_end) {
+  
+  double e = 0.0;
+  
+  e = ceil(runError(i, j, a, b));
+  if (e + 2.0 <= (double) tol) {
+    return 1;
+  } else if (e > (double) tol) {
+    return 0;
+  }
+  return runCheck(i, j, a, b, tol, open_end);
+}
+
+/*
+ * Optimize the tempo map within a tolerance.
+ * 
+ * tol is the greatest number of output samples by which any transformed
+ * time may change.  It must be zero or greater.
+ * 
+ * Runs of consecutive nodes are merged greedily into a single node, up
+ * to OPT_MAX_RUN nodes at a time.  A run of constant tempi with the same
+ * rate is merged by extending the first of them.  Otherwise, a ramp or
+ * constant tempo is fit to the run by least squares.  Any ramp that is
+ * left on its own is replaced by a constant tempo if one fits.  Each
+ * replacement is only made if it is within tolerance (see runAccept()).
+ * The last node of the map has no end, so it can only be merged into a
+ * preceding run of constant tempi with the same rate, and then only if
+ * the constant difference between them is within tolerance.
+ * 
+ * The tempo map must already be successfully initialized or a fault
+ * occurs.  The counts before and after are stored in m_opt_before and
+ * m_opt_after.
+ * 
+ * Parameters:
+ * 
+ *   tol - the tolerance in output samples
+ */
+static void optimizeMap(int32_t tol) {
   
-  int status = 1;
-  int32_t a = 0;
-  int32_t b = 0;
-  int64_t r = 0;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t k = 0;
+  int32_t n = 0;
+  int same = 0;
+  double a = 0.0;
+  double b = 0.0;
+  double ca = 0.0;
+  double cb = 0.0;
+  double c = 0.0;
+  TEMPONODE *pi = NULL;
+  TEMPONODE *pj = NULL;
   
   /* Check parameter */
-  if (per == NULL) {
+  if (tol < 0) {
     abort();
   }
   
-  /* Pop the parameters */
-  if (!stack_pop(&b, per)) {
-    status = 0;
-  }
-  if (status) {
-    if (!stack_pop(&a, per)) {
-      status = 0;
-    }
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
   }
   
-  /* Compute result in 64-bit */
-  if (status) {
-    r = ((int64_t) a) * ((int64_t) b);
-  }
+  m_opt_before = m_map_count;
   
-  /* Range-check result */
-  if (status) {
-    if ((r < INT32_MIN) || (r > INT32_MAX)) {
-      status = 0;
-      *per = ERR_OVERFL;
+  /* Go through the runs, compacting the map in place; n is the number
+   * of nodes kept so far, and node i is the start of the next run */
+  n = 0;
+  i = 0;
+  while (i < m_map_count) {
+    pi = &(m_map_t[i]);
+    ca = pi->a;
+    cb = pi->b;
+    
+    /* Extend the run as far as possible */
+    for(j = i; (j + 1 < m_map_count) && (j + 1 - i < OPT_MAX_RUN); j++) {
+      pj = &(m_map_t[j + 1]);
+      
+      /* Check whether the run so far and the next node are all constant
+       * tempi with the same rate as the first */
+      same = 0;
+      if ((pi->a == 0.0) && (pj->a == 0.0) && (pj->b == pi->b)) {
+        same = 1;
+        for(k = i + 1; k <= j; k++) {
+          if (((m_map_t[k]).a != 0.0) || ((m_map_t[k]).b != pi->b)) {
+            same = 0;
+            break;
+          }
+        }
+      }
+      
+      if (j + 1 == m_map_count - 1) {
+        /* Next node is the last node, so it can only be merged into a
+         * run of the same rate, where the candidate differs from it by
+         * a constant with no clamping at the end */
+        if (!same) {
+          break;
+        }
+        c = pi->b * ((double) (pj->offset_input - pi->offset_input)) +
+              ((double) pi->offset_output) - ((double) pj->offset_output);
+        if (!(ceil(fabs(c)) <= (double) tol)) {
+          break;
+        }
+        if (!runAccept(i, j, pi->a, pi->b, tol, 1)) {
+          break;
+        }
+        ca = pi->a;
+        cb = pi->b;
+        
+      } else if (same && runAccept(i, j + 1, pi->a, pi->b, tol, 0)) {
+        /* Extend the first constant tempo */
+        ca = pi->a;
+        cb = pi->b;
+        
+      } else if (runFit(i, j + 1, 0, &a, &b) &&
+                  runAccept(i, j + 1, a, b, tol, 0)) {
+        /* Use the fit */
+        ca = a;
+        cb = b;
+        
+      } else {
+        break;
+      }
     }
-  }
-  
-  /* Push result */
-  if (status) {
-    if (!stack_push((int32_t) r, per)) {
-      status = 0;
+    
+    /* If a ramp is left on its own and is not the last node, replace it
+     * with a constant tempo if one fits */
+    if ((j == i) && (pi->a != 0.0) && (i < m_map_count - 1)) {
+      if (runFit(i, i, 1, &a, &b) && runAccept(i, i, a, b, tol, 0)) {
+        ca = a;
+        cb = b;
+      }
     }
+    
+    /* Store the node for the run */
+    m_map_t[n] = m_map_t[i];
+    (m_map_t[n]).a = ca;
+    (m_map_t[n]).b = cb;
+    n++;
+    
+    /* Next run */
+    i = j + 1;
   }
   
-  /* Return status */
-  return status;
+  m_map_count = n;
+  m_opt_after = n;
 }
 
 /*
- * Run a section operation.
+ * Find the tempo node that applies to an input t value.
  * 
- * This pops an integer off the stack, and moves the cursor to the start
- * of that section, based on the input NMF sections in m_pdi.
+ * t is the input quantum offset, which must be greater than or equal to
+ * zero.
  * 
- * A fault occurs if m_pdi is NULL.
+ * The return value is the index of the tempo node with the greatest
+ * offset_input that is less than or equal to t.
  * 
- * per points to a variable to receive to an error code if error.
+ * The tempo map must already be successfully initialized or a fault
+ * occurs.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
+ *   t - the input t value
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   the index of the tempo node
  */
-static int opSect(int *per) {
+static int32_t mapFind(int32_t t) {
   
-  int status = 1;
-  int32_t sect = 0;
+  int32_t lo = 0;
+  int32_t hi = 0;
+  int32_t mid = 0;
+  int32_t mid_val = 0;
   
   /* Check parameter */
-  if (per == NULL) {
+  if (t < 0) {
     abort();
   }
   
   /* Check state */
-  if (m_pdi == NULL) {
+  if (m_map_init <= 0) {
     abort();
   }
   
-  /* Pop the section number */
-  if (!stack_pop(&sect, per)) {
-    status = 0;
+  /* If t greater than or equal to last node, use last node */
+  if ((m_map_t[m_map_count - 1]).offset_input <= t) {
+    return (m_map_count - 1);
   }
   
-  /* Check that section number is in range */
-  if (status) {
-    if ((sect < 0) || (sect >= nmf_sections(m_pdi))) {
-      status = 0;
-      *per = ERR_BADSEC;
+  /* t less than last node, so perform binary search to find desired
+   * node */
+  lo = 0;
+  hi = m_map_count - 1;
+  while (lo < hi) {
+    
+    /* Compute midpoint, which must be greater than low bound */
+    mid = lo + ((hi - lo) / 2);
+    if (mid <= lo) {
+      mid = lo + 1;
+    }
+    
+    /* Get midpoint value */
+    mid_val = (m_map_t[mid]).offset_input;
+    
+    /* Compare t to midpoint value */
+    if (t < mid_val) {
+      /* t less than midpoint value, so set hi bound to one lower than
+       * midpoint */
+      hi = mid - 1;
+      
+    } else if (t > mid_val) {
+      /* t greater than midpoint vlaue, so set lo bound to midpoint */
+      lo = mid;
+      
+    } else if (t == mid_val) {
+      /* t equals midpoint value, so zoom in on midpoint */
+      lo = mid;
+      hi = mid;
+      
+    } else {
+      abort();  /* shouldn't happen */
     }
   }
   
-  /* Set the cursor to the section offset */
-  if (status) {
-    m_cursor = nmf_offset(m_pdi, sect);
-  }
-  
-  /* Return status */
-  return status;
+  /* Return the node index */
+  return lo;
 }
 
 /*
- * Run a step operation.
+ * Finish transforming an input t value using a specific tempo node.
  * 
- * This pops an integer off the stack, and adds its value to the current
- * cursor position.  The integer may be negative, but it may not take
- * the cursor to a negative position.
+ * i is the index of the tempo node.  f is the offset of the output t
+ * value from the start of the node, computed in floating-point from the
+ * node parameters but not yet floored.  This function floors f, checks
+ * it for numeric problems, and adds it to the output offset of the
+ * node, clamping the result to the output range of the node.
  * 
- * per points to a variable to receive to an error code if error.
+ * The return value is the offset using the fixed-length basis, or -1
+ * if the output t can not be computed due to overflow or other numeric
+ * problems.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
+ *   i - the index of the tempo node
+ * 
+ *   f - the unfloored offset from the start of the node
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   the output t value, or -1 if t could not be computed
  */
-static int opStep(int *per) {
+static int32_t nodeFinish(int32_t i, double f) {
   
   int status = 1;
-  int32_t sv = 0;
-  int64_t r = 0;
+  int32_t t = 0;
+  TEMPONODE *pt = NULL;
+  TEMPONODE *pnx = NULL;
   
-  /* Check parameter */
-  if (per == NULL) {
+  /* Check parameters */
+  if ((i < 0) || (i >= m_map_count)) {
     abort();
   }
   
-  /* Pop step value */
-  if (!stack_pop(&sv, per)) {
-    status = 0;
+  /* Get pointer to node and next node, if there is one */
+  pt = &(m_map_t[i]);
+  if (i < m_map_count - 1) {
+    pnx = &(m_map_t[i + 1]);
+  } else {
+    pnx = NULL;
   }
   
-  /* Add the step value to the cursor in 64-bit */
-  if (status) {
-    r = m_cursor + sv;
-  }
+  /* Floor the offset */
+  f = floor(f);
   
-  /* Range-check result */
-  if (status) {
-    if ((r < 0) || (r > INT32_MAX)) {
+  /* Check for numeric problems */
+  if (!isfinite(f)) {
+    status = 0;
+  }
+  if (status) {
+    if (!((f >= ((double) INT32_MIN)) && (f <= ((double) INT32_MAX)))) {
       status = 0;
-      *per = ERR_BADCUR;
     }
   }
   
-  /* Update cursor */
+  /* Get transformed offset as integer */
   if (status) {
-    m_cursor = (int32_t) r;
+    t = (int32_t) f;
   }
   
-  /* Return status */
-  return status;
+  /* If transformed offset less than zero, set to zero */
+  if (status && (t < 0)) {
+    t = 0;
+  }
+  
+  /* Add transformed offset to output offset, watching for overflow */
+  if (status) {
+    if (t <= INT32_MAX - pt->offset_output) {
+      t = t + pt->offset_output;
+    } else {
+      status = 0;
+    }
+  }
+  
+  /* If there is a next node, make sure transformed t is less than its
+   * output offset */
+  if (status && (pnx != NULL)) {
+    if (pnx->offset_output <= t) {
+      t = pnx->offset_output - 1;
+    }
+  }
+  
+  /* If failure, set t to -1 */
+  if (!status) {
+    t = -1;
+  }
+  
+  /* Return result */
+  return t;
 }
 
 /*
- * Run a constant tempo operation.
+ * Transform an input t value using a specific tempo node.
  * 
- * This pops a rate integer, and then a quanta integer off the stack,
- * and combines it with the current cursor position to add a constant
- * tempo to the tempo map.
+ * i is the index of the tempo node, which must be the node returned by
+ * mapFind() for t.  t is the input quantum offset, which must be
+ * greater than or equal to zero.
  * 
- * per points to a variable to receive to an error code if error.
+ * The return value is the offset using the fixed-length basis, or -1
+ * if the output t can not be computed due to overflow or other numeric
+ * problems.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
+ *   i - the index of the tempo node
+ * 
+ *   t - the input t value
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   the output t value, or -1 if t could not be computed
  */
-static int opTempo(int *per) {
+static int32_t nodeTransform(int32_t i, int32_t t) {
   
-  int status = 1;
-  int32_t r = 0;
-  int32_t q = 0;
+  TEMPONODE *pt = NULL;
+  double f = 0.0;
   
-  /* Check parameter */
-  if (per == NULL) {
+  /* Check parameters */
+  if ((i < 0) || (i >= m_map_count) || (t < 0)) {
     abort();
   }
   
-  /* Pop parameters */
-  if (!stack_pop(&r, per)) {
-    status = 0;
-  }
-  if (status) {
-    if (!stack_pop(&q, per)) {
-      status = 0;
-    }
-  }
+  /* Get pointer to node */
+  pt = &(m_map_t[i]);
   
-  /* Range-check parameters */
-  if (status && (r < 1)) {
-    status = 0;
-    *per = ERR_BADRATE;
-  }
-  if (status && (q < 1)) {
-    status = 0;
-    *per = ERR_BADQ;
-  }
+  /* Change t to be an offset within this tempo node */
+  t = t - pt->offset_input;
   
-  /* Add tempo */
-  if (status) {
-    if (!addConstantTempo(m_cursor, q, r, per)) {
-      status = 0;
-    }
+  /* Compute the transformed offset in floating-point */
+  if (pt->a == 0.0) {
+    f = pt->b * ((double) t);
+  } else {
+    f = pt->a * (((double) t) * ((double) t)) + pt->b * ((double) t);
   }
   
-  /* Return status */
-  return status;
+  /* Floor, check, and offset the result */
+  return nodeFinish(i, f);
 }
 
 /*
- * Run a ramp tempo operation.
+ * Transform an input t value to an output t value using the tempo map.
  * 
- * This pops a rate2 integer, then a quanta2 integer, then a rate1
- * integer, and finally a quanta1 integer off the stack, and combines it
- * with the current cursor position to buffer a ramp tempo.  The buffer
- * will be flushed on the next tempo, when the length of the ramp is
- * determined.
+ * t is the input quantum offset, which must be greater than or equal to
+ * zero.  t is specified with a quantum basis of 96 quanta per quarter.
  * 
- * per points to a variable to receive to an error code if error.
+ * The return value is the offset using the fixed-length basis
+ * established by parseMap().
+ * 
+ * If the output t can not be computed due to overflow or other numeric
+ * problems, -1 is returned.
+ * 
+ * The tempo map must already be successfully initialized or a fault
+ * occurs.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
+ *   t - the input t value
  * 
  * Return:
  * 
- *   non-zero if successful, zero if error
+ *   the output t value, or -1 if t could not be computed
  */
-static int opRamp(int *per) {
+static int32_t mapTransform(int32_t t) {
+  return nodeTransform(mapFind(t), t);
+}
+
+/*
+ * Transform an array of input t values using the tempo map.
+ * 
+ * pt points to the count input t values, each of which must be greater
+ * than or equal to zero.  pr points to count elements that receive the
+ * output t values.  Each result is the same as mapTransform() would
+ * return for the corresponding input, including -1 for failure.
+ * 
+ * When the input values are in ascending order, the tempo nodes are
+ * walked forward instead of searched, so the cost of each value is
+ * constant.  Input values that are not in ascending order fall back to
+ * a search.
+ * 
+ * The tempo map must already be successfully initialized or a fault
+ * occurs.
+ * 
+ * Parameters:
+ * 
+ *   pt - the input t values
+ * 
+ *   pr - the array receiving the output t values
+ * 
+ *   count - the number of values
+ */
+static void mapTransformVec(
+    const int32_t * pt,
+          int32_t * pr,
+          int32_t   count) {
   
-  int status = 1;
-  int32_t r2 = 0;
-  int32_t q2 = 0;
-  int32_t r1 = 0;
-  int32_t q1 = 0;
+  int32_t x = 0;
+  int32_t i = 0;
+  int32_t t = 0;
   
-  /* Check parameter */
-  if (per == NULL) {
+  /* Check parameters */
+  if ((pt == NULL) || (pr == NULL) || (count < 0)) {
     abort();
   }
   
-  /* Pop parameters */
-  if (!stack_pop(&r2, per)) {
-    status = 0;
-  }
-  if (status) {
-    if (!stack_pop(&q2, per)) {
-      status = 0;
-    }
-  }
-  if (status) {
-    if (!stack_pop(&r1, per)) {
-      status = 0;
-    }
-  }
-  if (status) {
-    if (!stack_pop(&q1, per)) {
-      status = 0;
-    }
-  }
-  
-  /* Range-check parameters */
-  if (status && ((r1 < 1) || (r2 < 1))) {
-    status = 0;
-    *per = ERR_BADRATE;
-  }
-  if (status && ((q1 < 1) || (q2 < 1))) {
-    status = 0;
-    *per = ERR_BADQ;
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
   }
   
-  /* Buffer tempo */
-  if (status) {
-    if (!bufferRamp(m_cursor, q1, r1, q2, r2, per)) {
-      status = 0;
+  /* Transform each value */
+  for(x = 0; x < count; x++) {
+    
+    /* Get value */
+    t = pt[x];
+    if (t < 0) {
+      abort();
+    }
+    
+    /* If value before current node, search; otherwise walk forward */
+    if (t < (m_map_t[i]).offset_input) {
+      i = mapFind(t);
+    } else {
+      while (i < m_map_count - 1) {
+        if ((m_map_t[i + 1]).offset_input <= t) {
+          i++;
+        } else {
+          break;
+        }
+      }
     }
+    
+    /* Transform value */
+    pr[x] = nodeTransform(i, t);
   }
-  
-  /* Return status */
-  return status;
 }
 
 /*
- * Run a span tempo operation.
- * 
- * This pops a millisecond count, and then a quanta integer off the
- * stack, and combines it with the current cursor position to add a span
- * tempo to the tempo map.
+ * Mark the tempo nodes that may be evaluated in single precision.
+ * 
+ * t_max is the greatest input t value that will be transformed.  It is
+ * used as the end of the input range of the last node, which otherwise
+ * has no end.  It must be zero or greater.
+ * 
+ * Within a node, the offset x from the start of the node is exact in
+ * single precision as long as it is at most 2^24.  Evaluating
+ * a * x^2 + b * x in single precision then has four roundings (the two
+ * parameters, the products, and the sum), so the absolute error is at
+ * most about 4u * (|a| * X^2 + |b| * X), where u is the unit roundoff
+ * and X is the greatest offset in the node.  A node qualifies if twice
+ * that bound is less than one, so its floored result is within one
+ * sample of the double-precision result.  Clamping to the output range
+ * of the node does not increase the difference.
  * 
- * per points to a variable to receive to an error code if error.
+ * The tempo map must already be successfully initialized or a fault
+ * occurs.
  * 
  * Parameters:
  * 
- *   per - pointer to variable to receive error code
- * 
- * Return:
- * 
- *   non-zero if successful, zero if error
+ *   t_max - the greatest input t value
  */
-static int opSpan(int *per) {
+static void markPreview(int32_t t_max) {
   
-  int status = 1;
-  int32_t m = 0;
-  int32_t q = 0;
+  int32_t i = 0;
+  int32_t x_max = 0;
+  double x = 0.0;
+  TEMPONODE *pt = NULL;
   
   /* Check parameter */
-  if (per == NULL) {
+  if (t_max < 0) {
     abort();
   }
   
-  /* Pop parameters */
-  if (!stack_pop(&m, per)) {
-    status = 0;
-  }
-  if (status) {
-    if (!stack_pop(&q, per)) {
-      status = 0;
-    }
-  }
-  
-  /* Range-check parameters */
-  if (status && (m < 1)) {
-    status = 0;
-    *per = ERR_BADMIL;
-  }
-  if (status && (q < 1)) {
-    status = 0;
-    *per = ERR_BADQ;
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
   }
   
-  /* Add tempo */
-  if (status) {
-    if (!addSpanTempo(m_cursor, q, m, per)) {
-      status = 0;
+  /* Check each node */
+  m_preview_nodes = 0;
+  for(i = 0; i < m_map_count; i++) {
+    pt = &(m_map_t[i]);
+    
+    /* Get the greatest offset within the node */
+    if (i < m_map_count - 1) {
+      x_max = (m_map_t[i + 1]).offset_input - pt->offset_input - 1;
+    } else if (t_max > pt->offset_input) {
+      x_max = t_max - pt->offset_input;
+    } else {
+      x_max = 0;
+    }
+    x = (double) x_max;
+    
+    /* Check the error bound */
+    pt->preview = 0;
+    if (x_max <= 16777216) {
+      if (8.0 * FLOAT_UNIT * (fabs(pt->a) * x * x + fabs(pt->b) * x)
+            < 1.0) {
+        pt->preview = 1;
+        m_preview_nodes++;
+      }
     }
   }
-  
-  /* Return status */
-  return status;
 }
 
 /*
- * Parse a tempo map.
+ * Transform an array of input t values in preview mode.
  * 
- * This may only be called once.  Additional calls cause a fault.
+ * This is like mapTransformVec(), except that values in tempo nodes
+ * marked by markPreview() are evaluated in single precision, and so
+ * may differ by one sample from mapTransform().  Values in other nodes
+ * fall back to double precision, and give the same result as
+ * mapTransform().
  * 
- * pIn is the Shastina file to read.  It must be open for reading or
- * undefined behavior occurs.  Reading is fully sequential.
+ * pf points to count flags that are set to one for each value that used
+ * the double-precision fallback and zero otherwise.
  * 
- * srate is the sampling rate to use.  It must be either 48000 or 44100.
+ * Values are processed in batches.  The node of each value is found
+ * first, then the single-precision products are computed over the whole
+ * batch in a loop without branches, which the compiler can vectorize
+ * with twice as many lanes as double precision, and finally each result
+ * is floored and offset with nodeFinish().
  * 
- * per points to a variable to receive an error code in case of failure.
- * pln points to a variable to receive a line number in case of failure.
- * The error code can be converted into a string with error_string().
+ * markPreview() must have been called for a t_max that is at least the
+ * greatest input value or the error bound does not hold.
  * 
  * Parameters:
  * 
- *   pIn - the tempo map file to read
- * 
- *   srate - the sampling rate
- * 
- *   per - pointer to variable to receive the error code
+ *   pt - the input t values
  * 
- *   pln - pointer to variable to receive a line number
+ *   pr - the array receiving the output t values
  * 
- * Return:
+ *   pf - the array receiving the fallback flags
  * 
- *   non-zero if successful, zero if error
+ *   count - the number of values
+ */
+static void mapPreviewVec(
+    const int32_t * pt,
+          int32_t * pr,
+          uint8_t * pf,
+          int32_t   count) {
+  
+  int32_t base = 0;
+  int32_t batch = 0;
+  int32_t x = 0;
+  int32_t i = 0;
+  int32_t t = 0;
+  int32_t node[PREVIEW_BATCH];
+  float fx[PREVIEW_BATCH];
+  float fa[PREVIEW_BATCH];
+  float fb[PREVIEW_BATCH];
+  float fy[PREVIEW_BATCH];
+  
+  /* Check parameters */
+  if ((pt == NULL) || (pr == NULL) || (pf == NULL) || (count < 0)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
+  }
+  
+  /* Process each batch */
+  for(base = 0; base < count; base += batch) {
+    
+    /* Determine batch size */
+    batch = count - base;
+    if (batch > PREVIEW_BATCH) {
+      batch = PREVIEW_BATCH;
+    }
+    
+    /* Find the node of each value, walking forward when the values are
+     * ascending, and gather the single-precision operands of the values
+     * in nodes that qualify */
+    for(x = 0; x < batch; x++) {
+      t = pt[base + x];
+      if (t < 0) {
+        abort();
+      }
+      
+      if (t < (m_map_t[i]).offset_input) {
+        i = mapFind(t);
+      } else {
+        while (i < m_map_count - 1) {
+          if ((m_map_t[i + 1]).offset_input <= t) {
+            i++;
+          } else {
+            break;
+          }
+        }
+      }
+      
+      node[x] = i;
+      if ((m_map_t[i]).preview) {
+        fx[x] = (float) (t - (m_map_t[i]).offset_input);
+        fa[x] = (float) (m_map_t[i]).a;
+        fb[x] = (float) (m_map_t[i]).b;
+      } else {
+        fx[x] = 0.0f;
+        fa[x] = 0.0f;
+        fb[x] = 0.0f;
+      }
+    }
+    
+    /* Compute the single-precision offsets */
+    for(x = 0; x < batch; x++) {
+      fy[x] = fa[x] * fx[x] * fx[x] + fb[x] * fx[x];
+    }
+    
+    /* Finish each value, falling back to double precision for values in
+     * nodes that do not qualify */
+    for(x = 0; x < batch; x++) {
+      if ((m_map_t[node[x]]).preview) {
+        pr[base + x] = nodeFinish(node[x], (double) fy[x]);
+        pf[base + x] = 0;
+      } else {
+        pr[base + x] = nodeTransform(node[x], pt[base + x]);
+        pf[base + x] = 1;
+      }
+    }
+  }
+}
+
+/*
+ * Report the statistics of preview mode.
+ * 
+ * Parameters:
+ * 
+ *   pf - the file to report to
+ * 
+ *   pModule - the module name to prefix the report with
+ */
+static void reportPreview(FILE *pf, const char *pModule) {
+  
+  /* Check parameters */
+  if ((pf == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Report */
+  fprintf(pf, "%s: Preview evaluated %ld of %ld tempo nodes in single "
+              "precision\n",
+          pModule, (long) m_preview_nodes, (long) m_map_count);
+  fprintf(pf, "%s: Preview used the double precision fallback for "
+              "%ld of %ld notes\n",
+          pModule, (long) m_preview_fallback, (long) m_preview_notes);
+}
+
+/*
+ * Snap an output time to the block grid.
+ * 
+ * t is the output time, which must be zero or greater.  It is rounded
+ * to a multiple of m_block according to m_round.  The absolute
+ * difference between the snapped and original times is accumulated in
+ * the note end statistics if is_end is greater than zero, the note
+ * start statistics if is_end is zero, or not at all if is_end is less
+ * than zero.
+ * 
+ * pr points to the variable that receives the snapped time.  The
+ * function fails if the snapped time is out of range.
+ * 
+ * m_block must be greater than zero or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   t - the output time to snap
+ * 
+ *   is_end - which statistics to accumulate (see above)
+ * 
+ *   pr - pointer to variable to receive the snapped time
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if out of range
+ */
+static int snapTime(int32_t t, int is_end, int32_t *pr) {
+  
+  int64_t r = 0;
+  int64_t e = 0;
+  
+  /* Check parameters */
+  if ((t < 0) || (pr == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_block < 1) {
+    abort();
+  }
+  
+  /* Round according to the rounding policy */
+  if (m_round == ROUND_FLOOR) {
+    r = (int64_t) t;
+  } else if (m_round == ROUND_CEIL) {
+    r = ((int64_t) t) + ((int64_t) (m_block - 1));
+  } else if (m_round == ROUND_NEAREST) {
+    r = ((int64_t) t) + ((int64_t) (m_block / 2));
+  } else {
+    abort();  /* shouldn't happen */
+  }
+  r = (r / ((int64_t) m_block)) * ((int64_t) m_block);
+  
+  /* Check range */
+  if (r > INT32_MAX) {
+    return 0;
+  }
+  
+  /* Accumulate error statistics */
+  e = r - ((int64_t) t);
+  if (e < 0) {
+    e = -e;
+  }
+  if (is_end > 0) {
+    m_snap_end_sum += e;
+    if (e > m_snap_end_max) {
+      m_snap_end_max = e;
+    }
+  } else if (is_end == 0) {
+    m_snap_start_sum += e;
+    if (e > m_snap_start_max) {
+      m_snap_start_max = e;
+    }
+  }
+  
+  /* Return snapped time */
+  *pr = (int32_t) r;
+  return 1;
+}
+
+/*
+ * Snap a converted note to the block grid.
+ * 
+ * pn is the converted note.  Its t value is snapped with snapTime().
+ * If its duration is greater than zero, the end of the note is also
+ * snapped, and the duration is adjusted so that the note remains at
+ * least one block long.  Zero and negative durations are left alone.
+ * 
+ * m_block must be greater than zero or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pn - the note to snap
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if out of range
+ */
+static int snapNote(NMF_NOTE *pn) {
+  
+  int status = 1;
+  int32_t t = 0;
+  int32_t y = 0;
+  
+  /* Check parameter */
+  if (pn == NULL) {
+    abort();
+  }
+  
+  /* Snap the start of the note */
+  if (!snapTime(pn->t, 0, &t)) {
+    status = 0;
+  }
+  
+  /* Snap the end of the note if it has a duration */
+  if (status && (pn->dur > 0)) {
+    if (pn->dur <= INT32_MAX - pn->t) {
+      if (!snapTime(pn->t + pn->dur, 1, &y)) {
+        status = 0;
+      }
+    } else {
+      status = 0;
+    }
+    
+    if (status && (y - t < m_block)) {
+      if (t <= INT32_MAX - m_block) {
+        y = t + m_block;
+        m_snap_extended++;
+      } else {
+        status = 0;
+      }
+    }
+    
+    if (status) {
+      pn->dur = y - t;
+      m_snap_end_count++;
+    }
+  }
+  
+  /* Store snapped start */
+  if (status) {
+    pn->t = t;
+    m_snap_start_count++;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Report the timing error statistics of block snapping.
+ * 
+ * Parameters:
+ * 
+ *   pf - the file to report to
+ * 
+ *   pModule - the module name to prefix the report with
+ */
+static void reportSnap(FILE *pf, const char *pModule) {
+  
+  double start_mean = 0.0;
+  double end_mean = 0.0;
+  
+  /* Check parameters */
+  if ((pf == NULL) || (pModule == NULL)) {
+    abort();
+  }
+  
+  /* Compute mean errors */
+  if (m_snap_start_count > 0) {
+    start_mean = ((double) m_snap_start_sum) /
+                    ((double) m_snap_start_count);
+  }
+  if (m_snap_end_count > 0) {
+    end_mean = ((double) m_snap_end_sum) /
+                  ((double) m_snap_end_count);
+  }
+  
+  /* Report */
+  fprintf(pf, "%s: Snapped %ld note starts to %ld-sample blocks, "
+              "error mean %.2f max %ld\n",
+          pModule, (long) m_snap_start_count, (long) m_block,
+          start_mean, (long) m_snap_start_max);
+  fprintf(pf, "%s: Snapped %ld note ends, error mean %.2f max %ld\n",
+          pModule, (long) m_snap_end_count,
+          end_mean, (long) m_snap_end_max);
+  fprintf(pf, "%s: Extended %ld notes to one block\n",
+          pModule, (long) m_snap_extended);
+}
+
+/*
+ * Find the last input time needed to convert a range of sections.
+ * 
+ * lo and hi are the first and last sections of the range, inclusive.
+ * They must be valid section indices in pdi with lo not greater than
+ * hi.
+ * 
+ * The return value is the greatest input time among the section
+ * offsets of the range and the starts and ends of the notes in the
+ * range.
+ * 
+ * Parameters:
+ * 
+ *   pdi - the input NMF data
+ * 
+ *   lo - the first section of the range
+ * 
+ *   hi - the last section of the range
+ * 
+ * Return:
+ * 
+ *   the last input time needed
+ */
+static int32_t findHorizon(NMF_DATA *pdi, int32_t lo, int32_t hi) {
+  
+  int32_t result = 0;
+  int32_t notes = 0;
+  int32_t i = 0;
+  int64_t r = 0;
+  NMF_NOTE n;
+  
+  /* Initialize structures */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameters */
+  if (pdi == NULL) {
+    abort();
+  }
+  if ((lo < 0) || (lo > hi) || (hi >= nmf_sections(pdi))) {
+    abort();
+  }
+  
+  /* Start with the offset of the last section in the range */
+  result = nmf_offset(pdi, hi);
+  
+  /* Extend to the end of each note in the range */
+  notes = nmf_notes(pdi);
+  for(i = 0; i < notes; i++) {
+    nmf_get(pdi, i, &n);
+    if ((((int32_t) n.sect) >= lo) && (((int32_t) n.sect) <= hi)) {
+      r = (int64_t) n.t;
+      if (n.dur > 0) {
+        r += (int64_t) n.dur;
+      }
+      if (r > INT32_MAX) {
+        r = INT32_MAX;
+      }
+      if (r > result) {
+        result = (int32_t) r;
+      }
+    }
+  }
+  
+  /* Return result */
+  return result;
+}
+
+/*
+ * Apply a tempo map to the input NMF and write to the output NMF.
+ * 
+ * pdi is the input NMF data.
+ * 
+ * pOut is the output NMF file to write.  It must be open for writing or
+ * undefined behavior occurs.  Writing is fully sequential.
+ * 
+ * per points to a variable to receive an error code in case of error.
+ * The error code may be converted to an error message with the function
+ * error_string().
+ * 
+ * The tempo map must be successfully initialized or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pdi - the input NMF data
+ * 
+ *   pOut - the output file to write
+ * 
+ *   per - pointer to variable to receive an error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int applyMap(NMF_DATA *pdi, FILE *pOut, int *per) {
+  
+  int status = 1;
+  NMF_DATA *pdo = NULL;
+  int32_t sections = 0;
+  int32_t notes = 0;
+  int32_t i = 0;
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t base = 0;
+  int32_t sect_lo = 0;
+  int32_t sect_hi = 0;
+  int32_t t_max = 0;
+  int32_t *pvi = NULL;
+  int32_t *pvo = NULL;
+  uint8_t *pvf = NULL;
+  NMF_NOTE n;
+  
+  /* Initialize structures */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameters */
+  if ((pdi == NULL) || (pOut == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();  /* tempo map not initialized */
+  }
+  
+  /* Reset error */
+  *per = ERR_OK;
+  
+  /* Make sure input has proper quantum basis */
+  if (status) {
+    if (nmf_basis(pdi) != NMF_BASIS_Q96) {
+      status = 0;
+      *per = ERR_BASISIN;
+    }
+  }
+  
+  /* Allocate output object and set its basis */
+  if (status) {
+    pdo = nmf_alloc();
+    if (m_map_rate == 48000) {
+      nmf_rebase(pdo, NMF_BASIS_48000);
+    } else if (m_map_rate == 44100) {
+      nmf_rebase(pdo, NMF_BASIS_44100);
+    } else {
+      abort();  /* shouldn't happen */
+    }
+  }
+  
+  /* Get the number of sections and notes in the input */
+  if (status) {
+    sections = nmf_sections(pdi);
+    notes = nmf_notes(pdi);
+  }
+  
+  /* Determine the range of sections to convert; if it is a partial
+   * range, output times are rebased to the start of the range */
+  if (status) {
+    if (m_sect_lo >= 0) {
+      sect_lo = m_sect_lo;
+      sect_hi = m_sect_hi;
+      if ((sect_lo > sect_hi) || (sect_hi >= sections)) {
+        abort();  /* range should have been checked */
+      }
+      base = mapTransform(nmf_offset(pdi, sect_lo));
+      if (base < 0) {
+        status = 0;
+        *per = ERR_XFORM;
+      }
+    } else {
+      sect_lo = 0;
+      sect_hi = sections - 1;
+      base = 0;
+    }
+  }
+  
+  /* Transfer all input sections in range to output, transforming their
+   * offsets according to the tempo map */
+  if (status) {
+    for(i = sect_lo + 1; i <= sect_hi; i++) {
+      x = mapTransform(nmf_offset(pdi, i));
+      if (x < 0) {
+        status = 0;
+        *per = ERR_XFORM;
+        break;
+      }
+      x = x - base;
+      if (m_block > 0) {
+        if (!snapTime(x, -1, &x)) {
+          status = 0;
+          *per = ERR_XFORM;
+          break;
+        }
+      }
+      if (!nmf_sect(pdo, x)) {
+        abort();  /* shouldn't happen */
+      }
+    }
+  }
+  
+  /* In preview mode, transform the start and end of every note in the
+   * range up front with the preview kernel; the end of notes without a
+   * positive duration or whose end overflows is replaced by the start,
+   * and the overflow is detected again below */
+  if (status && m_preview && (notes > 0)) {
+    pvi = (int32_t *) calloc((size_t) notes, 2 * sizeof(int32_t));
+    pvo = (int32_t *) calloc((size_t) notes, 2 * sizeof(int32_t));
+    pvf = (uint8_t *) calloc((size_t) notes, 2 * sizeof(uint8_t));
+    if ((pvi == NULL) || (pvo == NULL) || (pvf == NULL)) {
+      abort();
+    }
+    
+    t_max = 0;
+    for(i = 0; i < notes; i++) {
+      nmf_get(pdi, i, &n);
+      if ((((int32_t) n.sect) < sect_lo) || (((int32_t) n.sect) > sect_hi)) {
+        n.t = nmf_offset(pdi, sect_lo);
+        n.dur = 0;
+      }
+      pvi[2 * i] = n.t;
+      pvi[2 * i + 1] = n.t;
+      if ((n.dur > 0) && (n.dur <= INT32_MAX - n.t)) {
+        pvi[2 * i + 1] = n.t + n.dur;
+      }
+      if (pvi[2 * i + 1] > t_max) {
+        t_max = pvi[2 * i + 1];
+      }
+    }
+    
+    markPreview(t_max);
+    mapPreviewVec(pvi, pvo, pvf, 2 * notes);
+  }
+  
+  /* Transfer all notes to output, transforming their t offsets and
+   * durations according to tempo map */
+  if (status) {
+    for(i = 0; i < notes; i++) {
+      
+      /* Get current note */
+      nmf_get(pdi, i, &n);
+      
+      /* Skip notes outside the section range */
+      if ((((int32_t) n.sect) < sect_lo) || (((int32_t) n.sect) > sect_hi)) {
+        continue;
+      }
+      
+      /* In preview mode, count the note, and count it as a fallback if
+       * either of its transformed times used double precision */
+      if (m_preview) {
+        m_preview_notes++;
+        if ((((n.t != 0) || (m_warp_n > 0)) && pvf[2 * i]) ||
+            ((n.dur > 0) && pvf[2 * i + 1])) {
+          m_preview_fallback++;
+        }
+      }
+      
+      /* Transform the t value, unless it is zero; zero is left as zero
+       * because that mapping should always hold, unless there is a warp
+       * that moves it */
+      if ((n.t != 0) || (m_warp_n > 0)) {
+        if (m_preview) {
+          x = pvo[2 * i];
+        } else {
+          x = mapTransform(n.t);
+        }
+        if (x < 0) {
+          status = 0;
+          *per = ERR_XFORM;
+        }
+      } else {
+        x = 0;
+      }
+            
+      /* If the duration is greater than zero, transform it; leave alone
+       * durations of zero and negative durations (grace note
+       * offsets) */
+      if (status && (n.dur > 0)) {
+        /* Compute the t value at the end of the duration, watching for
+         * overflow */
+        if (n.dur <= INT32_MAX - n.t) {
+          y = n.dur + n.t;
+        } else {
+          status = 0;
+          *per = ERR_XFORM;
+        }
+        
+        /* Transform the endpoint t value */
+        if (status) {
+          if (m_preview) {
+            y = pvo[2 * i + 1];
+          } else {
+            y = mapTransform(y);
+          }
+          if (y < 0) {
+            status = 0;
+            *per = ERR_XFORM;
+          }
+        }
+        
+        /* Compute the transformed duration */
+        if (status) {
+          n.dur = y - x;
+        }
+      }
+      
+      /* Now that duration is computed, store the transformed t, rebased
+       * to the start of the section range, and renumber the section */
+      if (status) {
+        n.t = x - base;
+        if (n.t < 0) {
+          n.t = 0;
+        }
+        n.sect = (uint16_t) (((int32_t) n.sect) - sect_lo);
+      }
+      
+      /* Snap to the block grid if requested */
+      if (status && (m_block > 0)) {
+        if (!snapNote(&n)) {
+          status = 0;
+          *per = ERR_XFORM;
+        }
+      }
+      
+      /* Write transformed note to output */
+      if (status) {
+        if (!nmf_append(pdo, &n)) {
+          abort();  /* shouldn't happen */
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Serialize to output */
+  if (status) {
+    if (!nmf_serialize(pdo, pOut)) {
+      abort();  /* shouldn't happen */
+    }
+  }
+  
+  /* Free the data objects and preview arrays if allocated */
+  nmf_free(pdi);
+  nmf_free(pdo);
+  pdi = NULL;
+  pdo = NULL;
+  
+  free(pvi);
+  free(pvo);
+  free(pvf);
+  pvi = NULL;
+  pvo = NULL;
+  pvf = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Format a non-negative integer in decimal.
+ * 
+ * pbuf must have room for at least 11 characters.  No terminating nul
+ * is written.
+ * 
+ * Parameters:
+ * 
+ *   pbuf - the buffer to write into
+ * 
+ *   v - the value to format
+ * 
+ * Return:
+ * 
+ *   the number of characters written
+ */
+static int fmtInt(char *pbuf, int32_t v) {
+  
+  char tmp[12];
+  int n = 0;
+  int i = 0;
+  
+  /* Check parameters */
+  if ((pbuf == NULL) || (v < 0)) {
+    abort();
+  }
+  
+  /* Write digits in reverse */
+  do {
+    tmp[n] = (char) ('0' + (v % 10));
+    n++;
+    v = v / 10;
+  } while (v > 0);
+  
+  /* Copy digits in order */
+  for(i = 0; i < n; i++) {
+    pbuf[i] = tmp[n - 1 - i];
+  }
+  
+  /* Return length */
+  return n;
+}
+
+/*
+ * Write a beat grid using the tempo map.
+ * 
+ * The grid has a beat every m_grid_beat input quanta, starting at t=0.
+ * The number of beats is m_grid_count if it is zero or greater.
+ * Otherwise, enough beats are written to cover the end of the last
+ * note and the last section in pdi.  pdi may be NULL if m_grid_count
+ * is zero or greater, since the input is then not needed.
+ * 
+ * Each beat is written to pOut as a line of text.  If no meters were
+ * given, each line has the output sample offset of the beat followed
+ * by the one-based beat number.  If meters were given, each line has
+ * the output sample offset followed by the one-based bar number and
+ * the one-based beat number within the bar.
+ * 
+ * Beats are transformed in batches with mapTransformVec().
+ * 
+ * per points to a variable to receive an error code in case of error.
+ * 
+ * The tempo map must be successfully initialized and m_grid_beat must
+ * be greater than zero or a fault occurs.
+ * 
+ * Parameters:
+ * 
+ *   pdi - the input NMF data, or NULL
+ * 
+ *   pOut - the output file to write
+ * 
+ *   per - pointer to variable to receive an error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int writeGrid(NMF_DATA *pdi, FILE *pOut, int *per) {
+  
+  int status = 1;
+  int32_t count = 0;
+  int32_t last = 0;
+  int32_t notes = 0;
+  int32_t sections = 0;
+  int32_t done = 0;
+  int32_t batch = 0;
+  int32_t x = 0;
+  int32_t bar = 1;
+  int32_t beat = 1;
+  int32_t mi = 0;
+  int64_t r = 0;
+  size_t len = 0;
+  NMF_NOTE n;
+  int32_t *pt = NULL;
+  int32_t *pr = NULL;
+  char *pbuf = NULL;
+  
+  /* Initialize structures */
+  memset(&n, 0, sizeof(NMF_NOTE));
+  
+  /* Check parameters */
+  if ((pOut == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if ((m_map_init <= 0) || (m_grid_beat < 1)) {
+    abort();
+  }
+  if ((pdi == NULL) && (m_grid_count < 0)) {
+    abort();
+  }
+  
+  /* Reset error */
+  *per = ERR_OK;
+  
+  /* Determine the number of beats */
+  if (m_grid_count >= 0) {
+    count = m_grid_count;
+    
+  } else {
+    /* Find the last input time of the notes and sections */
+    last = 0;
+    sections = nmf_sections(pdi);
+    if (sections > 0) {
+      last = nmf_offset(pdi, sections - 1);
+    }
+    notes = nmf_notes(pdi);
+    for(x = 0; x < notes; x++) {
+      nmf_get(pdi, x, &n);
+      r = (int64_t) n.t;
+      if (n.dur > 0) {
+        r += (int64_t) n.dur;
+      }
+      if (r > INT32_MAX) {
+        r = INT32_MAX;
+      }
+      if (r > last) {
+        last = (int32_t) r;
+      }
+    }
+    
+    /* Include the beat at or after the last time */
+    count = (last / m_grid_beat) + 1;
+    if (last % m_grid_beat != 0) {
+      count++;
+    }
+  }
+  
+  /* Make sure the last beat is in range */
+  if (count > 0) {
+    if (((int64_t) (count - 1)) * ((int64_t) m_grid_beat) > INT32_MAX) {
+      status = 0;
+      *per = ERR_XFORM;
+    }
+  }
+  
+  /* Allocate batch buffers, with room for three numbers per line */
+  if (status) {
+    pt = (int32_t *) calloc(GRID_BATCH, sizeof(int32_t));
+    pr = (int32_t *) calloc(GRID_BATCH, sizeof(int32_t));
+    pbuf = (char *) malloc(((size_t) GRID_BATCH) * 36);
+    if ((pt == NULL) || (pr == NULL) || (pbuf == NULL)) {
+      abort();
+    }
+  }
+  
+  /* Write the grid in batches */
+  while (status && (done < count)) {
+    
+    /* Fill the batch with input times */
+    batch = count - done;
+    if (batch > GRID_BATCH) {
+      batch = GRID_BATCH;
+    }
+    for(x = 0; x < batch; x++) {
+      pt[x] = (done + x) * m_grid_beat;
+    }
+    
+    /* Transform the batch */
+    mapTransformVec(pt, pr, batch);
+    
+    /* Format the batch */
+    len = 0;
+    for(x = 0; x < batch; x++) {
+      
+      /* Check transformed value */
+      if (pr[x] < 0) {
+        status = 0;
+        *per = ERR_XFORM;
+        break;
+      }
+      
+      /* Write the line */
+      len += (size_t) fmtInt(pbuf + len, pr[x]);
+      pbuf[len] = ' ';
+      len++;
+      if (m_meter_n > 0) {
+        len += (size_t) fmtInt(pbuf + len, bar);
+        pbuf[len] = ' ';
+        len++;
+        len += (size_t) fmtInt(pbuf + len, beat);
+      } else {
+        len += (size_t) fmtInt(pbuf + len, done + x + 1);
+      }
+      pbuf[len] = '\n';
+      len++;
+      
+      /* Advance the bar and beat counters, switching meters at the
+       * start of a bar where a new meter begins */
+      if (m_meter_n > 0) {
+        beat++;
+        if (beat > m_meter_beats[mi]) {
+          beat = 1;
+          bar++;
+          if (mi < m_meter_n - 1) {
+            if (bar >= m_meter_bar[mi + 1]) {
+              mi++;
+            }
+          }
+        }
+      }
+    }
+    
+    /* Write the batch */
+    if (status && (len > 0)) {
+      if (fwrite(pbuf, 1, len, pOut) != len) {
+        abort();  /* I/O error */
+      }
+    }
+    
+    done += batch;
+  }
+  
+  /* Free batch buffers */
+  free(pt);
+  free(pr);
+  free(pbuf);
+  pt = NULL;
+  pr = NULL;
+  pbuf = NULL;
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Push the number of quanta in a duration string onto the interpreter
+ * stack.
+ * 
+ * pstr is the duration string.  per points to a variable to receive an
+ * error code in case of error.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the duration string
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pushDur(const char *pstr, int *per) {
+  
+  int status = 1;
+  int c = 0;
+  int32_t d = 0;
+  int32_t dur = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Duration string may not be empty */
+  if (*pstr == 0) {
+    status = 0;
+    *per = ERR_DURSTR;
+  }
+  
+  /* Go through each character in the duration string */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+      
+      /* Get current character */
+      c = *pstr;
+      
+      /* Get the number of quanta represented */
+      if (c == '1') {
+        d = 6;
+      } else if (c == '2') {
+        d = 12;
+      } else if (c == '3') {
+        d = 24;
+      } else if (c == '4') {
+        d = 48;
+      } else if (c == '5') {
+        d = 96;
+      } else if (c == '6') {
+        d = 192;
+      } else if (c == '7') {
+        d = 384;
+      } else if (c == '8') {
+        d = 32;
+      } else if (c == '9') {
+        d = 64;
+      } else {
+        /* Invalid character */
+        status = 0;
+        *per = ERR_DURSTR;
+      }
+      
+      /* Check if the next character is a modifier; if it is, apply it
+       * and skip the character */
+      if (status) {
+        if (pstr[1] == '\'') {
+          /* Doubling modifier */
+          d *= 2;
+          pstr++;
+          
+        } else if (pstr[1] == '.') {
+          /* Multiply by 1.5 */
+          d = d + (d / 2);
+          pstr++;
+          
+        } else if (pstr[1] == ',') {
+          /* Halving modifier */
+          d /= 2;
+          pstr++;
+        }
+      }
+      
+      /* Add duration to current duration, watching for overflow */
+      if (status) {
+        if (d <= INT32_MAX - dur) {
+          dur += d;
+        } else {
+          /* overflow */
+          status = 0;
+          *per = ERR_DURSTR;
+        }
+      }
+      
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Push the duration */
+  if (status) {
+    if (!stack_push(dur, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Push an integer literal onto the interpreter stack.
+ * 
+ * pstr is the numeric string.  per points to a variable to receive an
+ * error code in case of error.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the numeric string
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int pushNum(const char *pstr, int *per) {
+  
+  int status = 1;
+  int32_t val = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (per == NULL)) {
+    abort();
+  }
+  
+  /* Try to parse the number */
+  if (!parseInt(pstr, &val)) {
+    status = 0;
+    *per = ERR_NUMSTR;
+  }
+  
+  /* Push the number */
+  if (status) {
+    if (!stack_push(val, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a multiply operation.
+ * 
+ * This pops two integers off the stack, multiplies them, and pushes the
+ * result back onto the stack.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opMul(int *per) {
+  
+  int status = 1;
+  int32_t a = 0;
+  int32_t b = 0;
+  int64_t r = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Pop the parameters */
+  if (!stack_pop(&b, per)) {
+    status = 0;
+  }
+  if (status) {
+    if (!stack_pop(&a, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Compute result in 64-bit */
+  if (status) {
+    r = ((int64_t) a) * ((int64_t) b);
+  }
+  
+  /* Range-check result */
+  if (status) {
+    if ((r < INT32_MIN) || (r > INT32_MAX)) {
+      status = 0;
+      *per = ERR_OVERFL;
+    }
+  }
+  
+  /* Push result */
+  if (status) {
+    if (!stack_push((int32_t) r, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a section operation.
+ * 
+ * This pops an integer off the stack, and moves the cursor to the start
+ * of that section, based on the input NMF sections in m_pdi.
+ * 
+ * If m_pdi is NULL because the input was not read, the operation fails
+ * with ERR_NOSECIN.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opSect(int *per) {
+  
+  int status = 1;
+  int32_t sect = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Check that there is an input to take the section from */
+  if (m_pdi == NULL) {
+    status = 0;
+    *per = ERR_NOSECIN;
+  }
+  
+  /* Pop the section number */
+  if (status) {
+    if (!stack_pop(&sect, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Check that section number is in range */
+  if (status) {
+    if ((sect < 0) || (sect >= nmf_sections(m_pdi))) {
+      status = 0;
+      *per = ERR_BADSEC;
+    }
+  }
+  
+  /* Set the cursor to the section offset */
+  if (status) {
+    m_cursor = nmf_offset(m_pdi, sect);
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a step operation.
+ * 
+ * This pops an integer off the stack, and adds its value to the current
+ * cursor position.  The integer may be negative, but it may not take
+ * the cursor to a negative position.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opStep(int *per) {
+  
+  int status = 1;
+  int32_t sv = 0;
+  int64_t r = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Pop step value */
+  if (!stack_pop(&sv, per)) {
+    status = 0;
+  }
+  
+  /* Add the step value to the cursor in 64-bit */
+  if (status) {
+    r = m_cursor + sv;
+  }
+  
+  /* Range-check result */
+  if (status) {
+    if ((r < 0) || (r > INT32_MAX)) {
+      status = 0;
+      *per = ERR_BADCUR;
+    }
+  }
+  
+  /* Update cursor */
+  if (status) {
+    m_cursor = (int32_t) r;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a constant tempo operation.
+ * 
+ * This pops a rate integer, and then a quanta integer off the stack,
+ * and combines it with the current cursor position to add a constant
+ * tempo to the tempo map.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opTempo(int *per) {
+  
+  int status = 1;
+  int32_t r = 0;
+  int32_t q = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Pop parameters */
+  if (!stack_pop(&r, per)) {
+    status = 0;
+  }
+  if (status) {
+    if (!stack_pop(&q, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Range-check parameters */
+  if (status && (r < 1)) {
+    status = 0;
+    *per = ERR_BADRATE;
+  }
+  if (status && (q < 1)) {
+    status = 0;
+    *per = ERR_BADQ;
+  }
+  
+  /* Add tempo */
+  if (status) {
+    if (!addConstantTempo(m_cursor, q, r, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a ramp tempo operation.
+ * 
+ * This pops a rate2 integer, then a quanta2 integer, then a rate1
+ * integer, and finally a quanta1 integer off the stack, and combines it
+ * with the current cursor position to buffer a ramp tempo.  The buffer
+ * will be flushed on the next tempo, when the length of the ramp is
+ * determined.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opRamp(int *per) {
+  
+  int status = 1;
+  int32_t r2 = 0;
+  int32_t q2 = 0;
+  int32_t r1 = 0;
+  int32_t q1 = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Pop parameters */
+  if (!stack_pop(&r2, per)) {
+    status = 0;
+  }
+  if (status) {
+    if (!stack_pop(&q2, per)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (!stack_pop(&r1, per)) {
+      status = 0;
+    }
+  }
+  if (status) {
+    if (!stack_pop(&q1, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Range-check parameters */
+  if (status && ((r1 < 1) || (r2 < 1))) {
+    status = 0;
+    *per = ERR_BADRATE;
+  }
+  if (status && ((q1 < 1) || (q2 < 1))) {
+    status = 0;
+    *per = ERR_BADQ;
+  }
+  
+  /* Buffer tempo */
+  if (status) {
+    if (!bufferRamp(m_cursor, q1, r1, q2, r2, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Run a span tempo operation.
+ * 
+ * This pops a millisecond count, and then a quanta integer off the
+ * stack, and combines it with the current cursor position to add a span
+ * tempo to the tempo map.
+ * 
+ * per points to a variable to receive to an error code if error.
+ * 
+ * Parameters:
+ * 
+ *   per - pointer to variable to receive error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int opSpan(int *per) {
+  
+  int status = 1;
+  int32_t m = 0;
+  int32_t q = 0;
+  
+  /* Check parameter */
+  if (per == NULL) {
+    abort();
+  }
+  
+  /* Pop parameters */
+  if (!stack_pop(&m, per)) {
+    status = 0;
+  }
+  if (status) {
+    if (!stack_pop(&q, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Range-check parameters */
+  if (status && (m < 1)) {
+    status = 0;
+    *per = ERR_BADMIL;
+  }
+  if (status && (q < 1)) {
+    status = 0;
+    *per = ERR_BADQ;
+  }
+  
+  /* Add tempo */
+  if (status) {
+    if (!addSpanTempo(m_cursor, q, m, per)) {
+      status = 0;
+    }
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Interpret a single entity of the tempo map.
+ * 
+ * The entity is given by its Shastina entity type, string type, key,
+ * and value.  The type signature and the EOF entity are not handled by
+ * this function.  The string type and value are only used for string
+ * entities.
+ * 
+ * per points to a variable to receive an error code in case of error.
+ * 
+ * Parameters:
+ * 
+ *   etype - the Shastina entity type
+ * 
+ *   str_type - the Shastina string type
+ * 
+ *   pKey - the entity key
+ * 
+ *   pValue - the entity value
+ * 
+ *   per - pointer to variable to receive the error code
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int runEntity(
+          int    etype,
+          int    str_type,
+    const char * pKey,
+    const char * pValue,
+          int  * per) {
+  
+  int status = 1;
+  int autostep = 0;
+  
+  /* Check parameters */
+  if ((pKey == NULL) || (per == NULL)) {
+    abort();
+  }
+  if ((etype == SNENTITY_STRING) && (pValue == NULL)) {
+    abort();
+  }
+  
+  if (etype == SNENTITY_STRING) {
+    /* String type -- first, make sure quoted */
+    if (str_type != SNSTRING_QUOTED) {
+      status = 0;
+      *per = ERR_BADENT;
+    }
+    
+    /* If "t" prefix is present, set autostep flag; if no prefix,
+     * clear autostep flag; if any other prefix, error */
+    if (status) {
+      if (strlen(pKey) < 1) {
+        /* No prefix */
+        autostep = 0;
+      
+      } else if (strcmp(pKey, "t") == 0) {
+        /* Autostep prefix */
+        autostep = 1;
+        
+      } else {
+        /* Unknown prefix */
+        status = 0;
+        *per = ERR_BADENT;
+      }
+    }
+    
+    /* Push the duration */
+    if (status) {
+      if (!pushDur(pValue, per)) {
+        status = 0;
+      }
+    }
+    
+    /* If autostepping, invoke step op */
+    if (status && autostep) {
+      if (!opStep(per)) {
+        status = 0;
+      }
+    }
+    
+  } else if (etype == SNENTITY_NUMERIC) {
+    /* Push numeric literal */
+    if (!pushNum(pKey, per)) {
+      status = 0;
+    }
+  
+  } else if (etype == SNENTITY_OPERATION) {
+    /* Determine the kind of operation */
+    if (strcmp(pKey, "mul") == 0) {
+      if (!opMul(per)) {
+        status = 0;
+      }
+      
+    } else if (strcmp(pKey, "sect") == 0) {
+      if (!opSect(per)) {
+        status = 0;
+      }
+      
+    } else if (strcmp(pKey, "step") == 0) {
+      if (!opStep(per)) {
+        status = 0;
+      }
+      
+    } else if (strcmp(pKey, "tempo") == 0) {
+      if (!opTempo(per)) {
+        status = 0;
+      }
+      
+    } else if (strcmp(pKey, "ramp") == 0) {
+      if (!opRamp(per)) {
+        status = 0;
+      }
+      
+    } else if (strcmp(pKey, "span") == 0) {
+      if (!opSpan(per)) {
+        status = 0;
+      }
+      
+    } else {
+      /* Unrecognized operation */
+      status = 0;
+      *per = ERR_BADOP;
+    }
+  
+  } else {
+    /* Unsupported entity type */
+    status = 0;
+    *per = ERR_BADENT;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse a tempo map.
+ * 
+ * This may only be called once.  Additional calls cause a fault.
+ * 
+ * pIn is the Shastina file to read.  It must be open for reading or
+ * undefined behavior occurs.  Reading is fully sequential.
+ * 
+ * srate is the sampling rate to use.  It must be either 48000 or 44100.
+ * 
+ * per points to a variable to receive an error code in case of failure.
+ * pln points to a variable to receive a line number in case of failure.
+ * The error code can be converted into a string with error_string().
+ * 
+ * If m_horizon is zero or greater, interpretation stops as soon as a
+ * tempo begins after m_horizon, so only the part of the tempo map that
+ * is needed to transform times up to the horizon is compiled.  The
+ * rest of the file is not checked in that case.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the tempo map file to read
+ * 
+ *   srate - the sampling rate
+ * 
+ *   per - pointer to variable to receive the error code
+ * 
+ *   pln - pointer to variable to receive a line number
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
  */
 static int parseMap(FILE *pIn, int32_t srate, int *per, long *pln) {
   
-  int status = 1;
-  int first_ent = 1;
-  int autostep = 0;
-  int retval = 0;
-  SNPARSER *pr = NULL;
-  SNSOURCE *ps = NULL;
-  SNENTITY ent;
+  int status = 1;
+  int first_ent = 1;
+  int stopped = 0;
+  int retval = 0;
+  SNPARSER *pr = NULL;
+  SNSOURCE *ps = NULL;
+  SNENTITY ent;
+  
+  /* Initialize structure */
+  memset(&ent, 0, sizeof(SNENTITY));
+  
+  /* Check state */
+  if (m_map_init != 0) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (per == NULL) || (pln == NULL)) {
+    abort();
+  }
+  if ((srate != 48000) && (srate != 44100)) {
+    abort();
+  }
+  
+  /* Wrap the input file in a Shastina source object */
+  ps = snsource_file(pIn, 0);
+  
+  /* Reset error */
+  *per = ERR_OK;
+  *pln = -1;
+  
+  /* Initialize interpreter stack */
+  init_stack();
+  
+  /* Initialize an empty tempo map state */
+  m_map_init = 1;
+  m_map_count = 0;
+  m_map_rate = srate;
+  m_map_cap = INIT_ALLOC;
+  m_map_t = (TEMPONODE *) calloc(INIT_ALLOC, sizeof(TEMPONODE));
+  if (m_map_t == NULL) {
+    abort();
+  }
+  
+  /* Allocate a Shastina parser */
+  pr = snparser_alloc();
+  
+  /* Go through all Shastina entities in input until either an error or
+   * the EOF marker */
+  for(snparser_read(pr, &ent, ps);
+      ent.status > 0;
+      snparser_read(pr, &ent, ps)) {
+    
+    /* If this is the first entity being read, make sure it is the
+     * opening metacommand sequence, then continue the loop to read
+     * on */
+    if (first_ent) {
+      /* First entity, so clear first entity flag */
+      first_ent = 0;
+      
+      /* This entity must be BEGIN_META */
+      if (ent.status != SNENTITY_BEGIN_META) {
+        status = 0;
+        *per = ERR_TYPESIG;
+        *pln = snparser_count(pr);
+      }
+      
+      /* Read another entity, which must be the correct metatoken */
+      if (status) {
+        snparser_read(pr, &ent, ps);
+        if (ent.status != SNENTITY_META_TOKEN) {
+          status = 0;
+          *per = ERR_TYPESIG;
+          *pln = snparser_count(pr);
+        }
+        if (status) {
+          if (strcmp(ent.pKey, "noir-tempo") != 0) {
+            status = 0;
+            *per = ERR_TYPESIG;
+            *pln = snparser_count(pr);
+          }
+        }
+      }
+      
+      /* Read another entity, which must be end meta */
+      if (status) {
+        snparser_read(pr, &ent, ps);
+        if (ent.status != SNENTITY_END_META) {
+          status = 0;
+          *per = ERR_TYPESIG;
+          *pln = snparser_count(pr);
+        }
+      }
+      
+      /* Continue the loop */
+      if (status) {
+        continue;
+      }
+    }
+    
+    /* Handle the supported entity types (excluding the type signature,
+     * handled above, and the special EOF type) */
+    if (status) {
+      if (!runEntity(ent.status, ent.str_type, ent.pKey, ent.pValue, per)) {
+        status = 0;
+        *pln = snparser_count(pr);
+      }
+    }
+    
+    /* Leave loop if error */
+    if (!status) {
+      break;
+    }
+    
+    /* If there is a horizon and a tempo now begins after it, all tempo
+     * nodes up to the horizon are known, so stop interpreting */
+    if (m_horizon >= 0) {
+      if (m_tbuf_filled) {
+        if (m_tbuf_t > m_horizon) {
+          stopped = 1;
+        }
+      } else if (m_map_count > 0) {
+        if ((m_map_t[m_map_count - 1]).offset_input > m_horizon) {
+          stopped = 1;
+        }
+      }
+      if (stopped) {
+        break;
+      }
+    }
+  }
+  
+  /* If interpretation stopped at the horizon, drop any ramp buffered
+   * past the horizon and skip the end of map checks except for the empty
+   * map check */
+  if (stopped) {
+    m_tbuf_filled = 0;
+  }
+  
+  /* Watch for Shastina error */
+  if (status && (!stopped) && (ent.status < 0)) {
+    status = 0;
+    *per = ERR_SN_MAX + ent.status;
+    *pln = snparser_count(pr);
+  }
+  
+  /* Check that nothing after the |; in the file */
+  if (status && (!stopped)) {
+    retval = snsource_consume(ps);
+    if (retval < 0) {
+      status = 0;
+      *per = ERR_SN_MAX + retval;
+      *pln = -1;
+    }
+  }
+  
+  /* Check that stack is empty */
+  if (status && (!stopped) && (m_st_count > 0)) {
+    status = 0;
+    *per = ERR_STACKRM;
+    *pln = -1;
+  }
+  
+  /* Make sure no tempo remains buffered */
+  if (status && m_tbuf_filled) {
+    status = 0;
+    *per = ERR_DANGLE;
+    *pln = -1;
+  }
+  
+  /* Make sure tempo map is not empty */
+  if (status && (m_map_count < 1)) {
+    status = 0;
+    *per = ERR_EMPTY;
+    *pln = -1;
+  }
+  
+  /* Free parser if allocated */
+  snparser_free(pr);
+  pr = NULL;
+  
+  /* Free input source if allocated */
+  snsource_free(ps);
+  ps = NULL;
+  
+  /* If failure, set initialization state to -1 */
+  if (!status) {
+    m_map_init = -1;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Find the chunks that a tokenized tempo map can be split into.
+ * 
+ * A chunk may begin at a numeric literal followed by a "sect"
+ * operation, provided that the interpreter stack is empty before the
+ * literal.  The sect operation then sets the cursor without depending on
+ * anything before it, so the chunk can be interpreted independently,
+ * except for the tempo nodes and ramp buffer, which are resolved when
+ * the chunks are joined.  Stack depths are tracked symbolically here;
+ * if the map would underflow or overflow the stack or contains an
+ * invalid entity, no chunks begin after that point, and the error is
+ * reported by the interpreter.
+ * 
+ * The first chunk always begins at the first token.  Up to max_chunk
+ * chunks are chosen so that they have roughly equal numbers of tokens.
+ * The token ranges are written to pc, which must have room for
+ * max_chunk chunks.  All other fields of the chunks are cleared.
+ * 
+ * Parameters:
+ * 
+ *   pTok - the tokens
+ * 
+ *   tok_count - the number of tokens
+ * 
+ *   pArena - the token string arena
+ * 
+ *   pc - the array of chunks to fill
+ * 
+ *   max_chunk - the maximum number of chunks
+ * 
+ * Return:
+ * 
+ *   the number of chunks, which is at least one
+ */
+static int32_t findChunks(
+    const MAPTOKEN * pTok,
+          int32_t    tok_count,
+    const char     * pArena,
+          MAPCHUNK * pc,
+          int32_t    max_chunk) {
+  
+  int32_t chunk_count = 1;
+  int32_t depth = 0;
+  int32_t i = 0;
+  int32_t d = 0;
+  int64_t target = 0;
+  const char *pKey = NULL;
+  
+  /* Check parameters */
+  if ((pTok == NULL) || (tok_count < 0) || (pArena == NULL) ||
+      (pc == NULL) || (max_chunk < 1)) {
+    abort();
+  }
+  
+  /* Clear the chunks and begin the first chunk at the first token */
+  memset(pc, 0, ((size_t) max_chunk) * sizeof(MAPCHUNK));
+  pc[0].tok_lo = 0;
+  
+  /* Go through the tokens, tracking the stack depth */
+  for(i = 0; i < tok_count; i++) {
+    
+    /* If the stack is empty and this is a literal followed by a sect
+     * operation, begin a new chunk here if the current chunk has
+     * reached its share of the tokens */
+    if ((depth == 0) && (i > 0) && (chunk_count < max_chunk) &&
+        (i + 1 < tok_count) &&
+        (pTok[i].etype == SNENTITY_NUMERIC) &&
+        (pTok[i + 1].etype == SNENTITY_OPERATION) &&
+        (strcmp(pArena + pTok[i + 1].key, "sect") == 0)) {
+      target = (((int64_t) tok_count) * chunk_count) / max_chunk;
+      if (i >= target) {
+        pc[chunk_count - 1].tok_hi = i;
+        pc[chunk_count].tok_lo = i;
+        chunk_count++;
+      }
+    }
+    
+    /* Determine the effect of the token on the stack depth */
+    pKey = pArena + pTok[i].key;
+    d = INT32_MIN;
+    if (pTok[i].etype == SNENTITY_STRING) {
+      if (pTok[i].str_type == SNSTRING_QUOTED) {
+        if (strlen(pKey) < 1) {
+          d = 1;
+        } else if (strcmp(pKey, "t") == 0) {
+          d = 0;
+        }
+      }
+      
+    } else if (pTok[i].etype == SNENTITY_NUMERIC) {
+      d = 1;
+      
+    } else if (pTok[i].etype == SNENTITY_OPERATION) {
+      if ((strcmp(pKey, "mul") == 0) ||
+          (strcmp(pKey, "sect") == 0) ||
+          (strcmp(pKey, "step") == 0)) {
+        d = -1;
+      } else if ((strcmp(pKey, "tempo") == 0) ||
+                  (strcmp(pKey, "span") == 0)) {
+        d = -2;
+      } else if (strcmp(pKey, "ramp") == 0) {
+        d = -4;
+      }
+    }
+    
+    /* Stop looking for chunks if the depth can't be tracked */
+    if (d == INT32_MIN) {
+      break;
+    }
+    depth += d;
+    if ((depth < 0) || (depth > MAX_STACK)) {
+      break;
+    }
+  }
+  
+  /* The last chunk runs to the end of the tokens */
+  pc[chunk_count - 1].tok_hi = tok_count;
+  
+  /* Return chunk count */
+  return chunk_count;
+}
+
+/*
+ * Interpret one chunk of a tokenized tempo map.
+ * 
+ * This is the thread start routine used by parseMapThreaded().  pArg
+ * points to the MAPCHUNK to interpret, which must have its tokens and
+ * token range filled in.  The interpreter state of the calling thread
+ * is initialized in chunk mode, the tokens are interpreted, and the
+ * results are stored in the chunk.  The node arrays in the chunk are
+ * allocated by this function and must be freed by the caller.
+ * 
+ * Parameters:
+ * 
+ *   pArg - pointer to the MAPCHUNK
+ * 
+ * Return:
+ * 
+ *   NULL
+ */
+static void *compileChunk(void *pArg) {
+  
+  MAPCHUNK *pc = NULL;
+  const MAPTOKEN *pt = NULL;
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t before = 0;
+  int32_t line_cap = 0;
+  
+  /* Check parameter */
+  if (pArg == NULL) {
+    abort();
+  }
+  pc = (MAPCHUNK *) pArg;
+  
+  /* Initialize the interpreter state of this thread in chunk mode */
+  m_chunk = 1;
+  m_chunk_first = 0;
+  init_stack();
+  m_map_init = 1;
+  m_map_count = 0;
+  m_map_cap = INIT_ALLOC;
+  m_map_t = (TEMPONODE *) calloc(INIT_ALLOC, sizeof(TEMPONODE));
+  if (m_map_t == NULL) {
+    abort();
+  }
+  
+  line_cap = INIT_ALLOC;
+  pc->pNodeTok = (int32_t *) calloc(INIT_ALLOC, sizeof(int32_t));
+  if (pc->pNodeTok == NULL) {
+    abort();
+  }
+  
+  /* Interpret each token in the chunk */
+  pc->err = ERR_OK;
+  for(i = pc->tok_lo; i < pc->tok_hi; i++) {
+    pt = &((pc->pTok)[i]);
+    m_chunk_tok = i;
+    before = m_map_count;
+    
+    if (!runEntity(
+          pt->etype,
+          pt->str_type,
+          pc->pArena + pt->key,
+          pc->pArena + pt->val,
+          &(pc->err))) {
+      pc->err_tok = i;
+    }
+    
+    /* Record the token that added any new nodes */
+    if (m_map_count > line_cap) {
+      line_cap = m_map_cap;
+      pc->pNodeTok = (int32_t *) realloc(
+                        pc->pNodeTok, line_cap * sizeof(int32_t));
+      if (pc->pNodeTok == NULL) {
+        abort();
+      }
+    }
+    for(j = before; j < m_map_count; j++) {
+      (pc->pNodeTok)[j] = i;
+    }
+    
+    /* Leave loop if error */
+    if (pc->err != ERR_OK) {
+      break;
+    }
+  }
+  
+  /* Store the results */
+  pc->pNode = m_map_t;
+  pc->node_count = m_map_count;
+  
+  pc->has_first = m_chunk_first;
+  pc->first_t = m_chunk_first_t;
+  pc->first_tok = m_chunk_first_tok;
+  
+  pc->tbuf_filled = m_tbuf_filled;
+  pc->tbuf_t = m_tbuf_t;
+  pc->tbuf_q1 = m_tbuf_q1;
+  pc->tbuf_r1 = m_tbuf_r1;
+  pc->tbuf_q2 = m_tbuf_q2;
+  pc->tbuf_r2 = m_tbuf_r2;
+  
+  pc->st_count = m_st_count;
+  
+  m_map_t = NULL;
+  m_map_init = 0;
+  
+  return NULL;
+}
+
+/*
+ * Join a compiled chunk onto the end of the tempo map.
+ * 
+ * The tempo map of the calling thread must be initialized and hold all
+ * the chunks before this one.  The first tempo of the chunk is checked
+ * against the end of the tempo map, any ramp still buffered from the
+ * previous chunk is flushed now that its length is known, and then the
+ * nodes of the chunk are added with addTempo(), which recomputes their
+ * offset_output values exactly as a sequential compilation would.
+ * Finally, the ramp buffer at the end of the chunk becomes the current
+ * ramp buffer, and any error within the chunk is reported.
+ * 
+ * per points to a variable to receive an error code in case of error.
+ * pln points to a variable to receive a line number in case of error.
+ * 
+ * Parameters:
+ * 
+ *   pc - the compiled chunk
+ * 
+ *   per - pointer to variable to receive the error code
+ * 
+ *   pln - pointer to variable to receive a line number
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int joinChunk(const MAPCHUNK *pc, int *per, long *pln) {
+  
+  int status = 1;
+  int32_t i = 0;
+  const TEMPONODE *pn = NULL;
+  
+  /* Check parameters */
+  if ((pc == NULL) || (per == NULL) || (pln == NULL)) {
+    abort();
+  }
+  
+  /* Check state */
+  if (m_map_init <= 0) {
+    abort();
+  }
+  
+  /* Check the first tempo of the chunk and flush any ramp buffered from
+   * the previous chunk up to it */
+  if (pc->has_first) {
+    if (!checkTime(pc->first_t, per)) {
+      status = 0;
+    }
+    if (status) {
+      if (!flushRampBuffer(pc->first_t, per)) {
+        status = 0;
+      }
+    }
+    if (!status) {
+      *pln = ((pc->pTok)[pc->first_tok]).line;
+    }
+  }
+  
+  /* Add the nodes of the chunk */
+  if (status) {
+    for(i = 0; i < pc->node_count; i++) {
+      pn = &((pc->pNode)[i]);
+      if (!addTempo(pn->offset_input, pn->a, pn->b, per)) {
+        status = 0;
+        *pln = ((pc->pTok)[(pc->pNodeTok)[i]]).line;
+        break;
+      }
+    }
+  }
+  
+  /* If the chunk has a tempo, its ramp buffer replaces the current ramp
+   * buffer, which was flushed above */
+  if (status && pc->has_first) {
+    m_tbuf_filled = pc->tbuf_filled;
+    m_tbuf_t = pc->tbuf_t;
+    m_tbuf_q1 = pc->tbuf_q1;
+    m_tbuf_r1 = pc->tbuf_r1;
+    m_tbuf_q2 = pc->tbuf_q2;
+    m_tbuf_r2 = pc->tbuf_r2;
+  }
+  
+  /* Report any error within the chunk */
+  if (status && (pc->err != ERR_OK)) {
+    status = 0;
+    *per = pc->err;
+    *pln = ((pc->pTok)[pc->err_tok]).line;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse a tempo map using multiple threads.
+ * 
+ * This has the same interface and results as parseMap(), except that
+ * m_horizon must be -1 and m_threads should be greater than one.
+ * 
+ * The Shastina entities of the map are first read into memory.  The
+ * entities are then split into chunks at "sect" operations (see
+ * findChunks()), up to m_threads chunks are interpreted in parallel
+ * with compileChunk(), and the chunks are joined in order with
+ * joinChunk().  Errors are reported with the same codes and line
+ * numbers as parseMap() would report.
+ * 
+ * Parameters:
+ * 
+ *   pIn - the tempo map file to read
+ * 
+ *   srate - the sampling rate
+ * 
+ *   per - pointer to variable to receive the error code
+ * 
+ *   pln - pointer to variable to receive a line number
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if error
+ */
+static int parseMapThreaded(
+    FILE    * pIn,
+    int32_t   srate,
+    int     * per,
+    long    * pln) {
+  
+  int status = 1;
+  int retval = 0;
+  int sn_err = 0;
+  long sn_line = -1;
+  int32_t i = 0;
+  int32_t chunk_count = 0;
+  int32_t tok_count = 0;
+  int32_t tok_cap = 0;
+  size_t arena_len = 0;
+  size_t arena_cap = 0;
+  size_t klen = 0;
+  size_t vlen = 0;
+  SNPARSER *pr = NULL;
+  SNSOURCE *ps = NULL;
+  SNENTITY ent;
+  MAPTOKEN *pTok = NULL;
+  char *pArena = NULL;
+  MAPCHUNK *pc = NULL;
+  pthread_t *pth = NULL;
+  
+  /* Initialize structure */
+  memset(&ent, 0, sizeof(SNENTITY));
+  
+  /* Check state */
+  if ((m_map_init != 0) || (m_horizon >= 0)) {
+    abort();
+  }
+  
+  /* Check parameters */
+  if ((pIn == NULL) || (per == NULL) || (pln == NULL)) {
+    abort();
+  }
+  if ((srate != 48000) && (srate != 44100)) {
+    abort();
+  }
+  
+  /* Wrap the input file in a Shastina source object */
+  ps = snsource_file(pIn, 0);
+  
+  /* Reset error */
+  *per = ERR_OK;
+  *pln = -1;
+  
+  /* Initialize interpreter stack */
+  init_stack();
+  
+  /* Initialize an empty tempo map state */
+  m_map_init = 1;
+  m_map_count = 0;
+  m_map_rate = srate;
+  m_map_cap = INIT_ALLOC;
+  m_map_t = (TEMPONODE *) calloc(INIT_ALLOC, sizeof(TEMPONODE));
+  if (m_map_t == NULL) {
+    abort();
+  }
+  
+  /* Allocate a Shastina parser */
+  pr = snparser_alloc();
+  
+  /* Check the type signature, unless the map is empty or there is a
+   * Shastina error right away, which are reported below */
+  snparser_read(pr, &ent, ps);
+  if (ent.status > 0) {
+    if (ent.status != SNENTITY_BEGIN_META) {
+      status = 0;
+    }
+    if (status) {
+      snparser_read(pr, &ent, ps);
+      if (ent.status != SNENTITY_META_TOKEN) {
+        status = 0;
+      } else if (strcmp(ent.pKey, "noir-tempo") != 0) {
+        status = 0;
+      }
+    }
+    if (status) {
+      snparser_read(pr, &ent, ps);
+      if (ent.status != SNENTITY_END_META) {
+        status = 0;
+      }
+    }
+    if (status) {
+      snparser_read(pr, &ent, ps);
+    } else {
+      *per = ERR_TYPESIG;
+      *pln = snparser_count(pr);
+    }
+  }
+  
+  /* Read all remaining entities into memory up to the EOF marker,
+   * remembering any Shastina error so that it can be reported after
+   * errors in the entities before it */
+  for( ; status && (ent.status > 0); snparser_read(pr, &ent, ps)) {
+    /* Expand token array if necessary */
+    if (tok_count >= tok_cap) {
+      if (tok_cap < 1) {
+        tok_cap = 1024;
+      } else if (tok_cap <= INT32_MAX / 2) {
+        tok_cap *= 2;
+      } else {
+        abort();
+      }
+      pTok = (MAPTOKEN *) realloc(pTok, tok_cap * sizeof(MAPTOKEN));
+      if (pTok == NULL) {
+        abort();
+      }
+    }
+    
+    /* Expand the string arena if necessary */
+    klen = strlen(ent.pKey) + 1;
+    vlen = 1;
+    if ((ent.status == SNENTITY_STRING) && (ent.pValue != NULL)) {
+      vlen = strlen(ent.pValue) + 1;
+    }
+    while (arena_len + klen + vlen > arena_cap) {
+      if (arena_cap < 1) {
+        arena_cap = 65536;
+      } else {
+        arena_cap *= 2;
+      }
+      pArena = (char *) realloc(pArena, arena_cap);
+      if (pArena == NULL) {
+        abort();
+      }
+    }
+    
+    /* Store the token */
+    pTok[tok_count].etype = ent.status;
+    pTok[tok_count].str_type = ent.str_type;
+    pTok[tok_count].line = snparser_count(pr);
+    pTok[tok_count].key = arena_len;
+    memcpy(pArena + arena_len, ent.pKey, klen);
+    arena_len += klen;
+    pTok[tok_count].val = arena_len;
+    if (vlen > 1) {
+      memcpy(pArena + arena_len, ent.pValue, vlen);
+    } else {
+      pArena[arena_len] = (char) 0;
+    }
+    arena_len += vlen;
+    tok_count++;
+  }
+  if (status && (ent.status < 0)) {
+    sn_err = ERR_SN_MAX + ent.status;
+    sn_line = snparser_count(pr);
+  }
+  
+  /* Split the tokens into chunks and interpret them in parallel */
+  if (status && (tok_count > 0)) {
+    pc = (MAPCHUNK *) calloc((size_t) m_threads, sizeof(MAPCHUNK));
+    pth = (pthread_t *) calloc((size_t) m_threads, sizeof(pthread_t));
+    if ((pc == NULL) || (pth == NULL)) {
+      abort();
+    }
+    
+    chunk_count = findChunks(pTok, tok_count, pArena, pc, m_threads);
+    for(i = 0; i < chunk_count; i++) {
+      pc[i].pTok = pTok;
+      pc[i].pArena = pArena;
+      if (pthread_create(&(pth[i]), NULL, &compileChunk, &(pc[i]))) {
+        abort();
+      }
+    }
+    for(i = 0; i < chunk_count; i++) {
+      if (pthread_join(pth[i], NULL)) {
+        abort();
+      }
+    }
+    
+    /* Join the chunks in order */
+    for(i = 0; i < chunk_count; i++) {
+      if (!joinChunk(&(pc[i]), per, pln)) {
+        status = 0;
+        break;
+      }
+    }
+    
+    /* The stack at the end is the stack at the end of the last chunk,
+     * since chunks only begin where the stack is empty */
+    if (status) {
+      m_st_count = pc[chunk_count - 1].st_count;
+    }
+  }
+  
+  /* Report any Shastina error */
+  if (status && (sn_err != 0)) {
+    status = 0;
+    *per = sn_err;
+    *pln = sn_line;
+  }
+  
+  /* Check that nothing after the |; in the file */
+  if (status) {
+    retval = snsource_consume(ps);
+    if (retval < 0) {
+      status = 0;
+      *per = ERR_SN_MAX + retval;
+      *pln = -1;
+    }
+  }
+  
+  /* Check that stack is empty */
+  if (status && (m_st_count > 0)) {
+    status = 0;
+    *per = ERR_STACKRM;
+    *pln = -1;
+  }
+  
+  /* Make sure no tempo remains buffered */
+  if (status && m_tbuf_filled) {
+    status = 0;
+    *per = ERR_DANGLE;
+    *pln = -1;
+  }
+  
+  /* Make sure tempo map is not empty */
+  if (status && (m_map_count < 1)) {
+    status = 0;
+    *per = ERR_EMPTY;
+    *pln = -1;
+  }
+  
+  /* Free chunks, tokens, parser, and input source */
+  if (pc != NULL) {
+    for(i = 0; i < chunk_count; i++) {
+      free(pc[i].pNode);
+      free(pc[i].pNodeTok);
+    }
+    free(pc);
+    pc = NULL;
+  }
+  free(pth);
+  pth = NULL;
+  free(pTok);
+  pTok = NULL;
+  free(pArena);
+  pArena = NULL;
+  
+  snparser_free(pr);
+  pr = NULL;
+  
+  snsource_free(ps);
+  ps = NULL;
+  
+  /* If failure, set initialization state to -1 */
+  if (!status) {
+    m_map_init = -1;
+  }
+  
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse the given string as a signed integer.
+ * 
+ * pstr is the string to parse.
+ * 
+ * pv points to the integer value to use to return the parsed numeric
+ * value if the function is successful.
+ * 
+ * In two's complement, this function will not successfully parse the
+ * least negative value.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the string to parse
+ * 
+ *   pv - pointer to the return numeric value
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if failure
+ */
+static int parseInt(const char *pstr, int32_t *pv) {
+  
+  int negflag = 0;
+  int32_t result = 0;
+  int status = 1;
+  int32_t d = 0;
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (pv == NULL)) {
+    abort();
+  }
+  
+  /* If first character is a sign character, set negflag appropriately
+   * and skip it */
+  if (*pstr == '+') {
+    negflag = 0;
+    pstr++;
+  } else if (*pstr == '-') {
+    negflag = 1;
+    pstr++;
+  } else {
+    negflag = 0;
+  }
   
-  /* Initialize structure */
-  memset(&ent, 0, sizeof(SNENTITY));
+  /* Make sure we have at least one digit */
+  if (*pstr == 0) {
+    status = 0;
+  }
   
-  /* Check state */
-  if (m_map_init != 0) {
-    abort();
+  /* Parse all digits */
+  if (status) {
+    for( ; *pstr != 0; pstr++) {
+    
+      /* Make sure in range of digits */
+      if ((*pstr < '0') || (*pstr > '9')) {
+        status = 0;
+      }
+    
+      /* Get numeric value of digit */
+      if (status) {
+        d = (int32_t) (*pstr - '0');
+      }
+      
+      /* Multiply result by 10, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX / 10) {
+          result = result * 10;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+      
+      /* Add in digit value, watching for overflow */
+      if (status) {
+        if (result <= INT32_MAX - d) {
+          result = result + d;
+        } else {
+          status = 0; /* overflow */
+        }
+      }
+    
+      /* Leave loop if error */
+      if (!status) {
+        break;
+      }
+    }
   }
   
-  /* Check parameters */
-  if ((pIn == NULL) || (per == NULL) || (pln == NULL)) {
-    abort();
+  /* Invert result if negative mode */
+  if (status && negflag) {
+    result = -(result);
   }
-  if ((srate != 48000) && (srate != 44100)) {
-    abort();
+  
+  /* Write result if successful */
+  if (status) {
+    *pv = result;
   }
   
-  /* Wrap the input file in a Shastina source object */
-  ps = snsource_file(pIn, 0);
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse a warp option and add it as a warp layer.
+ * 
+ * pstr is the full option string, which must begin with "--stretch=",
+ * "--offset=", or "--warp=".  See the program documentation at the top
+ * of this source file for the formats.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the option string
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if option is invalid
+ */
+static int parseWarp(const char *pstr) {
   
-  /* Reset error */
-  *per = ERR_OK;
-  *pln = -1;
+  int status = 1;
+  int32_t n = 0;
+  int32_t v = 0;
+  size_t len = 0;
+  const char *pc = NULL;
+  char buf[32];
+  double *px = NULL;
+  double *py = NULL;
   
-  /* Initialize interpreter stack */
-  init_stack();
+  /* Initialize buffer */
+  memset(buf, 0, sizeof(buf));
   
-  /* Initialize an empty tempo map state */
-  m_map_init = 1;
-  m_map_count = 0;
-  m_map_rate = srate;
-  m_map_cap = INIT_ALLOC;
-  m_map_t = (TEMPONODE *) calloc(INIT_ALLOC, sizeof(TEMPONODE));
-  if (m_map_t == NULL) {
+  /* Check parameter */
+  if (pstr == NULL) {
     abort();
   }
   
-  /* Allocate a Shastina parser */
-  pr = snparser_alloc();
+  /* Allocate point buffers */
+  px = (double *) calloc(MAX_WARP, sizeof(double));
+  py = (double *) calloc(MAX_WARP, sizeof(double));
+  if ((px == NULL) || (py == NULL)) {
+    abort();
+  }
   
-  /* Go through all Shastina entities in input until either an error or
-   * the EOF marker */
-  for(snparser_read(pr, &ent, ps);
-      ent.status > 0;
-      snparser_read(pr, &ent, ps)) {
+  /* Handle the different options */
+  if (strncmp(pstr, "--stretch=", strlen("--stretch=")) == 0) {
+    /* Stretch is a line through the origin with slope r / 1000 */
+    if (!parseInt(pstr + strlen("--stretch="), &v)) {
+      status = 0;
+    }
+    if (status && (v < 1)) {
+      status = 0;
+    }
+    if (status) {
+      px[0] = 0.0;
+      py[0] = 0.0;
+      px[1] = 1000.0;
+      py[1] = (double) v;
+      n = 2;
+    }
     
-    /* If this is the first entity being read, make sure it is the
-     * opening metacommand sequence, then continue the loop to read
-     * on */
-    if (first_ent) {
-      /* First entity, so clear first entity flag */
-      first_ent = 0;
+  } else if (strncmp(pstr, "--offset=", strlen("--offset=")) == 0) {
+    /* Offset is a single point shift */
+    if (!parseInt(pstr + strlen("--offset="), &v)) {
+      status = 0;
+    }
+    if (status) {
+      px[0] = 0.0;
+      py[0] = (double) v;
+      n = 1;
+    }
+    
+  } else if (strncmp(pstr, "--warp=", strlen("--warp=")) == 0) {
+    /* Piecewise-linear list of x:y pairs */
+    pc = pstr + strlen("--warp=");
+    while (status) {
       
-      /* This entity must be BEGIN_META */
-      if (ent.status != SNENTITY_BEGIN_META) {
+      /* Make sure room for another point */
+      if (n >= MAX_WARP) {
         status = 0;
-        *per = ERR_TYPESIG;
-        *pln = snparser_count(pr);
       }
       
-      /* Read another entity, which must be the correct metatoken */
+      /* Parse x value up to the colon */
       if (status) {
-        snparser_read(pr, &ent, ps);
-        if (ent.status != SNENTITY_META_TOKEN) {
+        len = strcspn(pc, ":,");
+        if ((len < 1) || (len >= sizeof(buf)) || (pc[len] != ':')) {
           status = 0;
-          *per = ERR_TYPESIG;
-          *pln = snparser_count(pr);
-        }
-        if (status) {
-          if (strcmp(ent.pKey, "noir-tempo") != 0) {
-            status = 0;
-            *per = ERR_TYPESIG;
-            *pln = snparser_count(pr);
-          }
         }
       }
-      
-      /* Read another entity, which must be end meta */
       if (status) {
-        snparser_read(pr, &ent, ps);
-        if (ent.status != SNENTITY_END_META) {
+        memcpy(buf, pc, len);
+        buf[len] = (char) 0;
+        if (!parseInt(buf, &v)) {
           status = 0;
-          *per = ERR_TYPESIG;
-          *pln = snparser_count(pr);
         }
+        px[n] = (double) v;
+        pc += len + 1;
       }
       
-      /* Continue the loop */
+      /* Parse y value up to the comma or end of string */
       if (status) {
-        continue;
-      }
-    }
-    
-    /* Handle the supported entity types (excluding the type signature,
-     * handled above, and the special EOF type) */
-    if (status) {
-      if (ent.status == SNENTITY_STRING) {
-        /* String type -- first, make sure quoted */
-        if (ent.str_type != SNSTRING_QUOTED) {
-          status = 0;
-          *per = ERR_BADENT;
-          *pln = snparser_count(pr);
-        }
-        
-        /* If "t" prefix is present, set autostep flag; if no prefix,
-         * clear autostep flag; if any other prefix, error */
-        if (status) {
-          if (strlen(ent.pKey) < 1) {
-            /* No prefix */
-            autostep = 0;
-          
-          } else if (strcmp(ent.pKey, "t") == 0) {
-            /* Autostep prefix */
-            autostep = 1;
-            
-          } else {
-            /* Unknown prefix */
-            status = 0;
-            *per = ERR_BADENT;
-            *pln = snparser_count(pr);
-          }
-        }
-        
-        /* Push the duration */
-        if (status) {
-          if (!pushDur(ent.pValue, per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-        }
-        
-        /* If autostepping, invoke step op */
-        if (status && autostep) {
-          if (!opStep(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-        }
-        
-      } else if (ent.status == SNENTITY_NUMERIC) {
-        /* Push numeric literal */
-        if (!pushNum(ent.pKey, per)) {
+        len = strcspn(pc, ":,");
+        if ((len < 1) || (len >= sizeof(buf)) || (pc[len] == ':')) {
           status = 0;
-          *pln = snparser_count(pr);
         }
-      
-      } else if (ent.status == SNENTITY_OPERATION) {
-        /* Determine the kind of operation */
-        if (strcmp(ent.pKey, "mul") == 0) {
-          if (!opMul(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else if (strcmp(ent.pKey, "sect") == 0) {
-          if (!opSect(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else if (strcmp(ent.pKey, "step") == 0) {
-          if (!opStep(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else if (strcmp(ent.pKey, "tempo") == 0) {
-          if (!opTempo(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else if (strcmp(ent.pKey, "ramp") == 0) {
-          if (!opRamp(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else if (strcmp(ent.pKey, "span") == 0) {
-          if (!opSpan(per)) {
-            status = 0;
-            *pln = snparser_count(pr);
-          }
-          
-        } else {
-          /* Unrecognized operation */
+      }
+      if (status) {
+        memcpy(buf, pc, len);
+        buf[len] = (char) 0;
+        if (!parseInt(buf, &v)) {
           status = 0;
-          *per = ERR_BADOP;
-          *pln = snparser_count(pr);
         }
-      
-      } else {
-        /* Unsupported entity type */
-        status = 0;
-        *per = ERR_BADENT;
-        *pln = snparser_count(pr);
+        py[n] = (double) v;
+        n++;
+        pc += len;
       }
-    }
-    
-    /* Leave loop if error */
-    if (!status) {
-      break;
-    }
-  }
-  
-  /* Watch for Shastina error */
-  if (status && (ent.status < 0)) {
-    status = 0;
-    *per = ERR_SN_MAX + ent.status;
-    *pln = snparser_count(pr);
-  }
-  
-  /* Check that nothing after the |; in the file */
-  if (status) {
-    retval = snsource_consume(ps);
-    if (retval < 0) {
-      status = 0;
-      *per = ERR_SN_MAX + retval;
-      *pln = -1;
-    }
-  }
-  
-  /* Check that stack is empty */
-  if (status && (m_st_count > 0)) {
-    status = 0;
-    *per = ERR_STACKRM;
-    *pln = -1;
-  }
-  
-  /* Make sure no tempo remains buffered */
-  if (status && m_tbuf_filled) {
+      
+      /* Leave loop if end of string, else skip comma */
+      if (status) {
+        if (*pc == 0) {
+          break;
+        }
+        pc++;
+      }
+    }
+    
+  } else {
+    /* Not a warp option */
     status = 0;
-    *per = ERR_DANGLE;
-    *pln = -1;
   }
   
-  /* Make sure tempo map is not empty */
-  if (status && (m_map_count < 1)) {
-    status = 0;
-    *per = ERR_EMPTY;
-    *pln = -1;
+  /* Add the warp layer */
+  if (status) {
+    if (!addWarp(px, py, n)) {
+      status = 0;
+    }
   }
   
-  /* Free parser if allocated */
-  snparser_free(pr);
-  pr = NULL;
-  
-  /* Free input source if allocated */
-  snsource_free(ps);
-  ps = NULL;
-  
-  /* If failure, set initialization state to -1 */
-  if (!status) {
-    m_map_init = -1;
-  }
+  /* Free point buffers */
+  free(px);
+  free(py);
+  px = NULL;
+  py = NULL;
   
   /* Return status */
   return status;
 }
 
 /*
- * Parse the given string as a signed integer.
- * 
- * pstr is the string to parse.
+ * Parse a list of meters.
  * 
- * pv points to the integer value to use to return the parsed numeric
- * value if the function is successful.
+ * pstr is a comma-separated list of one or more meters.  Each meter is
+ * a number of beats per bar, optionally followed by @ and the one-based
+ * bar number at which the meter starts.  The first meter always starts
+ * at bar one.  Starting bars must be strictly ascending.
  * 
- * In two's complement, this function will not successfully parse the
- * least negative value.
+ * The meters are stored in m_meter_beats and m_meter_bar.
  * 
  * Parameters:
  * 
- *   pstr - the string to parse
- * 
- *   pv - pointer to the return numeric value
+ *   pstr - the meter list
  * 
  * Return:
  * 
- *   non-zero if successful, zero if failure
+ *   non-zero if successful, zero if list is invalid
  */
-static int parseInt(const char *pstr, int32_t *pv) {
+static int parseMeter(const char *pstr) {
   
-  int negflag = 0;
-  int32_t result = 0;
   int status = 1;
-  int32_t d = 0;
-  
-  /* Check parameters */
-  if ((pstr == NULL) || (pv == NULL)) {
-    abort();
-  }
+  size_t len = 0;
+  int32_t v = 0;
+  int32_t bar = 0;
+  char buf[32];
   
-  /* If first character is a sign character, set negflag appropriately
-   * and skip it */
-  if (*pstr == '+') {
-    negflag = 0;
-    pstr++;
-  } else if (*pstr == '-') {
-    negflag = 1;
-    pstr++;
-  } else {
-    negflag = 0;
-  }
+  /* Initialize buffer */
+  memset(buf, 0, sizeof(buf));
   
-  /* Make sure we have at least one digit */
-  if (*pstr == 0) {
-    status = 0;
+  /* Check parameter */
+  if (pstr == NULL) {
+    abort();
   }
   
-  /* Parse all digits */
-  if (status) {
-    for( ; *pstr != 0; pstr++) {
+  /* Parse each meter */
+  m_meter_n = 0;
+  while (status) {
     
-      /* Make sure in range of digits */
-      if ((*pstr < '0') || (*pstr > '9')) {
+    /* Make sure room for another meter */
+    if (m_meter_n >= MAX_METER) {
+      status = 0;
+    }
+    
+    /* Parse the beat count */
+    if (status) {
+      len = strcspn(pstr, "@,");
+      if ((len < 1) || (len >= sizeof(buf))) {
         status = 0;
       }
-    
-      /* Get numeric value of digit */
-      if (status) {
-        d = (int32_t) (*pstr - '0');
+    }
+    if (status) {
+      memcpy(buf, pstr, len);
+      buf[len] = (char) 0;
+      if (!parseInt(buf, &v)) {
+        status = 0;
       }
-      
-      /* Multiply result by 10, watching for overflow */
-      if (status) {
-        if (result <= INT32_MAX / 10) {
-          result = result * 10;
-        } else {
-          status = 0; /* overflow */
+      if (status && (v < 1)) {
+        status = 0;
+      }
+      pstr += len;
+    }
+    
+    /* Parse the optional starting bar */
+    if (status) {
+      if (*pstr == '@') {
+        pstr++;
+        len = strcspn(pstr, "@,");
+        if ((len < 1) || (len >= sizeof(buf))) {
+          status = 0;
+        }
+        if (status) {
+          memcpy(buf, pstr, len);
+          buf[len] = (char) 0;
+          if (!parseInt(buf, &bar)) {
+            status = 0;
+          }
+          pstr += len;
         }
+      } else if (m_meter_n < 1) {
+        bar = 1;
+      } else {
+        status = 0;
       }
-      
-      /* Add in digit value, watching for overflow */
-      if (status) {
-        if (result <= INT32_MAX - d) {
-          result = result + d;
-        } else {
-          status = 0; /* overflow */
+    }
+    
+    /* Check the starting bar */
+    if (status) {
+      if (m_meter_n < 1) {
+        if (bar != 1) {
+          status = 0;
         }
+      } else if (bar <= m_meter_bar[m_meter_n - 1]) {
+        status = 0;
       }
+    }
     
-      /* Leave loop if error */
-      if (!status) {
+    /* Store the meter */
+    if (status) {
+      m_meter_beats[m_meter_n] = v;
+      m_meter_bar[m_meter_n] = bar;
+      m_meter_n++;
+    }
+    
+    /* Leave loop if end of string, else skip comma */
+    if (status) {
+      if (*pstr == 0) {
         break;
+      } else if (*pstr == ',') {
+        pstr++;
+      } else {
+        status = 0;
       }
     }
   }
   
-  /* Invert result if negative mode */
-  if (status && negflag) {
-    result = -(result);
+  /* Return status */
+  return status;
+}
+
+/*
+ * Parse a section range.
+ * 
+ * pstr is either a single section number, or two section numbers
+ * separated by a hyphen.  Section numbers must be zero or greater, and
+ * the second may not be less than the first.
+ * 
+ * Parameters:
+ * 
+ *   pstr - the range string
+ * 
+ *   plo - pointer to variable to receive the first section
+ * 
+ *   phi - pointer to variable to receive the last section
+ * 
+ * Return:
+ * 
+ *   non-zero if successful, zero if range is invalid
+ */
+static int parseRange(const char *pstr, int32_t *plo, int32_t *phi) {
+  
+  int status = 1;
+  size_t len = 0;
+  char buf[32];
+  
+  /* Initialize buffer */
+  memset(buf, 0, sizeof(buf));
+  
+  /* Check parameters */
+  if ((pstr == NULL) || (plo == NULL) || (phi == NULL)) {
+    abort();
   }
   
-  /* Write result if successful */
+  /* Parse the first section number */
+  len = strcspn(pstr, "-");
+  if ((len < 1) || (len >= sizeof(buf))) {
+    status = 0;
+  }
   if (status) {
-    *pv = result;
+    memcpy(buf, pstr, len);
+    buf[len] = (char) 0;
+    if (!parseInt(buf, plo)) {
+      status = 0;
+    }
+    pstr += len;
+  }
+  
+  /* Parse the second section number if present */
+  if (status) {
+    if (*pstr == '-') {
+      if (!parseInt(pstr + 1, phi)) {
+        status = 0;
+      }
+    } else {
+      *phi = *plo;
+    }
+  }
+  
+  /* Check range */
+  if (status) {
+    if ((*plo < 0) || (*phi < *plo)) {
+      status = 0;
+    }
   }
   
   /* Return status */
@@ -2399,6 +5862,18 @@ static const char *error_string(int code) {
         pResult = "Invalid millisecond count";
         break;
       
+      case ERR_BADWARP:
+        pResult = "Invalid warp layer";
+        break;
+      
+      case ERR_NOSECIN:
+        pResult = "Section operation without input NMF";
+        break;
+      
+      case ERR_WARPOUT:
+        pResult = "Warp layers map output times below zero or backward";
+        break;
+      
       default:
         pResult = "Unknown error";
     }
@@ -2436,8 +5911,8 @@ int main(int argc, char *argv[]) {
     pModule = "nmftempo";
   }
   
-  /* We must have exactly two parameters beyond the module name */
-  if (argc != 3) {
+  /* We must have at least two parameters beyond the module name */
+  if (argc < 3) {
     status = 0;
     fprintf(stderr, "%s: Wrong number of parameters!\n", pModule);
   }
@@ -2468,8 +5943,130 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Parse the input */
+  /* Parse any options */
   if (status) {
+    for(x = 3; x < argc; x++) {
+      if ((strncmp(argv[x], "--stretch=", strlen("--stretch=")) == 0) ||
+          (strncmp(argv[x], "--offset=", strlen("--offset=")) == 0) ||
+          (strncmp(argv[x], "--warp=", strlen("--warp=")) == 0)) {
+        if (!parseWarp(argv[x])) {
+          status = 0;
+          fprintf(stderr, "%s: %s: %s!\n",
+                  pModule, argv[x], error_string(ERR_BADWARP));
+        }
+        
+      } else if (strncmp(argv[x], "--block=", strlen("--block=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--block="), &m_block)) {
+          status = 0;
+        } else if (m_block < 1) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid block size!\n", pModule);
+        }
+        
+      } else if (strcmp(argv[x], "--round=floor") == 0) {
+        m_round = ROUND_FLOOR;
+        
+      } else if (strcmp(argv[x], "--round=nearest") == 0) {
+        m_round = ROUND_NEAREST;
+        
+      } else if (strcmp(argv[x], "--round=ceil") == 0) {
+        m_round = ROUND_CEIL;
+        
+      } else if (strncmp(argv[x], "--optimize=",
+                    strlen("--optimize=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--optimize="), &m_opt_tol)) {
+          status = 0;
+        } else if (m_opt_tol < 0) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid optimizer tolerance!\n", pModule);
+        }
+        
+      } else if (strcmp(argv[x], "--preview") == 0) {
+        m_preview = 1;
+        
+      } else if (strncmp(argv[x], "--sections=",
+                    strlen("--sections=")) == 0) {
+        if (!parseRange(argv[x] + strlen("--sections="),
+                        &m_sect_lo, &m_sect_hi)) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid section range!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--threads=",
+                    strlen("--threads=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--threads="), &m_threads)) {
+          status = 0;
+        } else if ((m_threads < 1) || (m_threads > MAX_THREADS)) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid thread count!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--grid=", strlen("--grid=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--grid="), &m_grid_beat)) {
+          status = 0;
+        } else if (m_grid_beat < 1) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid grid beat!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--beats=", strlen("--beats=")) == 0) {
+        if (!parseInt(argv[x] + strlen("--beats="), &m_grid_count)) {
+          status = 0;
+        } else if (m_grid_count < 0) {
+          status = 0;
+        }
+        if (!status) {
+          fprintf(stderr, "%s: Invalid grid beat count!\n", pModule);
+        }
+        
+      } else if (strncmp(argv[x], "--meter=", strlen("--meter=")) == 0) {
+        if (!parseMeter(argv[x] + strlen("--meter="))) {
+          status = 0;
+          fprintf(stderr, "%s: Invalid meter list!\n", pModule);
+        }
+        
+      } else {
+        status = 0;
+        fprintf(stderr, "%s: Unrecognized option %s!\n",
+                pModule, argv[x]);
+      }
+      
+      if (!status) {
+        break;
+      }
+    }
+  }
+  
+  /* Check the grid options */
+  if (status && (m_grid_beat < 1)) {
+    if ((m_grid_count >= 0) || (m_meter_n > 0)) {
+      status = 0;
+      fprintf(stderr, "%s: --beats and --meter require --grid!\n",
+              pModule);
+    }
+  }
+  if (status && (m_grid_beat > 0)) {
+    if (m_sect_lo >= 0) {
+      status = 0;
+      fprintf(stderr, "%s: Can't combine section range with grid!\n",
+              pModule);
+    } else if ((m_block > 0) || m_preview) {
+      status = 0;
+      fprintf(stderr, "%s: Can't combine --block or --preview with grid!\n",
+              pModule);
+    }
+  }
+  
+  /* Parse the input, unless writing a grid with a given beat count */
+  if (status && ((m_grid_beat < 1) || (m_grid_count < 0))) {
     m_pdi = nmf_parse(stdin);
     if (m_pdi == NULL) {
       status = 0;
@@ -2478,13 +6075,26 @@ int main(int argc, char *argv[]) {
   }
   
   /* Make sure input has proper quantum basis */
-  if (status) {
+  if (status && (m_pdi != NULL)) {
     if (nmf_basis(m_pdi) != NMF_BASIS_Q96) {
       status = 0;
       fprintf(stderr, "%s: %s!\n", pModule, error_string(ERR_BASISIN));
     }
   }
   
+  /* If there is a section range, make sure it is in the input, and
+   * only compile the tempo map as far as the range needs */
+  if (status && (m_sect_lo >= 0)) {
+    if (m_sect_hi >= nmf_sections(m_pdi)) {
+      status = 0;
+      fprintf(stderr, "%s: Section range not found in input!\n",
+              pModule);
+    }
+    if (status) {
+      m_horizon = findHorizon(m_pdi, m_sect_lo, m_sect_hi);
+    }
+  }
+  
   /* Open the tempo map file */
   if (status) {
     pMap = fopen(argv[1], "r");
@@ -2494,10 +6104,19 @@ int main(int argc, char *argv[]) {
     }
   }
   
-  /* Build the tempo map from the tempo map parameter */
+  /* Build the tempo map from the tempo map parameter, using multiple
+   * threads if requested and the whole map is needed */
   if (status) {
-    if (!parseMap(pMap, srate, &errcode, &lnum)) {
-      status = 0;
+    if ((m_threads > 1) && (m_horizon < 0)) {
+      if (!parseMapThreaded(pMap, srate, &errcode, &lnum)) {
+        status = 0;
+      }
+    } else {
+      if (!parseMap(pMap, srate, &errcode, &lnum)) {
+        status = 0;
+      }
+    }
+    if (!status) {
       if ((lnum > 0) && (lnum < LONG_MAX)) {
         fprintf(stderr, "%s: [Tempo map line %ld] %s!\n",
                 pModule, lnum, error_string(errcode));
@@ -2514,12 +6133,48 @@ int main(int argc, char *argv[]) {
     pMap = NULL;
   }
   
-  /* Apply the tempo map */
+  /* Optimize the tempo map if requested */
+  if (status && (m_opt_tol >= 0)) {
+    optimizeMap(m_opt_tol);
+    fprintf(stderr, "%s: Optimized tempo map from %ld to %ld nodes\n",
+            pModule, (long) m_opt_before, (long) m_opt_after);
+  }
+  
+  /* Fold any warp layers into the tempo map */
   if (status) {
+    if (!foldWarp(&errcode)) {
+      status = 0;
+      if (errcode == ERR_WARPOUT) {
+        fprintf(stderr, "%s: %s!\n", pModule, error_string(errcode));
+      } else {
+        fprintf(stderr, "%s: [Tempo map] %s!\n",
+                pModule, error_string(errcode));
+      }
+    }
+  }
+  
+  /* Write the beat grid if requested, else apply the tempo map */
+  if (status && (m_grid_beat > 0)) {
+    if (!writeGrid(m_pdi, stdout, &errcode)) {
+      status = 0;
+      fprintf(stderr, "%s: %s!\n", pModule, error_string(errcode));
+    }
+    if (m_pdi != NULL) {
+      nmf_free(m_pdi);
+      m_pdi = NULL;
+    }
+    
+  } else if (status) {
     if (!applyMap(m_pdi, stdout, &errcode)) {
       status = 0;
       fprintf(stderr, "%s: %s!\n", pModule, error_string(errcode));
     }
+    if (status && (m_block > 0)) {
+      reportSnap(stderr, pModule);
+    }
+    if (status && m_preview) {
+      reportPreview(stderr, pModule);
+    }
   }
   
   /* Close the tempo map file if open */